@@ -95,8 +95,8 @@ int main()
             break;
         }
 
-        fprintf(stdout, "RX err=%llu buf ovrfl=%llu lost=%llu TX err=%llu bus off=%llu\n", 
-            stats.RxErrorCount, stats.RxBufferOverflow, stats.RxLost, stats.TxErrorCount, stats.TxBusOff);
+        fprintf(stdout, "RX err=%llu buf ovrfl=%llu lost=%llu TX err=%llu bus off=%llu cancelled=%llu\n", 
+            stats.RxErrorCount, stats.RxBufferOverflow, stats.RxLost, stats.TxErrorCount, stats.TxBusOff, stats.TxCancelled);
         
 
         if (DeviceIoControl(deviceHandle, MCBA_IOCTL_HOST_CAN_FRAME_READ_AT_LEAST_ONE, NULL, 0, messages, sizeof(messages), &r, NULL)) {
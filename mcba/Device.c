@@ -24,8 +24,6 @@
 #include "Pch.h"
 #include "Device.tmh"
 
-#define BULK_READ_PIPE_REQUESTS 2
-
 static 
 _IRQL_requires_same_
 _IRQL_requires_max_(PASSIVE_LEVEL)
@@ -122,30 +120,6 @@ McbaProcessKeepAliveUsb(
     const struct mcba_usb_msg_ka_usb* Msg
 );
 
-static 
-inline 
-UINT16 
-Swap16(UINT16 value) {
-    return RtlUshortByteSwap(value);
-}
-
-static 
-inline 
-UINT16 
-Nop16(UINT16 value) {
-    return value;
-}
-
-static
-inline
-UINT16
-ReadUnalignedBigEndian16(_In_ PMCBA_DEVICE_CONTEXT DeviceContext, _In_ const void* ptr)
-{
-    UINT16 x;
-    RtlCopyMemory(&x, ptr, 2);
-    return DeviceContext->BigEndianToHost(x);
-}
-
 static
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
@@ -158,8 +132,52 @@ static
 _IRQL_requires_same_
 _IRQL_requires_(PASSIVE_LEVEL)
 VOID
-McbaMessageBuffersFree(
-    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext
+McbaReadParameters(
+    _In_ WDFDEVICE Device
+);
+
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+McbaTxEchoConfirm(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ const MCBA_CAN_MSG_DATA_EX* Msg,
+    _Out_ PMCBA_TX_ECHO_ENTRY Entry
+);
+
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Requires_lock_held_(DeviceContext->TxLock)
+VOID
+McbaCyclicArm(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ LONGLONG Now
+);
+
+static
+_IRQL_requires_same_
+_IRQL_requires_(PASSIVE_LEVEL)
+VOID
+McbaFileCancelTxFrames(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ WDFFILEOBJECT FileObject
+);
+
+static
+_IRQL_requires_same_
+VOID
+McbaUrbCompletedForTxQueue(
+    _In_
+    WDFREQUEST Request,
+    _In_
+    WDFIOTARGET Target,
+    _In_
+    PWDF_REQUEST_COMPLETION_PARAMS Params,
+    _In_
+    WDFCONTEXT Context
 );
 
 static
@@ -183,7 +201,8 @@ NTSTATUS
 McbaUsbRequestsInit(
     _Inout_ PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
     _In_ WDFDEVICE Device,
-    _In_ WDFIOTARGET IoTarget
+    _In_ WDFIOTARGET IoTarget,
+    _In_ ULONG Max
 );
 
 static
@@ -227,10 +246,10 @@ DbgDevicePowerString(
 
 
 #ifdef ALLOC_PRAGMA
-#pragma alloc_text(PAGE, McbaMessageBuffersFree)
 #pragma alloc_text(PAGE, McbaCreateDevice)
 #pragma alloc_text(PAGE, McbaEvtDevicePrepareHardware)
 #pragma alloc_text(PAGE, McbaSelectInterfaces)
+#pragma alloc_text(PAGE, McbaReadParameters)
 #pragma alloc_text(PAGE, McbaEvtDeviceFileCreate)
 #pragma alloc_text(PAGE, McbaEvtFileCleanup)
 
@@ -277,6 +296,7 @@ McbaUrbCompletedForFirmwareRequest(
 
     McbaUsbRequestsReuse(&pDeviceContext->UsbRequests, 1, &index);
     McbaUsbRequestsFree(&pDeviceContext->UsbRequests, 1, &index);
+    McbaTxQueueDrain(pDeviceContext);
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC!");
 }
@@ -305,34 +325,22 @@ Return Value:
 --*/
 {
     WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
-    WDF_OBJECT_ATTRIBUTES deviceAttributes, fileAttributes;
+    WDF_OBJECT_ATTRIBUTES deviceAttributes, fileAttributes, requestAttributes;
     PMCBA_DEVICE_CONTEXT pDeviceContext = NULL;
     WDFDEVICE device;
     NTSTATUS status;
     WDF_DEVICE_PNP_CAPABILITIES pnpCaps;
     WDF_IO_TYPE_CONFIG ioTypeConfig;
     WDF_FILEOBJECT_CONFIG fileConfig;
-    BOOLEAN memoryAllocated = FALSE;
-    static const UINT16 Uint16 = 0xff;
-    UINT8 const* const pEndianCheck = (UINT8 const* const )&Uint16;
-    BOOLEAN littleEndian;
+    WDF_OBJECT_ATTRIBUTES memoryAttributes;
+    WDFMEMORY memory;
+    WDF_TIMER_CONFIG timerConfig;
+    WDF_OBJECT_ATTRIBUTES timerAttributes;
 
     PAGED_CODE();
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC!");
 
-    if (0xff == *pEndianCheck) {
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Little endian machine\n");
-        littleEndian = TRUE;
-    } else if (0 == *pEndianCheck) {
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Big endian machine\n");
-        littleEndian = FALSE;
-    } else {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! Unsupported endian machine\n");
-        status = STATUS_UNSUCCESSFUL;
-        goto Error;
-    }
-
     WDF_IO_TYPE_CONFIG_INIT(&ioTypeConfig);
     ioTypeConfig.DeviceControlIoType = WdfDeviceIoDirect;
     ioTypeConfig.ReadWriteIoType = WdfDeviceIoDirect;
@@ -378,6 +386,10 @@ Return Value:
 
     WdfDeviceInitSetFileObjectConfig(DeviceInit, &fileConfig, &fileAttributes);
 
+    // waiting reads, writes and parked requests keep their state here
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&requestAttributes, MCBA_REQUEST_CONTEXT);
+    WdfDeviceInitSetRequestAttributes(DeviceInit, &requestAttributes);
+
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&deviceAttributes, MCBA_DEVICE_CONTEXT);
 
     status = WdfDeviceCreate(&DeviceInit, &deviceAttributes, &device);
@@ -411,30 +423,51 @@ Return Value:
     //
     pDeviceContext = McbaDeviceGetContext(device);
 
-    if (littleEndian) {
-        pDeviceContext->BigEndianToHost = Swap16;
-        pDeviceContext->LittleEndianToHost = Nop16;
-    } else {
-        pDeviceContext->BigEndianToHost = Nop16;
-        pDeviceContext->LittleEndianToHost = Swap16;
-    }
-
+    InitializeListHead(&pDeviceContext->FilesList);
+    KeInitializeSpinLock(&pDeviceContext->FilesLock);
 
-    ExInitializeSListHead(&pDeviceContext->MessageBuffersAvailable);
-    KeInitializeSpinLock(&pDeviceContext->MessageBuffersLock);
-    status = McbaMessageBuffersAdd(pDeviceContext);
+    // one ring for all files, each frame is stored once no matter how many handles are open
+    WDF_OBJECT_ATTRIBUTES_INIT(&memoryAttributes);
+    memoryAttributes.ParentObject = device;
+    status = WdfMemoryCreate(
+        &memoryAttributes,
+        NonPagedPoolNxCacheAligned,
+        POOL_TAG,
+        McbaBroadcastRingSize(MCBA_RX_RING_CAPACITY),
+        &memory,
+        (PVOID*)&pDeviceContext->RxRing);
     if (!NT_SUCCESS(status)) {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! McbaAddMessageBuffers failed with status code %!STATUS!\n", status);
-        goto Error;
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfMemoryCreate failed with status code %!STATUS!\n", status);
+        goto Exit;
     }
 
-    memoryAllocated = TRUE;
-
-    InitializeListHead(&pDeviceContext->FilesList);
-    KeInitializeSpinLock(&pDeviceContext->FilesLock);
+    McbaBroadcastRingInit(pDeviceContext->RxRing, MCBA_RX_RING_CAPACITY);
+    McbaClockInit(&pDeviceContext->RxClock);
 
     ExInitializeSListHead(&pDeviceContext->BatchRequestDataListHeader);
     KeInitializeSpinLock(&pDeviceContext->BatchRequestDataLock);
+    KeInitializeSpinLock(&pDeviceContext->TxLock);
+    KeInitializeEvent(&pDeviceContext->TxIdle, NotificationEvent, TRUE);
+    McbaTxSchedulerInit(&pDeviceContext->TxQueue);
+    KeInitializeSpinLock(&pDeviceContext->TxEchoLock);
+    McbaTxEchoInit(&pDeviceContext->TxEcho);
+    KeInitializeSpinLock(&pDeviceContext->RxLatencyLock);
+    KeInitializeSpinLock(&pDeviceContext->DeviceStatusLock);
+    McbaSeqLockInit(&pDeviceContext->DeviceStatusSeq);
+    KeInitializeSpinLock(&pDeviceContext->BusLoadLock);
+    McbaBusLoadMeterInit(&pDeviceContext->BusLoad);
+
+    // cyclic frames want periods down to a millisecond, the default timer ticks at 15.6
+    WDF_TIMER_CONFIG_INIT(&timerConfig, McbaEvtCyclicTimer);
+    timerConfig.AutomaticSerialization = FALSE;
+    timerConfig.UseHighResolutionTimer = WdfTrue;
+    WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
+    timerAttributes.ParentObject = device;
+    status = WdfTimerCreate(&timerConfig, &timerAttributes, &pDeviceContext->CyclicTimer);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfTimerCreate failed with status code %!STATUS!\n", status);
+        goto Exit;
+    }
 
     //
     // Create a device interface so that applications can find and talk
@@ -443,24 +476,17 @@ Return Value:
     status = WdfDeviceCreateDeviceInterface(device, &GUID_DEVINTERFACE_MCBA, NULL);
     if (!NT_SUCCESS(status)) {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfDeviceCreateDeviceInterface failed with status code %!STATUS!\n", status);
-        goto Error;
+        goto Exit;
     }
 
     status = McbaQueueInitialize(device);
     if (!NT_SUCCESS(status)) {
-        goto Error;
+        goto Exit;
     }
 
 Exit:
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! completed with status=%!STATUS!\n", status);
     return status;
-
-Error:
-    if (memoryAllocated) {
-        McbaMessageBuffersFree(pDeviceContext);
-    }
-    
-    goto Exit;
 }
 
 
@@ -585,6 +611,7 @@ Return Value:
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE,
         "%!FUNC! Version: %x\n", deviceInfo.UsbdVersionInformation.Supported_USB_Version);
         
+    McbaReadParameters(Device);
     
     status = McbaSelectInterfaces(Device);
     if (!NT_SUCCESS(status)) {
@@ -683,9 +710,9 @@ McbaSelectInterfaces(
         &usbContinousReaderConfig,
         McbaUsbReaderCompletionRoutine,
         pDeviceContext,
-        MCBA_USB_RX_BUFF_SIZE);
+        pDeviceContext->RxTransferSize);
 
-    usbContinousReaderConfig.NumPendingReads = BULK_READ_PIPE_REQUESTS;
+    usbContinousReaderConfig.NumPendingReads = pDeviceContext->RxPendingReads;
 
     status = WdfUsbTargetPipeConfigContinuousReader(
         pDeviceContext->BulkReadPipe, 
@@ -702,6 +729,228 @@ Exit:
     return status;
 }
 
+/* Reads the USB pipe setup from the device's hardware key.
+ *
+ * RxPendingReads     reads kept at the bulk-IN pipe
+ * RxTransferSize     bytes per read, rounded up to MCBA_USB_RX_BUFF_SIZE
+ * TxPackFrames       non-zero stacks the frames of batch writes into
+ *                    transfers of up to MCBA_USB_TX_RECORDS_MAX records
+ * UsbRequestsMax     USB requests the write pool may grow to, clamped to
+ *                    MCBA_MAX_WRITES..MCBA_USB_REQUESTS_LIMIT
+ */
+_Use_decl_annotations_
+static
+VOID
+McbaReadParameters(
+    WDFDEVICE Device
+)
+{
+    DECLARE_CONST_UNICODE_STRING(pendingReadsName, L"RxPendingReads");
+    DECLARE_CONST_UNICODE_STRING(transferSizeName, L"RxTransferSize");
+    DECLARE_CONST_UNICODE_STRING(packName, L"TxPackFrames");
+    DECLARE_CONST_UNICODE_STRING(usbRequestsName, L"UsbRequestsMax");
+    PMCBA_DEVICE_CONTEXT pDeviceContext;
+    WDFKEY key;
+    ULONG value;
+    ULONG pendingReads = MCBA_RX_PENDING_READS_DEFAULT;
+    ULONG transferSize = MCBA_USB_RX_BUFF_SIZE;
+    BOOLEAN pack = FALSE;
+    ULONG usbRequests = MCBA_USB_REQUESTS_MAX_DEFAULT;
+    NTSTATUS status;
+
+    PAGED_CODE();
+
+    pDeviceContext = McbaDeviceGetContext(Device);
+
+    status = WdfDeviceOpenRegistryKey(Device, PLUGPLAY_REGKEY_DEVICE, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key);
+    if (NT_SUCCESS(status)) {
+        if (NT_SUCCESS(WdfRegistryQueryULong(key, &pendingReadsName, &value))) {
+            pendingReads = value;
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(key, &transferSizeName, &value))) {
+            transferSize = value;
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(key, &packName, &value))) {
+            pack = value != 0;
+        }
+
+        if (NT_SUCCESS(WdfRegistryQueryULong(key, &usbRequestsName, &value))) {
+            usbRequests = value;
+        }
+
+        WdfRegistryClose(key);
+    }
+    else {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE, "%!FUNC! WdfDeviceOpenRegistryKey failed with status=%!STATUS!, using defaults\n", status);
+    }
+
+    pendingReads = max(pendingReads, 1);
+    pendingReads = min(pendingReads, MCBA_RX_PENDING_READS_MAX);
+    transferSize = min(transferSize, MCBA_RX_TRANSFER_SIZE_MAX);
+    transferSize = max((transferSize + MCBA_USB_RX_BUFF_SIZE - 1) / MCBA_USB_RX_BUFF_SIZE, 1) * MCBA_USB_RX_BUFF_SIZE;
+    usbRequests = max(usbRequests, MCBA_MAX_WRITES);
+    usbRequests = min(usbRequests, MCBA_USB_REQUESTS_LIMIT);
+
+    pDeviceContext->RxPendingReads = pendingReads;
+    pDeviceContext->RxTransferSize = transferSize;
+    pDeviceContext->TxPackFrames = pack;
+    pDeviceContext->UsbRequestsMax = usbRequests;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! %u pending reads of %u bytes, packed writes %u, up to %u USB requests\n",
+        pendingReads, transferSize, pack, usbRequests);
+}
+
+// Memory of private receive rings of all devices.
+static volatile LONG64 McbaRxQueueMemory;
+
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+McbaRxQueueMemoryCharge(
+    _In_ SIZE_T Size
+)
+{
+    if (InterlockedAdd64(&McbaRxQueueMemory, (LONG64)Size) > MCBA_RX_QUEUE_MEMORY_BUDGET) {
+        InterlockedAdd64(&McbaRxQueueMemory, -(LONG64)Size);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaRxQueueMemoryRelease(
+    _In_ SIZE_T Size
+)
+{
+    InterlockedAdd64(&McbaRxQueueMemory, -(LONG64)Size);
+}
+
+_Use_decl_annotations_
+LONGLONG
+McbaQueryMonotonicTime(
+    VOID
+)
+{
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter = KeQueryPerformanceCounter(&frequency);
+
+    // split so the multiplication can't overflow
+    return (counter.QuadPart / frequency.QuadPart) * 10000000
+        + (counter.QuadPart % frequency.QuadPart) * 10000000 / frequency.QuadPart;
+}
+
+// What to add to a monotonic timestamp to get the file's clock.
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+LONGLONG
+McbaFileTimestampOffset(
+    _In_ const MCBA_FILE_CONTEXT* FileContext
+)
+{
+    LARGE_INTEGER now;
+
+    if (MCBA_RX_TIMESTAMP_CLOCK_MONOTONIC == FileContext->RxTimestampClock) {
+        return 0;
+    }
+
+    KeQuerySystemTimePrecise(&now);
+    return now.QuadPart - McbaQueryMonotonicTime();
+}
+
+static
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaCanMsgsShiftTimestamps(
+    _Inout_updates_(Count) PMCBA_CAN_MSG_DATA_EX Msgs,
+    _In_ ULONG Count,
+    _In_ LONGLONG Offset
+)
+{
+    if (!Offset) {
+        return;
+    }
+
+    for (ULONG i = 0; i < Count; ++i) {
+        Msgs[i].SystemTimeReceived += Offset;
+
+        // not mapped yet stays 0
+        if (Msgs[i].SystemTimeOnBus) {
+            Msgs[i].SystemTimeOnBus += Offset;
+        }
+    }
+}
+
+#define McbaTxEchoSenderBucket(DeviceContext, Tag) (&(DeviceContext)->TxEchoSenders[(Tag) & (MCBA_TX_ECHO_SENDERS - 1)])
+
+// The open file that sent frames tagged Tag, NULL if it is closed.
+static
+inline
+_Requires_lock_held_(DeviceContext->FilesLock)
+PMCBA_FILE_CONTEXT
+McbaTxEchoSender(
+    _In_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ UINT16 Tag
+)
+{
+    PMCBA_FILE_CONTEXT pFileContext = *McbaTxEchoSenderBucket(DeviceContext, Tag);
+
+    while (pFileContext && pFileContext->TxEchoTag != Tag) {
+        pFileContext = pFileContext->TxEchoSenderNext;
+    }
+
+    return pFileContext;
+}
+
+// Not in the paged section, runs at DISPATCH_LEVEL under the files lock.
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaFileAttach(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PMCBA_FILE_CONTEXT FileContext
+)
+{
+    PMCBA_FILE_CONTEXT* pBucket = McbaTxEchoSenderBucket(DeviceContext, FileContext->TxEchoTag);
+    KIRQL irql;
+
+    FileContext->RxRing = DeviceContext->RxRing;
+
+    // the file sees frames received from here on
+    KeAcquireSpinLock(&DeviceContext->FilesLock, &irql);
+    FileContext->ReadCursor = McbaBroadcastRingCursor(DeviceContext->RxRing);
+    InsertTailList(&DeviceContext->FilesList, &FileContext->FilesList);
+    FileContext->TxEchoSenderNext = *pBucket;
+    *pBucket = FileContext;
+    KeReleaseSpinLock(&DeviceContext->FilesLock, irql);
+}
+
+// Confirmations of the file's frames no longer find it.
+static
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_lock_held_(DeviceContext->FilesLock)
+VOID
+McbaFileDetachTxEchoSender(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PMCBA_FILE_CONTEXT FileContext
+)
+{
+    PMCBA_FILE_CONTEXT* pLink = McbaTxEchoSenderBucket(DeviceContext, FileContext->TxEchoTag);
+
+    while (*pLink != FileContext) {
+        pLink = &(*pLink)->TxEchoSenderNext;
+    }
+
+    *pLink = FileContext->TxEchoSenderNext;
+    FileContext->TxEchoSenderNext = NULL;
+}
+
 _Use_decl_annotations_
 static
 VOID
@@ -713,6 +962,10 @@ McbaEvtDeviceFileCreate(
 {
     PMCBA_DEVICE_CONTEXT pDeviceContext;
     PMCBA_FILE_CONTEXT pFileContext;
+    WDF_IO_QUEUE_CONFIG queueConfig;
+    WDF_TIMER_CONFIG timerConfig;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    NTSTATUS status;
 
     PAGED_CODE();
 
@@ -721,14 +974,59 @@ McbaEvtDeviceFileCreate(
     pDeviceContext = McbaDeviceGetContext(Device);
     pFileContext = McbaFileGetContext(FileObject);
 
-    InitializeListHead(&pFileContext->ReadBuffersList);
-    ExInterlockedInsertTailList(&pDeviceContext->FilesList, &pFileContext->FilesList, &pDeviceContext->FilesLock);
+    // blocked reads wait here in order of arrival, the framework handles cancellation
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+    queueConfig.PowerManaged = WdfFalse;
+    queueConfig.EvtIoCanceledOnQueue = McbaEvtIoCanceledOnPendingReadQueue;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+    attributes.ParentObject = FileObject;
+
+    status = WdfIoQueueCreate(Device, &queueConfig, &attributes, &pFileContext->PendingReads);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfIoQueueCreate failed with status code %!STATUS!\n", status);
+        goto Exit;
+    }
+
+    // the request lending its buffer as mapped ring, cancelling it unmaps the ring
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+    queueConfig.PowerManaged = WdfFalse;
+    queueConfig.EvtIoCanceledOnQueue = McbaEvtIoCanceledOnReadRingQueue;
+
+    status = WdfIoQueueCreate(Device, &queueConfig, &attributes, &pFileContext->ReadRingRequests);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfIoQueueCreate failed with status code %!STATUS!\n", status);
+        goto Exit;
+    }
+
+    WDF_TIMER_CONFIG_INIT(&timerConfig, McbaEvtRxModerationTimer);
+    timerConfig.AutomaticSerialization = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, MCBA_RX_MODERATION_TIMER_CONTEXT);
+    attributes.ParentObject = pFileContext->PendingReads;
+
+    status = WdfTimerCreate(&timerConfig, &attributes, &pFileContext->RxModerationTimer);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfTimerCreate failed with status code %!STATUS!\n", status);
+        goto Exit;
+    }
+
+    McbaRxModerationTimerGetContext(pFileContext->RxModerationTimer)->FileContext = pFileContext;
 
     KeInitializeSpinLock(&pFileContext->ReadLock);
+    pFileContext->TxPriority = MCBA_TX_PRIORITY_NORMAL;
 
-    WdfRequestComplete(Request, STATUS_SUCCESS);
+    // 0 marks frames of unknown origin
+    do {
+        pFileContext->TxEchoTag = (UINT16)InterlockedIncrement(&pDeviceContext->TxEchoTags);
+    } while (!pFileContext->TxEchoTag);
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC!\n");
+    McbaFileAttach(pDeviceContext, pFileContext);
+
+Exit:
+    WdfRequestComplete(Request, status);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
 }
 
 _Use_decl_annotations_
@@ -749,22 +1047,50 @@ McbaEvtFileCleanup(
     pDeviceContext = McbaDeviceGetContext(WdfFileObjectGetDevice(FileObject));
     pFileContext = McbaFileGetContext(FileObject);
 
-    NT_ASSERT(!pFileContext->PendingReadRequest);
-    if (pFileContext->PendingReadRequest) {
-        WdfRequestComplete(pFileContext->PendingReadRequest, STATUS_REQUEST_ABORTED);
-    }
-
+    // after this the reader completion no longer wakes readers of the file
     KeAcquireSpinLock(&pDeviceContext->FilesLock, &irql);
     RemoveEntryList(&pFileContext->FilesList);
+    McbaFileDetachTxEchoSender(pDeviceContext, pFileContext);
+    if (MCBA_TX_ECHO_NONE != pFileContext->TxEcho) {
+        pFileContext->TxEcho = MCBA_TX_ECHO_NONE;
+        InterlockedDecrement(&pDeviceContext->TxEchoFiles);
+    }
+    if (pFileContext->TxLatency) {
+        pFileContext->TxLatency = 0;
+        InterlockedDecrement(&pDeviceContext->TxLatencyFiles);
+    }
     KeReleaseSpinLock(&pDeviceContext->FilesLock, irql);
 
-    for (PLIST_ENTRY pEntry = pFileContext->ReadBuffersList.Flink; pEntry != &pFileContext->ReadBuffersList; ) {
-        PMCBA_CAN_MSG_ITEM pItem = CONTAINING_RECORD(pEntry, MCBA_CAN_MSG_ITEM, ReadBuffers);
-        pEntry = pItem->ReadBuffers.Flink;
-        ExInterlockedPushEntrySList(
-            &pDeviceContext->MessageBuffersAvailable,
-            &pItem->MessageBuffersAvailable,
-            &pDeviceContext->MessageBuffersLock);
+    // the handle is gone, nobody is going to wait for these
+    WdfIoQueuePurgeSynchronously(pFileContext->PendingReads);
+    WdfTimerStop(pFileContext->RxModerationTimer, TRUE);
+    McbaFileCancelTxFrames(pDeviceContext, pFileContext, FileObject);
+
+    // unmaps the ring, what is left is a private ring of our own
+    WdfIoQueuePurgeSynchronously(pFileContext->ReadRingRequests);
+    NT_ASSERT(!pFileContext->ReadRingRequest);
+
+    if (pFileContext->ReadRing) {
+        ExFreePoolWithTag(pFileContext->ReadRing, POOL_TAG);
+        McbaRxQueueMemoryRelease(pFileContext->ReadRingCharge);
+        pFileContext->ReadRing = NULL;
+        pFileContext->ReadRingCharge = 0;
+    }
+
+    if (pFileContext->Filter) {
+        ExFreePoolWithTag(pFileContext->Filter, POOL_TAG);
+        pFileContext->Filter = NULL;
+    }
+
+    if (pFileContext->TxResults) {
+        ExFreePoolWithTag(pFileContext->TxResults, POOL_TAG);
+        McbaRxQueueMemoryRelease((pFileContext->TxResultsMask + 1) * sizeof(*pFileContext->TxResults));
+        pFileContext->TxResults = NULL;
+    }
+
+    if (pFileContext->RxLatency) {
+        ExFreePoolWithTag(pFileContext->RxLatency, POOL_TAG);
+        pFileContext->RxLatency = NULL;
     }
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC!\n");
@@ -801,7 +1127,7 @@ McbaSendFirmwareRequests(
 
     NT_ASSERT(DeviceContext);
 
-    status = McbaUsbRequestsAlloc(&DeviceContext->UsbRequests, _countof(indices), indices);
+    status = McbaUsbRequestsTryAlloc(&DeviceContext->UsbRequests, _countof(indices), indices);
     if (!NT_SUCCESS(status)) {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! McbaUsbRequestAlloc for fw req failed with %!STATUS!\n", status);
         goto Exit;
@@ -916,7 +1242,7 @@ Return Value:
     }
 
     if (NT_SUCCESS(status)) {
-        status = McbaUsbRequestsInit(&pDeviceContext->UsbRequests, Device, bulkWriteTarget);
+        status = McbaUsbRequestsInit(&pDeviceContext->UsbRequests, Device, bulkWriteTarget, pDeviceContext->UsbRequestsMax);
         if (NT_SUCCESS(status)) {
             TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! initialized USB requests for bulk write pipe\n");
             status = McbaSendFirmwareRequests(pDeviceContext);
@@ -936,6 +1262,16 @@ Return Value:
         McbaUsbRequestsUninit(&pDeviceContext->UsbRequests);
         McbaStopPipes(pDeviceContext);
     }
+    else {
+        KIRQL irql;
+
+        // frames queued while the device was away go out now
+        KeAcquireSpinLock(&pDeviceContext->TxLock, &irql);
+        pDeviceContext->TxStarted = TRUE;
+        McbaCyclicArm(pDeviceContext, McbaQueryMonotonicTime());
+        KeReleaseSpinLock(&pDeviceContext->TxLock, irql);
+        McbaTxQueueDrain(pDeviceContext);
+    }
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
 
@@ -988,6 +1324,9 @@ Return Value:
 --*/
 {
     PMCBA_DEVICE_CONTEXT         pDeviceContext;
+    LARGE_INTEGER timeout;
+    NTSTATUS status;
+    KIRQL irql;
 
     PAGED_CODE();
 
@@ -996,7 +1335,20 @@ Return Value:
 
     pDeviceContext = McbaDeviceGetContext(Device);
 
+    // the TX queue keeps its frames until the device is back
+    KeAcquireSpinLock(&pDeviceContext->TxLock, &irql);
+    pDeviceContext->TxStarted = FALSE;
+    KeReleaseSpinLock(&pDeviceContext->TxLock, irql);
+
     McbaStopPipes(pDeviceContext);
+
+    // a drain that took a request before TxStarted was cleared fails to send it
+    timeout.QuadPart = -MCBA_TX_IDLE_TIMEOUT;
+    status = KeWaitForSingleObject(&pDeviceContext->TxIdle, Executive, KernelMode, FALSE, &timeout);
+    if (STATUS_TIMEOUT == status) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! %d TX queue requests still in flight\n", (int)ReadNoFence(&pDeviceContext->TxUsbRequestCount));
+    }
+
     McbaUsbRequestsUninit(&pDeviceContext->UsbRequests);
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC!\n");
@@ -1006,717 +1358,2999 @@ Return Value:
 
 
 
+// Hands the buffer of Request back if it still is the file's ring.
 static
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 VOID
-McbaAddCanMessageToFileReadQueue(
+McbaFileUnmapReadRing(
     _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
     _Inout_ PMCBA_FILE_CONTEXT FileContext,
-    _In_ const MCBA_CAN_MSG_DATA* Msg
+    _In_ WDFREQUEST Request
 )
 {
-    WDFREQUEST requestToComplete = NULL;
-    NTSTATUS status = STATUS_SUCCESS;
-    ULONG_PTR information = 0;
     KIRQL irql;
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! DeviceContext=0x%p FileContext=0x%p Msg=0x%p\n", DeviceContext, FileContext, Msg);
+    // with producer and readers locked out nobody touches the buffer afterwards
+    KeAcquireSpinLock(&DeviceContext->FilesLock, &irql);
+    KeAcquireSpinLockAtDpcLevel(&FileContext->ReadLock);
 
-    NT_ASSERT(DeviceContext);
-    NT_ASSERT(FileContext);
-    NT_ASSERT(Msg);
+    if (FileContext->ReadRingRequest == Request) {
+        // frames left in the buffer are the caller's, new ones come from the shared ring
+        FileContext->ReadRing = NULL;
+        RtlZeroMemory(&FileContext->ReadRingProducer, sizeof(FileContext->ReadRingProducer));
+        FileContext->ReadRingRequest = NULL;
+        FileContext->ReadCursor = McbaBroadcastRingCursor(FileContext->RxRing);
+    }
 
-    KeAcquireSpinLock(&FileContext->ReadLock, &irql);
+    KeReleaseSpinLockFromDpcLevel(&FileContext->ReadLock);
+    KeReleaseSpinLock(&DeviceContext->FilesLock, irql);
 
-    if (FileContext->PendingReadRequest) {
-        NT_ASSERT(FileContext->PendingReadOffset < FileContext->PendingReadCount);
-        FileContext->PendingReadBuffer[FileContext->PendingReadOffset] = *Msg;
-        ++FileContext->PendingReadOffset;
+    // reads waiting for the ring complete empty
+    McbaFileCompletePendingReadRequests(FileContext);
+}
 
-        // call this here to check for cancelation
-        status = WdfRequestUnmarkCancelable(FileContext->PendingReadRequest);
-        if (NT_SUCCESS(status)) {
-            if (FileContext->PendingReadOffset == FileContext->PendingReadCount) {
-                requestToComplete = FileContext->PendingReadRequest;
-                information = FileContext->PendingReadCount * sizeof(*FileContext->PendingReadBuffer);
-                McbaClearPendingReadRequest(FileContext);
-            }
-            else {
-                // re-mark cancelable
-                status = WdfRequestMarkCancelableEx(FileContext->PendingReadRequest, McbaCancelPendingReadRequest);
-                if (!NT_SUCCESS(status)) {
-                    goto PostCancelOp;
-                }
-            }
-        }
-        else {
-        PostCancelOp:
-            if (STATUS_CANCELLED == status) { // cancel callback executed, we don't need to complete the request
-                TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Pending read request=%p was cancelled\n", FileContext->PendingReadRequest);
-            }
-            else {
-                requestToComplete = FileContext->PendingReadRequest;
-            }
+_Use_decl_annotations_
+NTSTATUS
+McbaFileMapReadRing(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    WDFREQUEST Request,
+    PMCBA_RING Ring,
+    ULONG Capacity
+)
+{
+    MCBA_RING_PRODUCER producer;
+    MCBA_CAN_MSG_DATA_EX msgs[16];
+    PMCBA_RING pOldRing = NULL;
+    SIZE_T oldCharge = 0;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG count;
+    ULONG written;
+    KIRQL irql;
 
-            McbaClearPendingReadRequest(FileContext);
-        }
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! FileContext=0x%p Request=0x%p Capacity=%u\n", FileContext, Request, (unsigned)Capacity);
+
+    NT_ASSERT(Capacity && !(Capacity & (Capacity - 1)));
+
+    // Ring is the system mapping of the locked output buffer, it stays
+    // valid until Request completes
+    RtlZeroMemory(Ring, FIELD_OFFSET(MCBA_RING, Entries));
+    McbaRingInit(Ring, &producer, Capacity);
+
+    // swap rings with producer and readers locked out
+    KeAcquireSpinLock(&DeviceContext->FilesLock, &irql);
+    KeAcquireSpinLockAtDpcLevel(&FileContext->ReadLock);
+
+    if (FileContext->ReadRingRequest || FileContext->PendingReadCount) {
+        status = STATUS_INVALID_DEVICE_STATE;
     }
     else {
-        PMCBA_CAN_MSG_ITEM pCanMessageListItem;
-        if (MCBA_MAX_READ_BUFFERS_QUEUED == FileContext->ReadBuffersQueued) {
-            TraceEvents(
-                TRACE_LEVEL_WARNING,
-                TRACE_DEVICE,
-                "%!FUNC! Dropping message from file 0x%p queue which is full (size=%d)\n",
-                WdfObjectContextGetObject(FileContext),
-                MCBA_MAX_READ_BUFFERS_QUEUED);
-            PLIST_ENTRY pEntry = RemoveHeadList(&FileContext->ReadBuffersList);
-            NT_ASSERT(pEntry);
-            ++FileContext->Stats.RxLost;
-            --FileContext->ReadBuffersQueued;
-            pCanMessageListItem = CONTAINING_RECORD(pEntry, MCBA_CAN_MSG_ITEM, ReadBuffers);
+        // carry over what is queued, whatever doesn't fit is dropped
+        while ((count = McbaFileReadCanMsgs(FileContext, msgs, ARRAYSIZE(msgs))) > 0) {
+            written = McbaRingWrite(&producer, msgs, count);
+            McbaCounterAdd(&FileContext->RxReaderCounters.Lost, count - written);
+        }
+
+        pOldRing = FileContext->ReadRing;
+        oldCharge = FileContext->ReadRingCharge;
+        FileContext->ReadRing = Ring;
+        FileContext->ReadRingProducer = producer;
+        FileContext->ReadRingCharge = 0;
+        FileContext->ReadRingRequest = Request;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&FileContext->ReadLock);
+    KeReleaseSpinLock(&DeviceContext->FilesLock, irql);
+
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! ring already mapped or read pending\n");
+        goto Exit;
+    }
+
+    // ring of a configured queue
+    if (pOldRing) {
+        ExFreePoolWithTag(pOldRing, POOL_TAG);
+        McbaRxQueueMemoryRelease(oldCharge);
+    }
+
+    // from here on cancelling the request unmaps the ring
+    status = WdfRequestForwardToIoQueue(Request, FileContext->ReadRingRequests);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfRequestForwardToIoQueue failed with status=%!STATUS!\n", status);
+        McbaFileUnmapReadRing(DeviceContext, FileContext, Request);
+        goto Exit;
+    }
+
+    status = STATUS_PENDING;
+
+Exit:
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileConfigureRxQueue(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    const MCBA_RX_QUEUE_CONFIG* Config
+)
+{
+    MCBA_RING_PRODUCER producer;
+    MCBA_CAN_MSG_DATA_EX msgs[16];
+    PMCBA_RING pRing = NULL;
+    PMCBA_RING pOldRing;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG depth = Config->Depth;
+    SIZE_T size = 0;
+    SIZE_T oldSize;
+    ULONG count;
+    ULONG written;
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! FileContext=0x%p Depth=%u Policy=%u MaxAgeMs=%u\n", FileContext, (unsigned)Config->Depth, (unsigned)Config->Policy, (unsigned)Config->MaxAgeMs);
+
+    if (depth > MCBA_RX_QUEUE_MAX_DEPTH ||
+        Config->Policy > MCBA_RX_QUEUE_POLICY_MAX_AGE ||
+        (MCBA_RX_QUEUE_POLICY_DROP_NEWEST == Config->Policy && !depth) ||
+        (MCBA_RX_QUEUE_POLICY_MAX_AGE == Config->Policy && !Config->MaxAgeMs)) {
+        status = STATUS_INVALID_PARAMETER;
+        goto Exit;
+    }
+
+    RtlZeroMemory(&producer, sizeof(producer));
+
+    if (depth) {
+        // round up to a power of 2
+        while (depth & (depth - 1)) {
+            depth = (depth | (depth - 1)) + 1;
+        }
+
+        size = McbaRingSize(depth);
+        if (!McbaRxQueueMemoryCharge(size)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! receive queue memory budget exhausted\n");
+            status = STATUS_QUOTA_EXCEEDED;
+            goto Exit;
+        }
+
+        // the cache aligned pool keeps head and tail on separate lines
+        pRing = ExAllocatePoolWithTag(NonPagedPoolNxCacheAligned, size, POOL_TAG);
+        if (!pRing) {
+            McbaRxQueueMemoryRelease(size);
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+
+        McbaRingInit(pRing, &producer, depth);
+    }
+
+    // swap queues with producer and readers locked out
+    KeAcquireSpinLock(&DeviceContext->FilesLock, &irql);
+    KeAcquireSpinLockAtDpcLevel(&FileContext->ReadLock);
+
+    if (FileContext->ReadRingRequest || FileContext->PendingReadCount) {
+        status = STATUS_INVALID_DEVICE_STATE;
+    }
+    else {
+        if (pRing) {
+            // carry over what is queued, drop according to the new policy if it doesn't fit
+            while ((count = McbaFileReadCanMsgs(FileContext, msgs, ARRAYSIZE(msgs))) > 0) {
+                written = McbaRingWrite(&producer, msgs, count);
+                if (written < count && MCBA_RX_QUEUE_POLICY_DROP_NEWEST != Config->Policy) {
+                    McbaRingDiscard(pRing, count - written);
+                    written += McbaRingWrite(&producer, msgs + written, count - written);
+                }
+
+                McbaCounterAdd(&FileContext->RxReaderCounters.Lost, count - written);
+            }
+        }
+        else if (FileContext->ReadRing) {
+            // what is queued privately can't go back to the shared ring
+            McbaCounterAdd(&FileContext->RxReaderCounters.Lost, McbaRingCount(FileContext->ReadRing));
+            FileContext->ReadCursor = McbaBroadcastRingCursor(FileContext->RxRing);
+        }
+
+        FileContext->RxPolicy = Config->Policy;
+        FileContext->RxMaxAge = (LONGLONG)Config->MaxAgeMs * 10000;
+
+        // the old ring is freed below
+        pOldRing = FileContext->ReadRing;
+        oldSize = FileContext->ReadRingCharge;
+        FileContext->ReadRing = pRing;
+        FileContext->ReadRingProducer = producer;
+        FileContext->ReadRingCharge = size;
+        pRing = pOldRing;
+        size = oldSize;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&FileContext->ReadLock);
+    KeReleaseSpinLock(&DeviceContext->FilesLock, irql);
+
+    if (pRing) {
+        ExFreePoolWithTag(pRing, POOL_TAG);
+        McbaRxQueueMemoryRelease(size);
+    }
+
+Exit:
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileSetFilter(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    const MCBA_CAN_FILTER* Filters,
+    ULONG Count
+)
+{
+    PMCBA_FILTER pFilter = NULL;
+    PMCBA_FILTER pOldFilter;
+    NTSTATUS status = STATUS_SUCCESS;
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! FileContext=0x%p Count=%u\n", FileContext, (unsigned)Count);
+
+    // no filters, accept all
+    if (Count) {
+        // read by the USB reader completion at DISPATCH_LEVEL
+        pFilter = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(*pFilter), POOL_TAG);
+        if (!pFilter) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+
+        if (!McbaFilterBuild(pFilter, Filters, Count)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! invalid filter\n");
+            ExFreePoolWithTag(pFilter, POOL_TAG);
+            status = STATUS_INVALID_PARAMETER;
+            goto Exit;
+        }
+    }
+
+    // neither the producer nor a reader can be looking at the old filter
+    KeAcquireSpinLock(&DeviceContext->FilesLock, &irql);
+    KeAcquireSpinLockAtDpcLevel(&FileContext->ReadLock);
+
+    pOldFilter = FileContext->Filter;
+    FileContext->Filter = pFilter;
+
+    KeReleaseSpinLockFromDpcLevel(&FileContext->ReadLock);
+    KeReleaseSpinLock(&DeviceContext->FilesLock, irql);
+
+    if (pOldFilter) {
+        ExFreePoolWithTag(pOldFilter, POOL_TAG);
+    }
+
+Exit:
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileSetRxModeration(
+    PMCBA_FILE_CONTEXT FileContext,
+    const MCBA_RX_MODERATION* Moderation
+)
+{
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! FileContext=0x%p FrameCount=%u TimeoutUs=%u\n", FileContext, Moderation->FrameCount, Moderation->TimeoutUs);
+
+    if (Moderation->TimeoutUs > MCBA_RX_MODERATION_MAX_TIMEOUT_US) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeAcquireSpinLock(&FileContext->ReadLock, &irql);
+    FileContext->RxModeration = *Moderation;
+    KeReleaseSpinLock(&FileContext->ReadLock, irql);
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileSetRxRecordFormat(
+    PMCBA_FILE_CONTEXT FileContext,
+    ULONG Format
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! FileContext=0x%p Format=%u\n", FileContext, Format);
+
+    if (MCBA_RX_RECORD_FORMAT_DATA != Format && MCBA_RX_RECORD_FORMAT_DATA_EX != Format) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // reads check their buffer against the format when they arrive
+    KeAcquireSpinLock(&FileContext->ReadLock, &irql);
+
+    if (FileContext->PendingReadCount) {
+        status = STATUS_INVALID_DEVICE_STATE;
+    }
+    else {
+        FileContext->RxRecordFormat = Format;
+    }
+
+    KeReleaseSpinLock(&FileContext->ReadLock, irql);
+
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileSetRxTimestampClock(
+    PMCBA_FILE_CONTEXT FileContext,
+    ULONG Clock
+)
+{
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! FileContext=0x%p Clock=%u\n", FileContext, Clock);
+
+    if (MCBA_RX_TIMESTAMP_CLOCK_SYSTEM != Clock && MCBA_RX_TIMESTAMP_CLOCK_MONOTONIC != Clock) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // readers convert under the read lock, the producer of a mapped ring doesn't care when it changes
+    KeAcquireSpinLock(&FileContext->ReadLock, &irql);
+    FileContext->RxTimestampClock = Clock;
+    KeReleaseSpinLock(&FileContext->ReadLock, irql);
+
+    return STATUS_SUCCESS;
+}
+
+// Whether the file reads the frame as far as echoes of transmitted frames
+// are concerned.
+static
+inline
+BOOLEAN
+McbaFileAcceptsTxEcho(
+    _In_ const MCBA_FILE_CONTEXT* FileContext,
+    _In_ const MCBA_CAN_MSG_DATA_EX* Msg
+)
+{
+    if (!(Msg->Msg.Flags & MCBA_CAN_MSG_FLAG_TX)) {
+        return TRUE;
+    }
+
+    switch (FileContext->TxEcho) {
+    case MCBA_TX_ECHO_OTHERS:
+        return Msg->Sender != FileContext->TxEchoTag;
+    case MCBA_TX_ECHO_ALL:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+// Moves the frames the file reads to the front and turns the sender of
+// echoed frames into MCBA_CAN_MSG_FLAG_SELF, returns their number.
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+ULONG
+McbaFileCompactTxEcho(
+    _In_ const MCBA_FILE_CONTEXT* FileContext,
+    _Inout_updates_(Count) PMCBA_CAN_MSG_DATA_EX Msgs,
+    _In_ ULONG Count
+)
+{
+    ULONG kept = 0;
+
+    for (ULONG i = 0; i < Count; ++i) {
+        if (!McbaFileAcceptsTxEcho(FileContext, &Msgs[i])) {
+            continue;
+        }
+
+        if ((Msgs[i].Msg.Flags & MCBA_CAN_MSG_FLAG_TX) && Msgs[i].Sender == FileContext->TxEchoTag) {
+            Msgs[i].Msg.Flags |= MCBA_CAN_MSG_FLAG_SELF;
+        }
+
+        if (kept != i) {
+            Msgs[kept] = Msgs[i];
+        }
+
+        ++kept;
+    }
+
+    return kept;
+}
+
+// TRUE if the file reads any of the frames.
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+McbaFileMatchAny(
+    _In_ const MCBA_FILE_CONTEXT* FileContext,
+    _In_reads_(Count) const MCBA_CAN_MSG_DATA_EX* Msgs,
+    _In_ ULONG Count,
+    _In_ BOOLEAN TxEcho
+)
+{
+    if (!TxEcho) {
+        return !FileContext->Filter || McbaFilterMatchAny(FileContext->Filter, Msgs, Count);
+    }
+
+    for (ULONG i = 0; i < Count; ++i) {
+        if (McbaFileAcceptsTxEcho(FileContext, &Msgs[i]) &&
+            (!FileContext->Filter || McbaFilterMatch(FileContext->Filter, Msgs[i].Msg.Id))) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileSetTxEcho(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    ULONG Echo
+)
+{
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! FileContext=0x%p Echo=%u\n", FileContext, Echo);
+
+    if (Echo > MCBA_TX_ECHO_ALL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // the producer and readers of the file both decide on it
+    KeAcquireSpinLock(&DeviceContext->FilesLock, &irql);
+    KeAcquireSpinLockAtDpcLevel(&FileContext->ReadLock);
+
+    if ((MCBA_TX_ECHO_NONE == FileContext->TxEcho) != (MCBA_TX_ECHO_NONE == Echo)) {
+        if (MCBA_TX_ECHO_NONE == Echo) {
+            InterlockedDecrement(&DeviceContext->TxEchoFiles);
+        }
+        else {
+            InterlockedIncrement(&DeviceContext->TxEchoFiles);
+        }
+    }
+
+    FileContext->TxEcho = Echo;
+
+    KeReleaseSpinLockFromDpcLevel(&FileContext->ReadLock);
+    KeReleaseSpinLock(&DeviceContext->FilesLock, irql);
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileSetTxLatency(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    const MCBA_TX_LATENCY_CONFIG* Config
+)
+{
+    PMCBA_TX_RESULT pResults = NULL;
+    PMCBA_TX_RESULT pOldResults;
+    ULONG capacity = Config->ResultsCapacity ? Config->ResultsCapacity : MCBA_TX_RESULTS_CAPACITY_DEFAULT;
+    ULONG oldMask;
+    SIZE_T size = 0;
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! FileContext=0x%p Flags=0x%x ResultsCapacity=%u\n", FileContext, (unsigned)Config->Flags, (unsigned)Config->ResultsCapacity);
+
+    if (Config->Flags & ~(MCBA_TX_LATENCY_FLAG_HISTOGRAM | MCBA_TX_LATENCY_FLAG_RESULTS) ||
+        capacity > MCBA_TX_RESULTS_CAPACITY_MAX) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Config->Flags & MCBA_TX_LATENCY_FLAG_RESULTS) {
+        // round up to a power of 2
+        while (capacity & (capacity - 1)) {
+            capacity = (capacity | (capacity - 1)) + 1;
+        }
+
+        size = capacity * sizeof(*pResults);
+        if (!McbaRxQueueMemoryCharge(size)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! receive queue memory budget exhausted\n");
+            return STATUS_QUOTA_EXCEEDED;
+        }
+
+        pResults = ExAllocatePoolWithTag(NonPagedPoolNx, size, POOL_TAG);
+        if (!pResults) {
+            McbaRxQueueMemoryRelease(size);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+
+    // the producer finds the file under the files lock and queues under the read lock
+    KeAcquireSpinLock(&DeviceContext->FilesLock, &irql);
+    KeAcquireSpinLockAtDpcLevel(&FileContext->ReadLock);
+
+    if (!FileContext->TxLatency != !Config->Flags) {
+        if (Config->Flags) {
+            InterlockedIncrement(&DeviceContext->TxLatencyFiles);
         }
         else {
-            PSLIST_ENTRY pEntry;
-        AllocBuffers:
-            pEntry = ExInterlockedPopEntrySList(&DeviceContext->MessageBuffersAvailable, &DeviceContext->MessageBuffersLock);
-            if (!pEntry) {
-                status = McbaMessageBuffersAdd(DeviceContext);
+            InterlockedDecrement(&DeviceContext->TxLatencyFiles);
+        }
+    }
+
+    FileContext->TxLatency = Config->Flags;
+
+    // the old queue is freed below
+    pOldResults = FileContext->TxResults;
+    oldMask = FileContext->TxResultsMask;
+    FileContext->TxResults = pResults;
+    FileContext->TxResultsMask = pResults ? capacity - 1 : 0;
+    FileContext->TxResultsHead = 0;
+    FileContext->TxResultsTail = 0;
+    FileContext->TxResultsLost = 0;
+
+    KeReleaseSpinLockFromDpcLevel(&FileContext->ReadLock);
+    KeReleaseSpinLock(&DeviceContext->FilesLock, irql);
+
+    if (pOldResults) {
+        ExFreePoolWithTag(pOldResults, POOL_TAG);
+        McbaRxQueueMemoryRelease((oldMask + 1) * sizeof(*pOldResults));
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileReadTxResults(
+    PMCBA_FILE_CONTEXT FileContext,
+    PMCBA_TX_RESULT Results,
+    ULONG Count,
+    PULONG Read
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    KIRQL irql;
+
+    *Read = 0;
+
+    KeAcquireSpinLock(&FileContext->ReadLock, &irql);
+
+    if (!FileContext->TxResults) {
+        status = STATUS_INVALID_DEVICE_STATE;
+        goto Exit;
+    }
+
+    while (*Read < Count && FileContext->TxResultsTail != FileContext->TxResultsHead) {
+        Results[(*Read)++] = FileContext->TxResults[FileContext->TxResultsTail++ & FileContext->TxResultsMask];
+    }
+
+Exit:
+    KeReleaseSpinLock(&FileContext->ReadLock, irql);
+
+    return status;
+}
+
+static
+_Requires_lock_held_(FileContext->ReadLock)
+_IRQL_requires_(DISPATCH_LEVEL)
+VOID
+McbaFileRecordRxLatency(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Format,
+    _In_reads_bytes_(Frames * McbaRxRecordSize(Format)) const VOID* Records,
+    _In_ ULONG_PTR Frames
+)
+{
+    PMCBA_DEVICE_CONTEXT pDeviceContext = McbaDeviceGetContext(WdfFileObjectGetDevice(WdfObjectContextGetObject(FileContext)));
+    const UCHAR* pRecord = Records;
+    const SIZE_T recordSize = McbaRxRecordSize(Format);
+    // the records already carry their reception time in the handle's clock
+    const LONGLONG now = McbaQueryMonotonicTime() + McbaFileTimestampOffset(FileContext);
+    UINT32 us;
+
+    KeAcquireSpinLockAtDpcLevel(&pDeviceContext->RxLatencyLock);
+
+    // both record formats start with MCBA_CAN_MSG_DATA
+    for (ULONG_PTR i = 0; i < Frames; ++i, pRecord += recordSize) {
+        us = McbaHistogramSpanUs((LONGLONG)((const MCBA_CAN_MSG_DATA*)pRecord)->SystemTimeReceived, now);
+        McbaHistogramRecord(FileContext->RxLatency, us);
+        McbaHistogramRecord(&pDeviceContext->RxLatency, us);
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&pDeviceContext->RxLatencyLock);
+}
+
+_Use_decl_annotations_
+VOID
+McbaFileCountRead(
+    PMCBA_FILE_CONTEXT FileContext,
+    ULONG Format,
+    const VOID* Records,
+    ULONG_PTR Frames
+)
+{
+    PMCBA_FILE_COUNTERS pCounters = &FileContext->RxReaderCounters;
+
+    McbaCounterAdd(&pCounters->Reads, 1);
+    McbaCounterAdd(&pCounters->Frames, (LONG64)Frames);
+    McbaCounterAdd(&pCounters->Bytes, (LONG64)(Frames * McbaRxRecordSize(Format)));
+
+    if (FileContext->RxLatency && Frames) {
+        McbaFileRecordRxLatency(FileContext, Format, Records, Frames);
+    }
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileSetRxLatency(
+    PMCBA_FILE_CONTEXT FileContext,
+    ULONG Flags
+)
+{
+    PMCBA_LATENCY_HISTOGRAM pHistogram = NULL;
+    PMCBA_LATENCY_HISTOGRAM pOldHistogram;
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! FileContext=0x%p Flags=0x%x\n", FileContext, (unsigned)Flags);
+
+    if (Flags & ~MCBA_RX_LATENCY_FLAG_HISTOGRAM) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Flags) {
+        pHistogram = ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(*pHistogram), POOL_TAG);
+        if (!pHistogram) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        McbaHistogramInit(pHistogram);
+    }
+
+    KeAcquireSpinLock(&FileContext->ReadLock, &irql);
+
+    // a histogram already running is kept
+    pOldHistogram = FileContext->RxLatency;
+    if (pOldHistogram && pHistogram) {
+        pOldHistogram = pHistogram;
+    }
+    else {
+        FileContext->RxLatency = pHistogram;
+    }
+
+    KeReleaseSpinLock(&FileContext->ReadLock, irql);
+
+    if (pOldHistogram) {
+        ExFreePoolWithTag(pOldHistogram, POOL_TAG);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileGetRxLatency(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    const MCBA_RX_LATENCY_QUERY* Query,
+    PMCBA_RX_LATENCY Latency
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    KIRQL irql;
+
+    if (Query->Scope > MCBA_RX_LATENCY_SCOPE_DEVICE || Query->Count > MCBA_RX_LATENCY_PERCENTILES_MAX) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlZeroMemory(Latency->ValuesUs, sizeof(Latency->ValuesUs));
+
+    KeAcquireSpinLock(&FileContext->ReadLock, &irql);
+    KeAcquireSpinLockAtDpcLevel(&DeviceContext->RxLatencyLock);
+
+    if (MCBA_RX_LATENCY_SCOPE_DEVICE == Query->Scope) {
+        Latency->ReceivedToRead = DeviceContext->RxLatency;
+    }
+    else if (FileContext->RxLatency) {
+        Latency->ReceivedToRead = *FileContext->RxLatency;
+    }
+    else {
+        status = STATUS_INVALID_DEVICE_STATE;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&DeviceContext->RxLatencyLock);
+    KeReleaseSpinLock(&FileContext->ReadLock, irql);
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    // on the copy, the readers are not held up by the walk over the buckets
+    for (ULONG i = 0; i < Query->Count; ++i) {
+        Latency->ValuesUs[i] = McbaHistogramPercentile(&Latency->ReceivedToRead, Query->Percentiles[i]);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileClearRxLatency(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    ULONG Scope
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    KIRQL irql;
+
+    if (Scope > MCBA_RX_LATENCY_SCOPE_DEVICE) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    KeAcquireSpinLock(&FileContext->ReadLock, &irql);
+    KeAcquireSpinLockAtDpcLevel(&DeviceContext->RxLatencyLock);
+
+    if (MCBA_RX_LATENCY_SCOPE_DEVICE == Scope) {
+        McbaHistogramInit(&DeviceContext->RxLatency);
+    }
+    else if (FileContext->RxLatency) {
+        McbaHistogramInit(FileContext->RxLatency);
+    }
+    else {
+        status = STATUS_INVALID_DEVICE_STATE;
+    }
+
+    KeReleaseSpinLockFromDpcLevel(&DeviceContext->RxLatencyLock);
+    KeReleaseSpinLock(&FileContext->ReadLock, irql);
+
+    return status;
+}
+
+_Use_decl_annotations_
+VOID
+McbaFileGetStats(
+    PMCBA_FILE_CONTEXT FileContext,
+    PMCBA_FILE_STATS Stats
+)
+{
+    Stats->RxLost = (ULONGLONG)(ReadNoFence64(&FileContext->RxReaderCounters.Lost) + ReadNoFence64(&FileContext->RxProducerCounters.Lost));
+    Stats->TxFrames = (ULONGLONG)ReadNoFence64(&FileContext->TxCounters.Frames);
+    Stats->TxErrors = (ULONGLONG)ReadNoFence64(&FileContext->TxCounters.Errors);
+}
+
+_Use_decl_annotations_
+VOID
+McbaFileGetStatsEx(
+    PMCBA_FILE_CONTEXT FileContext,
+    PMCBA_FILE_STATS_EX Stats
+)
+{
+    const MCBA_FILE_COUNTERS* pReader = &FileContext->RxReaderCounters;
+    const MCBA_FILE_COUNTERS* pProducer = &FileContext->RxProducerCounters;
+    ULONG depth;
+    KIRQL irql;
+
+    Stats->RxFrames = (UINT64)(ReadNoFence64(&pReader->Frames) + ReadNoFence64(&pProducer->Frames));
+    Stats->RxFiltered = (UINT64)(ReadNoFence64(&pReader->Filtered) + ReadNoFence64(&pProducer->Filtered));
+    Stats->RxLost = (UINT64)(ReadNoFence64(&pReader->Lost) + ReadNoFence64(&pProducer->Lost));
+    Stats->RxReads = (UINT64)ReadNoFence64(&pReader->Reads);
+    Stats->RxBytes = (UINT64)ReadNoFence64(&pReader->Bytes);
+    Stats->RxPendingReads = (UINT64)ReadNoFence64(&pReader->PendingReads);
+    Stats->RxPendingWaitSumUs = (UINT64)ReadNoFence64(&pReader->PendingWait) / 10;
+    Stats->RxPendingWaitMaxUs = (UINT32)min(ReadNoFence64(&pReader->PendingWaitMax) / 10, (LONG64)MAXULONG);
+    Stats->RxQueueHighWater = (UINT32)max(ReadNoFence64(&pReader->QueueHighWater), ReadNoFence64(&pProducer->QueueHighWater));
+    Stats->Reserved = 0;
+    Stats->TxFrames = (UINT64)ReadNoFence64(&FileContext->TxCounters.Frames);
+    Stats->TxErrors = (UINT64)ReadNoFence64(&FileContext->TxCounters.Errors);
+
+    // the private ring may be replaced meanwhile
+    KeAcquireSpinLock(&FileContext->ReadLock, &irql);
+    depth = FileContext->ReadRingRequest
+        ? McbaRingProducerCount(&FileContext->ReadRingProducer)
+        : FileContext->ReadRing
+        ? McbaRingCount(FileContext->ReadRing)
+        : min(McbaBroadcastRingCount(FileContext->RxRing, FileContext->ReadCursor), (ULONG)MCBA_RX_RING_CAPACITY);
+    KeReleaseSpinLock(&FileContext->ReadLock, irql);
+
+    Stats->RxQueueDepth = depth;
+}
+
+_Use_decl_annotations_
+VOID
+McbaFileClearStats(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext
+)
+{
+    KIRQL irql;
+
+    KeAcquireSpinLock(&DeviceContext->FilesLock, &irql);
+    KeAcquireSpinLockAtDpcLevel(&FileContext->ReadLock);
+    RtlZeroMemory(&FileContext->RxReaderCounters, sizeof(FileContext->RxReaderCounters));
+    RtlZeroMemory(&FileContext->RxProducerCounters, sizeof(FileContext->RxProducerCounters));
+    KeReleaseSpinLockFromDpcLevel(&FileContext->ReadLock);
+    KeReleaseSpinLock(&DeviceContext->FilesLock, irql);
+
+    KeAcquireSpinLock(&DeviceContext->TxLock, &irql);
+    RtlZeroMemory(&FileContext->TxCounters, sizeof(FileContext->TxCounters));
+    KeReleaseSpinLock(&DeviceContext->TxLock, irql);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaFileSetTxPriority(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    ULONG Priority
+)
+{
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! FileContext=0x%p Priority=%u\n", FileContext, Priority);
+
+    if (Priority > MCBA_TX_PRIORITY_LOW) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // frames already queued keep theirs
+    KeAcquireSpinLock(&DeviceContext->TxLock, &irql);
+    FileContext->TxPriority = Priority;
+    KeReleaseSpinLock(&DeviceContext->TxLock, irql);
+
+    return STATUS_SUCCESS;
+}
+
+// Stores the cursor a read moved from Start to Cursor. The producer moves
+// a caught up cursor past frames the file doesn't want without the read
+// lock, a plain store could move it back over them. Returns how many of
+// the frames read the producer already counted as filtered.
+static
+_Requires_lock_held_(FileContext->ReadLock)
+_IRQL_requires_(DISPATCH_LEVEL)
+ULONG
+McbaFilePublishReadCursor(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Start,
+    _In_ ULONG Cursor
+)
+{
+    ULONG expected = Start;
+    ULONG skipped = 0;
+    ULONG seen;
+
+    for (;;) {
+        seen = (ULONG)InterlockedCompareExchange((LONG volatile*)&FileContext->ReadCursor, (LONG)Cursor, (LONG)expected);
+        if (seen == expected) {
+            return skipped;
+        }
+
+        // skipped from expected to seen, relative to Start so it survives wrap around
+        skipped += min(seen - Start, Cursor - Start) - (expected - Start);
+
+        if (seen - Start >= Cursor - Start) {
+            return skipped;
+        }
+
+        expected = seen;
+    }
+}
+
+_Use_decl_annotations_
+ULONG
+McbaFileReadCanMsgs(
+    PMCBA_FILE_CONTEXT FileContext,
+    PMCBA_CAN_MSG_DATA_EX Msgs,
+    ULONG Count
+)
+{
+    const ULONG start = FileContext->ReadCursor;
+    ULONG cursor = start;
+    LONGLONG oldest = 0;
+    ULONGLONG lost = 0;
+    ULONGLONG stale = 0;
+    ULONG filtered = 0;
+    ULONG read = 0;
+    ULONG copied;
+    ULONG skip;
+
+    NT_ASSERT(!FileContext->ReadRingRequest);
+
+    // a private ring is measured as frames go in
+    if (!FileContext->ReadRing) {
+        McbaCounterMax(
+            &FileContext->RxReaderCounters.QueueHighWater,
+            min(McbaBroadcastRingCount(FileContext->RxRing, cursor), (ULONG)MCBA_RX_RING_CAPACITY));
+    }
+
+    // queued frames carry monotonic timestamps
+    if (MCBA_RX_QUEUE_POLICY_MAX_AGE == FileContext->RxPolicy) {
+        oldest = McbaQueryMonotonicTime() - FileContext->RxMaxAge;
+    }
+
+    // refill what was thrown away as long as the ring has frames
+    while (read < Count) {
+        copied = FileContext->ReadRing
+            ? McbaRingRead(FileContext->ReadRing, Msgs + read, Count - read)
+            : McbaBroadcastRingRead(FileContext->RxRing, &cursor, Msgs + read, Count - read, &lost);
+        if (!copied) {
+            break;
+        }
+
+        // frames are in order of arrival, the stale ones are at the front
+        if (oldest) {
+            for (skip = 0; skip < copied && Msgs[read + skip].SystemTimeReceived < oldest; ++skip);
+
+            if (skip) {
+                RtlMoveMemory(Msgs + read, Msgs + read + skip, (copied - skip) * sizeof(*Msgs));
+                stale += skip;
+                copied -= skip;
+            }
+        }
+
+        filtered += copied;
+        copied = FileContext->Filter ? McbaFilterCompact(FileContext->Filter, Msgs + read, copied) : copied;
+        copied = McbaFileCompactTxEcho(FileContext, Msgs + read, copied);
+        filtered -= copied;
+        read += copied;
+    }
+
+    if (!FileContext->ReadRing && cursor != start) {
+        filtered -= min(filtered, McbaFilePublishReadCursor(FileContext, start, cursor));
+    }
+
+    if (filtered) {
+        McbaCounterAdd(&FileContext->RxReaderCounters.Filtered, filtered);
+    }
+
+    if (lost) {
+        McbaCounterAdd(&FileContext->RxReaderCounters.Lost, (LONG64)lost);
+        TraceEvents(
+            TRACE_LEVEL_WARNING,
+            TRACE_DEVICE,
+            "%!FUNC! File 0x%p fell behind, lost %u message(s) (size=%d)\n",
+            WdfObjectContextGetObject(FileContext),
+            (unsigned)lost,
+            MCBA_RX_RING_CAPACITY);
+    }
+
+    if (stale) {
+        McbaCounterAdd(&FileContext->RxReaderCounters.Lost, (LONG64)stale);
+        TraceEvents(
+            TRACE_LEVEL_WARNING,
+            TRACE_DEVICE,
+            "%!FUNC! File 0x%p dropped %u message(s) older than %u ms\n",
+            WdfObjectContextGetObject(FileContext),
+            (unsigned)stale,
+            (unsigned)(FileContext->RxMaxAge / 10000));
+    }
+
+    return read;
+}
+
+_Use_decl_annotations_
+ULONG
+McbaFileReadCanRecords(
+    PMCBA_FILE_CONTEXT FileContext,
+    ULONG Format,
+    PVOID Records,
+    ULONG Count
+)
+{
+    PMCBA_CAN_MSG_DATA pRecords = Records;
+    MCBA_CAN_MSG_DATA_EX msgs[16];
+    LONGLONG offset = 0;
+    ULONG read = 0;
+    ULONG wanted;
+    ULONG copied;
+
+    // queues hold extended records with monotonic timestamps, convert on the way out
+    if (MCBA_RX_RECORD_FORMAT_DATA_EX == Format) {
+        read = McbaFileReadCanMsgs(FileContext, Records, Count);
+        if (read) {
+            McbaCanMsgsShiftTimestamps(Records, read, McbaFileTimestampOffset(FileContext));
+        }
+
+        return read;
+    }
+
+    while (read < Count) {
+        wanted = min(Count - read, (ULONG)ARRAYSIZE(msgs));
+        copied = McbaFileReadCanMsgs(FileContext, msgs, wanted);
+
+        // the clocks are compared once per read, only if there is something to convert
+        if (copied && !read) {
+            offset = McbaFileTimestampOffset(FileContext);
+        }
+
+        for (ULONG i = 0; i < copied; ++i) {
+            pRecords[read + i].Msg = msgs[i].Msg;
+            pRecords[read + i].SystemTimeReceived = msgs[i].SystemTimeReceived + offset;
+        }
+
+        read += copied;
+
+        if (copied < wanted) {
+            break;
+        }
+    }
+
+    return read;
+}
+
+_Use_decl_annotations_
+WDFREQUEST
+McbaServicePendingReadRequest(
+    PMCBA_FILE_CONTEXT FileContext,
+    NTSTATUS* Status,
+    ULONG_PTR* Information
+)
+{
+    PMCBA_REQUEST_CONTEXT pReadContext;
+    WDFREQUEST request;
+    size_t available;
+    size_t wanted;
+    ULONGLONG now, elapsed;
+    NTSTATUS status;
+
+    // out of the queue the request can't be cancelled while its buffer is filled
+    status = WdfIoQueueRetrieveNextRequest(FileContext->PendingReads, &request);
+    if (!NT_SUCCESS(status)) {
+        return NULL;
+    }
+
+    pReadContext = McbaRequestGetContext(request);
+
+    if (pReadContext->RingWait) {
+        // consumed in user mode, the request completes once there is enough to
+        // consume or the ring is gone
+        available = FileContext->ReadRingRequest
+            ? McbaRingProducerCount(&FileContext->ReadRingProducer)
+            : pReadContext->Threshold;
+    }
+    else {
+        NT_ASSERT(pReadContext->Offset < pReadContext->Count);
+
+        wanted = pReadContext->Count - pReadContext->Offset;
+        if (wanted > MCBA_RX_QUEUE_MAX_DEPTH) {
+            wanted = MCBA_RX_QUEUE_MAX_DEPTH;
+        }
+
+        pReadContext->Offset += McbaFileReadCanRecords(
+            FileContext,
+            pReadContext->RecordFormat,
+            (PUCHAR)pReadContext->Buffer + pReadContext->Offset * McbaRxRecordSize(pReadContext->RecordFormat),
+            (ULONG)wanted);
+
+        available = pReadContext->Offset;
+    }
+
+    if (available < pReadContext->Threshold) {
+        if (!available || !pReadContext->Timeout) {
+            goto Requeue;
+        }
+
+        now = KeQueryInterruptTime();
+        if (!pReadContext->FirstFrameTime) {
+            pReadContext->FirstFrameTime = now;
+        }
+
+        elapsed = now - pReadContext->FirstFrameTime;
+        if (elapsed < pReadContext->Timeout) {
+            // Only the oldest request gets here, restarting the timer moves
+            // it to this request's deadline.
+            WdfTimerStart(FileContext->RxModerationTimer, -(LONGLONG)(pReadContext->Timeout - elapsed));
+            goto Requeue;
+        }
+    }
+
+    status = STATUS_SUCCESS;
+    goto Complete;
+
+Requeue:
+    // back to the head of the queue, it stays the oldest
+    status = WdfRequestRequeue(request);
+    if (NT_SUCCESS(status)) {
+        return NULL;
+    }
+
+    TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfRequestRequeue failed with status=%!STATUS!\n", status);
+
+    // the frames copied are gone from the ring, hand them over
+    if (pReadContext->Offset) {
+        status = STATUS_SUCCESS;
+    }
+
+Complete:
+    InterlockedDecrement(&FileContext->PendingReadCount);
+    *Status = status;
+    *Information = pReadContext->Offset * McbaRxRecordSize(pReadContext->RecordFormat);
+
+    if (NT_SUCCESS(status)) {
+        LONG64 waited = (LONG64)(KeQueryInterruptTime() - pReadContext->QueuedTime);
+
+        McbaFileCountRead(FileContext, pReadContext->RecordFormat, pReadContext->Buffer, pReadContext->Offset);
+        McbaCounterAdd(&FileContext->RxReaderCounters.PendingReads, 1);
+        McbaCounterAdd(&FileContext->RxReaderCounters.PendingWait, waited);
+        McbaCounterMax(&FileContext->RxReaderCounters.PendingWaitMax, waited);
+    }
+
+    return request;
+}
+
+// Only for files with a private ring, all others read from the device's ring.
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaFileEnqueueCanMsgs(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_reads_(Count) const MCBA_CAN_MSG_DATA_EX* Msgs,
+    _In_ ULONG Count,
+    _In_ BOOLEAN TxEcho // some of the frames are echoes
+)
+{
+    MCBA_CAN_MSG_DATA_EX filtered[MCBA_RX_BATCH_FRAMES];
+    ULONG dropped = 0;
+    ULONG written;
+    KIRQL irql;
+
+    NT_ASSERT(FileContext->ReadRing);
+    NT_ASSERT(Count <= ARRAYSIZE(filtered));
+
+    if (FileContext->Filter || TxEcho) {
+        ULONG kept;
+
+        RtlCopyMemory(filtered, Msgs, Count * sizeof(*Msgs));
+        kept = FileContext->Filter ? McbaFilterCompact(FileContext->Filter, filtered, Count) : Count;
+        kept = McbaFileCompactTxEcho(FileContext, filtered, kept);
+        McbaCounterAdd(&FileContext->RxProducerCounters.Filtered, Count - kept);
+        Count = kept;
+        Msgs = filtered;
+    }
+
+    // nobody converts frames on their way out of a mapped ring
+    if (FileContext->ReadRingRequest && MCBA_RX_TIMESTAMP_CLOCK_MONOTONIC != FileContext->RxTimestampClock) {
+        if (Msgs != filtered) {
+            RtlCopyMemory(filtered, Msgs, Count * sizeof(*Msgs));
+            Msgs = filtered;
+        }
+
+        McbaCanMsgsShiftTimestamps(filtered, Count, McbaFileTimestampOffset(FileContext));
+    }
+
+    written = McbaRingWrite(&FileContext->ReadRingProducer, Msgs, Count);
+    if (written == Count) {
+        goto Exit;
+    }
+
+    if (FileContext->ReadRingRequest) {
+        // the tail belongs to user mode, drop the new frames
+        dropped = Count - written;
+        McbaCounterAdd(&FileContext->RxProducerCounters.Lost, dropped);
+    }
+    else {
+        // Readers account under the read lock, holding it also keeps them
+        // out so the tail can be moved from this side.
+        KeAcquireSpinLock(&FileContext->ReadLock, &irql);
+        written += McbaRingWrite(&FileContext->ReadRingProducer, Msgs + written, Count - written);
+        if (written < Count) {
+            if (MCBA_RX_QUEUE_POLICY_DROP_NEWEST == FileContext->RxPolicy) {
+                dropped = Count - written;
+            }
+            else {
+                dropped = McbaRingDiscard(FileContext->ReadRing, Count - written);
+                McbaRingWrite(&FileContext->ReadRingProducer, Msgs + written, Count - written);
+            }
+
+            McbaCounterAdd(&FileContext->RxProducerCounters.Lost, dropped);
+        }
+        KeReleaseSpinLock(&FileContext->ReadLock, irql);
+    }
+
+    if (dropped) {
+        TraceEvents(
+            TRACE_LEVEL_WARNING,
+            TRACE_DEVICE,
+            "%!FUNC! Dropped %u message(s) for file 0x%p, queue is full (size=%u)\n",
+            (unsigned)dropped,
+            WdfObjectContextGetObject(FileContext),
+            (unsigned)(FileContext->ReadRingProducer.Mask + 1));
+    }
+
+Exit:
+    // frames in a mapped ring are as good as read
+    if (FileContext->ReadRingRequest) {
+        McbaCounterAdd(&FileContext->RxProducerCounters.Frames, Count - dropped);
+    }
+
+    McbaCounterMax(&FileContext->RxProducerCounters.QueueHighWater, McbaRingProducerCount(&FileContext->ReadRingProducer));
+}
+
+_Use_decl_annotations_
+VOID
+McbaFileCompletePendingReadRequests(
+    PMCBA_FILE_CONTEXT FileContext
+)
+{
+    WDFREQUEST requestToComplete;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG_PTR information = 0;
+    KIRQL irql;
+
+    while (ReadNoFence(&FileContext->PendingReadCount)) {
+        KeAcquireSpinLock(&FileContext->ReadLock, &irql);
+        requestToComplete = McbaServicePendingReadRequest(FileContext, &status, &information);
+        KeReleaseSpinLock(&FileContext->ReadLock, irql);
+
+        if (!requestToComplete) {
+            break;
+        }
+
+        WdfRequestCompleteWithInformation(requestToComplete, status, information);
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Pending read request=%p completed with status=%!STATUS! information=%ul\n", requestToComplete, status, (unsigned long)information);
+    }
+}
+
+_Use_decl_annotations_
+VOID
+McbaEvtRxModerationTimer(
+    WDFTIMER Timer
+)
+{
+    // the oldest read timed out, a stale expiry only services the queue once more
+    McbaFileCompletePendingReadRequests(McbaRxModerationTimerGetContext(Timer)->FileContext);
+}
+
+// Queues the result of a confirmed frame of the file if it asked for them.
+static
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+VOID
+McbaFileQueueTxResult(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ const MCBA_TX_ECHO_ENTRY* Entry,
+    _In_ ULONGLONG OnBus
+)
+{
+    const LONGLONG offset = McbaFileTimestampOffset(FileContext);
+    PMCBA_TX_RESULT pResult;
+
+    KeAcquireSpinLockAtDpcLevel(&FileContext->ReadLock);
+
+    if (!FileContext->TxResults) {
+        goto Exit;
+    }
+
+    if (FileContext->TxResultsHead - FileContext->TxResultsTail > FileContext->TxResultsMask) {
+        ++FileContext->TxResultsLost;
+        goto Exit;
+    }
+
+    pResult = &FileContext->TxResults[FileContext->TxResultsHead++ & FileContext->TxResultsMask];
+    pResult->Msg = Entry->Msg;
+    pResult->Lost = FileContext->TxResultsLost;
+    pResult->Reserved = 0;
+    pResult->SystemTimeSubmitted = (ULONGLONG)(Entry->Submitted + offset);
+    pResult->SystemTimeWritten = Entry->Written ? (ULONGLONG)(Entry->Written + offset) : 0;
+    pResult->SystemTimeOnBus = OnBus ? (ULONGLONG)((LONGLONG)OnBus + offset) : 0;
+    FileContext->TxResultsLost = 0;
+
+Exit:
+    KeReleaseSpinLockFromDpcLevel(&FileContext->ReadLock);
+}
+
+// Matches the transmit confirmations among the frames with the frames
+// sent, tags them with their sender and accounts for their latencies.
+// Unless a file reads echoes they are dropped, returns the frames left.
+static
+_IRQL_requires_same_
+_IRQL_requires_(DISPATCH_LEVEL)
+_Requires_lock_held_(DeviceContext->FilesLock)
+ULONG
+McbaTxEchoConfirmMsgs(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_updates_(Count) PMCBA_CAN_MSG_DATA_EX Msgs,
+    _In_ ULONG Count
+)
+{
+    const BOOLEAN echo = DeviceContext->TxEchoFiles != 0;
+    const BOOLEAN results = DeviceContext->TxLatencyFiles != 0;
+    ULONG kept = 0;
+
+    for (ULONG i = 0; i < Count; ++i) {
+        PMCBA_CAN_MSG pMsg = &Msgs[i].Msg;
+        MCBA_TX_ECHO_ENTRY entry;
+
+        if (pMsg->Flags & MCBA_CAN_MSG_FLAG_TX) {
+            if (McbaTxEchoConfirm(DeviceContext, &Msgs[i], &entry)) {
+                Msgs[i].Sender = entry.Tag;
+            }
+            else {
+                entry.Tag = 0;
+            }
+
+            // the sender, if it still has a handle open
+            if (results && entry.Tag) {
+                PMCBA_FILE_CONTEXT pFileContext = McbaTxEchoSender(DeviceContext, entry.Tag);
+
+                if (pFileContext && (pFileContext->TxLatency & MCBA_TX_LATENCY_FLAG_RESULTS)) {
+                    McbaFileQueueTxResult(pFileContext, &entry, Msgs[i].SystemTimeOnBus);
+                }
+            }
+
+            if (!echo) {
+                continue;
+            }
+        }
+
+        if (kept != i) {
+            Msgs[kept] = Msgs[i];
+        }
+
+        ++kept;
+    }
+
+    return kept;
+}
+
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaOnCanMsgsReceived(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_updates_(Count) PMCBA_CAN_MSG_DATA_EX Msgs,
+    _In_ ULONG Count,
+    _In_ BOOLEAN TxEcho // some of the frames are echoes
+)
+{
+    PLIST_ENTRY pFileEntry;
+    ULONG head;
+    ULONG frames = 0, bits = 0, worstBits = 0, frameWorstBits;
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE, "--> %!FUNC! Count=%u\n", (unsigned)Count);
+
+    NT_ASSERT(Count <= MCBA_RX_RING_CAPACITY);
+
+    // confirmations of frames sent were counted when they were written
+    for (ULONG i = 0; i < Count; ++i) {
+        if (!(Msgs[i].Msg.Flags & MCBA_CAN_MSG_FLAG_TX)) {
+            bits += McbaCanFrameBits(Msgs[i].Msg.Id, Msgs[i].Msg.Dlc, &frameWorstBits);
+            worstBits += frameWorstBits;
+            ++frames;
+        }
+    }
+
+    KeAcquireSpinLock(&DeviceContext->FilesLock, &irql);
+
+    if (frames) {
+        KeAcquireSpinLockAtDpcLevel(&DeviceContext->BusLoadLock);
+        McbaBusLoadMeterCount(&DeviceContext->BusLoad, (LONGLONG)Msgs[Count - 1].SystemTimeReceived, FALSE, frames, bits, worstBits);
+        KeReleaseSpinLockFromDpcLevel(&DeviceContext->BusLoadLock);
+    }
+
+    // the last frame of the transfer is the one closest to its completion
+    for (ULONG i = 0; i < Count; ++i) {
+        Msgs[i].DeviceTimestamp = McbaClockExtend(&DeviceContext->RxClock, (ULONG)Msgs[i].DeviceTimestamp);
+    }
+
+    McbaClockUpdate(&DeviceContext->RxClock, Msgs[Count - 1].DeviceTimestamp, (LONGLONG)Msgs[Count - 1].SystemTimeReceived);
+
+    for (ULONG i = 0; i < Count; ++i) {
+        Msgs[i].SystemTimeOnBus = (ULONGLONG)McbaClockMap(&DeviceContext->RxClock, Msgs[i].DeviceTimestamp);
+    }
+
+    if (TxEcho) {
+        Count = McbaTxEchoConfirmMsgs(DeviceContext, Msgs, Count);
+        if (!Count) {
+            goto Exit;
+        }
+    }
+
+    // stored once, files that lag more than the ring's capacity lose frames on their next read
+    head = DeviceContext->RxRing->Head;
+    McbaBroadcastRingWrite(DeviceContext->RxRing, Msgs, Count);
+
+    for (pFileEntry = DeviceContext->FilesList.Flink; pFileEntry != &DeviceContext->FilesList; pFileEntry = pFileEntry->Flink) {
+        PMCBA_FILE_CONTEXT pFileContext = CONTAINING_RECORD(pFileEntry, MCBA_FILE_CONTEXT, FilesList);
+
+        pFileContext->RxMatched = McbaFileMatchAny(pFileContext, Msgs, Count, TxEcho);
+        if (!pFileContext->RxMatched) {
+            // Nothing for this file. If it is caught up move it past the
+            // frames so they don't count as lost should it lag later. A
+            // reader racing with this at most sees them again.
+            if (!pFileContext->ReadRing && pFileContext->ReadCursor == head) {
+                if ((LONG)head == InterlockedCompareExchange((LONG volatile*)&pFileContext->ReadCursor, (LONG)(head + Count), (LONG)head)) {
+                    McbaCounterAdd(&pFileContext->RxProducerCounters.Filtered, Count);
+                }
+            }
+            continue;
+        }
+
+        if (pFileContext->ReadRing) {
+            McbaFileEnqueueCanMsgs(pFileContext, Msgs, Count, TxEcho);
+        }
+    }
+
+    // Pairs with the barrier in McbaRead: either the reader finds the frames
+    // just stored or we find the request it left pending.
+    KeMemoryBarrier();
+
+    for (pFileEntry = DeviceContext->FilesList.Flink; pFileEntry != &DeviceContext->FilesList; pFileEntry = pFileEntry->Flink) {
+        PMCBA_FILE_CONTEXT pFileContext = CONTAINING_RECORD(pFileEntry, MCBA_FILE_CONTEXT, FilesList);
+
+        if (pFileContext->RxMatched) {
+            McbaFileCompletePendingReadRequests(pFileContext);
+        }
+    }
+
+Exit:
+    KeReleaseSpinLock(&DeviceContext->FilesLock, irql);
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE, "<-- %!FUNC!\n");
+}
+
+static
+_Use_decl_annotations_
+VOID
+McbaProcessKeepAliveCan(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    const struct mcba_usb_msg_ka_can* Msg
+)
+{
+    PMCBA_DEVICE_STATUS pStatus = &DeviceContext->DeviceStatus;
+    UINT16 rxLost = McbaCodecReadLittleEndian16(&Msg->rx_lost);
+    ULONG bitrate = McbaCodecReadBigEndian16(&Msg->can_bitrate);
+    KIRQL irql;
+
+    if ((bitrate == 33) || (bitrate == 83)) {
+        bitrate = bitrate * 1000 + 333;
+    }
+    else {
+        bitrate *= 1000;
+    }
+
+    // completions of the reader may run on several CPUs at once
+    KeAcquireSpinLock(&DeviceContext->DeviceStatusLock, &irql);
+    McbaSeqLockWriteBegin(&DeviceContext->DeviceStatusSeq);
+
+    pStatus->Bitrate = (MCBA_BITRATE)bitrate;
+    pStatus->Stats.RxLost += rxLost;
+    pStatus->Stats.RxBufferOverflow += Msg->rx_buff_ovfl;
+    pStatus->Stats.TxErrorCount += Msg->tx_err_cnt;
+    pStatus->Stats.RxErrorCount += Msg->rx_err_cnt;
+    pStatus->Stats.TxBusOff += Msg->tx_bus_off;
+    pStatus->CanSoftwareVersionMajor = Msg->soft_ver_major;
+    pStatus->CanSoftwareVersionMinor = Msg->soft_ver_minor;
+
+    McbaSeqLockWriteEnd(&DeviceContext->DeviceStatusSeq);
+    KeReleaseSpinLock(&DeviceContext->DeviceStatusLock, irql);
+
+    KeAcquireSpinLock(&DeviceContext->BusLoadLock, &irql);
+    McbaBusLoadMeterCountErrors(&DeviceContext->BusLoad, McbaQueryMonotonicTime(), Msg->tx_err_cnt, Msg->rx_err_cnt, Msg->rx_buff_ovfl);
+    KeReleaseSpinLock(&DeviceContext->BusLoadLock, irql);
+}
+
+static
+_Use_decl_annotations_
+VOID
+McbaProcessKeepAliveUsb(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    const struct mcba_usb_msg_ka_usb* Msg
+)
+{
+    KIRQL irql;
+
+    KeAcquireSpinLock(&DeviceContext->DeviceStatusLock, &irql);
+    McbaSeqLockWriteBegin(&DeviceContext->DeviceStatusSeq);
+
+    DeviceContext->DeviceStatus.UsbSoftwareVersionMajor = Msg->soft_ver_major;
+    DeviceContext->DeviceStatus.UsbSoftwareVersionMinor = Msg->soft_ver_minor;
+    DeviceContext->DeviceStatus.TerminationEnabled = Msg->termination_state;
+
+    McbaSeqLockWriteEnd(&DeviceContext->DeviceStatusSeq);
+    KeReleaseSpinLock(&DeviceContext->DeviceStatusLock, irql);
+}
+
+_Use_decl_annotations_
+VOID
+McbaGetDeviceStatus(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_DEVICE_STATUS Status
+)
+{
+    MCBA_DEVICE_STATS baseline;
+    ULONG seq;
+
+    do {
+        seq = McbaSeqLockReadBegin(&DeviceContext->DeviceStatusSeq);
+        *Status = DeviceContext->DeviceStatus;
+        baseline = DeviceContext->DeviceStatsBaseline;
+    } while (McbaSeqLockReadRetry(&DeviceContext->DeviceStatusSeq, seq));
+
+    Status->Stats.TxErrorCount -= baseline.TxErrorCount;
+    Status->Stats.RxErrorCount -= baseline.RxErrorCount;
+    Status->Stats.RxBufferOverflow -= baseline.RxBufferOverflow;
+    Status->Stats.TxBusOff -= baseline.TxBusOff;
+    Status->Stats.RxLost -= baseline.RxLost;
+    Status->Stats.TxCancelled -= baseline.TxCancelled;
+}
+
+_Use_decl_annotations_
+VOID
+McbaClearDeviceStats(
+    PMCBA_DEVICE_CONTEXT DeviceContext
+)
+{
+    KIRQL irql;
+
+    // the counters keep running, readers subtract where they stood
+    KeAcquireSpinLock(&DeviceContext->DeviceStatusLock, &irql);
+    McbaSeqLockWriteBegin(&DeviceContext->DeviceStatusSeq);
+    DeviceContext->DeviceStatsBaseline = DeviceContext->DeviceStatus.Stats;
+    McbaSeqLockWriteEnd(&DeviceContext->DeviceStatusSeq);
+    KeReleaseSpinLock(&DeviceContext->DeviceStatusLock, irql);
+}
+
+static
+_Use_decl_annotations_
+VOID
+McbaUsbReaderCompletionRoutine(
+    WDFUSBPIPE Pipe,
+    WDFMEMORY Buffer,
+    size_t NumBytesTransferred,
+    WDFCONTEXT Context
+)
+{
+    PMCBA_DEVICE_CONTEXT pDeviceContext = Context;
+    size_t count;
+    struct mcba_usb_msg* pMsg;
+    MCBA_CAN_MSG_DATA_EX canMsgs[MCBA_RX_BATCH_FRAMES];
+    ULONG canMsgCount = 0;
+    BOOLEAN canMsgsEcho = FALSE;
+    // one clock read for all frames of the transfer, converted for the reader when read
+    LONGLONG received = McbaQueryMonotonicTime();
+
+    UNREFERENCED_PARAMETER(Pipe);
+
+    TraceEvents(
+        TRACE_LEVEL_VERBOSE,
+        TRACE_DEVICE,
+        "--> %!FUNC! %u bytes transferred\n",
+        (unsigned)NumBytesTransferred);
+
+    if (NumBytesTransferred == 0) {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE, "%!FUNC! zero length read\n");
+        goto Exit;
+    }
+
+    count = NumBytesTransferred / sizeof(*pMsg);
+    if (count * sizeof(*pMsg) != NumBytesTransferred) {
+        TraceEvents(
+            TRACE_LEVEL_VERBOSE,
+            TRACE_DEVICE,
+            "%!FUNC! payload length=%u is not a multiple of %u=sizeof(struct mcba_usb_msg)\n",
+            (unsigned)NumBytesTransferred, 
+            (unsigned)sizeof(*pMsg));
+    }
+
+    if (!count) {
+        goto Exit;
+    }
+
+    pMsg = WdfMemoryGetBuffer(Buffer, NULL);
+
+
+    for (size_t i = 0; i < count; ++i, ++pMsg) {
+        switch (pMsg->cmd_id) {
+        case MBCA_CMD_I_AM_ALIVE_FROM_CAN:
+            McbaProcessKeepAliveCan(pDeviceContext, (const struct mcba_usb_msg_ka_can*)pMsg);
+            break;
+
+        case MBCA_CMD_I_AM_ALIVE_FROM_USB:
+            McbaProcessKeepAliveUsb(pDeviceContext, (const struct mcba_usb_msg_ka_usb*)pMsg);
+            break;
+
+        case MBCA_CMD_RECEIVE_MESSAGE:
+        case MBCA_CMD_TRANSMIT_MESSAGE_RSP:
+            // Transmission response from the device containing timestamp,
+            // only of interest to handles that read transmitted frames or
+            // track their latencies.
+            if (MBCA_CMD_TRANSMIT_MESSAGE_RSP == pMsg->cmd_id && !McbaTxEchoTracked(pDeviceContext)) {
+                break;
+            }
+
+            if (canMsgCount == ARRAYSIZE(canMsgs)) {
+                McbaOnCanMsgsReceived(pDeviceContext, canMsgs, canMsgCount, canMsgsEcho);
+                canMsgCount = 0;
+                canMsgsEcho = FALSE;
+            }
+
+            McbaCodecDecodeCanMsg((const struct mcba_usb_msg_can*)pMsg, &canMsgs[canMsgCount].Msg);
+            canMsgs[canMsgCount].SystemTimeReceived = (ULONGLONG)received;
+            // extended and mapped once the clock is locked
+            canMsgs[canMsgCount].DeviceTimestamp = McbaCodecDecodeTimestamp((const struct mcba_usb_msg_can*)pMsg);
+            canMsgs[canMsgCount].Sender = 0;
+            RtlZeroMemory(canMsgs[canMsgCount].Reserved, sizeof(canMsgs[canMsgCount].Reserved));
+
+            // matched with the frame sent once the timestamp is mapped
+            if (MBCA_CMD_TRANSMIT_MESSAGE_RSP == pMsg->cmd_id) {
+                canMsgs[canMsgCount].Msg.Flags = MCBA_CAN_MSG_FLAG_TX;
+                canMsgsEcho = TRUE;
+            }
+
+            ++canMsgCount;
+            break;
+
+        case MBCA_CMD_NOTHING_TO_SEND:
+            /* Side effect of communication between PIC_USB and PIC_CAN.
+             * PIC_CAN is telling us that it has nothing to send
+             */
+            break;
+
+        case 0x00:
+            TraceEvents(
+                TRACE_LEVEL_VERBOSE,
+                TRACE_DEVICE,
+                "%!FUNC! message index %u, command id 0x00\n",
+                (unsigned)i);
+            break;
+
+        default:
+            TraceEvents(
+                TRACE_LEVEL_WARNING,
+                TRACE_DEVICE,
+                "%!FUNC! unsupported msg (0x%02X)\n",
+                pMsg->cmd_id);
+            break;
+        }
+    }
+
+    // hand the frames to the files in batches, a default sized transfer is a single one
+    if (canMsgCount) {
+        McbaOnCanMsgsReceived(pDeviceContext, canMsgs, canMsgCount, canMsgsEcho);
+    }
+Exit:
+    TraceEvents(
+        TRACE_LEVEL_VERBOSE,
+        TRACE_DEVICE,
+        "<-- %!FUNC!\n");
+}
+
+#if DBG
+// Under UsbRequestData->Lock.
+static
+BOOLEAN
+McbaCheckUsbRequestIndices(
+    _In_ const MCBA_DEVICE_USB_REQUEST_DATA* UsbRequestData
+    )
+{
+    BOOLEAN result = TRUE;
+    ULONG seen[_countof(UsbRequestData->FreeIndices)];
+    RtlZeroMemory(seen, sizeof(seen));
+
+    NT_ASSERT(UsbRequestData);
+    if (UsbRequestData->FreeIndexEnd > (ULONG)UsbRequestData->Count) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p free index end=%u count=%u\n", UsbRequestData, UsbRequestData->FreeIndexEnd, (unsigned)UsbRequestData->Count);
+        result = FALSE;
+    }
+    else {
+        for (ULONG i = 0; i < UsbRequestData->FreeIndexEnd; ++i) {
+            MCBA_USB_REQUEST_INDEX_TYPE index = UsbRequestData->FreeIndices[i];
+            if (index >= (ULONG)UsbRequestData->Count) {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p index=%u out of bounds=%u\n", UsbRequestData, index, (unsigned)UsbRequestData->Count);
+                result = FALSE;
+            }
+            else {
+                ++seen[index];
+                if (seen[index] > 1) {
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p index=%u count=%u\n", UsbRequestData, index, seen[index]);
+                    result = FALSE;
+                }
+            }
+        }
+    }
+
+    return result;
+}
+#endif
+
+// Creates request Index and its memory.
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaUsbRequestsCreate(
+    _Inout_ PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
+    _In_ ULONG Index
+)
+{
+    NTSTATUS status;
+    WDF_OBJECT_ATTRIBUTES attrs;
+
+    WDF_OBJECT_ATTRIBUTES_INIT(&attrs);
+    attrs.ParentObject = UsbRequestData->Device;
+
+    status = WdfRequestCreate(&attrs, UsbRequestData->IoTarget, &UsbRequestData->Requests[Index]);
+    if (!NT_SUCCESS(status)) {
+        __analysis_assume(!UsbRequestData->Requests[Index]);
+        return status;
+    }
+
+    status = WdfMemoryCreatePreallocated(&attrs, &UsbRequestData->Messages[Index], sizeof(UsbRequestData->Messages[Index]), &UsbRequestData->Memory[Index]);
+    if (!NT_SUCCESS(status)) {
+        __analysis_assume(!UsbRequestData->Memory[Index]);
+        WdfObjectDelete(UsbRequestData->Requests[Index]);
+        __analysis_assume(!UsbRequestData->Requests[Index]);
+        return status;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+static
+_Use_decl_annotations_
+NTSTATUS
+McbaUsbRequestsInit(
+    PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
+    WDFDEVICE Device,
+    WDFIOTARGET IoTarget,
+    ULONG Max
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p Device=0x%p IoTarget=0x%p Max=%u\n", UsbRequestData, Device, IoTarget, Max);
+
+    NT_ASSERT(UsbRequestData);
+    NT_ASSERT(Device);
+    NT_ASSERT(Max >= MCBA_MAX_WRITES && Max <= MCBA_USB_REQUESTS_LIMIT);
+
+    UsbRequestData->Device = Device;
+    UsbRequestData->IoTarget = IoTarget;
+    UsbRequestData->Max = (LONG)Max;
+    UsbRequestData->InUse = 0;
+    UsbRequestData->HighWater = 0;
+    UsbRequestData->Allocations = 0;
+    UsbRequestData->Exhausted = 0;
+    UsbRequestData->FreeIndexEnd = 0;
+    KeInitializeSpinLock(&UsbRequestData->Lock);
+
+    // the rest is created once the pool runs dry
+    for (ULONG i = 0; i < MCBA_MAX_WRITES; ++i) {
+        status = McbaUsbRequestsCreate(UsbRequestData, i);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        UsbRequestData->FreeIndices[i] = (MCBA_USB_REQUEST_INDEX_TYPE)i;
+        UsbRequestData->FreeIndexEnd = i + 1;
+        UsbRequestData->Count = (LONG)i + 1;
+    }
+
+    if (NT_SUCCESS(status)) {
+        NT_ASSERT(McbaCheckUsbRequestIndices(UsbRequestData));
+    }
+    else {
+        McbaUsbRequestsUninit(UsbRequestData);
+
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! failed to allocate requests/memory for %u USB requests with status=%!STATUS!\n", (unsigned)MCBA_MAX_WRITES, status);   
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
+
+    return status;
+}
+
+static
+_Use_decl_annotations_
+VOID
+McbaUsbRequestsUninit(
+    _Inout_ PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData
+)
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p\n", UsbRequestData);
+
+    NT_ASSERT(UsbRequestData);
+    
+    if (UsbRequestData->Count) {
+        NT_ASSERT(UsbRequestData->Count <= _countof(UsbRequestData->Requests));
+        NT_ASSERT(UsbRequestData->Count <= _countof(UsbRequestData->Memory));
+
+        for (LONG j = 0; j < UsbRequestData->Count; ++j) {
+            NT_ASSERT(UsbRequestData->Requests[j]);
+            WdfObjectDelete(UsbRequestData->Requests[j]);
+            __analysis_assume(!UsbRequestData->Requests[j]);
+
+            NT_ASSERT(UsbRequestData->Memory[j]);
+            WdfObjectDelete(UsbRequestData->Memory[j]);
+            __analysis_assume(!UsbRequestData->Memory[j]);
+        }
+
+        UsbRequestData->Count = 0;
+    }
+
+    UsbRequestData->FreeIndexEnd = 0;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC!\n");
+}
+
+// Adds a free request to the pool unless it reached Max, FALSE if it can't
+// grow. Under UsbRequestData->Lock.
+static
+_IRQL_requires_(DISPATCH_LEVEL)
+BOOLEAN
+McbaUsbRequestsGrow(
+    _Inout_ PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData
+)
+{
+    ULONG index = (ULONG)UsbRequestData->Count;
+    NTSTATUS status;
+
+    if (!index || index >= (ULONG)UsbRequestData->Max) {
+        return FALSE;
+    }
+
+    status = McbaUsbRequestsCreate(UsbRequestData, index);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE, "%!FUNC! failed to create request %u with status=%!STATUS!\n", index, status);
+        return FALSE;
+    }
+
+    UsbRequestData->FreeIndices[UsbRequestData->FreeIndexEnd++] = (MCBA_USB_REQUEST_INDEX_TYPE)index;
+    InterlockedIncrement(&UsbRequestData->Count);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! pool grew to %u requests\n", index + 1);
+
+    return TRUE;
+}
+
+// Takes Count pool requests if that many are free or can be created, never
+// waits.
+_Use_decl_annotations_
+NTSTATUS
+McbaUsbRequestsTryAlloc(
+    PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
+    MCBA_USB_REQUEST_INDEX_TYPE Count,
+    MCBA_USB_REQUEST_INDEX_TYPE* Indices
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p Count=%u Indices=0x%p\n", UsbRequestData, (unsigned)Count, Indices);
+
+    NT_ASSERT(UsbRequestData);
+    NT_ASSERT(Count);
+    NT_ASSERT(Indices);
+
+    if (!UsbRequestData->Count || Count > UsbRequestData->Max) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    KeAcquireSpinLock(&UsbRequestData->Lock, &irql);
+    NT_ASSERT(McbaCheckUsbRequestIndices(UsbRequestData));
+
+    ++UsbRequestData->Allocations;
+
+    while (UsbRequestData->FreeIndexEnd < Count && McbaUsbRequestsGrow(UsbRequestData)) {
+        // the rest is created once the pool runs dry
+    }
+
+    if (Count <= UsbRequestData->FreeIndexEnd) {
+        UsbRequestData->FreeIndexEnd -= Count;
+        RtlCopyMemory(Indices, &UsbRequestData->FreeIndices[UsbRequestData->FreeIndexEnd], sizeof(*Indices) * Count);
+        UsbRequestData->InUse += Count;
+        UsbRequestData->HighWater = max(UsbRequestData->HighWater, UsbRequestData->InUse);
+        NT_ASSERT(McbaCheckUsbRequestIndices(UsbRequestData));
+    }
+    else {
+        ++UsbRequestData->Exhausted;
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    KeReleaseSpinLock(&UsbRequestData->Lock, irql);
+
+Exit:
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
+    return status;
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaUsbRequestsAllocOrPark(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    WDFREQUEST Request,
+    MCBA_USB_REQUEST_INDEX_TYPE* Indices
+)
+{
+    PMCBA_REQUEST_CONTEXT pContext = McbaRequestGetContext(Request);
+    ULONG parked;
+    NTSTATUS status;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! Request=0x%p Count=%u\n", Request, (unsigned)pContext->UsbRequestCount);
+
+    NT_ASSERT(pContext->UsbRequestCount && pContext->UsbRequestCount <= MCBA_BATCH_WRITE_USB_REQUESTS_MAX);
+
+    if (pContext->UsbRequestCount > DeviceContext->UsbRequests.Count) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto Exit;
+    }
+
+    // requests parked before this one go first
+    WdfIoQueueGetState(DeviceContext->ParkedRequests, &parked, NULL);
+    if (!parked) {
+        status = McbaUsbRequestsTryAlloc(&DeviceContext->UsbRequests, pContext->UsbRequestCount, Indices);
+        if (NT_SUCCESS(status)) {
+            goto Exit;
+        }
+    }
+
+    status = WdfRequestForwardToIoQueue(Request, DeviceContext->ParkedRequests);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfRequestForwardToIoQueue failed %!STATUS!\n", status);
+        goto Exit;
+    }
+
+    // pool requests may have come back before the request was parked
+    status = STATUS_PENDING;
+    McbaServiceParkedRequests(DeviceContext);
+
+Exit:
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
+    return status;
+}
+
+_Use_decl_annotations_
+VOID
+McbaServiceParkedRequests(
+    PMCBA_DEVICE_CONTEXT DeviceContext
+)
+{
+    LONG requests = 1;
+
+    // Whoever comes first serves on behalf of everyone that calls meanwhile,
+    // which keeps the parked requests in order.
+    if (InterlockedIncrement(&DeviceContext->ParkedServiceRequests) != 1) {
+        return;
+    }
+
+    do {
+        for (;;) {
+            MCBA_USB_REQUEST_INDEX_TYPE indices[MCBA_BATCH_WRITE_USB_REQUESTS_MAX];
+            PMCBA_REQUEST_CONTEXT pContext;
+            WDFREQUEST request;
+            NTSTATUS status;
+
+            if (!NT_SUCCESS(WdfIoQueueRetrieveNextRequest(DeviceContext->ParkedRequests, &request))) {
+                break;
+            }
+
+            pContext = McbaRequestGetContext(request);
+            status = McbaUsbRequestsTryAlloc(&DeviceContext->UsbRequests, pContext->UsbRequestCount, indices);
+            if (!NT_SUCCESS(status)) {
+                // back to the head of the queue until more requests return
+                status = WdfRequestRequeue(request);
                 if (!NT_SUCCESS(status)) {
-                    TraceEvents(
-                        TRACE_LEVEL_ERROR,
-                        TRACE_DEVICE,
-                        "%!FUNC! Memory allocation failed with status %!STATUS!\n",
-                        status);
-                    ++FileContext->Stats.RxLost;
-                    goto Exit;
+                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfRequestRequeue failed %!STATUS!\n", status);
+                    WdfRequestCompleteWithInformation(request, status, 0);
+                    continue;
                 }
 
-                goto AllocBuffers;
-            }
+                break;
+            }
+
+            McbaResumeParkedRequest(DeviceContext, request, indices);
+        }
+    } while ((requests = InterlockedAdd(&DeviceContext->ParkedServiceRequests, -requests)) != 0);
+}
+
+_Use_decl_annotations_
+VOID
+McbaUsbRequestsFree(
+    PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
+    MCBA_USB_REQUEST_INDEX_TYPE Count,
+    const MCBA_USB_REQUEST_INDEX_TYPE* Indices
+)
+{
+    KIRQL irql;
+    LONG inUse;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p Count=%u Indices=0x%p\n", UsbRequestData, (unsigned)Count, Indices);
+
+    NT_ASSERT(UsbRequestData);
+    NT_ASSERT(Count);
+    NT_ASSERT(Indices);
+
+    KeAcquireSpinLock(&UsbRequestData->Lock, &irql);
+
+    NT_ASSERT(McbaCheckUsbRequestIndices(UsbRequestData));
+    NT_ASSERT(UsbRequestData->FreeIndexEnd + Count <= (ULONG)UsbRequestData->Count);
+
+    RtlCopyMemory(&UsbRequestData->FreeIndices[UsbRequestData->FreeIndexEnd], Indices, sizeof(*Indices) * Count);
+    UsbRequestData->FreeIndexEnd += Count;
+    inUse = UsbRequestData->InUse -= Count;
+    NT_ASSERT(inUse >= 0);
+    NT_ASSERT(McbaCheckUsbRequestIndices(UsbRequestData));
+
+    KeReleaseSpinLock(&UsbRequestData->Lock, irql);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! in use %ld\n", inUse);
+}
+
+
+_Use_decl_annotations_
+VOID
+McbaUsbRequestsReuse(
+    PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
+    MCBA_USB_REQUEST_INDEX_TYPE Count,
+    const MCBA_USB_REQUEST_INDEX_TYPE* Indices
+)
+{
+    WDF_REQUEST_REUSE_PARAMS reuseParams;
+
+    UNREFERENCED_PARAMETER(Indices);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p Count=%u Indices=0x%p\n", UsbRequestData, (unsigned)Count, Indices);
+    
+    NT_ASSERT(UsbRequestData);
+    NT_ASSERT(Count);
+    NT_ASSERT(Indices);
+    NT_ASSERT(Count <= _countof(UsbRequestData->Requests));
+
+    WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+    for (MCBA_USB_REQUEST_INDEX_TYPE i = 0; i < Count; ++i) {
+        MCBA_USB_REQUEST_INDEX_TYPE index = Indices[i];        
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! reuse Request=0x%p index=%u\n", UsbRequestData->Requests[index], index);
+        NTSTATUS status = WdfRequestReuse(UsbRequestData->Requests[index], &reuseParams);
+        NT_ASSERT(NT_SUCCESS(status));
+        (void)status;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC!\n");
+}
+
+
+_Use_decl_annotations_
+VOID
+McbaTxEchoRecord(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    MCBA_USB_REQUEST_INDEX_TYPE Index,
+    ULONG Records,
+    const UINT16* Tags,
+    const LONGLONG* Submitted
+)
+{
+    const struct mcba_usb_msg* pRecords = DeviceContext->UsbRequests.Messages[Index].Msg;
+    LONGLONG now;
+    ULONG dropped = 0;
+    KIRQL irql;
+
+    if (!McbaTxEchoTracked(DeviceContext)) {
+        return;
+    }
+
+    now = McbaQueryMonotonicTime();
+
+    KeAcquireSpinLock(&DeviceContext->TxEchoLock, &irql);
+
+    DeviceContext->TxEchoPositions[Index] = DeviceContext->TxEcho.Head;
+
+    for (ULONG i = 0; i < Records; ++i) {
+        PMCBA_TX_ECHO_ENTRY pEntry;
+
+        if (MBCA_CMD_TRANSMIT_MESSAGE_EV != pRecords[i].cmd_id) {
+            continue;
+        }
+
+        pEntry = McbaTxEchoAppend(&DeviceContext->TxEcho, now, &dropped);
+        McbaCodecDecodeCanMsg((const struct mcba_usb_msg_can*)&pRecords[i], &pEntry->Msg);
+        pEntry->Tag = Tags[i];
+        pEntry->UsbRequest = Index;
+        pEntry->Submitted = Submitted[i];
+        pEntry->Written = 0;
+        ++DeviceContext->TxLatency.Frames;
+    }
+
+    // the oldest were never confirmed
+    DeviceContext->TxLatency.Unconfirmed += dropped;
+
+    KeReleaseSpinLock(&DeviceContext->TxEchoLock, irql);
+}
+
+_Use_decl_annotations_
+VOID
+McbaBusLoadCountWritten(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    MCBA_USB_REQUEST_INDEX_TYPE Index,
+    ULONG Records
+)
+{
+    const struct mcba_usb_msg* pRecords = DeviceContext->UsbRequests.Messages[Index].Msg;
+    ULONG frames = 0, bits = 0, worstBits = 0, frameWorstBits;
+    KIRQL irql;
+
+    for (ULONG i = 0; i < Records; ++i) {
+        const struct mcba_usb_msg_can* pMsg = (const struct mcba_usb_msg_can*)&pRecords[i];
+
+        // the pool request may have carried a command
+        if (MBCA_CMD_TRANSMIT_MESSAGE_EV != pMsg->cmd_id) {
+            continue;
+        }
+
+        bits += McbaCanFrameBits(McbaCodecDecodeCanId(pMsg), McbaCodecDecodeDlc(pMsg), &frameWorstBits);
+        worstBits += frameWorstBits;
+        ++frames;
+    }
+
+    if (!frames) {
+        return;
+    }
+
+    KeAcquireSpinLock(&DeviceContext->BusLoadLock, &irql);
+    McbaBusLoadMeterCount(&DeviceContext->BusLoad, McbaQueryMonotonicTime(), TRUE, frames, bits, worstBits);
+    KeReleaseSpinLock(&DeviceContext->BusLoadLock, irql);
+}
+
+_Use_decl_annotations_
+VOID
+McbaGetBusLoad(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_BUS_LOAD Load
+)
+{
+    const ULONG bitrate = (ULONG)ReadNoFence((volatile LONG*)&DeviceContext->DeviceStatus.Bitrate);
+    KIRQL irql;
+
+    KeAcquireSpinLock(&DeviceContext->BusLoadLock, &irql);
+    McbaBusLoadMeterQuery(&DeviceContext->BusLoad, McbaQueryMonotonicTime(), bitrate, Load);
+    KeReleaseSpinLock(&DeviceContext->BusLoadLock, irql);
+}
+
+_Use_decl_annotations_
+VOID
+McbaTxEchoWritten(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    MCBA_USB_REQUEST_INDEX_TYPE Index
+)
+{
+    LONGLONG now;
+    ULONG position;
+    KIRQL irql;
+
+    if (!McbaTxEchoTracked(DeviceContext)) {
+        return;
+    }
 
-            pCanMessageListItem = CONTAINING_RECORD(pEntry, MCBA_CAN_MSG_ITEM, MessageBuffersAvailable);
-        }
+    now = McbaQueryMonotonicTime();
 
-        pCanMessageListItem->Msg = Msg->Msg;
-        pCanMessageListItem->Timestamp = Msg->SystemTimeReceived << 1;
+    KeAcquireSpinLock(&DeviceContext->TxEchoLock, &irql);
 
-        InsertTailList(&FileContext->ReadBuffersList, &pCanMessageListItem->ReadBuffers);
-        ++FileContext->ReadBuffersQueued;
+    // the transfer's frames follow each other, those dropped from the tail are gone
+    position = DeviceContext->TxEchoPositions[Index];
+    if ((LONG)(position - DeviceContext->TxEcho.Tail) < 0) {
+        position = DeviceContext->TxEcho.Tail;
     }
-Exit:
-    KeReleaseSpinLock(&FileContext->ReadLock, irql);
 
-    if (requestToComplete) {
-        WdfRequestCompleteWithInformation(requestToComplete, status, information);
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Pending read request=%p completed with status=%!STATUS! information=%ul\n", requestToComplete, status, (unsigned long)information);
+    for (ULONG i = position; i != DeviceContext->TxEcho.Head; ++i) {
+        PMCBA_TX_ECHO_ENTRY pEntry = McbaTxEchoEntry(&DeviceContext->TxEcho, i);
+
+        if (pEntry->UsbRequest != Index || pEntry->Written) {
+            break;
+        }
+
+        pEntry->Written = now;
+        McbaHistogramRecord(&DeviceContext->TxLatency.SubmittedToWritten, McbaHistogramSpanUs(pEntry->Submitted, now));
     }
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC!\n");
+    KeReleaseSpinLock(&DeviceContext->TxEchoLock, irql);
 }
 
-static
-_IRQL_requires_same_
-_IRQL_requires_max_(DISPATCH_LEVEL)
+_Use_decl_annotations_
 VOID
-McbaOnCanMsgReceived(
-    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
-    _In_ const struct mcba_usb_msg_can* Msg
-)   
-{
-    MCBA_CAN_MSG_DATA canMsg;
-    UINT16 sid;
-
-    sid = ReadUnalignedBigEndian16(DeviceContext, &Msg->sid);
-
-    if (sid & MCBA_SIDL_EXID_MASK) {
-        /* SIDH    | SIDL                 | EIDH   | EIDL
-         * 28 - 21 | 20 19 18 x x x 17 16 | 15 - 8 | 7 - 0
-         */
-        canMsg.Msg.Id = MCBA_CAN_EFF_FLAG;
-
-        /* store 28-18 bits */
-        canMsg.Msg.Id |= (sid & 0xffe0) << 13;
-        /* store 17-16 bits */
-        canMsg.Msg.Id |= (sid & 3) << 16;
-        /* store 15-0 bits */
-        canMsg.Msg.Id |= ReadUnalignedBigEndian16(DeviceContext, &Msg->eid);
-    } else {
-        /* SIDH   | SIDL
-         * 10 - 3 | 2 1 0 x x x x x
-         */
-        canMsg.Msg.Id = (sid & 0xffe0) >> 5;
-    }
+McbaTxEchoFailed(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    MCBA_USB_REQUEST_INDEX_TYPE Index
+)
+{
+    KIRQL irql;
 
-    if (Msg->dlc & MCBA_DLC_RTR_MASK) {
-        canMsg.Msg.Id |= MCBA_CAN_RTR_FLAG;
+    if (!McbaTxEchoTracked(DeviceContext)) {
+        return;
     }
 
-    canMsg.Msg.Dlc = Msg->dlc & MCBA_DLC_MASK;
-    if (canMsg.Msg.Dlc > MCBA_CAN_MAX_DLC) {
-        canMsg.Msg.Dlc = MCBA_CAN_MAX_DLC;
-    }
+    KeAcquireSpinLock(&DeviceContext->TxEchoLock, &irql);
+    DeviceContext->TxLatency.Unconfirmed += McbaTxEchoFail(&DeviceContext->TxEcho, DeviceContext->TxEchoPositions[Index], Index);
+    KeReleaseSpinLock(&DeviceContext->TxEchoLock, irql);
+}
+
+// Finds the frame sent a transmit confirmation is for and accounts for its
+// latencies, FALSE if it wasn't recorded.
+//
+// Concurrent writers may put their transfers on the pipe in another order
+// than they recorded them in, so only the frame matched leaves the log.
+// Frames that stay unconfirmed, their transfer failed, time out.
+_Use_decl_annotations_
+static
+BOOLEAN
+McbaTxEchoConfirm(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    const MCBA_CAN_MSG_DATA_EX* Msg,
+    PMCBA_TX_ECHO_ENTRY Entry
+)
+{
+    PMCBA_TX_LATENCY pLatency = &DeviceContext->TxLatency;
+    const LONGLONG onBus = (LONGLONG)Msg->SystemTimeOnBus;
+    const LONGLONG now = McbaQueryMonotonicTime();
+    MCBA_CAN_MSG msg = Msg->Msg;
+    BOOLEAN found;
+    KIRQL irql;
 
-    RtlCopyMemory(canMsg.Msg.Data, Msg->data, MCBA_CAN_MAX_DLC);
-    KeQuerySystemTime(&canMsg.SystemTimeReceived);
+    // as recorded from the transfer
+    msg.Flags = 0;
 
-    for (PLIST_ENTRY pFileEntry = DeviceContext->FilesList.Flink; pFileEntry != &DeviceContext->FilesList; pFileEntry = pFileEntry->Flink) {
-        PMCBA_FILE_CONTEXT pFileContext = CONTAINING_RECORD(pFileEntry, MCBA_FILE_CONTEXT, FilesList);
-        
-        McbaAddCanMessageToFileReadQueue(DeviceContext, pFileContext, &canMsg);
+    KeAcquireSpinLock(&DeviceContext->TxEchoLock, &irql);
+
+    found = McbaTxEchoMatch(&DeviceContext->TxEcho, &msg, Entry);
+    pLatency->Unconfirmed += McbaTxEchoExpire(&DeviceContext->TxEcho, now);
+
+    if (found) {
+        ++pLatency->Confirmed;
+
+        // not mapped until the clock is fitted
+        if (onBus) {
+            if (Entry->Written) {
+                McbaHistogramRecord(&pLatency->WrittenToOnBus, McbaHistogramSpanUs(Entry->Written, onBus));
+            }
+
+            McbaHistogramRecord(&pLatency->SubmittedToOnBus, McbaHistogramSpanUs(Entry->Submitted, onBus));
+        }
     }
+
+    KeReleaseSpinLock(&DeviceContext->TxEchoLock, irql);
+
+    return found;
 }
 
-static
 _Use_decl_annotations_
 VOID
-McbaProcessKeepAliveCan(
+McbaGetTxLatency(
     PMCBA_DEVICE_CONTEXT DeviceContext,
-    const struct mcba_usb_msg_ka_can* Msg
+    PMCBA_TX_LATENCY Latency
 )
 {
-    UINT16 be, le;
-    RtlCopyMemory(&be, &Msg->can_bitrate, 2);
-    DeviceContext->DeviceStatus.Bitrate = DeviceContext->BigEndianToHost(be);
-
-    if ((DeviceContext->DeviceStatus.Bitrate == 33) || (DeviceContext->DeviceStatus.Bitrate == 83)) {
-        DeviceContext->DeviceStatus.Bitrate = DeviceContext->DeviceStatus.Bitrate * 1000 + 333;
-    }
-    else {
-        DeviceContext->DeviceStatus.Bitrate *= 1000;
-    }
+    KIRQL irql;
 
-    RtlCopyMemory(&le, &Msg->rx_lost, 2);
-    DeviceContext->DeviceStatus.Stats.RxLost += DeviceContext->LittleEndianToHost(le);
-    DeviceContext->DeviceStatus.Stats.RxBufferOverflow += Msg->rx_buff_ovfl;
-    DeviceContext->DeviceStatus.Stats.TxErrorCount += Msg->tx_err_cnt;
-    DeviceContext->DeviceStatus.Stats.RxErrorCount += Msg->rx_err_cnt;
-    DeviceContext->DeviceStatus.Stats.TxBusOff += Msg->tx_bus_off;
-    DeviceContext->DeviceStatus.CanSoftwareVersionMajor = Msg->soft_ver_major;
-    DeviceContext->DeviceStatus.CanSoftwareVersionMinor = Msg->soft_ver_minor;
+    KeAcquireSpinLock(&DeviceContext->TxEchoLock, &irql);
+    *Latency = DeviceContext->TxLatency;
+    KeReleaseSpinLock(&DeviceContext->TxEchoLock, irql);
 }
 
-static
 _Use_decl_annotations_
 VOID
-McbaProcessKeepAliveUsb(
+McbaClearTxLatency(
+    PMCBA_DEVICE_CONTEXT DeviceContext
+)
+{
+    KIRQL irql;
+
+    KeAcquireSpinLock(&DeviceContext->TxEchoLock, &irql);
+    RtlZeroMemory(&DeviceContext->TxLatency, sizeof(DeviceContext->TxLatency));
+    KeReleaseSpinLock(&DeviceContext->TxEchoLock, irql);
+}
+
+_Use_decl_annotations_
+NTSTATUS
+McbaUsbBulkWritePipeSend(
     PMCBA_DEVICE_CONTEXT DeviceContext,
-    const struct mcba_usb_msg_ka_usb* Msg
+    MCBA_USB_REQUEST_INDEX_TYPE Index
 )
 {
-    DeviceContext->DeviceStatus.UsbSoftwareVersionMajor = Msg->soft_ver_major;
-    DeviceContext->DeviceStatus.UsbSoftwareVersionMinor = Msg->soft_ver_minor;
-    DeviceContext->DeviceStatus.TerminationEnabled = Msg->termination_state;
+    return McbaUsbBulkWritePipeSendRecords(DeviceContext, Index, 1);
 }
 
-static
 _Use_decl_annotations_
-VOID
-McbaUsbReaderCompletionRoutine(
-    WDFUSBPIPE Pipe,
-    WDFMEMORY Buffer,
-    size_t NumBytesTransferred,
-    WDFCONTEXT Context
+NTSTATUS
+McbaUsbBulkWritePipeSendRecords(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    MCBA_USB_REQUEST_INDEX_TYPE Index,
+    ULONG Records
 )
 {
-    PMCBA_DEVICE_CONTEXT pDeviceContext = Context;
-    size_t count;
-    struct mcba_usb_msg* pMsg;
-    
+    NTSTATUS status;
+    WDFREQUEST request;
+    WDFMEMORY memory;
+    WDFMEMORY_OFFSET offset;
 
-    UNREFERENCED_PARAMETER(Pipe);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! DeviceContext=0x%p Index=%u Records=%u\n", DeviceContext, (unsigned)Index, (unsigned)Records);
 
-    TraceEvents(
-        TRACE_LEVEL_VERBOSE,
-        TRACE_DEVICE,
-        "--> %!FUNC! %u bytes transferred\n",
-        (unsigned)NumBytesTransferred);
+    NT_ASSERT(DeviceContext);
+    NT_ASSERT(DeviceContext->BulkWritePipe);
+    NT_ASSERT(Index < MCBA_USB_REQUESTS_LIMIT);
+    NT_ASSERT(Index < DeviceContext->UsbRequests.Count);
+    NT_ASSERT(Records && Records <= MCBA_USB_TX_RECORDS_MAX);
 
-    if (NumBytesTransferred == 0) {
-        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE, "%!FUNC! zero length read\n");
+    request = DeviceContext->UsbRequests.Requests[Index];
+    memory = DeviceContext->UsbRequests.Memory[Index];
+
+    // the memory holds MCBA_USB_TX_RECORDS_MAX records, only send those in use
+    offset.BufferOffset = 0;
+    offset.BufferLength = Records * sizeof(struct mcba_usb_msg);
+
+    status = WdfUsbTargetPipeFormatRequestForWrite(DeviceContext->BulkWritePipe, request, memory, &offset);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfUsbTargetPipeFormatRequestForWrite failed with status=%!STATUS!\n", status);
         goto Exit;
     }
 
-    count = NumBytesTransferred / sizeof(*pMsg);
-    if (count * sizeof(*pMsg) != NumBytesTransferred) {
-        TraceEvents(
-            TRACE_LEVEL_VERBOSE,
-            TRACE_DEVICE,
-            "%!FUNC! payload length=%u is not a multiple of %u=sizeof(struct mcba_usb_msg)\n",
-            (unsigned)NumBytesTransferred, 
-            (unsigned)sizeof(*pMsg));
+    if (WdfRequestSend(request, WdfUsbTargetPipeGetIoTarget(DeviceContext->BulkWritePipe), WDF_NO_SEND_OPTIONS) == FALSE) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfRequestSend failed\n");
+        status = WdfRequestGetStatus(request);
+        NT_ASSERT(!NT_SUCCESS(status));
+        goto Exit;
     }
+Exit:
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
+    return status;
+}
 
-    if (!count) {
-        goto Exit;
+
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Requires_lock_held_(DeviceContext->TxLock)
+ULONG
+McbaTxQueuePut(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ PMCBA_FILE_CONTEXT FileContext,
+    _In_reads_(Count) const MCBA_CAN_MSG* Msgs,
+    _In_ ULONG Count,
+    _In_ LONGLONG Submitted
+)
+{
+    ULONG written = 0;
+
+    while (written < Count &&
+        McbaTxSchedulerPush(
+            &DeviceContext->TxQueue,
+            &Msgs[written],
+            McbaTxSchedulerKey(FileContext->TxPriority, &Msgs[written]),
+            FileContext,
+            Submitted)) {
+        ++written;
     }
 
-    BOOLEAN filesLocked = FALSE;
-    KIRQL irql = 0;
-    BOOLEAN filesAvailable = FALSE;
-    
+    return written;
+}
 
-    pMsg = WdfMemoryGetBuffer(Buffer, NULL);
+// Fills waiting AT_LEAST_ONE writes in order of arrival while there is
+// space. Returns TRUE if any frames were queued.
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+BOOLEAN
+McbaServicePendingWrites(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext
+)
+{
+    BOOLEAN queued = FALSE;
 
+    for (;;) {
+        PMCBA_REQUEST_CONTEXT pWriteContext;
+        WDFREQUEST request;
+        ULONG written;
+        KIRQL irql;
 
-    for (size_t i = 0; i < count; ++i, ++pMsg) {
-        switch (pMsg->cmd_id) {
-        case MBCA_CMD_I_AM_ALIVE_FROM_CAN:
-            McbaProcessKeepAliveCan(pDeviceContext, (const struct mcba_usb_msg_ka_can*)pMsg);
-            break;
+        KeAcquireSpinLock(&DeviceContext->TxLock, &irql);
 
-        case MBCA_CMD_I_AM_ALIVE_FROM_USB:
-            McbaProcessKeepAliveUsb(pDeviceContext, (const struct mcba_usb_msg_ka_usb*)pMsg);
+        if (DeviceContext->TxQueue.Count == MCBA_TX_QUEUE_CAPACITY ||
+            !NT_SUCCESS(WdfIoQueueRetrieveNextRequest(DeviceContext->PendingWrites, &request))) {
+            KeReleaseSpinLock(&DeviceContext->TxLock, irql);
             break;
+        }
 
-        case MBCA_CMD_RECEIVE_MESSAGE:
-            if (!filesLocked) {
-                KeAcquireSpinLock(&pDeviceContext->FilesLock, &irql);
-                filesLocked = TRUE;
-                filesAvailable = !IsListEmpty(&pDeviceContext->FilesList);
-            }
+        pWriteContext = McbaRequestGetContext(request);
+        written = McbaTxQueuePut(
+            DeviceContext,
+            McbaFileGetContext(WdfRequestGetFileObject(request)),
+            pWriteContext->Buffer,
+            (ULONG)pWriteContext->Count,
+            pWriteContext->Submitted);
 
-            if (filesAvailable) {
-                McbaOnCanMsgReceived(pDeviceContext, (struct mcba_usb_msg_can*)pMsg);
-            }
-            break;
+        KeReleaseSpinLock(&DeviceContext->TxLock, irql);
 
-        case MBCA_CMD_NOTHING_TO_SEND:
-            /* Side effect of communication between PIC_USB and PIC_CAN.
-             * PIC_CAN is telling us that it has nothing to send
-             */
-            break;
+        queued = queued || written;
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! Request=0x%p queued %u frames\n", request, written);
+        WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, written * sizeof(MCBA_CAN_MSG));
+    }
 
-        case MBCA_CMD_TRANSMIT_MESSAGE_RSP:
-            /* Transmission response from the device containing timestamp */
-            break;
+    return queued;
+}
 
-        case 0x00:
-            TraceEvents(
-                TRACE_LEVEL_VERBOSE,
-                TRACE_DEVICE,
-                "%!FUNC! message index %u, command id 0x00\n",
-                (unsigned)i);
-            break;
+_Use_decl_annotations_
+NTSTATUS
+McbaFileWriteCanMsgs(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    WDFREQUEST Request,
+    const MCBA_CAN_MSG* Msgs,
+    ULONG Count,
+    BOOLEAN NonBlocking,
+    PULONG Written
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG queued = 0;
+    KIRQL irql;
 
-        default:
-            TraceEvents(
-                TRACE_LEVEL_WARNING,
-                TRACE_DEVICE,
-                "%!FUNC! unsupported msg (0x%02X)\n",
-                pMsg->cmd_id);
-            break;
+    *Written = 0;
+
+    for (ULONG i = 0; i < Count; ++i) {
+        if (Msgs[i].Dlc > MCBA_CAN_MAX_DLC) {
+            return STATUS_INVALID_PARAMETER;
         }
     }
 
-    if (filesLocked) {
-        KeReleaseSpinLock(&pDeviceContext->FilesLock, irql);
+    KeAcquireSpinLock(&DeviceContext->TxLock, &irql);
+
+    // writes that already wait get the space first
+    WdfIoQueueGetState(DeviceContext->PendingWrites, &queued, NULL);
+
+    if (!queued) {
+        *Written = McbaTxQueuePut(DeviceContext, FileContext, Msgs, Count, McbaRequestGetContext(Request)->Submitted);
     }
-Exit:
-    TraceEvents(
-        TRACE_LEVEL_VERBOSE,
-        TRACE_DEVICE,
-        "<-- %!FUNC!\n");
+
+    if (!NonBlocking && Count && !*Written) {
+        PMCBA_REQUEST_CONTEXT pWriteContext = McbaRequestGetContext(Request);
+
+        pWriteContext->Buffer = (PVOID)Msgs;
+        pWriteContext->Count = Count;
+
+        status = WdfRequestForwardToIoQueue(Request, DeviceContext->PendingWrites);
+        if (NT_SUCCESS(status)) {
+            status = STATUS_PENDING;
+        }
+        else {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfRequestForwardToIoQueue failed with status=%!STATUS!\n", status);
+        }
+    }
+
+    KeReleaseSpinLock(&DeviceContext->TxLock, irql);
+
+    McbaTxQueueDrain(DeviceContext);
+
+    return status;
 }
 
-_Use_decl_annotations_
-NTSTATUS
-McbaMessageBuffersAdd(
-    PMCBA_DEVICE_CONTEXT DeviceContext
+// Counts the frames of a finished request in the stats of their files and
+// returns the request to the pool.
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaTxUsbRequestFinish(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ MCBA_USB_REQUEST_INDEX_TYPE Index,
+    _In_ NTSTATUS Status
 )
 {
-    PMCBA_CAN_MSG_ITEM pItem = ExAllocatePoolWithTag(NonPagedPoolNx, PAGE_SIZE, POOL_TAG);
-    if (!pItem) {
-        return STATUS_NO_MEMORY;
+    PMCBA_TX_USB_REQUEST pTxRequest = &DeviceContext->TxUsbRequests[Index];
+    KIRQL irql;
+
+    if (!NT_SUCCESS(Status)) {
+        McbaTxEchoFailed(DeviceContext, Index);
     }
 
-    // store header
-    pItem->MemoryBlockOwner = 1;
-    ExInterlockedPushEntrySList(&DeviceContext->MessageBuffersAvailable, &pItem->MessageBuffersAvailable, &DeviceContext->MessageBuffersLock);
-    
-    ++pItem;
-    size_t count = PAGE_SIZE / sizeof(MCBA_CAN_MSG_ITEM);
+    KeAcquireSpinLock(&DeviceContext->TxLock, &irql);
+
+    for (ULONG i = 0; i < pTxRequest->Count; ++i) {
+        PMCBA_FILE_CONTEXT pFileContext = pTxRequest->FileContexts[i];
+
+        if (pFileContext) {
+            if (NT_SUCCESS(Status)) {
+                McbaCounterAdd(&pFileContext->TxCounters.Frames, 1);
+            }
+            else {
+                McbaCounterAdd(&pFileContext->TxCounters.Errors, 1);
+            }
+        }
+    }
 
-    // store rest
-    for (size_t i = 1; i < count; ++i, ++pItem) {
-        pItem->MemoryBlockOwner = 0;
-        ExInterlockedPushEntrySList(&DeviceContext->MessageBuffersAvailable, &pItem->MessageBuffersAvailable, &DeviceContext->MessageBuffersLock);
+    pTxRequest->Count = 0;
+    if (!--DeviceContext->TxUsbRequestCount) {
+        KeSetEvent(&DeviceContext->TxIdle, IO_NO_INCREMENT, FALSE);
     }
 
-    return STATUS_SUCCESS;
+    KeReleaseSpinLock(&DeviceContext->TxLock, irql);
+
+    McbaUsbRequestsReuse(&DeviceContext->UsbRequests, 1, &Index);
+    McbaUsbRequestsFree(&DeviceContext->UsbRequests, 1, &Index);
 }
 
 _Use_decl_annotations_
+VOID
+McbaFileCountTxFrames(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    ULONG Frames,
+    ULONG Errors
+)
+{
+    KIRQL irql;
+
+    KeAcquireSpinLock(&DeviceContext->TxLock, &irql);
+    McbaCounterAdd(&FileContext->TxCounters.Frames, Frames);
+    McbaCounterAdd(&FileContext->TxCounters.Errors, Errors);
+    KeReleaseSpinLock(&DeviceContext->TxLock, irql);
+}
+
+// Hands queued frames to pool requests until one of them runs out.
 static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaTxQueueSend(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext
+)
+{
+    const ULONG framesPerUsbRequest = DeviceContext->TxPackFrames ? MCBA_USB_TX_RECORDS_MAX : 1;
+
+    for (;;) {
+        MCBA_USB_REQUEST_INDEX_TYPE index;
+        PMCBA_TX_USB_REQUEST pTxRequest;
+        MCBA_TX_SCHEDULER_ENTRY entry;
+        UINT16 tags[MCBA_USB_TX_RECORDS_MAX];
+        LONGLONG submitted[MCBA_USB_TX_RECORDS_MAX];
+        ULONG frames;
+        NTSTATUS status;
+        KIRQL irql;
+
+        KeAcquireSpinLock(&DeviceContext->TxLock, &irql);
+
+        if (!DeviceContext->TxStarted ||
+            !DeviceContext->TxQueue.Count ||
+            DeviceContext->TxUsbRequestCount >= MCBA_TX_QUEUE_USB_REQUESTS_MAX ||
+            !NT_SUCCESS(McbaUsbRequestsTryAlloc(&DeviceContext->UsbRequests, 1, &index))) {
+            KeReleaseSpinLock(&DeviceContext->TxLock, irql);
+            break;
+        }
+
+        if (!DeviceContext->TxUsbRequestCount++) {
+            KeClearEvent(&DeviceContext->TxIdle);
+        }
+        pTxRequest = &DeviceContext->TxUsbRequests[index];
+        frames = 0;
+
+        // highest priority first, see McbaTxSchedulerKey
+        while (frames < framesPerUsbRequest && McbaTxSchedulerPop(&DeviceContext->TxQueue, &entry)) {
+            McbaCodecEncodeCanMsg(&entry.Msg, (struct mcba_usb_msg_can*)&DeviceContext->UsbRequests.Messages[index].Msg[frames]);
+            tags[frames] = ((PMCBA_FILE_CONTEXT)entry.Context)->TxEchoTag;
+            submitted[frames] = entry.Time;
+            pTxRequest->FileContexts[frames++] = entry.Context;
+        }
+
+        pTxRequest->Count = frames;
+
+        KeReleaseSpinLock(&DeviceContext->TxLock, irql);
+
+        WdfRequestSetCompletionRoutine(DeviceContext->UsbRequests.Requests[index], McbaUrbCompletedForTxQueue, ULongToPtr(index));
+        McbaTxEchoRecord(DeviceContext, index, frames, tags, submitted);
+        status = McbaUsbBulkWritePipeSendRecords(DeviceContext, index, frames);
+        if (!NT_SUCCESS(status)) {
+            McbaTxUsbRequestFinish(DeviceContext, index, status);
+        }
+    }
+}
+
+_Use_decl_annotations_
 VOID
-McbaMessageBuffersFree(
+McbaTxQueueDrain(
     PMCBA_DEVICE_CONTEXT DeviceContext
 )
 {
-    PMCBA_CAN_MSG_ITEM pMemoryOwnerList = NULL;
+    LONG requests = 1;
 
-    for (PSLIST_ENTRY pEntry = ExInterlockedPopEntrySList(&DeviceContext->MessageBuffersAvailable, &DeviceContext->MessageBuffersLock); pEntry; ) {
-        PMCBA_CAN_MSG_ITEM pItem = CONTAINING_RECORD(pEntry, MCBA_CAN_MSG_ITEM, ReadBuffers);
-        if (pItem->MemoryBlockOwner) {
-            pItem->MessageBuffersAvailable.Next = (PSLIST_ENTRY)pMemoryOwnerList;
-            pMemoryOwnerList = pItem;
-        }
+    // Whoever comes first drains on behalf of everyone that calls meanwhile,
+    // which keeps the frames in order on the pipe.
+    if (InterlockedIncrement(&DeviceContext->TxDrainRequests) != 1) {
+        return;
     }
 
-    while (pMemoryOwnerList) {
-        PVOID mem = pMemoryOwnerList;
-        pMemoryOwnerList = (PMCBA_CAN_MSG_ITEM)pMemoryOwnerList->MessageBuffersAvailable.Next;
-        ExFreePoolWithTag(mem, POOL_TAG);
-    }
+    do {
+        // frames of writes that waited for the space go out in the next round
+        do {
+            McbaTxQueueSend(DeviceContext);
+        } while (McbaServicePendingWrites(DeviceContext));
+    } while ((requests = InterlockedAdd(&DeviceContext->TxDrainRequests, -requests)) != 0);
+
+    // Queued frames go before parked writes so that a handle that saturates
+    // the pool with WriteFile can't hold up frames of a higher priority.
+    // The queue takes at most MCBA_TX_QUEUE_USB_REQUESTS_MAX, parked writes
+    // get the rest.
+    McbaServiceParkedRequests(DeviceContext);
 }
 
 _Use_decl_annotations_
+static
 VOID
-McbaFormatCanMessage(
-    PMCBA_DEVICE_CONTEXT DeviceContext,
-    const MCBA_CAN_MSG* Input,
-    struct mcba_usb_msg_can* Output
-)
-{
-    UINT16 beSid, beEid;
-
-    Output->cmd_id = MBCA_CMD_TRANSMIT_MESSAGE_EV;
-
-    if (Input->Id & MCBA_CAN_EFF_FLAG) {
-        UINT16 sid;
-        /* SIDH    | SIDL                 | EIDH   | EIDL
-         * 28 - 21 | 20 19 18 x x x 17 16 | 15 - 8 | 7 - 0
-         */
-        sid = MCBA_SIDL_EXID_MASK;
-        /* store 28-18 bits */
-        sid |= (Input->Id & 0x1ffc0000) >> 13;
-        /* store 17-16 bits */
-        sid |= (Input->Id & 0x30000) >> 16;
-        beSid = DeviceContext->BigEndianToHost(sid);
-        RtlCopyMemory(&Output->sid, &beSid, 2);
-
-        /* store 15-0 bits */
-        beEid = DeviceContext->BigEndianToHost(Input->Id & 0xffff);
-        RtlCopyMemory(&Output->eid, &beEid, 2);
-    } else {
-        /* SIDH   | SIDL
-         * 10 - 3 | 2 1 0 x x x x x
-         */
-        beSid = DeviceContext->BigEndianToHost((Input->Id & MCBA_CAN_SFF_MASK) << 5);
-        beEid = 0;
-        RtlCopyMemory(&Output->sid, &beSid, 2);
-        RtlCopyMemory(&Output->eid, &beEid, 2);
-    }
-
-    Output->dlc = Input->Dlc;
+McbaUrbCompletedForTxQueue(
+    WDFREQUEST Request,
+    WDFIOTARGET Target,
+    PWDF_REQUEST_COMPLETION_PARAMS Params,
+    WDFCONTEXT Context
+)
+{
+    NTSTATUS status = Params->IoStatus.Status;
+    PWDF_USB_REQUEST_COMPLETION_PARAMS usbCompletionParams = Params->Parameters.Usb.Completion;
+    MCBA_USB_REQUEST_INDEX_TYPE index = (MCBA_USB_REQUEST_INDEX_TYPE)PtrToUlong(Context);
+    PMCBA_DEVICE_CONTEXT pDeviceContext = McbaDeviceGetContext(WdfIoTargetGetDevice(Target));
+    size_t expected = pDeviceContext->TxUsbRequests[index].Count * sizeof(struct mcba_usb_msg);
 
-    RtlCopyMemory(Output->data, Input->Data, sizeof(Output->data));
+    UNREFERENCED_PARAMETER(Request);
 
-    if (Input->Id & MCBA_CAN_RTR_FLAG) {
-        Output->dlc |= MCBA_DLC_RTR_MASK;
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE,
+            "%!FUNC! write failed with status=%!STATUS!, UsbdStatus=0x%x\n",
+            status, usbCompletionParams->UsbdStatus);
     }
-}
-#if DBG
-static
-BOOLEAN
-McbaCheckUsbRequestIndices(
-    _In_ const MCBA_DEVICE_USB_REQUEST_DATA* UsbRequestData
-    )
-{
-    BOOLEAN result = TRUE;
-    ULONG seen[_countof(UsbRequestData->FreeIndices)];
-    RtlZeroMemory(seen, sizeof(seen));
-
-    NT_ASSERT(UsbRequestData);
-    if (UsbRequestData->FreeIndexEnd > UsbRequestData->Count) {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p free index end=%u count=%u\n", UsbRequestData, UsbRequestData->FreeIndexEnd, UsbRequestData->Count);
-        result = FALSE;
+    else if (usbCompletionParams->Parameters.PipeWrite.Length != expected) {
+        TraceEvents(TRACE_LEVEL_WARNING, TRACE_DEVICE, "%!FUNC! incomplete write, expected %u bytes\n", (unsigned)expected);
+        status = STATUS_DATA_ERROR;
     }
     else {
-        for (MCBA_USB_REQUEST_INDEX_TYPE i = 0; i < UsbRequestData->FreeIndexEnd; ++i) {
-            MCBA_USB_REQUEST_INDEX_TYPE index = UsbRequestData->FreeIndices[i];
-            if (index >= _countof(UsbRequestData->FreeIndices)) {
-                TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p index=%u out of bounds=%u\n", UsbRequestData, index, (unsigned)_countof(UsbRequestData->FreeIndices));
-                result = FALSE;
-            }
-            else {
-                ++seen[index];
-                if (seen[index] > 1) {
-                    TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p index=%u count=%u\n", UsbRequestData, index, seen[index]);
-                    result = FALSE;
-                }
-            }
-        }
+        McbaTxEchoWritten(pDeviceContext, index);
+        McbaBusLoadCountWritten(pDeviceContext, index, pDeviceContext->TxUsbRequests[index].Count);
     }
 
-    return result;
+    McbaTxUsbRequestFinish(pDeviceContext, index, status);
+    McbaTxQueueDrain(pDeviceContext);
 }
-#endif
 
-static
+// Fails the file's waiting and parked requests and drops its queued frames,
+// frames already on their way are sent but no longer counted.
 _Use_decl_annotations_
-NTSTATUS
-McbaUsbRequestsInit(
-    PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
-    WDFDEVICE Device,
-    WDFIOTARGET IoTarget
+static
+VOID
+McbaFileCancelTxFrames(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    WDFFILEOBJECT FileObject
 )
 {
-    NTSTATUS status = STATUS_SUCCESS;
-    WDF_OBJECT_ATTRIBUTES attrs;
+    WDFREQUEST request;
+    ULONG cancelled;
+    KIRQL irql;
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p Device=0x%p IoTarget=0x%p\n", UsbRequestData, Device, IoTarget);
+    while (NT_SUCCESS(WdfIoQueueRetrieveRequestByFileObject(DeviceContext->PendingWrites, FileObject, &request))) {
+        WdfRequestComplete(request, STATUS_CANCELLED);
+    }
 
-    NT_ASSERT(UsbRequestData);
-    NT_ASSERT(Device);
-    NT_ASSERT(IoTarget);
+    while (NT_SUCCESS(WdfIoQueueRetrieveRequestByFileObject(DeviceContext->ParkedRequests, FileObject, &request))) {
+        WdfRequestComplete(request, STATUS_CANCELLED);
+    }
 
-    WDF_OBJECT_ATTRIBUTES_INIT(&attrs);
-    attrs.ParentObject = Device;
+    KeAcquireSpinLock(&DeviceContext->TxLock, &irql);
 
-    for (MCBA_USB_REQUEST_INDEX_TYPE i = 0; i < _countof(UsbRequestData->Requests); ++i) {
-        status = WdfRequestCreate(&attrs, IoTarget, &UsbRequestData->Requests[i]);
-        if (!NT_SUCCESS(status)) {
-            __analysis_assume(!UsbRequestData->Requests[i]);
-            break;
-        }
+    cancelled = McbaTxSchedulerRemove(&DeviceContext->TxQueue, FileContext);
 
-        status = WdfMemoryCreatePreallocated(&attrs, &UsbRequestData->Messages[i], sizeof(UsbRequestData->Messages[i]), &UsbRequestData->Memory[i]);
-        if (!NT_SUCCESS(status)) {
-            __analysis_assume(!UsbRequestData->Memory[i]);
-            WdfObjectDelete(UsbRequestData->Requests[i]);
-            __analysis_assume(!UsbRequestData->Requests[i]);
-            break;
+    for (ULONG i = 0; i < ARRAYSIZE(DeviceContext->TxUsbRequests); ++i) {
+        for (ULONG j = 0; j < DeviceContext->TxUsbRequests[i].Count; ++j) {
+            if (DeviceContext->TxUsbRequests[i].FileContexts[j] == FileContext) {
+                DeviceContext->TxUsbRequests[i].FileContexts[j] = NULL;
+            }
         }
-
-        UsbRequestData->FreeIndices[i] = i;
-        UsbRequestData->Count = i + 1;
     }
 
-    if (NT_SUCCESS(status)) {
-        UsbRequestData->FreeIndexEnd = UsbRequestData->Count;
-        KeInitializeSemaphore(&UsbRequestData->Availabe, _countof(UsbRequestData->Requests), _countof(UsbRequestData->Requests));
-        KeInitializeSpinLock(&UsbRequestData->Lock);
-        NT_ASSERT(McbaCheckUsbRequestIndices(UsbRequestData));
+    for (ULONG i = 0; i < ARRAYSIZE(DeviceContext->Cyclic); ++i) {
+        if (DeviceContext->Cyclic[i].FileContext == FileContext) {
+            RtlZeroMemory(&DeviceContext->Cyclic[i], sizeof(DeviceContext->Cyclic[i]));
+        }
     }
-    else {
-        UsbRequestData->FreeIndexEnd = 0;
-        McbaUsbRequestsUninit(UsbRequestData);
-        NT_ASSERT(McbaCheckUsbRequestIndices(UsbRequestData));
 
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! failed to allocate requests/memory for %u USB requests with status=%!STATUS!\n", (unsigned)_countof(UsbRequestData->Requests), status);   
-    }
+    McbaCyclicArm(DeviceContext, McbaQueryMonotonicTime());
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
+    KeReleaseSpinLock(&DeviceContext->TxLock, irql);
 
-    return status;
+    if (cancelled) {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! dropped %u queued frames\n", cancelled);
+
+        KeAcquireSpinLock(&DeviceContext->DeviceStatusLock, &irql);
+        McbaSeqLockWriteBegin(&DeviceContext->DeviceStatusSeq);
+        DeviceContext->DeviceStatus.Stats.TxCancelled += cancelled;
+        McbaSeqLockWriteEnd(&DeviceContext->DeviceStatusSeq);
+        KeReleaseSpinLock(&DeviceContext->DeviceStatusLock, irql);
+    }
 }
 
-static
+// Starts the timer for the earliest active cyclic frame, stops it if there
+// is none or the device is away.
 _Use_decl_annotations_
+static
 VOID
-McbaUsbRequestsUninit(
-    _Inout_ PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData
+McbaCyclicArm(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    LONGLONG Now
 )
 {
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p\n", UsbRequestData);
-
-    NT_ASSERT(UsbRequestData);
-    
-    if (UsbRequestData->Count) {
-        NT_ASSERT(UsbRequestData->Count <= _countof(UsbRequestData->Requests));
-        NT_ASSERT(UsbRequestData->Count <= _countof(UsbRequestData->Memory));
+    LONGLONG due = MAXLONGLONG;
 
-        for (MCBA_USB_REQUEST_INDEX_TYPE j = 0; j < UsbRequestData->Count; ++j) {
-            NT_ASSERT(UsbRequestData->Requests[j]);
-            WdfObjectDelete(UsbRequestData->Requests[j]);
-            __analysis_assume(!UsbRequestData->Requests[j]);
-
-            NT_ASSERT(UsbRequestData->Memory[j]);
-            WdfObjectDelete(UsbRequestData->Memory[j]);
-            __analysis_assume(!UsbRequestData->Memory[j]);
+    for (ULONG i = 0; i < ARRAYSIZE(DeviceContext->Cyclic); ++i) {
+        if (DeviceContext->Cyclic[i].Active && DeviceContext->Cyclic[i].Due < due) {
+            due = DeviceContext->Cyclic[i].Due;
         }
+    }
 
-        UsbRequestData->Count = 0;
-        UsbRequestData->FreeIndexEnd = 0;
+    if (MAXLONGLONG == due || !DeviceContext->TxStarted) {
+        WdfTimerStop(DeviceContext->CyclicTimer, FALSE);
+        return;
     }
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC!\n");
+    // restarting moves a pending timer to the new due time
+    WdfTimerStart(DeviceContext->CyclicTimer, -max(due - Now, 1));
 }
 
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_Requires_lock_held_(DeviceContext->TxLock)
+PMCBA_CYCLIC_ENTRY
+McbaCyclicFind(
+    _In_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_opt_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Index
+)
+{
+    for (ULONG i = 0; i < ARRAYSIZE(DeviceContext->Cyclic); ++i) {
+        PMCBA_CYCLIC_ENTRY pEntry = &DeviceContext->Cyclic[i];
+
+        if (pEntry->FileContext == FileContext && (!FileContext || pEntry->Index == Index)) {
+            return pEntry;
+        }
+    }
+
+    return NULL;
+}
 
+// Queues every frame due within MCBA_CYCLIC_BATCH_WINDOW in one go, the
+// drain packs them into as few transfers as it can.
 _Use_decl_annotations_
-NTSTATUS
-McbaUsbRequestsAlloc(
-    PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
-    MCBA_USB_REQUEST_INDEX_TYPE Count,
-    MCBA_USB_REQUEST_INDEX_TYPE* Indices
+VOID
+McbaEvtCyclicTimer(
+    WDFTIMER Timer
 )
 {
+    PMCBA_DEVICE_CONTEXT pDeviceContext = McbaDeviceGetContext(WdfTimerGetParentObject(Timer));
+    LONGLONG now = McbaQueryMonotonicTime();
+    ULONG queued = 0;
     KIRQL irql;
-    NTSTATUS status = STATUS_SUCCESS;
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p Count=%u Indices=0x%p\n", UsbRequestData, (unsigned)Count, Indices);
+    KeAcquireSpinLock(&pDeviceContext->TxLock, &irql);
 
-    NT_ASSERT(UsbRequestData);
-    NT_ASSERT(Count);
-    NT_ASSERT(Indices);
-    
+    for (ULONG i = 0; i < ARRAYSIZE(pDeviceContext->Cyclic) && pDeviceContext->TxStarted; ++i) {
+        PMCBA_CYCLIC_ENTRY pEntry = &pDeviceContext->Cyclic[i];
+        PMCBA_CYCLIC_FRAME_STATS pStats = &pEntry->Stats;
 
-    if (Count > UsbRequestData->Count) {
-        status = STATUS_INSUFFICIENT_RESOURCES;
-        goto Exit;
-    }
-    
-    for (MCBA_USB_REQUEST_INDEX_TYPE i = 0; i < Count;  ) {
-        status = KeWaitForSingleObject(&UsbRequestData->Availabe, Executive, KernelMode, FALSE, NULL);
-        if (NT_SUCCESS(status)) {
-            ++i;
+        if (!pEntry->Active || pEntry->Due > now + MCBA_CYCLIC_BATCH_WINDOW) {
+            continue;
+        }
+
+        if (McbaTxSchedulerPush(
+                &pDeviceContext->TxQueue,
+                &pEntry->Msg,
+                McbaTxSchedulerKey(pEntry->FileContext->TxPriority, &pEntry->Msg),
+                pEntry->FileContext,
+                now)) {
+            LONG lateness = (LONG)((now - pEntry->Due) / 10);
+
+            if (pEntry->Last) {
+                ULONG interval = (ULONG)((now - pEntry->Last) / 10);
+
+                pStats->IntervalMinUs = pStats->Sent > 1 ? min(pStats->IntervalMinUs, interval) : interval;
+                pStats->IntervalMaxUs = max(pStats->IntervalMaxUs, interval);
+            }
+
+            pStats->LatenessMinUs = pStats->Sent ? min(pStats->LatenessMinUs, lateness) : lateness;
+            pStats->LatenessMaxUs = pStats->Sent ? max(pStats->LatenessMaxUs, lateness) : lateness;
+            pStats->LatenessSumUs += lateness;
+            ++pStats->Sent;
+            pEntry->Last = now;
+            ++queued;
+
+            if (pStats->Remaining && !--pStats->Remaining) {
+                pEntry->Active = FALSE;
+            }
+        }
+        else {
+            ++pStats->Skipped;
+        }
+
+        pEntry->Due += pEntry->Period;
+
+        // periods the timer overslept are skipped, not sent in a burst
+        if (pEntry->Due <= now) {
+            LONGLONG behind = (now - pEntry->Due) / pEntry->Period + 1;
+
+            pStats->Skipped += behind;
+            pEntry->Due += behind * pEntry->Period;
         }
     }
-    
-    KeAcquireSpinLock(&UsbRequestData->Lock, &irql);
-    NT_ASSERT(McbaCheckUsbRequestIndices(UsbRequestData));
-    NT_ASSERT(Count <= UsbRequestData->FreeIndexEnd);
-    UsbRequestData->FreeIndexEnd -= Count;
-    RtlCopyMemory(Indices, &UsbRequestData->FreeIndices[UsbRequestData->FreeIndexEnd], sizeof(*Indices) * Count);
-    NT_ASSERT(McbaCheckUsbRequestIndices(UsbRequestData));
 
-    KeReleaseSpinLock(&UsbRequestData->Lock, irql);
-Exit:
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! completed with status=%!STATUS!\n", status);
-    return status;
+    McbaCyclicArm(pDeviceContext, now);
+
+    KeReleaseSpinLock(&pDeviceContext->TxLock, irql);
+
+    TraceEvents(TRACE_LEVEL_VERBOSE, TRACE_DEVICE, "%!FUNC! queued %u frames\n", queued);
+
+    if (queued) {
+        McbaTxQueueDrain(pDeviceContext);
+    }
 }
 
 _Use_decl_annotations_
-VOID
-McbaUsbRequestsFree(
-    PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
-    MCBA_USB_REQUEST_INDEX_TYPE Count,
-    const MCBA_USB_REQUEST_INDEX_TYPE* Indices
+NTSTATUS
+McbaFileSetCyclicFrame(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    const MCBA_CYCLIC_FRAME* Frame
 )
 {
+    NTSTATUS status = STATUS_SUCCESS;
+    PMCBA_CYCLIC_ENTRY pEntry;
+    LONGLONG now;
     KIRQL irql;
-    LONG available;
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p Count=%u Indices=0x%p\n", UsbRequestData, (unsigned)Count, Indices);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! FileContext=0x%p Index=%u Flags=0x%x PeriodUs=%u PhaseUs=%u Count=%u\n",
+        FileContext, Frame->Index, Frame->Flags, Frame->PeriodUs, Frame->PhaseUs, Frame->Count);
 
-    NT_ASSERT(UsbRequestData);
-    NT_ASSERT(Count);
-    NT_ASSERT(Indices);
+    if (Frame->Msg.Dlc > MCBA_CAN_MAX_DLC ||
+        (Frame->Flags & ~MCBA_CYCLIC_FRAME_FLAG_UPDATE_DATA) ||
+        (!(Frame->Flags & MCBA_CYCLIC_FRAME_FLAG_UPDATE_DATA) &&
+            (Frame->PeriodUs < MCBA_CYCLIC_FRAME_PERIOD_MIN_US || Frame->PeriodUs > MCBA_CYCLIC_FRAME_PERIOD_MAX_US ||
+                Frame->PhaseUs > MCBA_CYCLIC_FRAME_PERIOD_MAX_US))) {
+        return STATUS_INVALID_PARAMETER;
+    }
 
+    KeAcquireSpinLock(&DeviceContext->TxLock, &irql);
 
-    KeAcquireSpinLock(&UsbRequestData->Lock, &irql);
+    pEntry = McbaCyclicFind(DeviceContext, FileContext, Frame->Index);
 
-    NT_ASSERT(McbaCheckUsbRequestIndices(UsbRequestData));
-    NT_ASSERT(UsbRequestData->FreeIndexEnd + Count <= _countof(UsbRequestData->FreeIndices));
+    // the next frame sent carries the new data, nothing else changes
+    if (Frame->Flags & MCBA_CYCLIC_FRAME_FLAG_UPDATE_DATA) {
+        if (pEntry) {
+            pEntry->Msg = Frame->Msg;
+        }
+        else {
+            status = STATUS_NOT_FOUND;
+        }
 
-    RtlCopyMemory(&UsbRequestData->FreeIndices[UsbRequestData->FreeIndexEnd], Indices, sizeof(*Indices) * Count);
-    UsbRequestData->FreeIndexEnd += Count;
-    NT_ASSERT(McbaCheckUsbRequestIndices(UsbRequestData));
-    
-    KeReleaseSpinLock(&UsbRequestData->Lock, irql);
+        goto Exit;
+    }
+
+    if (!pEntry) {
+        pEntry = McbaCyclicFind(DeviceContext, NULL, 0);
+        if (!pEntry) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            goto Exit;
+        }
+    }
 
-    available = KeReleaseSemaphore(&UsbRequestData->Availabe, 0, Count, FALSE);
+    now = McbaQueryMonotonicTime();
+    RtlZeroMemory(pEntry, sizeof(*pEntry));
+    pEntry->FileContext = FileContext;
+    pEntry->Index = Frame->Index;
+    pEntry->Active = TRUE;
+    pEntry->Msg = Frame->Msg;
+    pEntry->Period = Frame->PeriodUs * 10LL;
+    pEntry->Due = now + Frame->PhaseUs * 10LL;
+    pEntry->Stats.Remaining = Frame->Count;
+    McbaCyclicArm(DeviceContext, now);
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! available %ld\n", available + Count);
-}
+Exit:
+    KeReleaseSpinLock(&DeviceContext->TxLock, irql);
 
+    return status;
+}
 
 _Use_decl_annotations_
-VOID
-McbaUsbRequestsReuse(
-    PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
-    MCBA_USB_REQUEST_INDEX_TYPE Count,
-    const MCBA_USB_REQUEST_INDEX_TYPE* Indices
+NTSTATUS
+McbaFileRemoveCyclicFrame(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    PMCBA_FILE_CONTEXT FileContext,
+    ULONG Index
 )
 {
-    WDF_REQUEST_REUSE_PARAMS reuseParams;
+    NTSTATUS status = STATUS_NOT_FOUND;
+    PMCBA_CYCLIC_ENTRY pEntry;
+    KIRQL irql;
 
-    UNREFERENCED_PARAMETER(Indices);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "%!FUNC! FileContext=0x%p Index=%u\n", FileContext, Index);
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! UsbRequestData=0x%p Count=%u Indices=0x%p\n", UsbRequestData, (unsigned)Count, Indices);
-    
-    NT_ASSERT(UsbRequestData);
-    NT_ASSERT(Count);
-    NT_ASSERT(Indices);
-    NT_ASSERT(Count <= _countof(UsbRequestData->Requests));
+    KeAcquireSpinLock(&DeviceContext->TxLock, &irql);
 
-    WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
-    for (MCBA_USB_REQUEST_INDEX_TYPE i = 0; i < Count; ++i) {
-        MCBA_USB_REQUEST_INDEX_TYPE index = Indices[i];        
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! reuse Request=0x%p index=%u\n", UsbRequestData->Requests[index], index);
-        NTSTATUS status = WdfRequestReuse(UsbRequestData->Requests[index], &reuseParams);
-        NT_ASSERT(NT_SUCCESS(status));
-        (void)status;
+    pEntry = McbaCyclicFind(DeviceContext, FileContext, Index);
+    if (pEntry) {
+        RtlZeroMemory(pEntry, sizeof(*pEntry));
+        McbaCyclicArm(DeviceContext, McbaQueryMonotonicTime());
+        status = STATUS_SUCCESS;
     }
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC!\n");
-}
+    KeReleaseSpinLock(&DeviceContext->TxLock, irql);
 
+    return status;
+}
 
 _Use_decl_annotations_
 NTSTATUS
-McbaUsbBulkWritePipeSend(
+McbaFileGetCyclicFrameStats(
     PMCBA_DEVICE_CONTEXT DeviceContext,
-    MCBA_USB_REQUEST_INDEX_TYPE Index
+    PMCBA_FILE_CONTEXT FileContext,
+    ULONG Index,
+    PMCBA_CYCLIC_FRAME_STATS Stats
 )
 {
-    NTSTATUS status;
-    WDFREQUEST request;
-    WDFMEMORY memory;
-
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! DeviceContext=0x%p Index=%u\n", DeviceContext, (unsigned)Index);
-
-    NT_ASSERT(DeviceContext);
-    NT_ASSERT(DeviceContext->BulkWritePipe);
-    NT_ASSERT(Index < MCBA_MAX_WRITES);
-    NT_ASSERT(Index < DeviceContext->UsbRequests.Count);
+    NTSTATUS status = STATUS_NOT_FOUND;
+    PMCBA_CYCLIC_ENTRY pEntry;
+    KIRQL irql;
 
-    request = DeviceContext->UsbRequests.Requests[Index];
-    memory = DeviceContext->UsbRequests.Memory[Index];
+    KeAcquireSpinLock(&DeviceContext->TxLock, &irql);
 
-    status = WdfUsbTargetPipeFormatRequestForWrite(DeviceContext->BulkWritePipe, request, memory, NULL);
-    if (!NT_SUCCESS(status)) {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfUsbTargetPipeFormatRequestForWrite failed with status=%!STATUS!\n", status);
-        goto Exit;
+    pEntry = McbaCyclicFind(DeviceContext, FileContext, Index);
+    if (pEntry) {
+        *Stats = pEntry->Stats;
+        Stats->Active = pEntry->Active;
+        status = STATUS_SUCCESS;
     }
 
-    if (WdfRequestSend(request, WdfUsbTargetPipeGetIoTarget(DeviceContext->BulkWritePipe), WDF_NO_SEND_OPTIONS) == FALSE) {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_DEVICE, "%!FUNC! WdfRequestSend failed\n");
-        status = WdfRequestGetStatus(request);
-        NT_ASSERT(!NT_SUCCESS(status));
-        goto Exit;
-    }
-Exit:
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
+    KeReleaseSpinLock(&DeviceContext->TxLock, irql);
+
     return status;
 }
 
-
 _Use_decl_annotations_
 VOID
-McbaCancelPendingReadRequest(
+McbaEvtIoCanceledOnPendingReadQueue(
+    WDFQUEUE Queue,
     WDFREQUEST Request
 )
 {
-    KIRQL irql;
     PMCBA_FILE_CONTEXT pFileContext;
+    PMCBA_REQUEST_CONTEXT pReadContext;
+
+    UNREFERENCED_PARAMETER(Queue);
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! Request=%p\n", Request);
 
     pFileContext = McbaFileGetContext(WdfRequestGetFileObject(Request));
+    pReadContext = McbaRequestGetContext(Request);
 
-    KeAcquireSpinLock(&pFileContext->ReadLock, &irql);
+    InterlockedDecrement(&pFileContext->PendingReadCount);
 
-    NT_ASSERT(Request == pFileContext->PendingReadRequest);
+    // frames already moved into the buffer are returned
+    WdfRequestCompleteWithInformation(Request, STATUS_CANCELLED, pReadContext->Offset * McbaRxRecordSize(pReadContext->RecordFormat));
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC!\n");
+}
 
-    McbaClearPendingReadRequest(pFileContext);
+_Use_decl_annotations_
+VOID
+McbaEvtIoCanceledOnReadRingQueue(
+    WDFQUEUE Queue,
+    WDFREQUEST Request
+)
+{
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "--> %!FUNC! Request=%p\n", Request);
 
-    KeReleaseSpinLock(&pFileContext->ReadLock, irql);
+    // the buffer goes back to the caller with the request
+    McbaFileUnmapReadRing(
+        McbaDeviceGetContext(WdfIoQueueGetDevice(Queue)),
+        McbaFileGetContext(WdfRequestGetFileObject(Request)),
+        Request);
 
     WdfRequestComplete(Request, STATUS_CANCELLED);
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_DEVICE, "<-- %!FUNC!\n");
-}
\ No newline at end of file
+}
@@ -28,92 +28,267 @@
 
 #include "McbaDriverInterface.h"
 #include "Mcba.h"
+#include "McbaRing.h"
+#include "McbaClock.h"
+#include "McbaTxScheduler.h"
+#include "McbaHistogram.h"
+#include "McbaSeqLock.h"
+#include "McbaBusLoad.h"
+#include "McbaTxEcho.h"
 
 
 EXTERN_C_START
 
 
-#pragma warning(push)
-#pragma warning(disable: 4214 4201)
-
-typedef struct _MCBA_CAN_MSG_ITEM {
-    union {
-        SLIST_ENTRY MessageBuffersAvailable;
-        struct {
-            LIST_ENTRY ReadBuffers;
-            MCBA_CAN_MSG Msg;
-        };
-    };
-    
-    ULONGLONG Timestamp : sizeof(ULONGLONG) * 8 - 1; // contains system time << 1
-    ULONGLONG MemoryBlockOwner : 1;
-} MCBA_CAN_MSG_ITEM, *PMCBA_CAN_MSG_ITEM;
-
-#pragma warning(pop)
+#define MCBA_RX_RING_CAPACITY MCBA_RX_QUEUE_SHARED_DEPTH // must be a power of 2
+#define MCBA_RX_QUEUE_MEMORY_BUDGET (32 * 1024 * 1024) // private rings and TX result queues of all files
+
+// Continuous reader, overridden by RxPendingReads and RxTransferSize in the device's hardware key.
+#define MCBA_RX_PENDING_READS_DEFAULT 2
+#define MCBA_RX_PENDING_READS_MAX 32
+#define MCBA_RX_TRANSFER_SIZE_MAX 1024 // multiple of MCBA_USB_RX_BUFF_SIZE
+#define MCBA_RX_BATCH_FRAMES 16 // frames the reader hands to the files at a time
+
+#define MCBA_TX_QUEUE_CAPACITY MCBA_TX_SCHEDULER_CAPACITY // frames
+#define MCBA_TX_QUEUE_USB_REQUESTS_MAX (MCBA_BATCH_WRITE_MAX_SIZE / 2) // the rest of the pool serves WriteFile and control requests
+#define MCBA_TX_IDLE_TIMEOUT (5 * 1000 * 1000 * 10) // 100 ns, D0Exit waits this long for the queue's requests
+
+#define McbaRxRecordSize(Format) \
+    (MCBA_RX_RECORD_FORMAT_DATA_EX == (Format) ? sizeof(MCBA_CAN_MSG_DATA_EX) : sizeof(MCBA_CAN_MSG_DATA))
+
+// Statistics of a file kept by one writer at a time, each under a lock it
+// holds anyway, and added up without a lock when queried. The padding
+// keeps counters of different writers off each other's cache line.
+typedef struct _MCBA_FILE_COUNTERS {
+    volatile LONG64 Frames;
+    volatile LONG64 Filtered;
+    volatile LONG64 Lost;
+    volatile LONG64 Errors;
+    volatile LONG64 Reads;
+    volatile LONG64 Bytes;
+    volatile LONG64 PendingReads;
+    volatile LONG64 PendingWait; // 100 ns
+    volatile LONG64 PendingWaitMax; // 100 ns
+    volatile LONG64 QueueHighWater;
+    UINT8 Padding[MCBA_CACHE_LINE_SIZE];
+} MCBA_FILE_COUNTERS, *PMCBA_FILE_COUNTERS;
+
+// Only for the single writer of the counter.
+FORCEINLINE
+VOID
+McbaCounterAdd(
+    _Inout_ volatile LONG64* Counter,
+    _In_ LONG64 Value
+)
+{
+    WriteNoFence64(Counter, ReadNoFence64(Counter) + Value);
+}
 
-#define MCBA_MAX_READ_BUFFERS_QUEUED 128
+FORCEINLINE
+VOID
+McbaCounterMax(
+    _Inout_ volatile LONG64* Counter,
+    _In_ LONG64 Value
+)
+{
+    if (Value > ReadNoFence64(Counter)) {
+        WriteNoFence64(Counter, Value);
+    }
+}
 
 typedef struct _MCBA_FILE_CONTEXT {
-    LIST_ENTRY ReadBuffersList;
+    PMCBA_BROADCAST_RING RxRing; // device wide
+    volatile ULONG ReadCursor; // position in RxRing, under ReadLock
+    PMCBA_FILTER Filter; // NULL accepts all, replaced under FilesLock and ReadLock
+    BOOLEAN RxMatched; // USB reader completion, serialized by FilesLock
+    PMCBA_RING ReadRing; // private ring if configured or mapped, replaced under FilesLock and ReadLock, consumed under ReadLock unless mapped
+    MCBA_RING_PRODUCER ReadRingProducer; // USB reader completion, serialized by FilesLock
+    SIZE_T ReadRingCharge; // bytes charged against MCBA_RX_QUEUE_MEMORY_BUDGET
+    ULONG RxPolicy; // MCBA_RX_QUEUE_POLICY_*
+    LONGLONG RxMaxAge; // 100 ns units, MCBA_RX_QUEUE_POLICY_MAX_AGE only
+    ULONG RxRecordFormat; // MCBA_RX_RECORD_FORMAT_*, under ReadLock
+    ULONG RxTimestampClock; // MCBA_RX_TIMESTAMP_CLOCK_*, frames are queued with the monotonic one
+    ULONG TxPriority; // MCBA_TX_PRIORITY_* of the frames the handle queues, under the device's TxLock
+    ULONG TxEcho; // MCBA_TX_ECHO_*, replaced under FilesLock and ReadLock
+    UINT16 TxEchoTag; // marks the frames the handle sent in the device's TxEcho, their Sender once echoed
+    struct _MCBA_FILE_CONTEXT* TxEchoSenderNext; // same bucket of the device's TxEchoSenders, under FilesLock
+    ULONG TxLatency; // MCBA_TX_LATENCY_FLAG_*, replaced under FilesLock and ReadLock
+    PMCBA_TX_RESULT TxResults; // MCBA_TX_LATENCY_FLAG_RESULTS only, under ReadLock
+    ULONG TxResultsMask; // capacity - 1
+    ULONG TxResultsHead;
+    ULONG TxResultsTail;
+    ULONG TxResultsLost; // since the last result queued
+    PMCBA_LATENCY_HISTOGRAM RxLatency; // MCBA_RX_LATENCY_FLAG_HISTOGRAM only, replaced under ReadLock
+    WDFREQUEST ReadRingRequest; // MCBA_IOCTL_HOST_CAN_FRAME_RING_MAP whose buffer is ReadRing, NULL unless mapped, replaced with ReadRing
     LIST_ENTRY FilesList;
-    LONG ReadBuffersQueued;
-    MCBA_FILE_STATS Stats;
+    MCBA_FILE_COUNTERS RxReaderCounters; // under ReadLock
+    MCBA_FILE_COUNTERS RxProducerCounters; // USB reader completion, under FilesLock
+    MCBA_FILE_COUNTERS TxCounters; // Frames and Errors of the TX queue and WriteFile, under the device's TxLock
     KSPIN_LOCK ReadLock;
-    WDFREQUEST PendingReadRequest;
-    PMCBA_CAN_MSG_DATA PendingReadBuffer;
-    size_t PendingReadCount;
-    size_t PendingReadOffset;
+    WDFQUEUE PendingReads; // manual, the oldest read is filled first
+    WDFQUEUE ReadRingRequests; // manual, holds ReadRingRequest until it is cancelled
+    volatile LONG PendingReadCount; // requests in PendingReads, checked by the producer without lock
+    MCBA_RX_MODERATION RxModeration; // for moderated reads, under ReadLock
+    WDFTIMER RxModerationTimer; // services PendingReads once the oldest read times out
 } MCBA_FILE_CONTEXT, *PMCBA_FILE_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(MCBA_FILE_CONTEXT, McbaFileGetContext)
 
-#define MCBA_MAX_WRITES MCBA_BATCH_WRITE_MAX_SIZE
+typedef struct _MCBA_RX_MODERATION_TIMER_CONTEXT {
+    PMCBA_FILE_CONTEXT FileContext;
+} MCBA_RX_MODERATION_TIMER_CONTEXT, *PMCBA_RX_MODERATION_TIMER_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(MCBA_RX_MODERATION_TIMER_CONTEXT, McbaRxModerationTimerGetContext)
+
+// state of a read while it waits in the file's PendingReads queue, of a
+// write while it waits in the device's PendingWrites queue (Buffer, Count)
+// and of a request parked in ParkedRequests for pool requests (Buffer and
+// Count of a batch write, UsbMsg otherwise)
+typedef struct _MCBA_REQUEST_CONTEXT {
+    PVOID Buffer; // records of RecordFormat
+    ULONG RecordFormat;
+    size_t Count; // frames Buffer holds
+    size_t Threshold; // frames that complete the read
+    size_t Offset; // frames already in Buffer
+    BOOLEAN RingWait; // waits for frames in the mapped ring, Buffer isn't filled
+    ULONGLONG Timeout; // 100 ns after the first frame the read completes regardless, 0 for none
+    ULONGLONG FirstFrameTime; // interrupt time, 0 until the first frame arrived
+    ULONGLONG QueuedTime; // interrupt time the read started to wait
+    LONGLONG Submitted; // monotonic time a write reached the driver
+    struct mcba_usb_msg UsbMsg; // control request or single frame write
+    UINT8 UsbRequestCount; // pool requests the parked request waits for
+} MCBA_REQUEST_CONTEXT, *PMCBA_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(MCBA_REQUEST_CONTEXT, McbaRequestGetContext)
+
+#define MCBA_MAX_WRITES MCBA_BATCH_WRITE_MAX_SIZE // pool requests created up front
+#define MCBA_USB_REQUESTS_LIMIT 128 // the pool grows on demand up to UsbRequestsMax, at most this
+#define MCBA_USB_REQUESTS_MAX_DEFAULT 64
+#define MCBA_USB_TX_RECORDS_MAX (MCBA_USB_RX_BUFF_SIZE / sizeof(struct mcba_usb_msg)) // records in one bulk-OUT packet
 typedef UINT8 MCBA_USB_REQUEST_INDEX_TYPE, * PMCBA_USB_REQUEST_INDEX_TYPE;
 
 typedef struct _MCBA_DEVICE_CONTEXT MCBA_DEVICE_CONTEXT, *PMCBA_DEVICE_CONTEXT;
+#define MCBA_BATCH_WRITE_USB_REQUESTS_MAX (MCBA_MAX_WRITES / 2) // transfers a write keeps in flight
 typedef struct _MCBA_DEVICE_BATCH_REQUEST_DATA {
     SLIST_ENTRY Next;
     WDFREQUEST Request;
-    volatile LONG Pending;
-    LONG Count;
-    NTSTATUS UsbRequestStatuses[MCBA_MAX_WRITES];
-    MCBA_USB_REQUEST_INDEX_TYPE UsbRequestIndices[MCBA_MAX_WRITES];
-    MCBA_USB_REQUEST_INDEX_TYPE BatchIndices[MCBA_MAX_WRITES];
+    PMCBA_DEVICE_CONTEXT DeviceContext;
+    const MCBA_CAN_MSG* Msg; // input buffer of Request
+    size_t Count; // frames
+    size_t Queued; // frames handed to transfers
+    size_t Failed; // first frame that didn't go out, Count if all did
+    NTSTATUS Status; // of the transfer that carried frame Failed
+    KSPIN_LOCK Lock; // guards Failed, Status and the idle transfers
+    volatile LONG References; // transfers in flight plus whoever is filling them
+    volatile LONG FillRequests;
+    LONG FramesPerUsbRequest; // 1 or MCBA_USB_TX_RECORDS_MAX if packed
+    MCBA_USB_REQUEST_INDEX_TYPE UsbRequestCount; // pool requests the write owns
+    MCBA_USB_REQUEST_INDEX_TYPE IdleCount;
+    MCBA_USB_REQUEST_INDEX_TYPE Idle[MCBA_BATCH_WRITE_USB_REQUESTS_MAX]; // slots not in flight
+    size_t FirstFrames[MCBA_BATCH_WRITE_USB_REQUESTS_MAX]; // by slot, frame the transfer started with
+    MCBA_USB_REQUEST_INDEX_TYPE UsbRequestIndices[MCBA_BATCH_WRITE_USB_REQUESTS_MAX]; // by slot
+    MCBA_USB_REQUEST_INDEX_TYPE BatchIndices[MCBA_BATCH_WRITE_USB_REQUESTS_MAX]; // slot of each completion context
 } MCBA_DEVICE_BATCH_REQUEST_DATA, * PMCBA_DEVICE_BATCH_REQUEST_DATA;
 
 typedef struct _MCBA_ALIGNED_USB_MESSAGE {
-    struct mcba_usb_msg Msg;
+    struct mcba_usb_msg Msg[MCBA_USB_TX_RECORDS_MAX]; // a single record unless the write is packed
 } MCBA_ALIGNED_USB_MESSAGE, * PMCBA_ALIGNED_USB_MESSAGE;
 
 typedef struct _MCBA_DEVICE_USB_REQUEST_DATA {
-    WDFCONTEXT Contexts[MCBA_MAX_WRITES];
-    WDFREQUEST Requests[MCBA_MAX_WRITES];
-    WDFMEMORY Memory[MCBA_MAX_WRITES];    
-    MCBA_ALIGNED_USB_MESSAGE Messages[MCBA_MAX_WRITES];
-    MCBA_USB_REQUEST_INDEX_TYPE FreeIndices[MCBA_MAX_WRITES];
-    KSEMAPHORE Availabe;
-    KSPIN_LOCK Lock;
-    MCBA_USB_REQUEST_INDEX_TYPE FreeIndexEnd;
-    MCBA_USB_REQUEST_INDEX_TYPE Count;
+    WDFCONTEXT Contexts[MCBA_USB_REQUESTS_LIMIT];
+    WDFREQUEST Requests[MCBA_USB_REQUESTS_LIMIT];
+    WDFMEMORY Memory[MCBA_USB_REQUESTS_LIMIT];    
+    MCBA_ALIGNED_USB_MESSAGE Messages[MCBA_USB_REQUESTS_LIMIT];
+    KSPIN_LOCK Lock; // the free indices, creating requests past Count and the stats below
+    MCBA_USB_REQUEST_INDEX_TYPE FreeIndices[MCBA_USB_REQUESTS_LIMIT];
+    ULONG FreeIndexEnd;
+    WDFDEVICE Device; // parent of the requests
+    WDFIOTARGET IoTarget; // bulk-OUT pipe
+    volatile LONG Count; // requests created, only grows while started
+    LONG Max; // Count grows on demand up to this
+    LONG InUse;
+    LONG HighWater; // InUse at most
+    LONG64 Allocations;
+    LONG64 Exhausted; // allocations that found no free request
 } MCBA_DEVICE_USB_REQUEST_DATA, * PMCBA_DEVICE_USB_REQUEST_DATA;
 
+#define MCBA_TX_ECHO_SENDERS 64 // buckets of the files by TxEchoTag, must be a power of 2
+
+// Frames are recorded while a file reads echoes or tracks latencies.
+#define McbaTxEchoTracked(DeviceContext) ((DeviceContext)->TxEchoFiles || (DeviceContext)->TxLatencyFiles)
+
+#define MCBA_CYCLIC_BATCH_WINDOW (500 * 10) // 100 ns, frames due this soon go out with those due now
+
+// MCBA_IOCTL_HOST_CYCLIC_FRAME_SET, under TxLock
+typedef struct _MCBA_CYCLIC_ENTRY {
+    PMCBA_FILE_CONTEXT FileContext; // owner, NULL if the entry is free
+    ULONG Index;
+    BOOLEAN Active; // until Count frames were sent
+    MCBA_CAN_MSG Msg;
+    LONGLONG Period; // 100 ns
+    LONGLONG Due; // monotonic time of the next frame
+    LONGLONG Last; // monotonic time of the last frame, 0 before the first
+    MCBA_CYCLIC_FRAME_STATS Stats;
+} MCBA_CYCLIC_ENTRY, *PMCBA_CYCLIC_ENTRY;
+
+// frames of the TX queue in flight on a pool request
+typedef struct _MCBA_TX_USB_REQUEST {
+    ULONG Count;
+    PMCBA_FILE_CONTEXT FileContexts[MCBA_USB_TX_RECORDS_MAX];
+} MCBA_TX_USB_REQUEST, *PMCBA_TX_USB_REQUEST;
+
 typedef struct _MCBA_DEVICE_CONTEXT {
     WDFUSBDEVICE UsbDevice;
 	WDFUSBINTERFACE UsbInterface;
 	WDFUSBPIPE BulkReadPipe;
 	WDFUSBPIPE BulkWritePipe;
-    SLIST_HEADER MessageBuffersAvailable;
-    KSPIN_LOCK MessageBuffersLock;
     SLIST_HEADER BatchRequestDataListHeader;
     KSPIN_LOCK BatchRequestDataLock;
     LIST_ENTRY FilesList;
-    KSPIN_LOCK FilesLock;
+    KSPIN_LOCK FilesLock; // also serializes writes to RxRing and RxClock
+    PMCBA_BROADCAST_RING RxRing;
+    MCBA_CLOCK RxClock; // device timestamps of received frames against the monotonic clock
     MCBA_DEVICE_USB_REQUEST_DATA UsbRequests;
     
-    UINT16 (*BigEndianToHost)(UINT16);
-    UINT16 (*LittleEndianToHost)(UINT16);
-    
-    MCBA_DEVICE_STATUS DeviceStatus;
+    KSPIN_LOCK DeviceStatusLock; // serializes the writers of DeviceStatus and DeviceStatsBaseline
+    MCBA_SEQLOCK DeviceStatusSeq; // readers copy DeviceStatus and DeviceStatsBaseline without lock
+    MCBA_DEVICE_STATUS DeviceStatus; // Stats since the device started
+    MCBA_DEVICE_STATS DeviceStatsBaseline; // Stats at the last clear
+
+    KSPIN_LOCK BusLoadLock; // BusLoad, taken under FilesLock
+    MCBA_BUS_LOAD_METER BusLoad; // frames received and written and the device's error counts
+
+    // continuous reader of the current start, see McbaReadParameters
+    ULONG RxPendingReads;
+    ULONG RxTransferSize;
+    BOOLEAN TxPackFrames; // batch writes stack up to MCBA_USB_TX_RECORDS_MAX frames per transfer
+    ULONG UsbRequestsMax; // pool requests of the next start, UsbRequestsMax in the hardware key
+
+    KSPIN_LOCK TxLock; // TxQueue, TxUsbRequests, PendingWrites and the TX stats of the files
+    volatile LONG TxUsbRequestCount; // pool requests in flight for the queue
+    KEVENT TxIdle; // notification, signaled while TxUsbRequestCount is 0
+    BOOLEAN TxStarted; // the write pipe and the pool are up
+    volatile LONG TxDrainRequests; // McbaTxQueueDrain runs on one CPU at a time, in order
+    WDFQUEUE PendingWrites; // manual, MCBA_IOCTL_HOST_CAN_FRAME_WRITE_AT_LEAST_ONE waiting for space
+    MCBA_TX_USB_REQUEST TxUsbRequests[MCBA_USB_REQUESTS_LIMIT]; // by pool index
+    MCBA_TX_SCHEDULER TxQueue; // frames of MCBA_IOCTL_HOST_CAN_FRAME_WRITE_*, Context is the file
+    WDFTIMER CyclicTimer; // due with the next cyclic frame while the device runs
+    MCBA_CYCLIC_ENTRY Cyclic[MCBA_CYCLIC_FRAMES_MAX];
+
+    KSPIN_LOCK TxEchoLock; // TxEcho, TxEchoPositions and TxLatency
+    volatile LONG TxEchoFiles; // files with TxEcho other than MCBA_TX_ECHO_NONE
+    volatile LONG TxLatencyFiles; // files with TxLatency flags
+    volatile LONG TxEchoTags; // last tag handed out
+    PMCBA_FILE_CONTEXT TxEchoSenders[MCBA_TX_ECHO_SENDERS]; // open files by TxEchoTag, under FilesLock
+    MCBA_TX_ECHO TxEcho; // frames sent and not yet confirmed
+    ULONG TxEchoPositions[MCBA_USB_REQUESTS_LIMIT]; // by pool index, TxEcho.Head before the transfer's frames were recorded
+    MCBA_TX_LATENCY TxLatency;
+
+    KSPIN_LOCK RxLatencyLock; // RxLatency and those of the files, taken under their ReadLock
+    MCBA_LATENCY_HISTOGRAM RxLatency; // reads of the files that record theirs
+
+    WDFQUEUE ParkedRequests; // manual, writes and control requests waiting for pool requests, in order
+    volatile LONG ParkedServiceRequests; // McbaServiceParkedRequests runs on one CPU at a time
 
 } MCBA_DEVICE_CONTEXT, *PMCBA_DEVICE_CONTEXT;
 
@@ -131,30 +306,34 @@ McbaCreateDevice(
     _Inout_ PWDFDEVICE_INIT DeviceInit
     );
 
-
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
 NTSTATUS
-McbaMessageBuffersAdd(
-    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext
+McbaUsbRequestsTryAlloc(
+    _Inout_ PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
+    _In_ MCBA_USB_REQUEST_INDEX_TYPE Count,
+    _Out_writes_(Count) MCBA_USB_REQUEST_INDEX_TYPE* Indices
 );
 
-VOID
-McbaFormatCanMessage(
-    _In_ PMCBA_DEVICE_CONTEXT DeviceContext,
-    _In_ const MCBA_CAN_MSG* Input,
-    _Out_ struct mcba_usb_msg_can* Output
+// Allocates the context's UsbRequestCount pool requests for Request or
+// parks it in ParkedRequests until they are returned. On STATUS_PENDING
+// McbaResumeParkedRequest owns Request.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaUsbRequestsAllocOrPark(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _Out_writes_(MCBA_BATCH_WRITE_USB_REQUESTS_MAX) MCBA_USB_REQUEST_INDEX_TYPE* Indices
 );
 
-
-
+// Hands returned pool requests to parked requests, call after
+// McbaUsbRequestsFree.
 _IRQL_requires_same_
 _IRQL_requires_max_(DISPATCH_LEVEL)
-NTSTATUS
-McbaUsbRequestsAlloc(
-    _Inout_ PMCBA_DEVICE_USB_REQUEST_DATA UsbRequestData,
-    _In_ MCBA_USB_REQUEST_INDEX_TYPE Count,
-    _Out_writes_(Count) MCBA_USB_REQUEST_INDEX_TYPE* Indices
+VOID
+McbaServiceParkedRequests(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext
 );
 
 _IRQL_requires_same_
@@ -182,24 +361,375 @@ McbaUsbBulkWritePipeSend(
     _In_ MCBA_USB_REQUEST_INDEX_TYPE Index
 );
 
-EVT_WDF_REQUEST_CANCEL McbaCancelPendingReadRequest;
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaUsbBulkWritePipeSendRecords(
+    _In_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ MCBA_USB_REQUEST_INDEX_TYPE Index,
+    _In_ ULONG Records
+);
 
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE McbaEvtIoCanceledOnPendingReadQueue;
+EVT_WDF_IO_QUEUE_IO_CANCELED_ON_QUEUE McbaEvtIoCanceledOnReadRingQueue;
+EVT_WDF_TIMER McbaEvtRxModerationTimer;
+EVT_WDF_TIMER McbaEvtCyclicTimer;
 
-_Requires_lock_held_(FileContext->ReadLock)
-static
-inline
+// Queues up to Count frames, returns STATUS_PENDING if Request went to
+// PendingWrites instead and STATUS_INVALID_PARAMETER if a frame has a DLC
+// above MCBA_CAN_MAX_DLC.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileWriteCanMsgs(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ WDFREQUEST Request,
+    _In_reads_(Count) const MCBA_CAN_MSG* Msgs,
+    _In_ ULONG Count,
+    _In_ BOOLEAN NonBlocking,
+    _Out_ PULONG Written
+);
+
+// Remembers who sent the frames of a transfer about to go out and when
+// so their transmit confirmations can be echoed and timed, Tags and
+// Submitted hold one per record.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaTxEchoRecord(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ MCBA_USB_REQUEST_INDEX_TYPE Index,
+    _In_ ULONG Records,
+    _In_reads_(Records) const UINT16* Tags,
+    _In_reads_(Records) const LONGLONG* Submitted
+);
+
+// Stamps the frames McbaTxEchoRecord recorded for the pool request with
+// the completion time of its transfer.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaTxEchoWritten(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ MCBA_USB_REQUEST_INDEX_TYPE Index
+);
+
+// Drops the frames McbaTxEchoRecord recorded for the pool request, its
+// transfer failed.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaTxEchoFailed(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ MCBA_USB_REQUEST_INDEX_TYPE Index
+);
+
+// Adds the frames of a completed transfer to the bus load.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaBusLoadCountWritten(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ MCBA_USB_REQUEST_INDEX_TYPE Index,
+    _In_ ULONG Records
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaGetBusLoad(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Out_ PMCBA_BUS_LOAD Load
+);
+
+// Adds the frames a WriteFile of the file sent and failed to send to its
+// TxCounters.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaFileCountTxFrames(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Frames,
+    _In_ ULONG Errors
+);
+
+// Sends queued frames while pool requests are available, then hands the
+// pool requests left to parked requests.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaTxQueueDrain(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext
+);
+
+// Makes Ring, the output buffer of Request, the receive ring of the file.
+// Returns STATUS_PENDING if Request went to the file's ReadRingRequests,
+// cancelling it unmaps the ring.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileMapReadRing(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ WDFREQUEST Request,
+    _Out_writes_bytes_(McbaRingSize(Capacity)) PMCBA_RING Ring,
+    _In_ ULONG Capacity
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileConfigureRxQueue(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ const MCBA_RX_QUEUE_CONFIG* Config
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileSetFilter(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_reads_(Count) const MCBA_CAN_FILTER* Filters,
+    _In_ ULONG Count
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileSetRxModeration(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ const MCBA_RX_MODERATION* Moderation
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileSetRxRecordFormat(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Format
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileSetRxTimestampClock(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Clock
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileSetTxPriority(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Priority
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileSetTxEcho(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Echo
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileSetTxLatency(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ const MCBA_TX_LATENCY_CONFIG* Config
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileReadTxResults(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _Out_writes_to_(Count, *Read) PMCBA_TX_RESULT Results,
+    _In_ ULONG Count,
+    _Out_ PULONG Read
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaGetTxLatency(
+    _In_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Out_ PMCBA_TX_LATENCY Latency
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
 VOID
-McbaClearPendingReadRequest(
+McbaClearTxLatency(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileSetCyclicFrame(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ const MCBA_CYCLIC_FRAME* Frame
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileRemoveCyclicFrame(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Index
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileGetCyclicFrameStats(
+    _In_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Index,
+    _Out_ PMCBA_CYCLIC_FRAME_STATS Stats
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaFileGetStats(
+    _In_ PMCBA_FILE_CONTEXT FileContext,
+    _Out_ PMCBA_FILE_STATS Stats
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaFileGetStatsEx(
+    _In_ PMCBA_FILE_CONTEXT FileContext,
+    _Out_ PMCBA_FILE_STATS_EX Stats
+);
+
+// Takes the locks of all writers, the counters start over.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaFileClearStats(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
     _Inout_ PMCBA_FILE_CONTEXT FileContext
-)
-{
-    NT_ASSERT(FileContext);
+);
 
-    FileContext->PendingReadRequest = NULL;
-    FileContext->PendingReadBuffer = NULL;
-    FileContext->PendingReadOffset = 0;
-    FileContext->PendingReadCount = 0;
-}
+// Accounts for a read completing under the file's read lock, Records are
+// the Frames it returns in Format.
+_Requires_lock_held_(FileContext->ReadLock)
+_IRQL_requires_(DISPATCH_LEVEL)
+VOID
+McbaFileCountRead(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Format,
+    _In_reads_bytes_opt_(Frames * McbaRxRecordSize(Format)) const VOID* Records,
+    _In_ ULONG_PTR Frames
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileSetRxLatency(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Flags
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileGetRxLatency(
+    _In_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ const MCBA_RX_LATENCY_QUERY* Query,
+    _Out_ PMCBA_RX_LATENCY Latency
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+NTSTATUS
+McbaFileClearRxLatency(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Scope
+);
+
+// Consistent copy of the device status, Stats count from the last clear.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaGetDeviceStatus(
+    _In_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _Out_ PMCBA_DEVICE_STATUS Status
+);
+
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaClearDeviceStats(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext
+);
+
+// Performance counter in 100 ns units.
+_IRQL_requires_max_(HIGH_LEVEL)
+LONGLONG
+McbaQueryMonotonicTime(
+    VOID
+);
+
+// Copies frames from the file's private ring or past its cursor in the
+// shared ring that pass filter and age limit, accounts for the others.
+_Requires_lock_held_(FileContext->ReadLock)
+_IRQL_requires_(DISPATCH_LEVEL)
+ULONG
+McbaFileReadCanMsgs(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _Out_writes_to_(Count, return) PMCBA_CAN_MSG_DATA_EX Msgs,
+    _In_ ULONG Count
+);
+
+// McbaFileReadCanMsgs for a buffer of records in Format.
+_Requires_lock_held_(FileContext->ReadLock)
+_IRQL_requires_(DISPATCH_LEVEL)
+ULONG
+McbaFileReadCanRecords(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _In_ ULONG Format,
+    _Out_writes_bytes_(Count * McbaRxRecordSize(Format)) PVOID Records,
+    _In_ ULONG Count
+);
+
+// Moves frames from the read ring into the oldest pending read request.
+// Returns the request if it is now complete and must be completed by the
+// caller once the read lock has been released. Arms the moderation timer
+// if the request waits for its timeout.
+_Requires_lock_held_(FileContext->ReadLock)
+_IRQL_requires_(DISPATCH_LEVEL)
+WDFREQUEST
+McbaServicePendingReadRequest(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext,
+    _Out_ NTSTATUS* Status,
+    _Out_ ULONG_PTR* Information
+);
+
+// Completes pending reads the queued frames satisfy, oldest first.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaFileCompletePendingReadRequests(
+    _Inout_ PMCBA_FILE_CONTEXT FileContext
+);
 
 
 EXTERN_C_END
@@ -1,6 +1,6 @@
 #pragma once
 
-#include <ntdef.h>
+#include "McbaPortable.h"
 
 EXTERN_C_START
 
@@ -42,7 +42,7 @@ EXTERN_C_START
 
 
 
-#include <pshpack1.h>
+#pragma pack(push, 1)
 /* CAN frame */
 struct mcba_usb_msg_can {
 	UINT8 cmd_id;
@@ -103,6 +103,6 @@ struct  mcba_usb_msg_fw_ver {
 	UINT8 unused[17];
 };
 
-#include <poppack.h>
+#pragma pack(pop)
 
 EXTERN_C_END
@@ -0,0 +1,278 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Bus load and error rate meter (MCBA_BUS_LOAD).
+ *
+ * Frames add their bits to the current of MCBA_BUS_LOAD_SLOTS slots of
+ * 100 ms, the windows sum the slots completed before it. Counting a frame
+ * is a handful of adds, queries walk at most 100 slots. Error counts of the
+ * device's keep-alive messages go into one exponentially weighted average
+ * per window. Not thread safe, the caller serializes all calls.
+ *
+ * Header only and WDK independent so that perf/ can exercise the exact
+ * code the driver runs.
+ */
+
+#include <string.h>
+
+#include "McbaPortable.h"
+#include "McbaDriverInterface.h"
+
+EXTERN_C_START
+
+#define MCBA_BUS_LOAD_SLOT_TIME 1000000 /* 100 ns units */
+#define MCBA_BUS_LOAD_SLOTS 128 /* power of 2, the longest window plus the current slot */
+
+typedef struct _MCBA_BUS_LOAD_SLOT {
+    UINT32 RxFrames;
+    UINT32 TxFrames;
+    UINT32 Bits;
+    UINT32 WorstBits;
+} MCBA_BUS_LOAD_SLOT, *PMCBA_BUS_LOAD_SLOT;
+
+typedef struct _MCBA_BUS_LOAD_METER {
+    LONGLONG SlotStart; /* 0 until the first call */
+    ULONG Slot; /* free running */
+    MCBA_BUS_LOAD_SLOT Slots[MCBA_BUS_LOAD_SLOTS];
+    LONGLONG ErrorTime; /* of the last error counts, 0 before */
+    UINT64 TxErrorRate[MCBA_BUS_LOAD_WINDOWS];
+    UINT64 RxErrorRate[MCBA_BUS_LOAD_WINDOWS];
+    UINT64 RxOverflowRate[MCBA_BUS_LOAD_WINDOWS];
+} MCBA_BUS_LOAD_METER, *PMCBA_BUS_LOAD_METER;
+
+/* Bits a frame takes on the bus from start of frame through interframe
+ * space. Stuff bits can only occur from start of frame through the CRC, at
+ * most one per 4 bits after the first. Random payloads get about one per
+ * 26 bits, payloads of zeros one per 9, the expected count assumes one per
+ * 16 for payloads in between like counters and small values. The expected
+ * count is returned, the worst case stored in WorstBits.
+ */
+static
+inline
+ULONG
+McbaCanFrameBits(
+    _In_ MCBA_CAN_ID Id,
+    _In_ UINT8 Dlc,
+    _Out_ PULONG WorstBits
+)
+{
+    // SOF, identifier, RTR, IDE, r0, DLC and CRC, extended frames add SRR,
+    // 18 identifier bits and r1
+    ULONG stuffed = (Id & MCBA_CAN_EFF_FLAG) ? 54 : 34;
+    // CRC delimiter, ACK slot and delimiter, EOF and interframe space
+    const ULONG fixed = 13;
+
+    if (!(Id & MCBA_CAN_RTR_FLAG)) {
+        stuffed += 8 * (ULONG)(Dlc > MCBA_CAN_MAX_DLC ? MCBA_CAN_MAX_DLC : Dlc);
+    }
+
+    *WorstBits = stuffed + (stuffed - 1) / 4 + fixed;
+
+    return stuffed + (stuffed + 8) / 16 + fixed;
+}
+
+static
+inline
+VOID
+McbaBusLoadMeterInit(
+    _Out_ PMCBA_BUS_LOAD_METER Meter
+)
+{
+    memset(Meter, 0, sizeof(*Meter));
+}
+
+/* Moves the current slot up to Now, clearing the slots it passes. */
+static
+inline
+VOID
+McbaBusLoadMeterAdvance(
+    _Inout_ PMCBA_BUS_LOAD_METER Meter,
+    _In_ LONGLONG Now
+)
+{
+    LONGLONG steps;
+
+    if (!Meter->SlotStart) {
+        Meter->SlotStart = Now;
+        return;
+    }
+
+    // times slightly behind the current slot count for it
+    if (Now - Meter->SlotStart < MCBA_BUS_LOAD_SLOT_TIME) {
+        return;
+    }
+
+    steps = (Now - Meter->SlotStart) / MCBA_BUS_LOAD_SLOT_TIME;
+    Meter->SlotStart += steps * MCBA_BUS_LOAD_SLOT_TIME;
+
+    for (LONGLONG i = 0; i < steps && i < MCBA_BUS_LOAD_SLOTS; ++i) {
+        memset(&Meter->Slots[++Meter->Slot & (MCBA_BUS_LOAD_SLOTS - 1)], 0, sizeof(Meter->Slots[0]));
+    }
+
+    // a long pause cleared all slots, only the position matters
+    if (steps > MCBA_BUS_LOAD_SLOTS) {
+        Meter->Slot += (ULONG)(steps - MCBA_BUS_LOAD_SLOTS);
+    }
+}
+
+/* Adds frames of one direction, Bits and WorstBits from McbaCanFrameBits. */
+static
+inline
+VOID
+McbaBusLoadMeterCount(
+    _Inout_ PMCBA_BUS_LOAD_METER Meter,
+    _In_ LONGLONG Now,
+    _In_ BOOLEAN Tx,
+    _In_ ULONG Frames,
+    _In_ ULONG Bits,
+    _In_ ULONG WorstBits
+)
+{
+    PMCBA_BUS_LOAD_SLOT pSlot;
+
+    McbaBusLoadMeterAdvance(Meter, Now);
+
+    pSlot = &Meter->Slots[Meter->Slot & (MCBA_BUS_LOAD_SLOTS - 1)];
+    if (Tx) {
+        pSlot->TxFrames += Frames;
+    }
+    else {
+        pSlot->RxFrames += Frames;
+    }
+
+    pSlot->Bits += Bits;
+    pSlot->WorstBits += WorstBits;
+}
+
+/* One step of Rate towards Count events over Elapsed, Rate in events per
+ * 1000 seconds. Weight is the share of the step in 1/65536.
+ */
+static
+inline
+VOID
+McbaBusLoadMeterAverage(
+    _Inout_ UINT64* Rate,
+    _In_ ULONG Count,
+    _In_ LONGLONG Elapsed,
+    _In_ LONGLONG Weight
+)
+{
+    const LONGLONG sample = (LONGLONG)Count * 10000000 * 1000 / Elapsed;
+
+    *Rate = (UINT64)((LONGLONG)*Rate + (sample - (LONGLONG)*Rate) * Weight / 65536);
+}
+
+/* Adds the error counts the device reported since its last keep-alive. */
+static
+inline
+VOID
+McbaBusLoadMeterCountErrors(
+    _Inout_ PMCBA_BUS_LOAD_METER Meter,
+    _In_ LONGLONG Now,
+    _In_ ULONG TxErrors,
+    _In_ ULONG RxErrors,
+    _In_ ULONG RxOverflows
+)
+{
+    LONGLONG elapsed = Now - Meter->ErrorTime;
+    LONGLONG window = MCBA_BUS_LOAD_SLOT_TIME;
+
+    // the first counts have no interval to spread over
+    if (!Meter->ErrorTime || elapsed <= 0) {
+        Meter->ErrorTime = Meter->ErrorTime ? Meter->ErrorTime : Now;
+        return;
+    }
+
+    Meter->ErrorTime = Now;
+
+    for (ULONG i = 0; i < MCBA_BUS_LOAD_WINDOWS; ++i, window *= 10) {
+        // 1 - e^(-elapsed / window) for steps short against the window
+        LONGLONG weight = elapsed * 65536 / (window + elapsed);
+
+        McbaBusLoadMeterAverage(&Meter->TxErrorRate[i], TxErrors, elapsed, weight);
+        McbaBusLoadMeterAverage(&Meter->RxErrorRate[i], RxErrors, elapsed, weight);
+        McbaBusLoadMeterAverage(&Meter->RxOverflowRate[i], RxOverflows, elapsed, weight);
+    }
+}
+
+static
+inline
+UINT32
+McbaBusLoadPpm(
+    _In_ UINT64 Bits,
+    _In_ ULONG Bitrate,
+    _In_ ULONG Slots
+)
+{
+    // bits the bus could carry in the window are Bitrate * Slots / 10
+    UINT64 ppm = Bits * 10000000 / ((UINT64)Bitrate * Slots);
+
+    return ppm > 1000000 ? 1000000 : (UINT32)ppm;
+}
+
+static
+inline
+VOID
+McbaBusLoadMeterQuery(
+    _Inout_ PMCBA_BUS_LOAD_METER Meter,
+    _In_ LONGLONG Now,
+    _In_ ULONG Bitrate,
+    _Out_ PMCBA_BUS_LOAD Load
+)
+{
+    UINT64 rxFrames = 0, txFrames = 0, bits = 0, worstBits = 0;
+    ULONG slots = 0;
+
+    McbaBusLoadMeterAdvance(Meter, Now);
+
+    memset(Load, 0, sizeof(*Load));
+    Load->Bitrate = Bitrate;
+
+    // the windows nest, each one continues the sums of the shorter one
+    for (ULONG i = 0; i < MCBA_BUS_LOAD_WINDOWS; ++i) {
+        PMCBA_BUS_LOAD_WINDOW pWindow = &Load->Windows[i];
+        const ULONG windowSlots = MCBA_BUS_LOAD_WINDOW_MS(i) / 100;
+
+        for (; slots < windowSlots; ++slots) {
+            const MCBA_BUS_LOAD_SLOT* pSlot = &Meter->Slots[(Meter->Slot - 1 - slots) & (MCBA_BUS_LOAD_SLOTS - 1)];
+
+            rxFrames += pSlot->RxFrames;
+            txFrames += pSlot->TxFrames;
+            bits += pSlot->Bits;
+            worstBits += pSlot->WorstBits;
+        }
+
+        pWindow->WindowMs = MCBA_BUS_LOAD_WINDOW_MS(i);
+        pWindow->RxFrames = (UINT32)rxFrames;
+        pWindow->TxFrames = (UINT32)txFrames;
+        pWindow->LoadPpm = Bitrate ? McbaBusLoadPpm(bits, Bitrate, windowSlots) : 0;
+        pWindow->LoadWorstPpm = Bitrate ? McbaBusLoadPpm(worstBits, Bitrate, windowSlots) : 0;
+        pWindow->TxErrorRate = Meter->TxErrorRate[i];
+        pWindow->RxErrorRate = Meter->RxErrorRate[i];
+        pWindow->RxOverflowRate = Meter->RxOverflowRate[i];
+    }
+}
+
+EXTERN_C_END
@@ -0,0 +1,297 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Linear model of the device clock against the host clock.
+ *
+ * Received frames carry a 32 bit timestamp of the device's free running
+ * microsecond counter. McbaClockExtend turns it into a 64 bit device time.
+ * At most once per MCBA_CLOCK_SAMPLE_INTERVAL_US the time of a frame is
+ * paired with the host time of the transfer that delivered it. A least
+ * squares fit over the last MCBA_CLOCK_WINDOW pairs gives the drift of the
+ * device clock. USB polling and DPC latency only ever delay the host time,
+ * so the offset is taken from the sample closest to the fitted line from
+ * below rather than from the mean. The distance between two frames comes
+ * from the device clock alone.
+ *
+ * Integer only so that it runs at DISPATCH_LEVEL without saving the
+ * floating point state. Header only and WDK independent so that perf/ can
+ * simulate it.
+ */
+
+#include <string.h>
+
+#include "McbaPortable.h"
+
+EXTERN_C_START
+
+#define MCBA_CLOCK_WINDOW 128
+#define MCBA_CLOCK_SAMPLE_INTERVAL_US 250000
+/* samples older than this leave the fit, bounds the sums below 2^63 */
+#define MCBA_CLOCK_MAX_SPAN_US ((MCBA_CLOCK_WINDOW + 1) * MCBA_CLOCK_SAMPLE_INTERVAL_US)
+/* shorter spans keep the drift of the previous fit */
+#define MCBA_CLOCK_MIN_FIT_SPAN_US 2000000
+/* host units (100 ns) per device microsecond */
+#define MCBA_CLOCK_NOMINAL_RATE 10
+/* a sample the model misses by more than 100 ms restarts the fit */
+#define MCBA_CLOCK_MAX_ERROR 1000000
+/* older timestamps are taken as transfers completing out of order, not as a device restart */
+#define MCBA_CLOCK_MAX_REORDER_US 1000000
+/* about 1500 ppm in units of 2^-32 host units per microsecond */
+#define MCBA_CLOCK_MAX_DRIFT ((LONGLONG)1 << 26)
+
+typedef struct _MCBA_CLOCK_SAMPLE {
+    ULONGLONG Device; // microseconds
+    LONGLONG Host; // 100 ns
+} MCBA_CLOCK_SAMPLE, *PMCBA_CLOCK_SAMPLE;
+
+/* host = Base.Host + Offset + dx * MCBA_CLOCK_NOMINAL_RATE + dx * Drift / 2^32
+ * with dx = device - Base.Device
+ */
+typedef struct _MCBA_CLOCK {
+    ULONGLONG Device; // newest extended timestamp
+    ULONG Raw; // newest timestamp as sent by the device
+    BOOLEAN Started;
+    ULONG First; // oldest sample
+    ULONG Count;
+    MCBA_CLOCK_SAMPLE Base;
+    LONGLONG Offset;
+    LONGLONG Drift;
+    MCBA_CLOCK_SAMPLE Samples[MCBA_CLOCK_WINDOW];
+} MCBA_CLOCK, *PMCBA_CLOCK;
+
+static
+inline
+VOID
+McbaClockInit(
+    _Out_ PMCBA_CLOCK Clock
+)
+{
+    memset(Clock, 0, sizeof(*Clock));
+}
+
+/* Value * Q / 2^32, Q in 32 bit fixed point. */
+static
+inline
+LONGLONG
+McbaClockMulQ32(
+    _In_ LONGLONG Value,
+    _In_ LONGLONG Q
+)
+{
+    return (Value * Q) / ((LONGLONG)1 << 32);
+}
+
+/* Numerator * 2^32 / Denominator clamped to MCBA_CLOCK_MAX_DRIFT,
+ * Denominator must be positive and below 2^62.
+ */
+static
+inline
+LONGLONG
+McbaClockDivQ32(
+    _In_ LONGLONG Numerator,
+    _In_ LONGLONG Denominator
+)
+{
+    BOOLEAN negative = Numerator < 0;
+    ULONGLONG n = negative ? 0 - (ULONGLONG)Numerator : (ULONGLONG)Numerator;
+    ULONGLONG d = (ULONGLONG)Denominator;
+    ULONGLONG q, r;
+
+    // anything at or above 1 is way past the limit
+    if (n >= d) {
+        return negative ? -MCBA_CLOCK_MAX_DRIFT : MCBA_CLOCK_MAX_DRIFT;
+    }
+
+    // shift and subtract, the remainder stays below the denominator
+    q = 0;
+    r = n;
+    for (ULONG i = 0; i < 32; ++i) {
+        r <<= 1;
+        q <<= 1;
+        if (r >= d) {
+            r -= d;
+            q |= 1;
+        }
+    }
+
+    if (q > (ULONGLONG)MCBA_CLOCK_MAX_DRIFT) {
+        q = (ULONGLONG)MCBA_CLOCK_MAX_DRIFT;
+    }
+
+    return negative ? -(LONGLONG)q : (LONGLONG)q;
+}
+
+/* Extends a 32 bit device timestamp to 64 bit. Timestamps slightly older
+ * than the newest one seen are placed before it. Much older ones mean the
+ * device restarted its counter, time then continues from there.
+ */
+static
+inline
+ULONGLONG
+McbaClockExtend(
+    _Inout_ PMCBA_CLOCK Clock,
+    _In_ ULONG Raw
+)
+{
+    LONG delta;
+    ULONGLONG device;
+
+    if (!Clock->Started) {
+        Clock->Started = TRUE;
+        Clock->Raw = Raw;
+        Clock->Device = Raw;
+        return Raw;
+    }
+
+    delta = (LONG)(Raw - Clock->Raw);
+    device = Clock->Device + (LONGLONG)delta;
+
+    if (delta > 0 || delta < -MCBA_CLOCK_MAX_REORDER_US) {
+        Clock->Raw = Raw;
+        Clock->Device = device;
+    }
+
+    return device;
+}
+
+/* Host time of an extended device time, 0 without samples. */
+static
+inline
+LONGLONG
+McbaClockMap(
+    _In_ const MCBA_CLOCK* Clock,
+    _In_ ULONGLONG Device
+)
+{
+    LONGLONG dx;
+
+    if (!Clock->Count) {
+        return 0;
+    }
+
+    dx = (LONGLONG)(Device - Clock->Base.Device);
+
+    return Clock->Base.Host + Clock->Offset + dx * MCBA_CLOCK_NOMINAL_RATE + McbaClockMulQ32(dx, Clock->Drift);
+}
+
+#define McbaClockSampleAt(Clock, Index) (&(Clock)->Samples[((Clock)->First + (Index)) % MCBA_CLOCK_WINDOW])
+
+/* Fits the host time residual over the nominal rate. */
+static
+inline
+VOID
+McbaClockFit(
+    _Inout_ PMCBA_CLOCK Clock
+)
+{
+    const MCBA_CLOCK_SAMPLE* pBase = McbaClockSampleAt(Clock, 0);
+    LONGLONG n = Clock->Count;
+    LONGLONG span = (LONGLONG)(McbaClockSampleAt(Clock, Clock->Count - 1)->Device - pBase->Device);
+    LONGLONG sx = 0, sy = 0, sxx = 0, sxy = 0;
+    LONGLONG dx, dy, offset;
+
+    for (ULONG i = 0; i < Clock->Count; ++i) {
+        dx = (LONGLONG)(McbaClockSampleAt(Clock, i)->Device - pBase->Device);
+        dy = McbaClockSampleAt(Clock, i)->Host - pBase->Host - dx * MCBA_CLOCK_NOMINAL_RATE;
+        sx += dx;
+        sy += dy;
+    }
+
+    // slope about the means, keeps the sums small
+    if (span >= MCBA_CLOCK_MIN_FIT_SPAN_US) {
+        for (ULONG i = 0; i < Clock->Count; ++i) {
+            dx = (LONGLONG)(McbaClockSampleAt(Clock, i)->Device - pBase->Device);
+            dy = McbaClockSampleAt(Clock, i)->Host - pBase->Host - dx * MCBA_CLOCK_NOMINAL_RATE;
+            dx -= sx / n;
+            dy -= sy / n;
+            sxx += dx * dx;
+            sxy += dx * dy;
+        }
+
+        if (sxx > 0) {
+            Clock->Drift = McbaClockDivQ32(sxy, sxx);
+        }
+    }
+
+    // the least delayed sample
+    Clock->Offset = MAXLONGLONG;
+    for (ULONG i = 0; i < Clock->Count; ++i) {
+        dx = (LONGLONG)(McbaClockSampleAt(Clock, i)->Device - pBase->Device);
+        dy = McbaClockSampleAt(Clock, i)->Host - pBase->Host - dx * MCBA_CLOCK_NOMINAL_RATE;
+        offset = dy - McbaClockMulQ32(dx, Clock->Drift);
+        if (offset < Clock->Offset) {
+            Clock->Offset = offset;
+        }
+    }
+
+    Clock->Base = *pBase;
+}
+
+/* Pairs the extended device time of a frame with the host time it was
+ * received at. Returns TRUE if the sample was taken and the model refit.
+ */
+static
+inline
+BOOLEAN
+McbaClockUpdate(
+    _Inout_ PMCBA_CLOCK Clock,
+    _In_ ULONGLONG Device,
+    _In_ LONGLONG Host
+)
+{
+    LONGLONG error;
+    LONGLONG dt;
+
+    if (Clock->Count) {
+        dt = (LONGLONG)(Device - McbaClockSampleAt(Clock, Clock->Count - 1)->Device);
+        if (dt > -MCBA_CLOCK_MAX_REORDER_US && dt < MCBA_CLOCK_SAMPLE_INTERVAL_US) {
+            return FALSE;
+        }
+
+        error = Host - McbaClockMap(Clock, Device);
+        if (error > MCBA_CLOCK_MAX_ERROR || error < -MCBA_CLOCK_MAX_ERROR) {
+            Clock->Count = 0;
+        }
+    }
+
+    while (Clock->Count && (Clock->Count == MCBA_CLOCK_WINDOW || Device - McbaClockSampleAt(Clock, 0)->Device > MCBA_CLOCK_MAX_SPAN_US)) {
+        Clock->First = (Clock->First + 1) % MCBA_CLOCK_WINDOW;
+        --Clock->Count;
+    }
+
+    if (!Clock->Count) {
+        Clock->First = 0;
+    }
+
+    McbaClockSampleAt(Clock, Clock->Count)->Device = Device;
+    McbaClockSampleAt(Clock, Clock->Count)->Host = Host;
+    ++Clock->Count;
+
+    McbaClockFit(Clock);
+
+    return TRUE;
+}
+
+EXTERN_C_END
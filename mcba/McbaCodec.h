@@ -0,0 +1,257 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Encoding / decoding of the MCBA USB wire format.
+ *
+ * Everything in here is header only and does not depend on the WDK so that
+ * it can be shared between the driver and the user mode tools in perf/.
+ * Endianness is resolved at compile time (see McbaPortable.h).
+ */
+
+#include <string.h>
+
+#include "McbaPortable.h"
+#include "Mcba.h"
+#include "McbaDriverInterface.h"
+
+#if !defined(_KERNEL_MODE) && defined(_MSC_VER)
+#   include <stdlib.h>
+#endif
+
+EXTERN_C_START
+
+static
+inline
+UINT16
+McbaCodecByteSwap16(UINT16 value)
+{
+#if defined(_KERNEL_MODE)
+    return RtlUshortByteSwap(value);
+#elif defined(_MSC_VER)
+    return _byteswap_ushort(value);
+#else
+    return __builtin_bswap16(value);
+#endif
+}
+
+static
+inline
+UINT16
+McbaCodecBigEndianToHost16(UINT16 value)
+{
+#if MCBA_BIG_ENDIAN
+    return value;
+#else
+    return McbaCodecByteSwap16(value);
+#endif
+}
+
+static
+inline
+UINT16
+McbaCodecLittleEndianToHost16(UINT16 value)
+{
+#if MCBA_BIG_ENDIAN
+    return McbaCodecByteSwap16(value);
+#else
+    return value;
+#endif
+}
+
+static
+inline
+UINT32
+McbaCodecBigEndianToHost32(UINT32 value)
+{
+#if MCBA_BIG_ENDIAN
+    return value;
+#elif defined(_KERNEL_MODE)
+    return RtlUlongByteSwap(value);
+#elif defined(_MSC_VER)
+    return _byteswap_ulong(value);
+#else
+    return __builtin_bswap32(value);
+#endif
+}
+
+#define McbaCodecHostToBigEndian16 McbaCodecBigEndianToHost16
+#define McbaCodecHostToLittleEndian16 McbaCodecLittleEndianToHost16
+
+static
+inline
+UINT16
+McbaCodecReadBigEndian16(_In_ const void* Ptr)
+{
+    UINT16 x;
+    memcpy(&x, Ptr, 2);
+    return McbaCodecBigEndianToHost16(x);
+}
+
+static
+inline
+UINT16
+McbaCodecReadLittleEndian16(_In_ const void* Ptr)
+{
+    UINT16 x;
+    memcpy(&x, Ptr, 2);
+    return McbaCodecLittleEndianToHost16(x);
+}
+
+static
+inline
+UINT32
+McbaCodecReadBigEndian32(_In_ const void* Ptr)
+{
+    UINT32 x;
+    memcpy(&x, Ptr, 4);
+    return McbaCodecBigEndianToHost32(x);
+}
+
+static
+inline
+VOID
+McbaCodecWriteBigEndian16(_Out_ void* Ptr, UINT16 Value)
+{
+    UINT16 x = McbaCodecHostToBigEndian16(Value);
+    memcpy(Ptr, &x, 2);
+}
+
+static
+inline
+MCBA_CAN_ID
+McbaCodecDecodeCanId(_In_ const struct mcba_usb_msg_can* Input)
+{
+    MCBA_CAN_ID id;
+    UINT16 sid = McbaCodecReadBigEndian16(&Input->sid);
+
+    if (sid & MCBA_SIDL_EXID_MASK) {
+        /* SIDH    | SIDL                 | EIDH   | EIDL
+         * 28 - 21 | 20 19 18 x x x 17 16 | 15 - 8 | 7 - 0
+         */
+        id = MCBA_CAN_EFF_FLAG;
+        /* store 28-18 bits */
+        id |= (MCBA_CAN_ID)(sid & 0xffe0) << 13;
+        /* store 17-16 bits */
+        id |= (MCBA_CAN_ID)(sid & 3) << 16;
+        /* store 15-0 bits */
+        id |= McbaCodecReadBigEndian16(&Input->eid);
+    } else {
+        /* SIDH   | SIDL
+         * 10 - 3 | 2 1 0 x x x x x
+         */
+        id = (sid & 0xffe0) >> 5;
+    }
+
+    if (Input->dlc & MCBA_DLC_RTR_MASK) {
+        id |= MCBA_CAN_RTR_FLAG;
+    }
+
+    return id;
+}
+
+static
+inline
+UINT8
+McbaCodecDecodeDlc(_In_ const struct mcba_usb_msg_can* Input)
+{
+    UINT8 dlc = Input->dlc & MCBA_DLC_MASK;
+    return dlc > MCBA_CAN_MAX_DLC ? MCBA_CAN_MAX_DLC : dlc;
+}
+
+/* Device clock in microseconds at the time the frame was received,
+ * wraps after about 71 minutes. Big endian like the identifier fields.
+ */
+static
+inline
+UINT32
+McbaCodecDecodeTimestamp(_In_ const struct mcba_usb_msg_can* Input)
+{
+    return McbaCodecReadBigEndian32(Input->timestamp);
+}
+
+/* Decodes a single MBCA_CMD_RECEIVE_MESSAGE record, or any other with the
+ * same layout such as MBCA_CMD_TRANSMIT_MESSAGE_RSP.
+ */
+static
+inline
+VOID
+McbaCodecDecodeCanMsg(
+    _In_ const struct mcba_usb_msg_can* Input,
+    _Out_ PMCBA_CAN_MSG Output
+)
+{
+    Output->Id = McbaCodecDecodeCanId(Input);
+    Output->Dlc = McbaCodecDecodeDlc(Input);
+    Output->Flags = 0;
+    memset(Output->Padding, 0, sizeof(Output->Padding));
+    memcpy(Output->Data, Input->data, sizeof(Output->Data));
+}
+
+/* Formats a CAN frame as MBCA_CMD_TRANSMIT_MESSAGE_EV record. */
+static
+inline
+VOID
+McbaCodecEncodeCanMsg(
+    _In_ const MCBA_CAN_MSG* Input,
+    _Out_ struct mcba_usb_msg_can* Output
+)
+{
+    Output->cmd_id = MBCA_CMD_TRANSMIT_MESSAGE_EV;
+
+    if (Input->Id & MCBA_CAN_EFF_FLAG) {
+        UINT16 sid;
+        /* SIDH    | SIDL                 | EIDH   | EIDL
+         * 28 - 21 | 20 19 18 x x x 17 16 | 15 - 8 | 7 - 0
+         */
+        sid = MCBA_SIDL_EXID_MASK;
+        /* store 28-18 bits */
+        sid |= (Input->Id & 0x1ffc0000) >> 13;
+        /* store 17-16 bits */
+        sid |= (Input->Id & 0x30000) >> 16;
+        McbaCodecWriteBigEndian16(&Output->sid, sid);
+
+        /* store 15-0 bits */
+        McbaCodecWriteBigEndian16(&Output->eid, (UINT16)(Input->Id & 0xffff));
+    } else {
+        /* SIDH   | SIDL
+         * 10 - 3 | 2 1 0 x x x x x
+         */
+        McbaCodecWriteBigEndian16(&Output->sid, (UINT16)((Input->Id & MCBA_CAN_SFF_MASK) << 5));
+        McbaCodecWriteBigEndian16(&Output->eid, 0);
+    }
+
+    /* stray bits must not turn a data frame into a remote one */
+    Output->dlc = Input->Dlc & MCBA_DLC_MASK;
+
+    if (Input->Id & MCBA_CAN_RTR_FLAG) {
+        Output->dlc |= MCBA_DLC_RTR_MASK;
+    }
+
+    memcpy(Output->data, Input->Data, sizeof(Output->data));
+    memset(Output->timestamp, 0, sizeof(Output->timestamp));
+    Output->checksum = 0;
+}
+
+EXTERN_C_END
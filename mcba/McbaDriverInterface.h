@@ -23,6 +23,9 @@
 
 #pragma once
 
+#include "McbaPortable.h"
+
+#ifdef _WIN32
 #include <initguid.h>
 
 //
@@ -32,6 +35,7 @@
 DEFINE_GUID (GUID_DEVINTERFACE_MCBA,
     0xc07c7033,0x72cd,0x47be,0x96,0x70,0x96,0x14,0x45,0x8d,0x5f,0x6e);
 // {c07c7033-72cd-47be-9670-9614458d5f6e}
+#endif
 
 /* controller area network (CAN) kernel definitions */
 
@@ -59,25 +63,307 @@ typedef UINT32 MCBA_CAN_ID;
 #define MCBA_CAN_EFF_ID_BITS		29
 
 
-/* CAN payload length and DLC definitions according to ISO 11898-1 */
+/* CAN payload length and DLC definitions according to ISO 11898-1, writes
+ * with a larger DLC fail with STATUS_INVALID_PARAMETER
+ */
 #define MCBA_CAN_MAX_DLC 8
 #define MCBA_CAN_MAX_DLEN 8
 
+/* WriteFile takes any number of frames (array of MCBA_CAN_MSG) and
+ * completes once all went out. On failure it completes with the bytes of
+ * the frames that went out before the first one that didn't. This used to
+ * be the most frames a write could take, now it only sizes the driver's
+ * pool of USB requests.
+ */
 #define MCBA_BATCH_WRITE_MAX_SIZE 16
 
 
+/* Flags of read frames, 0 in frames written. */
+#define MCBA_CAN_MSG_FLAG_TX 0x01 /* sent by a handle on this adapter, see MCBA_IOCTL_HOST_TX_ECHO_SET */
+#define MCBA_CAN_MSG_FLAG_SELF 0x02 /* sent by the handle that reads it */
+
 typedef struct _MCBA_CAN_MSG {
     MCBA_CAN_ID Id;
     UINT8 Dlc;
-    UINT8 Padding[3];
+    UINT8 Flags; /* MCBA_CAN_MSG_FLAG_* */
+    UINT8 Padding[2];
     UINT8 Data[MCBA_CAN_MAX_DLEN];
 } MCBA_CAN_MSG, *PMCBA_CAN_MSG;
 
+/* SystemTimeReceived is when the transfer carrying the frame completed, in
+ * the clock the handle selected (MCBA_RX_TIMESTAMP_CLOCK_*).
+ */
 typedef struct _MCBA_CAN_MSG_DATA {
     MCBA_CAN_MSG Msg;
     ULONGLONG SystemTimeReceived;
 } MCBA_CAN_MSG_DATA, *PMCBA_CAN_MSG_DATA;
 
+/* Read record of MCBA_RX_RECORD_FORMAT_DATA_EX, starts like MCBA_CAN_MSG_DATA.
+ *
+ * DeviceTimestamp is the time the device took the frame off the bus in
+ * microseconds of its own clock, extended to 64 bit. SystemTimeOnBus is
+ * the same instant in the handle's clock, mapped through a running fit of
+ * the device clock against the host clock. It is 0 until the first frame
+ * arrived and converges within a few seconds of traffic.
+ *
+ * Sender tells echoes of frames sent by different handles apart (see
+ * MCBA_CAN_MSG_FLAG_TX), all frames of one handle carry the same non-zero
+ * value. It is 0 for frames received from the bus.
+ */
+typedef struct _MCBA_CAN_MSG_DATA_EX {
+    MCBA_CAN_MSG Msg;
+    ULONGLONG SystemTimeReceived;
+    ULONGLONG DeviceTimestamp;
+    ULONGLONG SystemTimeOnBus;
+    UINT16 Sender;
+    UINT8 Reserved[6];
+} MCBA_CAN_MSG_DATA_EX, *PMCBA_CAN_MSG_DATA_EX;
+
+/* Ring of received frames shared between driver and reader, see
+ * MCBA_IOCTL_HOST_CAN_FRAME_RING_MAP and McbaRing.h.
+ *
+ * Head and Tail are free running counters, the slot of a counter is
+ * (counter & Mask). The driver only writes Head, the reader only writes
+ * Tail and both live on their own cache line so the two sides don't bounce
+ * a line between processors on every frame.
+ */
+typedef struct _MCBA_RING {
+    /* producer */
+    volatile ULONG Head;
+    UINT8 HeadPadding[MCBA_CACHE_LINE_SIZE - sizeof(ULONG)];
+    /* consumer */
+    volatile ULONG Tail;
+    UINT8 TailPadding[MCBA_CACHE_LINE_SIZE - sizeof(ULONG)];
+    /* read only after initialization */
+    ULONG Capacity;
+    ULONG Mask;
+    UINT8 Padding[MCBA_CACHE_LINE_SIZE - 2 * sizeof(ULONG)];
+    MCBA_CAN_MSG_DATA_EX Entries[ANYSIZE_ARRAY];
+} MCBA_RING, *PMCBA_RING;
+
+#define MCBA_RING_MAP_DEFAULT_CAPACITY 4096
+#define MCBA_RING_MAP_MAX_CAPACITY 65536
+
+typedef struct _MCBA_RING_MAP_REQUEST {
+    ULONG Capacity; /* power of 2, 0 selects MCBA_RING_MAP_DEFAULT_CAPACITY */
+} MCBA_RING_MAP_REQUEST, *PMCBA_RING_MAP_REQUEST;
+
+/* Acceptance filter, see MCBA_IOCTL_HOST_CAN_FRAME_FILTER_SET.
+ *
+ * Id carries MCBA_CAN_EFF_FLAG for 29 bit identifiers. If Mask has
+ * MCBA_CAN_RTR_FLAG set only frames whose RTR flag equals the one in Id
+ * match, otherwise both data and remote frames do.
+ *
+ * MCBA_CAN_FILTER_TYPE_MASK: matches if (id & Mask) == (Id & Mask) for the
+ * identifier bits.
+ * MCBA_CAN_FILTER_TYPE_RANGE: matches identifiers from Id to Last
+ * inclusive, Last has the same frame format as Id.
+ */
+#define MCBA_CAN_FILTER_TYPE_MASK 0
+#define MCBA_CAN_FILTER_TYPE_RANGE 1
+
+#define MCBA_CAN_FILTER_MAX_COUNT 64
+
+typedef struct _MCBA_CAN_FILTER {
+    UINT32 Type;
+    MCBA_CAN_ID Id;
+    UINT32 Mask;
+    MCBA_CAN_ID Last;
+} MCBA_CAN_FILTER, *PMCBA_CAN_FILTER;
+
+/* Receive queue of a handle, see MCBA_IOCTL_HOST_RX_QUEUE_CONFIG_SET.
+ *
+ * MCBA_RX_QUEUE_POLICY_DROP_OLDEST: a full queue drops its oldest frames.
+ * MCBA_RX_QUEUE_POLICY_DROP_NEWEST: a full queue drops the frames arriving.
+ * MCBA_RX_QUEUE_POLICY_MAX_AGE: like DROP_OLDEST, additionally frames
+ * received more than MaxAgeMs ago are dropped instead of being read.
+ *
+ * Depth 0 selects the queue shared by all handles of the device which
+ * holds the last MCBA_RX_QUEUE_SHARED_DEPTH frames, DROP_NEWEST needs a
+ * queue of its own. Other depths are rounded up to a power of 2.
+ */
+#define MCBA_RX_QUEUE_POLICY_DROP_OLDEST 0
+#define MCBA_RX_QUEUE_POLICY_DROP_NEWEST 1
+#define MCBA_RX_QUEUE_POLICY_MAX_AGE 2
+
+#define MCBA_RX_QUEUE_SHARED_DEPTH 1024
+#define MCBA_RX_QUEUE_MAX_DEPTH 65536
+
+typedef struct _MCBA_RX_QUEUE_CONFIG {
+    ULONG Depth;
+    ULONG Policy;
+    ULONG MaxAgeMs;
+    ULONG Reserved;
+} MCBA_RX_QUEUE_CONFIG, *PMCBA_RX_QUEUE_CONFIG;
+
+/* Completion thresholds of MCBA_IOCTL_HOST_CAN_FRAME_READ_MODERATED, see
+ * MCBA_IOCTL_HOST_RX_MODERATION_SET.
+ *
+ * A moderated read completes once FrameCount frames are in its buffer or
+ * TimeoutUs microseconds after the first frame went in, whichever comes
+ * first. FrameCount 0 or larger than the buffer means a full buffer,
+ * TimeoutUs 0 disables the timeout.
+ */
+#define MCBA_RX_MODERATION_MAX_TIMEOUT_US 10000000
+
+typedef struct _MCBA_RX_MODERATION {
+    ULONG FrameCount;
+    ULONG TimeoutUs;
+} MCBA_RX_MODERATION, *PMCBA_RX_MODERATION;
+
+/* Record returned by the reads of a handle, see
+ * MCBA_IOCTL_HOST_RX_RECORD_FORMAT_SET. Read buffers must be a multiple of
+ * the record size.
+ */
+#define MCBA_RX_RECORD_FORMAT_DATA 0 /* MCBA_CAN_MSG_DATA */
+#define MCBA_RX_RECORD_FORMAT_DATA_EX 1 /* MCBA_CAN_MSG_DATA_EX */
+
+/* Clock of the timestamps read from a handle, see
+ * MCBA_IOCTL_HOST_RX_TIMESTAMP_CLOCK_SET.
+ *
+ * MCBA_RX_TIMESTAMP_CLOCK_SYSTEM: system time (100 ns since 1601 UTC).
+ * MCBA_RX_TIMESTAMP_CLOCK_MONOTONIC: performance counter in 100 ns units,
+ * doesn't follow adjustments of the system time.
+ *
+ * Frames are stamped with the performance counter. System time is derived
+ * when the frame is read (queued for mapped rings) from the distance of
+ * both clocks at that moment.
+ */
+#define MCBA_RX_TIMESTAMP_CLOCK_SYSTEM 0
+#define MCBA_RX_TIMESTAMP_CLOCK_MONOTONIC 1
+
+/* Priority class of the frames a handle queues, see
+ * MCBA_IOCTL_HOST_TX_PRIORITY_SET. Queued frames are sent by class, then
+ * in the order the bus would arbitrate their IDs, frames of the same ID
+ * and class in the order they were queued.
+ */
+#define MCBA_TX_PRIORITY_HIGH 0
+#define MCBA_TX_PRIORITY_NORMAL 1 /* default */
+#define MCBA_TX_PRIORITY_LOW 2
+
+/* Frames sent by the handles of the adapter a handle reads along with the
+ * frames received, see MCBA_IOCTL_HOST_TX_ECHO_SET. They carry
+ * MCBA_CAN_MSG_FLAG_TX and the time they went on the bus from the device's
+ * transmit confirmation, frames that failed are not echoed.
+ */
+#define MCBA_TX_ECHO_NONE 0 /* default */
+#define MCBA_TX_ECHO_OTHERS 1 /* frames of the other handles */
+#define MCBA_TX_ECHO_ALL 2 /* also the handle's own, flagged MCBA_CAN_MSG_FLAG_SELF */
+
+/* Distribution of latencies in microseconds, see McbaHistogram.h. Values
+ * below MCBA_LATENCY_HISTOGRAM_SUB_BUCKETS have a bucket each, above that
+ * every power of 2 is split into MCBA_LATENCY_HISTOGRAM_SUB_BUCKETS
+ * buckets, so a bucket is never wider than 1/16 of the values it counts.
+ */
+#define MCBA_LATENCY_HISTOGRAM_SUB_BUCKET_BITS 4
+#define MCBA_LATENCY_HISTOGRAM_SUB_BUCKETS (1 << MCBA_LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+#define MCBA_LATENCY_HISTOGRAM_BUCKETS ((32 - MCBA_LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) * MCBA_LATENCY_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct _MCBA_LATENCY_HISTOGRAM {
+    UINT64 Count;
+    UINT64 SumUs;
+    UINT32 MinUs; /* 0 while Count is */
+    UINT32 MaxUs;
+    UINT32 Buckets[MCBA_LATENCY_HISTOGRAM_BUCKETS];
+} MCBA_LATENCY_HISTOGRAM, *PMCBA_LATENCY_HISTOGRAM;
+
+/* Where the time of a transmitted frame goes, see
+ * MCBA_IOCTL_HOST_TX_LATENCY_SET. A frame is submitted when its write
+ * reached the driver, written when the USB transfer that carried it
+ * completed and on the bus when the device's transmit confirmation says it
+ * won arbitration. The time on the bus is mapped to the host clock like
+ * SystemTimeOnBus of received frames, until that converges frames only
+ * have the first two.
+ */
+#define MCBA_TX_LATENCY_FLAG_HISTOGRAM 0x1 /* keep the histograms of MCBA_TX_LATENCY running */
+#define MCBA_TX_LATENCY_FLAG_RESULTS 0x2 /* queue an MCBA_TX_RESULT for each confirmed frame of the handle */
+#define MCBA_TX_RESULTS_CAPACITY_DEFAULT 256
+#define MCBA_TX_RESULTS_CAPACITY_MAX 4096
+
+typedef struct _MCBA_TX_LATENCY_CONFIG {
+    UINT32 Flags; /* MCBA_TX_LATENCY_FLAG_*, 0 turns it off */
+    UINT32 ResultsCapacity; /* rounded up to a power of 2, 0 selects MCBA_TX_RESULTS_CAPACITY_DEFAULT */
+} MCBA_TX_LATENCY_CONFIG, *PMCBA_TX_LATENCY_CONFIG;
+
+/* Times are in the clock the handle selected (MCBA_RX_TIMESTAMP_CLOCK_*). */
+typedef struct _MCBA_TX_RESULT {
+    MCBA_CAN_MSG Msg;
+    UINT32 Lost; /* results dropped right before this one, the queue was full */
+    UINT32 Reserved;
+    ULONGLONG SystemTimeSubmitted;
+    ULONGLONG SystemTimeWritten; /* 0 if the confirmation overtook the completion of the transfer */
+    ULONGLONG SystemTimeOnBus; /* 0 until the device clock is fitted */
+} MCBA_TX_RESULT, *PMCBA_TX_RESULT;
+
+typedef struct _MCBA_TX_LATENCY {
+    UINT64 Frames; /* handed to the device while latencies were tracked */
+    UINT64 Confirmed;
+    UINT64 Unconfirmed; /* their transfer failed, or no confirmation came within a second or before the driver recorded 256 more */
+    MCBA_LATENCY_HISTOGRAM SubmittedToWritten;
+    MCBA_LATENCY_HISTOGRAM WrittenToOnBus;
+    MCBA_LATENCY_HISTOGRAM SubmittedToOnBus;
+} MCBA_TX_LATENCY, *PMCBA_TX_LATENCY;
+
+/* Time received frames take from the completion of the USB transfer that
+ * carried them to the completion of the read that returns them to the
+ * handle, see MCBA_IOCTL_HOST_RX_LATENCY_SET. Frames of a mapped ring are
+ * consumed in user mode and not measured.
+ */
+#define MCBA_RX_LATENCY_FLAG_HISTOGRAM 0x1 /* record the reads of the handle in its and the device's histogram */
+
+#define MCBA_RX_LATENCY_SCOPE_FILE 0 /* reads of the handle */
+#define MCBA_RX_LATENCY_SCOPE_DEVICE 1 /* reads of all handles that record theirs */
+
+#define MCBA_RX_LATENCY_PERCENTILES_MAX 8
+
+typedef struct _MCBA_RX_LATENCY_QUERY {
+    UINT32 Scope; /* MCBA_RX_LATENCY_SCOPE_* */
+    UINT32 Count; /* of Percentiles */
+    UINT32 Percentiles[MCBA_RX_LATENCY_PERCENTILES_MAX]; /* in parts per million, 990000 is the 99th */
+} MCBA_RX_LATENCY_QUERY, *PMCBA_RX_LATENCY_QUERY;
+
+/* ValuesUs[i] is the value at Percentiles[i] of the query within the
+ * resolution of the histogram, see McbaHistogramPercentile.
+ */
+typedef struct _MCBA_RX_LATENCY {
+    UINT32 ValuesUs[MCBA_RX_LATENCY_PERCENTILES_MAX];
+    MCBA_LATENCY_HISTOGRAM ReceivedToRead;
+} MCBA_RX_LATENCY, *PMCBA_RX_LATENCY;
+
+/* Frame the driver queues for transmission every PeriodUs on behalf of a
+ * handle, see MCBA_IOCTL_HOST_CYCLIC_FRAME_SET. Frames due within the same
+ * timer tick are queued together with the priority of the handle. A period
+ * without room in the TX queue is skipped, not caught up.
+ */
+#define MCBA_CYCLIC_FRAMES_MAX 64 /* of all handles of a device */
+#define MCBA_CYCLIC_FRAME_PERIOD_MIN_US 1000
+#define MCBA_CYCLIC_FRAME_PERIOD_MAX_US 3600000000
+#define MCBA_CYCLIC_FRAME_FLAG_UPDATE_DATA 0x1 /* replace Msg of a registered frame, its schedule and stats stay */
+
+typedef struct _MCBA_CYCLIC_FRAME {
+    UINT32 Index; /* chosen by the handle */
+    UINT32 Flags; /* MCBA_CYCLIC_FRAME_FLAG_* */
+    UINT32 PeriodUs;
+    UINT32 PhaseUs; /* from registration to the first frame */
+    UINT32 Count; /* frames to send, 0 until removed */
+    MCBA_CAN_MSG Msg;
+} MCBA_CYCLIC_FRAME, *PMCBA_CYCLIC_FRAME;
+
+/* Lateness is when the frame was queued minus when it was due, early frames
+ * of a tick count negative. Intervals are between consecutive frames.
+ */
+typedef struct _MCBA_CYCLIC_FRAME_STATS {
+    UINT64 Sent; /* frames queued for transmission */
+    UINT64 Skipped; /* periods without a frame */
+    INT64 LatenessSumUs;
+    INT32 LatenessMinUs;
+    INT32 LatenessMaxUs;
+    UINT32 IntervalMinUs;
+    UINT32 IntervalMaxUs;
+    UINT32 Remaining; /* frames of Count still to send, 0 if unlimited */
+    UINT32 Active; /* 0 once Count frames were sent */
+} MCBA_CYCLIC_FRAME_STATS, *PMCBA_CYCLIC_FRAME_STATS;
+
 typedef enum _MCBA_BITRATE {
     MCBA_BITRATE_UNKOWN = 0,
     MCBA_BITRATE_20000 = 20000,
@@ -106,6 +392,7 @@ typedef struct _MCBA_DEVICE_STATS {
     ULONGLONG RxBufferOverflow;
     ULONGLONG TxBusOff;
     ULONGLONG RxLost;
+    ULONGLONG TxCancelled; /* frames queued by handles that were closed before the frames went out */
 } MCBA_DEVICE_STATS, * PMCBA_DEVICE_STATS;
 
 typedef struct _MCBA_DEVICE_STATUS {
@@ -121,8 +408,73 @@ typedef struct _MCBA_DEVICE_STATUS {
 
 typedef struct _MCBA_FILE_STATS {
     ULONGLONG RxLost;
+    ULONGLONG TxFrames; /* frames the handle wrote or queued that went out to the device */
+    ULONGLONG TxErrors; /* frames the handle wrote or queued whose transfer failed */
 } MCBA_FILE_STATS, * PMCBA_FILE_STATS;
 
+/* A read is a read IOCTL or ReadFile that completed successfully, those
+ * that had to wait for frames also count as pending reads. The wait of a
+ * pending read lasts from the moment it was queued until it completed.
+ */
+typedef struct _MCBA_FILE_STATS_EX {
+    UINT64 RxFrames; /* copied by reads or queued in the mapped ring */
+    UINT64 RxFiltered; /* rejected by the filters or the TX echo setting of the handle */
+    UINT64 RxLost;
+    UINT64 RxReads;
+    UINT64 RxBytes; /* copied by reads */
+    UINT64 RxPendingReads;
+    UINT64 RxPendingWaitSumUs;
+    UINT32 RxPendingWaitMaxUs;
+    UINT32 RxQueueDepth; /* frames waiting for the handle when queried */
+    UINT32 RxQueueHighWater; /* RxQueueDepth at most */
+    UINT32 Reserved;
+    UINT64 TxFrames;
+    UINT64 TxErrors;
+} MCBA_FILE_STATS_EX, *PMCBA_FILE_STATS_EX;
+
+/* USB requests the driver sends frames and commands with. The pool starts
+ * with MCBA_BATCH_WRITE_MAX_SIZE requests and grows while it runs dry up to
+ * Limit, UsbRequestsMax in the device's hardware key.
+ */
+typedef struct _MCBA_USB_REQUEST_POOL_STATS {
+    UINT32 Count; /* requests created */
+    UINT32 Limit;
+    UINT32 InUse;
+    UINT32 HighWater; /* InUse at most since the device started */
+    UINT64 Allocations; /* attempts, including those of writes that had to wait */
+    UINT64 Exhausted; /* attempts that found too few requests */
+} MCBA_USB_REQUEST_POOL_STATS, *PMCBA_USB_REQUEST_POOL_STATS;
+
+/* Bus utilization and error rates, see McbaBusLoad.h. Window i covers the
+ * last MCBA_BUS_LOAD_WINDOW_MS(i) milliseconds of completed 100 ms steps.
+ * Frames are those the device received and those the driver handed it for
+ * transmission. A frame counts with its bits on the bus including
+ * interframe space, LoadPpm with the bit stuffing typical payloads get and
+ * LoadWorstPpm with the most stuff bits the frame could have. Error rates
+ * are exponentially weighted averages of the counts the device reports in
+ * its keep-alive messages, with the window as time constant.
+ */
+#define MCBA_BUS_LOAD_WINDOWS 3
+#define MCBA_BUS_LOAD_WINDOW_MS(i) ((i) == 0 ? 100 : (i) == 1 ? 1000 : 10000)
+
+typedef struct _MCBA_BUS_LOAD_WINDOW {
+    UINT32 WindowMs;
+    UINT32 RxFrames;
+    UINT32 TxFrames;
+    UINT32 LoadPpm; /* of the bitrate, 1000000 at most */
+    UINT32 LoadWorstPpm;
+    UINT32 Reserved;
+    UINT64 TxErrorRate; /* per 1000 seconds */
+    UINT64 RxErrorRate;
+    UINT64 RxOverflowRate; /* receive buffer overflows */
+} MCBA_BUS_LOAD_WINDOW, *PMCBA_BUS_LOAD_WINDOW;
+
+typedef struct _MCBA_BUS_LOAD {
+    UINT32 Bitrate; /* the loads refer to, 0 until the device reported it */
+    UINT32 Reserved;
+    MCBA_BUS_LOAD_WINDOW Windows[MCBA_BUS_LOAD_WINDOWS];
+} MCBA_BUS_LOAD, *PMCBA_BUS_LOAD;
+
 /* IOCTLs */
 #define MCBA_FILE_DEVICE 0x8112 
 #define MCBA_IOCTL_OFFSET 0x800
@@ -135,12 +487,122 @@ typedef struct _MCBA_FILE_STATS {
 #define MCBA_IOCTL_DEVICE_TERMINATION_DISABLE CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+5, METHOD_NEITHER, FILE_WRITE_DATA)
 #define MCBA_IOCTL_DEVICE_TERMINATION_ENABLE CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+6, METHOD_NEITHER, FILE_WRITE_DATA)
 #define MCBA_IOCTL_DEVICE_STATUS_GET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+7, METHOD_OUT_DIRECT, FILE_READ_DATA)
+/* Output MCBA_USB_REQUEST_POOL_STATS. */
+#define MCBA_IOCTL_DEVICE_USB_REQUEST_POOL_GET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+8, METHOD_OUT_DIRECT, FILE_READ_DATA)
+/* Output MCBA_BUS_LOAD. */
+#define MCBA_IOCTL_DEVICE_BUS_LOAD_GET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+9, METHOD_OUT_DIRECT, FILE_READ_DATA)
 #define MCBA_IOCTL_HOST_CAN_FRAME_READ_AT_LEAST_ONE CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+101, METHOD_OUT_DIRECT, FILE_READ_DATA)
 #define MCBA_IOCTL_HOST_CAN_FRAME_READ_NON_BLOCKING CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+102, METHOD_OUT_DIRECT, FILE_READ_DATA)
+/* Queue frames (input array of MCBA_CAN_MSG) for transmission and complete
+ * with the bytes of the frames queued. NON_BLOCKING queues as many as fit,
+ * possibly none, AT_LEAST_ONE waits until at least one fits. Writes that
+ * wait get the space first. Frames leave by priority, see
+ * MCBA_TX_PRIORITY_*. Whether the device accepted the frames is counted in
+ * the handle's MCBA_FILE_STATS. WriteFile still completes once the device
+ * received the frames and isn't reordered.
+ */
 #define MCBA_IOCTL_HOST_CAN_FRAME_WRITE_AT_LEAST_ONE CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+103, METHOD_IN_DIRECT, FILE_WRITE_DATA)
 #define MCBA_IOCTL_HOST_CAN_FRAME_WRITE_NON_BLOCKING CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+104, METHOD_IN_DIRECT, FILE_WRITE_DATA)
 #define MCBA_IOCTL_HOST_FILE_STATS_CLEAR CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+105, METHOD_NEITHER, FILE_WRITE_DATA)
 #define MCBA_IOCTL_HOST_FILE_STATS_GET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+106, METHOD_OUT_DIRECT, FILE_READ_DATA)
+/* Makes the output buffer the receive ring of the handle (input
+ * MCBA_RING_MAP_REQUEST, output at least McbaRingSize(Capacity) bytes
+ * aligned to MCBA_CACHE_LINE_SIZE, the driver initializes it). Frames are
+ * then consumed straight from the buffer as MCBA_CAN_MSG_DATA_EX
+ * regardless of the handle's record format, the read IOCTLs no longer
+ * return frames but wait until the ring is not empty and complete with 0
+ * bytes. Once the ring is full new frames are dropped.
+ *
+ * The request stays pending for as long as the ring is in use, so it has
+ * to be issued overlapped. Cancelling it (CancelIoEx, exit of the issuing
+ * thread or process, closing the handle) hands the buffer back, it
+ * completes with STATUS_CANCELLED and the handle reads from the shared
+ * queue again. Frames still in the buffer stay there. Only one ring can be
+ * mapped per handle at a time.
+ */
+#define MCBA_IOCTL_HOST_CAN_FRAME_RING_MAP CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+107, METHOD_OUT_DIRECT, FILE_READ_DATA)
+/* Installs acceptance filters on the handle (input array of up to
+ * MCBA_CAN_FILTER_MAX_COUNT MCBA_CAN_FILTER), a frame is received if any
+ * of them matches. An empty input removes the filters, the handle receives
+ * every frame again. Frames queued but not yet read are filtered as well,
+ * except for those already in a mapped ring.
+ */
+#define MCBA_IOCTL_HOST_CAN_FRAME_FILTER_SET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+108, METHOD_IN_DIRECT, FILE_READ_DATA)
+/* Sets depth and overflow policy of the handle's receive queue (input
+ * MCBA_RX_QUEUE_CONFIG). Queued frames are carried over as far as they fit.
+ * The memory of all queues of the driver is limited, if the new queue
+ * would exceed the limit the call fails with STATUS_QUOTA_EXCEEDED. Fails
+ * with STATUS_INVALID_DEVICE_STATE while a read is pending or the ring is
+ * mapped, a mapped ring always drops the newest frames.
+ */
+#define MCBA_IOCTL_HOST_RX_QUEUE_CONFIG_SET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+109, METHOD_IN_DIRECT, FILE_READ_DATA)
+/* Sets the completion thresholds of moderated reads on the handle (input
+ * MCBA_RX_MODERATION). Reads already pending keep theirs.
+ */
+#define MCBA_IOCTL_HOST_RX_MODERATION_SET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+110, METHOD_IN_DIRECT, FILE_READ_DATA)
+/* Reads frames like MCBA_IOCTL_HOST_CAN_FRAME_READ_AT_LEAST_ONE but waits
+ * for the thresholds set with MCBA_IOCTL_HOST_RX_MODERATION_SET. On a
+ * mapped ring it waits for the ring to hold FrameCount frames instead.
+ */
+#define MCBA_IOCTL_HOST_CAN_FRAME_READ_MODERATED CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+111, METHOD_OUT_DIRECT, FILE_READ_DATA)
+/* Selects the record the reads of the handle return (input ULONG
+ * MCBA_RX_RECORD_FORMAT_*). Fails with STATUS_INVALID_DEVICE_STATE while a
+ * read is pending.
+ */
+#define MCBA_IOCTL_HOST_RX_RECORD_FORMAT_SET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+112, METHOD_IN_DIRECT, FILE_READ_DATA)
+/* Selects the clock of the timestamps the handle reads (input ULONG
+ * MCBA_RX_TIMESTAMP_CLOCK_*), applies to frames not yet read.
+ */
+#define MCBA_IOCTL_HOST_RX_TIMESTAMP_CLOCK_SET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+113, METHOD_IN_DIRECT, FILE_READ_DATA)
+/* Sets the priority class of the frames the handle queues from here on
+ * (input ULONG MCBA_TX_PRIORITY_*).
+ */
+#define MCBA_IOCTL_HOST_TX_PRIORITY_SET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+114, METHOD_IN_DIRECT, FILE_WRITE_DATA)
+/* Registers a cyclic frame of the handle (input MCBA_CYCLIC_FRAME) or
+ * restarts it if the Index is taken. With MCBA_CYCLIC_FRAME_FLAG_UPDATE_DATA
+ * only the frame changes, fails with STATUS_NOT_FOUND if the Index isn't
+ * registered. Fails with STATUS_INSUFFICIENT_RESOURCES once the driver runs
+ * MCBA_CYCLIC_FRAMES_MAX frames. Cyclic frames go away with the handle.
+ */
+#define MCBA_IOCTL_HOST_CYCLIC_FRAME_SET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+115, METHOD_IN_DIRECT, FILE_WRITE_DATA)
+/* Removes a cyclic frame of the handle (input ULONG Index). */
+#define MCBA_IOCTL_HOST_CYCLIC_FRAME_REMOVE CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+116, METHOD_IN_DIRECT, FILE_WRITE_DATA)
+/* Input ULONG Index, output MCBA_CYCLIC_FRAME_STATS. */
+#define MCBA_IOCTL_HOST_CYCLIC_FRAME_STATS_GET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+117, METHOD_OUT_DIRECT, FILE_READ_DATA)
+/* Selects which transmitted frames the handle reads (input ULONG
+ * MCBA_TX_ECHO_*), applies to frames confirmed from here on.
+ */
+#define MCBA_IOCTL_HOST_TX_ECHO_SET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+118, METHOD_IN_DIRECT, FILE_READ_DATA)
+/* Tracks the latencies of transmitted frames for the handle (input
+ * MCBA_TX_LATENCY_CONFIG). Frames are tracked from the next transfer on
+ * while any handle asks for it. Results not yet read are dropped.
+ */
+#define MCBA_IOCTL_HOST_TX_LATENCY_SET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+119, METHOD_IN_DIRECT, FILE_READ_DATA)
+/* Takes the queued results of the handle, oldest first (output array of
+ * MCBA_TX_RESULT), completes with the bytes copied without waiting. Fails
+ * with STATUS_INVALID_DEVICE_STATE unless the handle set
+ * MCBA_TX_LATENCY_FLAG_RESULTS.
+ */
+#define MCBA_IOCTL_HOST_TX_RESULTS_READ CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+120, METHOD_OUT_DIRECT, FILE_READ_DATA)
+/* Output MCBA_TX_LATENCY of all frames the device sent. */
+#define MCBA_IOCTL_HOST_TX_LATENCY_GET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+121, METHOD_OUT_DIRECT, FILE_READ_DATA)
+#define MCBA_IOCTL_HOST_TX_LATENCY_CLEAR CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+122, METHOD_NEITHER, FILE_WRITE_DATA)
+/* Output MCBA_FILE_STATS_EX of the handle, cleared along with
+ * MCBA_FILE_STATS by MCBA_IOCTL_HOST_FILE_STATS_CLEAR.
+ */
+#define MCBA_IOCTL_HOST_FILE_STATS_EX_GET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+123, METHOD_OUT_DIRECT, FILE_READ_DATA)
+/* Records receive latencies of the handle (input ULONG
+ * MCBA_RX_LATENCY_FLAG_*, 0 turns it off), applies to reads completing
+ * from here on. Turning it off drops the histogram of the handle.
+ */
+#define MCBA_IOCTL_HOST_RX_LATENCY_SET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+124, METHOD_IN_DIRECT, FILE_READ_DATA)
+/* Input MCBA_RX_LATENCY_QUERY, output MCBA_RX_LATENCY. Fails with
+ * STATUS_INVALID_DEVICE_STATE for MCBA_RX_LATENCY_SCOPE_FILE unless the
+ * handle records its latencies.
+ */
+#define MCBA_IOCTL_HOST_RX_LATENCY_GET CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+125, METHOD_OUT_DIRECT, FILE_READ_DATA)
+/* Starts the histogram of the scope over (input ULONG MCBA_RX_LATENCY_SCOPE_*). */
+#define MCBA_IOCTL_HOST_RX_LATENCY_CLEAR CTL_CODE(MCBA_FILE_DEVICE, MCBA_IOCTL_OFFSET+126, METHOD_IN_DIRECT, FILE_WRITE_DATA)
 
 
 
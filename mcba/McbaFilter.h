@@ -0,0 +1,315 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Compiled form of the MCBA_CAN_FILTER list of a handle.
+ *
+ * 11 bit identifiers are looked up in a bitmap, one for data and one for
+ * remote frames, so rejecting a standard frame takes two loads. 29 bit
+ * identifiers go through a sorted table of disjoint ranges (binary search),
+ * mask filters whose don't care bits are the lowest ones become ranges,
+ * the others are kept in a short list that is scanned.
+ *
+ * Header only and WDK independent so that perf/ can use it.
+ */
+
+#include <string.h>
+
+#include "McbaPortable.h"
+#include "McbaDriverInterface.h"
+
+EXTERN_C_START
+
+#define MCBA_FILTER_SFF_WORDS ((1u << MCBA_CAN_SFF_ID_BITS) / 32)
+
+/* index into the per frame kind tables */
+#define MCBA_FILTER_KIND_DATA 0
+#define MCBA_FILTER_KIND_REMOTE 1
+#define MCBA_FILTER_KINDS 2
+
+typedef struct _MCBA_FILTER_RANGE {
+    ULONG First;
+    ULONG Last;
+} MCBA_FILTER_RANGE, *PMCBA_FILTER_RANGE;
+
+typedef struct _MCBA_FILTER_MASK {
+    ULONG Id;
+    ULONG Mask;
+} MCBA_FILTER_MASK, *PMCBA_FILTER_MASK;
+
+typedef struct _MCBA_FILTER {
+    ULONG Sff[MCBA_FILTER_KINDS][MCBA_FILTER_SFF_WORDS];
+    ULONG EffRangeCount[MCBA_FILTER_KINDS];
+    ULONG EffMaskCount[MCBA_FILTER_KINDS];
+    MCBA_FILTER_RANGE EffRanges[MCBA_FILTER_KINDS][MCBA_CAN_FILTER_MAX_COUNT];
+    MCBA_FILTER_MASK EffMasks[MCBA_FILTER_KINDS][MCBA_CAN_FILTER_MAX_COUNT];
+} MCBA_FILTER, *PMCBA_FILTER;
+
+static
+inline
+VOID
+McbaFilterAddRange(
+    _Inout_ PMCBA_FILTER Filter,
+    _In_ ULONG Kinds,
+    _In_ BOOLEAN Extended,
+    _In_ ULONG First,
+    _In_ ULONG Last
+)
+{
+    for (ULONG kind = 0; kind < MCBA_FILTER_KINDS; ++kind) {
+        if (!(Kinds & (1u << kind))) {
+            continue;
+        }
+
+        if (Extended) {
+            PMCBA_FILTER_RANGE pRange = &Filter->EffRanges[kind][Filter->EffRangeCount[kind]++];
+
+            pRange->First = First;
+            pRange->Last = Last;
+        }
+        else {
+            for (ULONG id = First; id <= Last; ++id) {
+                Filter->Sff[kind][id >> 5] |= 1u << (id & 31);
+            }
+        }
+    }
+}
+
+/* Sorts the ranges of a kind and merges overlapping / adjacent ones so that
+ * a lookup is a plain binary search.
+ */
+static
+inline
+VOID
+McbaFilterMergeRanges(
+    _Inout_ PMCBA_FILTER Filter,
+    _In_ ULONG Kind
+)
+{
+    PMCBA_FILTER_RANGE pRanges = Filter->EffRanges[Kind];
+    ULONG count = Filter->EffRangeCount[Kind];
+    ULONG merged = 0;
+
+    // insertion sort, there are at most MCBA_CAN_FILTER_MAX_COUNT
+    for (ULONG i = 1; i < count; ++i) {
+        MCBA_FILTER_RANGE range = pRanges[i];
+        ULONG j = i;
+
+        for (; j > 0 && pRanges[j - 1].First > range.First; --j) {
+            pRanges[j] = pRanges[j - 1];
+        }
+
+        pRanges[j] = range;
+    }
+
+    for (ULONG i = 0; i < count; ++i) {
+        if (merged && pRanges[i].First <= pRanges[merged - 1].Last + 1) {
+            if (pRanges[i].Last > pRanges[merged - 1].Last) {
+                pRanges[merged - 1].Last = pRanges[i].Last;
+            }
+        }
+        else {
+            pRanges[merged++] = pRanges[i];
+        }
+    }
+
+    Filter->EffRangeCount[Kind] = merged;
+}
+
+/* Compiles Count filters into Filter. Returns FALSE if one of them is
+ * malformed.
+ */
+static
+inline
+BOOLEAN
+McbaFilterBuild(
+    _Out_ PMCBA_FILTER Filter,
+    _In_reads_(Count) const MCBA_CAN_FILTER* Filters,
+    _In_ ULONG Count
+)
+{
+    memset(Filter, 0, sizeof(*Filter));
+
+    if (Count > MCBA_CAN_FILTER_MAX_COUNT) {
+        return FALSE;
+    }
+
+    for (ULONG i = 0; i < Count; ++i) {
+        const MCBA_CAN_FILTER* pFilter = &Filters[i];
+        BOOLEAN extended = (pFilter->Id & MCBA_CAN_EFF_FLAG) != 0;
+        ULONG idMask = extended ? MCBA_CAN_EFF_MASK : MCBA_CAN_SFF_MASK;
+        ULONG id = pFilter->Id & idMask;
+        ULONG kinds = (1u << MCBA_FILTER_KIND_DATA) | (1u << MCBA_FILTER_KIND_REMOTE);
+
+        if (pFilter->Id & ~(idMask | MCBA_CAN_EFF_FLAG | MCBA_CAN_RTR_FLAG)) {
+            return FALSE;
+        }
+
+        if (pFilter->Mask & MCBA_CAN_RTR_FLAG) {
+            kinds = 1u << ((pFilter->Id & MCBA_CAN_RTR_FLAG) ? MCBA_FILTER_KIND_REMOTE : MCBA_FILTER_KIND_DATA);
+        }
+
+        switch (pFilter->Type) {
+        case MCBA_CAN_FILTER_TYPE_MASK: {
+            ULONG mask = pFilter->Mask & idMask;
+            ULONG dontCare = ~mask & idMask;
+
+            id &= mask;
+
+            if (!(dontCare & (dontCare + 1))) {
+                // don't care bits are the lowest ones, that's a range
+                McbaFilterAddRange(Filter, kinds, extended, id, id | dontCare);
+            }
+            else if (extended) {
+                for (ULONG kind = 0; kind < MCBA_FILTER_KINDS; ++kind) {
+                    if (kinds & (1u << kind)) {
+                        PMCBA_FILTER_MASK pMask = &Filter->EffMasks[kind][Filter->EffMaskCount[kind]++];
+
+                        pMask->Id = id;
+                        pMask->Mask = mask;
+                    }
+                }
+            }
+            else {
+                for (ULONG sff = 0; sff <= MCBA_CAN_SFF_MASK; ++sff) {
+                    if ((sff & mask) == id) {
+                        McbaFilterAddRange(Filter, kinds, FALSE, sff, sff);
+                    }
+                }
+            }
+        } break;
+        case MCBA_CAN_FILTER_TYPE_RANGE:
+            if ((pFilter->Last & MCBA_CAN_EFF_FLAG) != (pFilter->Id & MCBA_CAN_EFF_FLAG) ||
+                (pFilter->Last & ~(idMask | MCBA_CAN_EFF_FLAG)) ||
+                (pFilter->Last & idMask) < id) {
+                return FALSE;
+            }
+
+            McbaFilterAddRange(Filter, kinds, extended, id, pFilter->Last & idMask);
+            break;
+        default:
+            return FALSE;
+        }
+    }
+
+    for (ULONG kind = 0; kind < MCBA_FILTER_KINDS; ++kind) {
+        McbaFilterMergeRanges(Filter, kind);
+    }
+
+    return TRUE;
+}
+
+static
+inline
+BOOLEAN
+McbaFilterMatch(
+    _In_ const MCBA_FILTER* Filter,
+    _In_ MCBA_CAN_ID Id
+)
+{
+    ULONG kind = (Id & MCBA_CAN_RTR_FLAG) ? MCBA_FILTER_KIND_REMOTE : MCBA_FILTER_KIND_DATA;
+    const MCBA_FILTER_RANGE* pRanges;
+    ULONG low, high;
+    ULONG id;
+
+    if (!(Id & MCBA_CAN_EFF_FLAG)) {
+        id = Id & MCBA_CAN_SFF_MASK;
+        return (Filter->Sff[kind][id >> 5] >> (id & 31)) & 1;
+    }
+
+    id = Id & MCBA_CAN_EFF_MASK;
+
+    // last range starting at or below id
+    pRanges = Filter->EffRanges[kind];
+    low = 0;
+    high = Filter->EffRangeCount[kind];
+    while (low < high) {
+        ULONG middle = (low + high) / 2;
+
+        if (pRanges[middle].First <= id) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+
+    if (low && id <= pRanges[low - 1].Last) {
+        return TRUE;
+    }
+
+    for (ULONG i = 0; i < Filter->EffMaskCount[kind]; ++i) {
+        if ((id & Filter->EffMasks[kind][i].Mask) == Filter->EffMasks[kind][i].Id) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* TRUE if any of the frames passes. */
+static
+inline
+BOOLEAN
+McbaFilterMatchAny(
+    _In_ const MCBA_FILTER* Filter,
+    _In_reads_(Count) const MCBA_CAN_MSG_DATA_EX* Msgs,
+    _In_ ULONG Count
+)
+{
+    for (ULONG i = 0; i < Count; ++i) {
+        if (McbaFilterMatch(Filter, Msgs[i].Msg.Id)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Moves the frames that pass to the front, returns their number. */
+static
+inline
+ULONG
+McbaFilterCompact(
+    _In_ const MCBA_FILTER* Filter,
+    _Inout_updates_(Count) PMCBA_CAN_MSG_DATA_EX Msgs,
+    _In_ ULONG Count
+)
+{
+    ULONG kept = 0;
+
+    for (ULONG i = 0; i < Count; ++i) {
+        if (McbaFilterMatch(Filter, Msgs[i].Msg.Id)) {
+            if (kept != i) {
+                Msgs[kept] = Msgs[i];
+            }
+
+            ++kept;
+        }
+    }
+
+    return kept;
+}
+
+EXTERN_C_END
@@ -0,0 +1,198 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Log-linear latency histogram (MCBA_LATENCY_HISTOGRAM).
+ *
+ * Recording is a bit scan and a few adds so it can run per frame at
+ * DISPATCH_LEVEL. Bucket b counts values from McbaHistogramBucketLow(b)
+ * up to McbaHistogramBucketLow(b + 1). Not thread safe, the caller
+ * serializes recording and copying out.
+ *
+ * Header only and WDK independent so that applications and perf/ can
+ * interpret the histograms the driver returns.
+ */
+
+#include <string.h>
+
+#include "McbaPortable.h"
+#include "McbaDriverInterface.h"
+
+#if defined(_MSC_VER)
+#   include <intrin.h>
+#endif
+
+EXTERN_C_START
+
+static
+inline
+ULONG
+McbaHistogramMsb(
+    _In_ UINT32 Value
+)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+
+    _BitScanReverse(&index, Value);
+    return index;
+#else
+    return 31 - (ULONG)__builtin_clz(Value);
+#endif
+}
+
+static
+inline
+ULONG
+McbaHistogramBucket(
+    _In_ UINT32 Value
+)
+{
+    ULONG shift;
+
+    if (Value < MCBA_LATENCY_HISTOGRAM_SUB_BUCKETS) {
+        return Value;
+    }
+
+    // the bits below the leading one that pick the sub-bucket
+    shift = McbaHistogramMsb(Value) - MCBA_LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+
+    return (shift + 1) * MCBA_LATENCY_HISTOGRAM_SUB_BUCKETS
+        + ((Value >> shift) & (MCBA_LATENCY_HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static
+inline
+UINT64
+McbaHistogramBucketLow(
+    _In_ ULONG Bucket
+)
+{
+    ULONG shift;
+
+    if (Bucket < MCBA_LATENCY_HISTOGRAM_SUB_BUCKETS) {
+        return Bucket;
+    }
+
+    shift = Bucket / MCBA_LATENCY_HISTOGRAM_SUB_BUCKETS - 1;
+
+    return (UINT64)(MCBA_LATENCY_HISTOGRAM_SUB_BUCKETS + Bucket % MCBA_LATENCY_HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+static
+inline
+VOID
+McbaHistogramInit(
+    _Out_ PMCBA_LATENCY_HISTOGRAM Histogram
+)
+{
+    memset(Histogram, 0, sizeof(*Histogram));
+}
+
+static
+inline
+VOID
+McbaHistogramRecord(
+    _Inout_ PMCBA_LATENCY_HISTOGRAM Histogram,
+    _In_ UINT32 ValueUs
+)
+{
+    if (!Histogram->Count || ValueUs < Histogram->MinUs) {
+        Histogram->MinUs = ValueUs;
+    }
+
+    if (ValueUs > Histogram->MaxUs) {
+        Histogram->MaxUs = ValueUs;
+    }
+
+    ++Histogram->Count;
+    Histogram->SumUs += ValueUs;
+    ++Histogram->Buckets[McbaHistogramBucket(ValueUs)];
+}
+
+/* Value at PartsPerMillion of the recorded values: the upper end of the
+ * bucket the value of that rank fell into, within MinUs and MaxUs. 0 while
+ * nothing was recorded.
+ */
+static
+inline
+UINT32
+McbaHistogramPercentile(
+    _In_ const MCBA_LATENCY_HISTOGRAM* Histogram,
+    _In_ UINT32 PartsPerMillion
+)
+{
+    UINT64 rank;
+    UINT64 seen = 0;
+    UINT64 high;
+    ULONG bucket;
+
+    if (!Histogram->Count) {
+        return 0;
+    }
+
+    if (PartsPerMillion > 1000000) {
+        PartsPerMillion = 1000000;
+    }
+
+    // the smallest value at least that share of all values is not above
+    rank = (Histogram->Count * PartsPerMillion + 999999) / 1000000;
+    if (!rank) {
+        rank = 1;
+    }
+
+    for (bucket = 0; bucket < MCBA_LATENCY_HISTOGRAM_BUCKETS - 1; ++bucket) {
+        seen += Histogram->Buckets[bucket];
+        if (seen >= rank) {
+            break;
+        }
+    }
+
+    high = McbaHistogramBucketLow(bucket + 1) - 1;
+    if (high > Histogram->MaxUs) {
+        return Histogram->MaxUs;
+    }
+
+    return high < Histogram->MinUs ? Histogram->MinUs : (UINT32)high;
+}
+
+/* Microseconds between two host times in 100 ns, negative spans count as 0. */
+static
+inline
+UINT32
+McbaHistogramSpanUs(
+    _In_ LONGLONG From,
+    _In_ LONGLONG To
+)
+{
+    LONGLONG us = (To - From) / 10;
+
+    if (us <= 0) {
+        return 0;
+    }
+
+    return us > 0xffffffff ? 0xffffffff : (UINT32)us;
+}
+
+EXTERN_C_END
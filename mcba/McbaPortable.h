@@ -0,0 +1,106 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Lets the protocol headers (Mcba.h, McbaDriverInterface.h, McbaCodec.h)
+ * compile outside of the WDK, e.g. for the user mode tools in perf/.
+ */
+
+#if defined(_KERNEL_MODE)
+#   include <ntdef.h>
+#elif defined(_WIN32)
+#   include <Windows.h>
+#else
+#   include <stddef.h>
+#   include <stdint.h>
+
+typedef uint8_t UINT8, *PUINT8;
+typedef uint16_t UINT16, *PUINT16;
+typedef uint32_t UINT32, *PUINT32;
+typedef uint64_t UINT64, *PUINT64;
+typedef int32_t INT32, *PINT32;
+typedef int64_t INT64, *PINT64;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG, LONG64;
+typedef uint64_t ULONGLONG, *PULONGLONG;
+typedef uint8_t BOOLEAN;
+typedef int32_t NTSTATUS;
+
+#   define VOID void
+#   define ANYSIZE_ARRAY 1
+#   define FIELD_OFFSET(type, field) offsetof(type, field)
+#   define MAXLONGLONG INT64_MAX
+
+#   ifndef TRUE
+#       define TRUE 1
+#   endif
+#   ifndef FALSE
+#       define FALSE 0
+#   endif
+
+#   define _In_
+#   define _Out_
+#   define _Inout_
+#   define _In_reads_(count)
+#   define _In_reads_bytes_(size)
+#   define _Out_writes_(count)
+#   define _Out_writes_to_(size, count)
+#   define _Inout_updates_(count)
+
+#   ifdef __cplusplus
+#       define EXTERN_C_START extern "C" {
+#       define EXTERN_C_END }
+#   else
+#       define EXTERN_C_START
+#       define EXTERN_C_END
+#   endif
+#endif
+
+/* All Windows targets are little endian. */
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#   define MCBA_BIG_ENDIAN 1
+#else
+#   define MCBA_BIG_ENDIAN 0
+#endif
+
+/* Cache line size used to keep data written from different contexts apart. */
+#define MCBA_CACHE_LINE_SIZE 64
+
+/* Ordered 32 bit loads / stores and a full barrier for data shared
+ * without a lock.
+ */
+#if defined(_WIN32)
+#   define McbaReadAcquire32(ptr) ReadULongAcquire(ptr)
+#   define McbaWriteRelease32(ptr, value) WriteULongRelease((ptr), (value))
+#   if defined(_KERNEL_MODE)
+#       define McbaMemoryBarrier() KeMemoryBarrier()
+#   else
+#       define McbaMemoryBarrier() MemoryBarrier()
+#   endif
+#else
+#   define McbaReadAcquire32(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#   define McbaWriteRelease32(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#   define McbaMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
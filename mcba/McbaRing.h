@@ -0,0 +1,348 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Rings of received CAN frames.
+ *
+ * MCBA_RING is a single producer / single consumer ring, see
+ * McbaDriverInterface.h for the layout.
+ *
+ * The producer keeps its own copy of Head and Mask in MCBA_RING_PRODUCER
+ * and never reads back anything but Tail from the ring. That way the
+ * consumer side can live in an untrusted address space (rings mapped with
+ * MCBA_IOCTL_HOST_CAN_FRAME_RING_MAP) without being able to steer the
+ * producer's writes outside of the entries.
+ *
+ * MCBA_BROADCAST_RING is the single producer / many consumer ring all
+ * handles of a device read from. Frames are stored once, every consumer
+ * keeps its own cursor. The producer never waits for consumers, it
+ * overwrites the oldest frames and a consumer that fell behind by more than
+ * the capacity loses what was overwritten.
+ *
+ * Header only and WDK independent so that perf/ can benchmark the exact
+ * code the driver runs.
+ */
+
+#include <string.h>
+
+#include "McbaPortable.h"
+#include "McbaDriverInterface.h"
+
+EXTERN_C_START
+
+/* Bytes to allocate for a ring of Capacity entries. */
+#define McbaRingSize(Capacity) (FIELD_OFFSET(MCBA_RING, Entries) + (size_t)(Capacity) * sizeof(MCBA_CAN_MSG_DATA_EX))
+
+typedef struct _MCBA_RING_PRODUCER {
+    PMCBA_RING Ring;
+    ULONG Head;
+    ULONG Mask;
+} MCBA_RING_PRODUCER, *PMCBA_RING_PRODUCER;
+
+/* Capacity must be a power of 2. */
+static
+inline
+VOID
+McbaRingInit(
+    _Out_ PMCBA_RING Ring,
+    _Out_ PMCBA_RING_PRODUCER Producer,
+    _In_ ULONG Capacity
+)
+{
+    Ring->Head = 0;
+    Ring->Tail = 0;
+    Ring->Capacity = Capacity;
+    Ring->Mask = Capacity - 1;
+
+    Producer->Ring = Ring;
+    Producer->Head = 0;
+    Producer->Mask = Capacity - 1;
+}
+
+/* Exact for the caller's side, a lower bound for the other side. */
+static
+inline
+ULONG
+McbaRingCount(
+    _In_ const MCBA_RING* Ring
+)
+{
+    return McbaReadAcquire32(&Ring->Head) - McbaReadAcquire32(&Ring->Tail);
+}
+
+/* Producer. Frames the consumer has not taken yet. */
+static
+inline
+ULONG
+McbaRingProducerCount(
+    _In_ const MCBA_RING_PRODUCER* Producer
+)
+{
+    ULONG used = Producer->Head - McbaReadAcquire32(&Producer->Ring->Tail);
+    return used > Producer->Mask + 1 ? Producer->Mask + 1 : used;
+}
+
+/* Producer. Stores up to Count frames, returns the number stored. */
+static
+inline
+ULONG
+McbaRingWrite(
+    _Inout_ PMCBA_RING_PRODUCER Producer,
+    _In_reads_(Count) const MCBA_CAN_MSG_DATA_EX* Msgs,
+    _In_ ULONG Count
+)
+{
+    PMCBA_RING ring = Producer->Ring;
+    ULONG head = Producer->Head;
+    ULONG capacity = Producer->Mask + 1;
+    ULONG space = capacity - McbaRingProducerCount(Producer);
+    ULONG offset = head & Producer->Mask;
+    ULONG first;
+
+    if (Count > space) {
+        Count = space;
+    }
+
+    first = capacity - offset;
+    if (first > Count) {
+        first = Count;
+    }
+
+    memcpy(&ring->Entries[offset], Msgs, first * sizeof(*Msgs));
+    memcpy(&ring->Entries[0], Msgs + first, (Count - first) * sizeof(*Msgs));
+
+    Producer->Head = head + Count;
+    McbaWriteRelease32(&ring->Head, head + Count);
+
+    return Count;
+}
+
+/* Consumer. Copies up to Count frames into Msgs, returns the number copied. */
+static
+inline
+ULONG
+McbaRingRead(
+    _Inout_ PMCBA_RING Ring,
+    _Out_writes_to_(Count, return) PMCBA_CAN_MSG_DATA_EX Msgs,
+    _In_ ULONG Count
+)
+{
+    ULONG tail = Ring->Tail;
+    ULONG available = McbaReadAcquire32(&Ring->Head) - tail;
+    ULONG offset = tail & Ring->Mask;
+    ULONG first;
+
+    if (Count > available) {
+        Count = available;
+    }
+
+    first = Ring->Capacity - offset;
+    if (first > Count) {
+        first = Count;
+    }
+
+    memcpy(Msgs, &Ring->Entries[offset], first * sizeof(*Msgs));
+    memcpy(Msgs + first, &Ring->Entries[0], (Count - first) * sizeof(*Msgs));
+
+    McbaWriteRelease32(&Ring->Tail, tail + Count);
+
+    return Count;
+}
+
+/* Consumer. Drops up to Count of the oldest frames, returns the number dropped. */
+static
+inline
+ULONG
+McbaRingDiscard(
+    _Inout_ PMCBA_RING Ring,
+    _In_ ULONG Count
+)
+{
+    ULONG tail = Ring->Tail;
+    ULONG available = McbaReadAcquire32(&Ring->Head) - tail;
+
+    if (Count > available) {
+        Count = available;
+    }
+
+    McbaWriteRelease32(&Ring->Tail, tail + Count);
+
+    return Count;
+}
+
+/* Head is the number of frames published. Before overwriting slots the
+ * producer advances Reserve, consumers copy frames without a lock and then
+ * check against Reserve that the slots they copied from were not reused
+ * meanwhile.
+ */
+typedef struct _MCBA_BROADCAST_RING {
+    volatile ULONG Head;
+    volatile ULONG Reserve;
+    ULONG Mask;
+    UINT8 Padding[MCBA_CACHE_LINE_SIZE - 3 * sizeof(ULONG)];
+    MCBA_CAN_MSG_DATA_EX Entries[ANYSIZE_ARRAY];
+} MCBA_BROADCAST_RING, *PMCBA_BROADCAST_RING;
+
+/* Bytes to allocate for a broadcast ring of Capacity entries. */
+#define McbaBroadcastRingSize(Capacity) (FIELD_OFFSET(MCBA_BROADCAST_RING, Entries) + (size_t)(Capacity) * sizeof(MCBA_CAN_MSG_DATA_EX))
+
+/* Capacity must be a power of 2. */
+static
+inline
+VOID
+McbaBroadcastRingInit(
+    _Out_ PMCBA_BROADCAST_RING Ring,
+    _In_ ULONG Capacity
+)
+{
+    Ring->Head = 0;
+    Ring->Reserve = 0;
+    Ring->Mask = Capacity - 1;
+}
+
+/* Cursor of a consumer that only wants frames published from now on. */
+static
+inline
+ULONG
+McbaBroadcastRingCursor(
+    _In_ const MCBA_BROADCAST_RING* Ring
+)
+{
+    return McbaReadAcquire32(&Ring->Head);
+}
+
+/* Frames published past Cursor, may exceed the capacity. */
+static
+inline
+ULONG
+McbaBroadcastRingCount(
+    _In_ const MCBA_BROADCAST_RING* Ring,
+    _In_ ULONG Cursor
+)
+{
+    return McbaReadAcquire32(&Ring->Head) - Cursor;
+}
+
+/* Producer. Stores all frames, of more than the capacity only the newest. */
+static
+inline
+VOID
+McbaBroadcastRingWrite(
+    _Inout_ PMCBA_BROADCAST_RING Ring,
+    _In_reads_(Count) const MCBA_CAN_MSG_DATA_EX* Msgs,
+    _In_ ULONG Count
+)
+{
+    ULONG head = Ring->Head;
+    ULONG capacity = Ring->Mask + 1;
+    ULONG offset;
+    ULONG first;
+
+    if (Count > capacity) {
+        head += Count - capacity;
+        Msgs += Count - capacity;
+        Count = capacity;
+    }
+
+    // consumers must see the reservation before any slot changes
+    Ring->Reserve = head + Count;
+    McbaMemoryBarrier();
+
+    offset = head & Ring->Mask;
+    first = capacity - offset;
+    if (first > Count) {
+        first = Count;
+    }
+
+    memcpy(&Ring->Entries[offset], Msgs, first * sizeof(*Msgs));
+    memcpy(&Ring->Entries[0], Msgs + first, (Count - first) * sizeof(*Msgs));
+
+    McbaWriteRelease32(&Ring->Head, head + Count);
+}
+
+/* Consumer. Copies up to Count frames past *Cursor into Msgs and advances
+ * *Cursor, returns the number copied. Frames overwritten before they could
+ * be copied are skipped and added to *Lost.
+ */
+static
+inline
+ULONG
+McbaBroadcastRingRead(
+    _In_ const MCBA_BROADCAST_RING* Ring,
+    _Inout_ PULONG Cursor,
+    _Out_writes_to_(Count, return) PMCBA_CAN_MSG_DATA_EX Msgs,
+    _In_ ULONG Count,
+    _Inout_ PULONGLONG Lost
+)
+{
+    ULONG capacity = Ring->Mask + 1;
+    ULONG head = McbaReadAcquire32(&Ring->Head);
+    ULONG cursor = *Cursor;
+    ULONG available = head - cursor;
+    ULONG offset;
+    ULONG first;
+    ULONG overwritten;
+
+    if (available > capacity) {
+        *Lost += available - capacity;
+        cursor = head - capacity;
+        available = capacity;
+    }
+
+    if (Count > available) {
+        Count = available;
+    }
+
+    offset = cursor & Ring->Mask;
+    first = capacity - offset;
+    if (first > Count) {
+        first = Count;
+    }
+
+    memcpy(Msgs, &Ring->Entries[offset], first * sizeof(*Msgs));
+    memcpy(Msgs + first, &Ring->Entries[0], (Count - first) * sizeof(*Msgs));
+
+    // slots below Reserve - capacity may have changed while copying
+    McbaMemoryBarrier();
+    overwritten = McbaReadAcquire32(&Ring->Reserve) - capacity - cursor;
+    if ((LONG)overwritten > 0) {
+        if (overwritten > Count) {
+            // lapped during the copy, none of it is usable
+            *Lost += overwritten;
+            *Cursor = cursor + overwritten;
+            return 0;
+        }
+
+        memmove(Msgs, Msgs + overwritten, (Count - overwritten) * sizeof(*Msgs));
+        *Lost += overwritten;
+        cursor += overwritten;
+        Count -= overwritten;
+    }
+
+    *Cursor = cursor + Count;
+
+    return Count;
+}
+
+EXTERN_C_END
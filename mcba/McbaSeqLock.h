@@ -0,0 +1,114 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Sequence lock, lets readers copy data that changes underneath without
+ * holding up the writer.
+ *
+ * Sequence is odd while a writer updates the data. A reader notes an even
+ * Sequence, copies the data and retries if Sequence moved meanwhile, so it
+ * never returns a copy torn by a write. Writers must be serialized by the
+ * caller, readers take no lock and write nothing shared.
+ *
+ *     do {
+ *         seq = McbaSeqLockReadBegin(&Lock);
+ *         copy = Data;
+ *     } while (McbaSeqLockReadRetry(&Lock, seq));
+ *
+ * Header only and WDK independent so that perf/ can test the exact code
+ * the driver runs.
+ */
+
+#include "McbaPortable.h"
+
+EXTERN_C_START
+
+typedef struct _MCBA_SEQLOCK {
+    volatile ULONG Sequence;
+} MCBA_SEQLOCK, *PMCBA_SEQLOCK;
+
+static
+inline
+VOID
+McbaSeqLockInit(
+    _Out_ PMCBA_SEQLOCK Lock
+)
+{
+    Lock->Sequence = 0;
+}
+
+static
+inline
+VOID
+McbaSeqLockWriteBegin(
+    _Inout_ PMCBA_SEQLOCK Lock
+)
+{
+    McbaWriteRelease32(&Lock->Sequence, Lock->Sequence + 1);
+    // no store to the data may become visible before the odd sequence
+    McbaMemoryBarrier();
+}
+
+static
+inline
+VOID
+McbaSeqLockWriteEnd(
+    _Inout_ PMCBA_SEQLOCK Lock
+)
+{
+    McbaWriteRelease32(&Lock->Sequence, Lock->Sequence + 1);
+}
+
+static
+inline
+ULONG
+McbaSeqLockReadBegin(
+    _In_ const MCBA_SEQLOCK* Lock
+)
+{
+    ULONG seq;
+
+    // a write takes a few stores, wait it out
+    while ((seq = McbaReadAcquire32(&Lock->Sequence)) & 1);
+
+    return seq;
+}
+
+/* TRUE if the data copied since McbaSeqLockReadBegin returned Sequence may
+ * be torn and has to be copied again.
+ */
+static
+inline
+BOOLEAN
+McbaSeqLockReadRetry(
+    _In_ const MCBA_SEQLOCK* Lock,
+    _In_ ULONG Sequence
+)
+{
+    // the loads of the data complete before the sequence is checked again
+    McbaMemoryBarrier();
+    return McbaReadAcquire32(&Lock->Sequence) != Sequence;
+}
+
+EXTERN_C_END
@@ -0,0 +1,207 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Log of the frames sent, matched with the device's transmit confirmations.
+ *
+ * Writers record the frames of a transfer before they send it, but
+ * nothing orders concurrent writers on the bulk-OUT pipe, so the device
+ * may confirm frames in another order than they were recorded in. A
+ * confirmation takes the oldest unconfirmed entry with the same frame and
+ * leaves the entries before it alone. Entries of a transfer that failed
+ * are done at once, those whose confirmation was lost are dropped once
+ * they were recorded MCBA_TX_ECHO_TIMEOUT ago or the log is full.
+ *
+ * The log is a ring in a fixed array, not thread safe.
+ *
+ * Header only and WDK independent so that perf/ can simulate the exact
+ * code the driver runs.
+ */
+
+#include <string.h>
+
+#include "McbaPortable.h"
+#include "McbaDriverInterface.h"
+
+EXTERN_C_START
+
+#define MCBA_TX_ECHO_CAPACITY 256 // frames sent and not yet confirmed, must be a power of 2
+#define MCBA_TX_ECHO_TIMEOUT (1000 * 1000 * 10) // 100 ns, unconfirmed frames recorded this long ago are dropped
+
+// frame on its way to the device, matched with its transmit confirmation
+typedef struct _MCBA_TX_ECHO_ENTRY {
+    MCBA_CAN_MSG Msg; // as decoded from the transfer
+    UINT16 Tag; // TxEchoTag of the sender, 0 if unknown
+    BOOLEAN Done; // confirmed or its transfer failed, dropped once the entries before it are
+    ULONG UsbRequest; // pool request of the transfer
+    LONGLONG Recorded; // monotonic time the frame was recorded
+    LONGLONG Submitted; // monotonic time the write reached the driver
+    LONGLONG Written; // monotonic time the transfer completed, 0 until then
+} MCBA_TX_ECHO_ENTRY, *PMCBA_TX_ECHO_ENTRY;
+
+typedef struct _MCBA_TX_ECHO {
+    ULONG Head;
+    ULONG Tail;
+    MCBA_TX_ECHO_ENTRY Entries[MCBA_TX_ECHO_CAPACITY]; // in the order recorded, oldest at Tail
+} MCBA_TX_ECHO, *PMCBA_TX_ECHO;
+
+#define McbaTxEchoEntry(Echo, Position) (&(Echo)->Entries[(Position) & (MCBA_TX_ECHO_CAPACITY - 1)])
+
+static
+inline
+VOID
+McbaTxEchoInit(
+    _Out_ PMCBA_TX_ECHO Echo
+)
+{
+    Echo->Head = 0;
+    Echo->Tail = 0;
+}
+
+/* Drops the entries at the tail that are done and the unconfirmed ones recorded
+ * MCBA_TX_ECHO_TIMEOUT before Now, returns the unconfirmed dropped.
+ */
+static
+inline
+ULONG
+McbaTxEchoExpire(
+    _Inout_ PMCBA_TX_ECHO Echo,
+    _In_ LONGLONG Now
+)
+{
+    ULONG dropped = 0;
+
+    for (; Echo->Tail != Echo->Head; ++Echo->Tail) {
+        const MCBA_TX_ECHO_ENTRY* pEntry = McbaTxEchoEntry(Echo, Echo->Tail);
+
+        if (!pEntry->Done) {
+            if (Now - pEntry->Recorded < MCBA_TX_ECHO_TIMEOUT) {
+                break;
+            }
+
+            ++dropped;
+        }
+    }
+
+    return dropped;
+}
+
+/* Appends an unconfirmed entry for the caller to fill in. If the log is
+ * full the oldest entry goes, added to Dropped unless it was done.
+ */
+static
+inline
+PMCBA_TX_ECHO_ENTRY
+McbaTxEchoAppend(
+    _Inout_ PMCBA_TX_ECHO Echo,
+    _In_ LONGLONG Now,
+    _Inout_ PULONG Dropped
+)
+{
+    PMCBA_TX_ECHO_ENTRY pEntry;
+
+    if (Echo->Head - Echo->Tail == MCBA_TX_ECHO_CAPACITY) {
+        if (!McbaTxEchoEntry(Echo, Echo->Tail)->Done) {
+            ++*Dropped;
+        }
+
+        // and the done entries it held back
+        do {
+            ++Echo->Tail;
+        } while (Echo->Tail != Echo->Head && McbaTxEchoEntry(Echo, Echo->Tail)->Done);
+    }
+
+    pEntry = McbaTxEchoEntry(Echo, Echo->Head++);
+    pEntry->Done = FALSE;
+    pEntry->Recorded = Now;
+
+    return pEntry;
+}
+
+/* Marks the entry the confirmation of Msg is for confirmed and copies it,
+ * FALSE if there is none. Msg must look like the frame as recorded.
+ */
+static
+inline
+BOOLEAN
+McbaTxEchoMatch(
+    _Inout_ PMCBA_TX_ECHO Echo,
+    _In_ const MCBA_CAN_MSG* Msg,
+    _Out_ PMCBA_TX_ECHO_ENTRY Entry
+)
+{
+    for (ULONG i = Echo->Tail; i != Echo->Head; ++i) {
+        PMCBA_TX_ECHO_ENTRY pEntry = McbaTxEchoEntry(Echo, i);
+
+        if (pEntry->Done) {
+            continue;
+        }
+
+        if (!memcmp(&pEntry->Msg, Msg, sizeof(*Msg))) {
+            pEntry->Done = TRUE;
+            *Entry = *pEntry;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* Marks the entries of a transfer that failed done, those from Position,
+ * the log's Head when they were recorded, that carry its UsbRequest.
+ * Returns the entries that were unconfirmed.
+ */
+static
+inline
+ULONG
+McbaTxEchoFail(
+    _Inout_ PMCBA_TX_ECHO Echo,
+    _In_ ULONG Position,
+    _In_ ULONG UsbRequest
+)
+{
+    ULONG failed = 0;
+
+    // the transfer's entries follow each other, those dropped from the tail are gone
+    if ((LONG)(Position - Echo->Tail) < 0) {
+        Position = Echo->Tail;
+    }
+
+    for (; Position != Echo->Head; ++Position) {
+        PMCBA_TX_ECHO_ENTRY pEntry = McbaTxEchoEntry(Echo, Position);
+
+        if (pEntry->UsbRequest != UsbRequest || pEntry->Written) {
+            break;
+        }
+
+        if (!pEntry->Done) {
+            pEntry->Done = TRUE;
+            ++failed;
+        }
+    }
+
+    return failed;
+}
+
+EXTERN_C_END
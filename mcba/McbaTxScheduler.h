@@ -0,0 +1,276 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Orders the frames queued for transmission the way the bus would.
+ *
+ * Frames leave by key, lowest first, and by the order they were queued in
+ * if the keys are equal, so frames with the same ID and priority class
+ * keep their order. McbaTxSchedulerKey puts the priority class of the
+ * handle above the arbitration order of the ID. A constant key gives a
+ * plain FIFO.
+ *
+ * The scheduler is a binary heap in a fixed array, not thread safe.
+ *
+ * Header only and WDK independent so that perf/ can simulate the exact
+ * code the driver runs.
+ */
+
+#include "McbaPortable.h"
+#include "McbaDriverInterface.h"
+
+EXTERN_C_START
+
+#define MCBA_TX_SCHEDULER_CAPACITY 256
+
+typedef struct _MCBA_TX_SCHEDULER_ENTRY {
+    MCBA_CAN_MSG Msg;
+    ULONGLONG Key;
+    ULONG Sequence;
+    VOID* Context; // the caller's, e.g. who queued the frame
+    LONGLONG Time; // the caller's, e.g. when the frame was queued
+} MCBA_TX_SCHEDULER_ENTRY, *PMCBA_TX_SCHEDULER_ENTRY;
+
+typedef struct _MCBA_TX_SCHEDULER {
+    ULONG Count;
+    ULONG Sequence; // of the next frame
+    MCBA_TX_SCHEDULER_ENTRY Entries[MCBA_TX_SCHEDULER_CAPACITY]; // heap, Entries[0] goes next
+} MCBA_TX_SCHEDULER, *PMCBA_TX_SCHEDULER;
+
+/* Lower value wins arbitration: base id, then SRR/IDE (11 bit beats 29 bit
+ * with the same base id), then extended id, then RTR (data beats remote).
+ */
+static
+inline
+ULONG
+McbaTxArbitrationKey(
+    _In_ const MCBA_CAN_MSG* Msg
+)
+{
+    ULONG key;
+    ULONG rtr = (Msg->Id & MCBA_CAN_RTR_FLAG) ? 1 : 0;
+
+    if (Msg->Id & MCBA_CAN_EFF_FLAG) {
+        key = ((Msg->Id & MCBA_CAN_EFF_MASK) >> 18) << 21;
+        key |= 3u << 19;
+        key |= (Msg->Id & 0x3ffff) << 1;
+        key |= rtr;
+    } else {
+        key = (Msg->Id & MCBA_CAN_SFF_MASK) << 21;
+        key |= rtr << 20;
+    }
+
+    return key;
+}
+
+static
+inline
+ULONGLONG
+McbaTxSchedulerKey(
+    _In_ ULONG PriorityClass,
+    _In_ const MCBA_CAN_MSG* Msg
+)
+{
+    return ((ULONGLONG)PriorityClass << 32) | McbaTxArbitrationKey(Msg);
+}
+
+static
+inline
+VOID
+McbaTxSchedulerInit(
+    _Out_ PMCBA_TX_SCHEDULER Scheduler
+)
+{
+    Scheduler->Count = 0;
+    Scheduler->Sequence = 0;
+}
+
+static
+inline
+BOOLEAN
+McbaTxSchedulerBefore(
+    _In_ const MCBA_TX_SCHEDULER_ENTRY* Lhs,
+    _In_ const MCBA_TX_SCHEDULER_ENTRY* Rhs
+)
+{
+    if (Lhs->Key != Rhs->Key) {
+        return Lhs->Key < Rhs->Key;
+    }
+
+    // Sequence numbers wrap. A frame of a low priority class can stay
+    // while any number of others pass, so this only holds while live
+    // entries were pushed less than 2^31 frames apart. The count
+    // restarts whenever the scheduler runs empty, see McbaTxSchedulerPop.
+    return (LONG)(Lhs->Sequence - Rhs->Sequence) < 0;
+}
+
+/* Returns FALSE if the scheduler is full. */
+static
+inline
+BOOLEAN
+McbaTxSchedulerPush(
+    _Inout_ PMCBA_TX_SCHEDULER Scheduler,
+    _In_ const MCBA_CAN_MSG* Msg,
+    _In_ ULONGLONG Key,
+    _In_ VOID* Context,
+    _In_ LONGLONG Time
+)
+{
+    MCBA_TX_SCHEDULER_ENTRY entry;
+    ULONG i;
+
+    if (Scheduler->Count == MCBA_TX_SCHEDULER_CAPACITY) {
+        return FALSE;
+    }
+
+    entry.Msg = *Msg;
+    entry.Key = Key;
+    entry.Sequence = Scheduler->Sequence++;
+    entry.Context = Context;
+    entry.Time = Time;
+
+    // sift up
+    for (i = Scheduler->Count++; i; ) {
+        ULONG parent = (i - 1) / 2;
+
+        if (!McbaTxSchedulerBefore(&entry, &Scheduler->Entries[parent])) {
+            break;
+        }
+
+        Scheduler->Entries[i] = Scheduler->Entries[parent];
+        i = parent;
+    }
+
+    Scheduler->Entries[i] = entry;
+
+    return TRUE;
+}
+
+/* Places Entry at or below position Index of the first Count entries. */
+static
+inline
+VOID
+McbaTxSchedulerSiftDown(
+    _Inout_ PMCBA_TX_SCHEDULER Scheduler,
+    _In_ ULONG Index,
+    _In_ ULONG Count,
+    _In_ const MCBA_TX_SCHEDULER_ENTRY* Entry
+)
+{
+    ULONG i = Index;
+
+    for (;;) {
+        ULONG child = 2 * i + 1;
+
+        if (child >= Count) {
+            break;
+        }
+
+        if (child + 1 < Count && McbaTxSchedulerBefore(&Scheduler->Entries[child + 1], &Scheduler->Entries[child])) {
+            ++child;
+        }
+
+        if (!McbaTxSchedulerBefore(&Scheduler->Entries[child], Entry)) {
+            break;
+        }
+
+        Scheduler->Entries[i] = Scheduler->Entries[child];
+        i = child;
+    }
+
+    Scheduler->Entries[i] = *Entry;
+}
+
+/* Returns FALSE if the scheduler is empty. */
+static
+inline
+BOOLEAN
+McbaTxSchedulerPop(
+    _Inout_ PMCBA_TX_SCHEDULER Scheduler,
+    _Out_ PMCBA_TX_SCHEDULER_ENTRY Entry
+)
+{
+    MCBA_TX_SCHEDULER_ENTRY last;
+    ULONG count;
+
+    if (!Scheduler->Count) {
+        return FALSE;
+    }
+
+    *Entry = Scheduler->Entries[0];
+    count = --Scheduler->Count;
+    last = Scheduler->Entries[count];
+
+    if (count) {
+        // sift the last entry down from the top
+        McbaTxSchedulerSiftDown(Scheduler, 0, count, &last);
+    }
+    else {
+        Scheduler->Sequence = 0;
+    }
+
+    return TRUE;
+}
+
+/* Drops the frames queued with Context and returns how many. The others
+ * keep their order, the heap is rebuilt around them.
+ */
+static
+inline
+ULONG
+McbaTxSchedulerRemove(
+    _Inout_ PMCBA_TX_SCHEDULER Scheduler,
+    _In_ const VOID* Context
+)
+{
+    ULONG count = 0;
+    ULONG removed;
+
+    for (ULONG i = 0; i < Scheduler->Count; ++i) {
+        if (Scheduler->Entries[i].Context != Context) {
+            Scheduler->Entries[count++] = Scheduler->Entries[i];
+        }
+    }
+
+    removed = Scheduler->Count - count;
+    Scheduler->Count = count;
+
+    if (!removed) {
+        return 0;
+    }
+
+    if (!count) {
+        Scheduler->Sequence = 0;
+    }
+
+    for (ULONG i = count / 2; i--; ) {
+        MCBA_TX_SCHEDULER_ENTRY entry = Scheduler->Entries[i];
+
+        McbaTxSchedulerSiftDown(Scheduler, i, count, &entry);
+    }
+
+    return removed;
+}
+
+EXTERN_C_END
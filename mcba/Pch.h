@@ -33,6 +33,15 @@
 #include "Trace.h"
 #include "Mcba.h"
 #include "McbaDriverInterface.h"
+#include "McbaCodec.h"
+#include "McbaRing.h"
+#include "McbaFilter.h"
+#include "McbaClock.h"
+#include "McbaTxScheduler.h"
+#include "McbaHistogram.h"
+#include "McbaSeqLock.h"
+#include "McbaBusLoad.h"
+#include "McbaTxEcho.h"
 #include "Driver.h"
 #include "Queue.h"
 #include "Device.h"
@@ -34,7 +34,20 @@ McbaStartBatchWrite(
     _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
     _In_ WDFREQUEST Request,
     _In_reads_(Count) const MCBA_CAN_MSG* Msg,
-    _In_ MCBA_USB_REQUEST_INDEX_TYPE Count
+    _In_ size_t Count
+);
+
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaRunBatchWrite(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_reads_(Count) const MCBA_CAN_MSG* Msg,
+    _In_ size_t Count,
+    _In_ MCBA_USB_REQUEST_INDEX_TYPE UsbRequestCount,
+    _In_reads_(UsbRequestCount) const MCBA_USB_REQUEST_INDEX_TYPE* UsbRequestIndices
 );
 
 static
@@ -47,6 +60,16 @@ McbaStandaloneUsbRequest(
     _In_ const struct mcba_usb_msg* Msg
 );
 
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaSendStandaloneUsbRequest(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ MCBA_USB_REQUEST_INDEX_TYPE Index
+);
+
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, McbaQueueInitialize)
@@ -119,6 +142,38 @@ McbaQueueInitialize(
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "%!FUNC! WdfDeviceConfigureRequestDispatching failed with %!STATUS!\n", status);
         goto Exit;
     }
+
+    // writes waiting for space in the TX queue, the framework handles cancellation
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+    queueConfig.PowerManaged = WdfFalse;
+
+    status = WdfIoQueueCreate(
+        Device,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &pDeviceContext->PendingWrites
+    );
+
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "%!FUNC! WdfIoQueueCreate failed %!STATUS!", status);
+        goto Exit;
+    }
+
+    // writes and control requests waiting for pool requests, served as they return
+    WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+    queueConfig.PowerManaged = WdfFalse;
+
+    status = WdfIoQueueCreate(
+        Device,
+        &queueConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &pDeviceContext->ParkedRequests
+    );
+
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "%!FUNC! WdfIoQueueCreate failed %!STATUS!", status);
+        goto Exit;
+    }
     
 Exit:
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "<-- %!FUNC! completed with status=%!STATUS!\n", status);
@@ -194,6 +249,16 @@ McbaUrbCompleted(
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
             "%!FUNC! write failed with status=%!STATUS!, UsbdStatus=0x%x\n",
             status, usbCompletionParams->UsbdStatus);
+        McbaTxEchoFailed(pDeviceContext, index);
+    }
+    else {
+        McbaTxEchoWritten(pDeviceContext, index);
+        McbaBusLoadCountWritten(pDeviceContext, index, 1);
+    }
+
+    // the request may have carried a command
+    if (MBCA_CMD_TRANSMIT_MESSAGE_EV == pDeviceContext->UsbRequests.Messages[index].Msg[0].cmd_id) {
+        McbaFileCountTxFrames(pDeviceContext, McbaFileGetContext(WdfRequestGetFileObject(userRequest)), NT_SUCCESS(status) ? 1 : 0, NT_SUCCESS(status) ? 0 : 1);
     }
 
     bytesWritten = 0;
@@ -201,6 +266,7 @@ McbaUrbCompleted(
 
     McbaUsbRequestsReuse(&pDeviceContext->UsbRequests, 1, &index);
     McbaUsbRequestsFree(&pDeviceContext->UsbRequests, 1, &index);
+    McbaTxQueueDrain(pDeviceContext);
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "<-- %!FUNC! Request 0x%p index=%u completed with status=%!STATUS! bytes transferred=%u\n", userRequest, index, status, (unsigned)bytesWritten);    
 }
@@ -213,100 +279,266 @@ McbaRead(
     WDFREQUEST Request,
     size_t Length,
     BOOLEAN readAll,
-    BOOLEAN nonBlocking
+    BOOLEAN nonBlocking,
+    BOOLEAN moderated
 )
 {
-    NTSTATUS status;
+    NTSTATUS status = STATUS_SUCCESS;
     PMCBA_FILE_CONTEXT pFileContext;
     size_t count;
     ULONG_PTR transferred = 0;
-    PMCBA_CAN_MSG_DATA pData;
+    PVOID pData = NULL;
+    size_t recordSize;
+    ULONG format;
     WDFFILEOBJECT fileObject;
-    PMCBA_DEVICE_CONTEXT pDeviceContext;
-
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! Request=0x%p bytes=%u all=%d, nonblocking=%d\n", Request, (unsigned)Length, readAll, nonBlocking);
-
-    count = Length / sizeof(MCBA_CAN_MSG_DATA);
-    if (Length != count * sizeof(MCBA_CAN_MSG_DATA)) {
+    PMCBA_REQUEST_CONTEXT pReadContext;
+    BOOLEAN completeRequest = TRUE;
+    BOOLEAN mapped;
+    BOOLEAN wait;
+    size_t read = 0;
+    size_t threshold;
+    ULONGLONG timeout = 0;
+    KIRQL irql;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! Request=0x%p bytes=%u all=%d, nonblocking=%d moderated=%d\n", Request, (unsigned)Length, readAll, nonBlocking, moderated);
+
+    fileObject = WdfRequestGetFileObject(Request);
+    pFileContext = McbaFileGetContext(fileObject);
+
+    // the request sticks to the format it saw here
+    format = pFileContext->RxRecordFormat;
+    recordSize = McbaRxRecordSize(format);
+
+    count = Length / recordSize;
+    if (Length != count * recordSize) {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
-            "%!FUNC! payload of length=%u is not a multiple of %u=sizeof(MCBA_CAN_MSG_DATA)\n",
-            (unsigned)Length, (unsigned)sizeof(MCBA_CAN_MSG_DATA));
+            "%!FUNC! payload of length=%u is not a multiple of %u=record size\n",
+            (unsigned)Length, (unsigned)recordSize);
         status = STATUS_INVALID_PARAMETER;
         goto Complete;
     }
 
-    status = WdfRequestRetrieveOutputBuffer(Request, Length, &pData, NULL);
-    if (!NT_SUCCESS(status)) {
-        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
-            "%!FUNC! WdfRequestRetrieveOutputBuffer failed with status=%!STATUS!\n", status);
-        goto Complete;
+    // readers of a mapped ring don't need to pass a buffer
+    if (count) {
+        status = WdfRequestRetrieveOutputBuffer(Request, Length, &pData, NULL);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveOutputBuffer failed with status=%!STATUS!\n", status);
+            goto Complete;
+        }
     }
 
-    if (count) {
+    KeAcquireSpinLock(&pFileContext->ReadLock, &irql);
 
-        fileObject = WdfRequestGetFileObject(Request);
-        pDeviceContext = McbaDeviceGetContext(WdfFileObjectGetDevice(fileObject));
-        pFileContext = McbaFileGetContext(fileObject);
-        KIRQL irql;
-        BOOLEAN completeRequest = TRUE;
-
-        KeAcquireSpinLock(&pFileContext->ReadLock, &irql);
-
-        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! %u buffers queued, want to read %u\n", (unsigned)pFileContext->ReadBuffersQueued, (unsigned)count);
-
-        for (size_t i = 0; i < count; ++i, ++pData, transferred += sizeof(*pData)) {
-            if (0 == pFileContext->ReadBuffersQueued) {
-                
-                if (nonBlocking) {
-                    break;
-                }
-
-                if (!readAll && i) {
-                    break;
-                }
-
-                if (pFileContext->PendingReadRequest) {
-                    status = STATUS_NOT_IMPLEMENTED;
-                }
-                else {
-                    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Making Request=0x%p cancelable\n", Request);
-                    status = WdfRequestMarkCancelableEx(Request, McbaCancelPendingReadRequest);
-                    if (NT_SUCCESS(status)) {
-                        pFileContext->PendingReadRequest = Request;
-                        pFileContext->PendingReadBuffer = pData;
-                        pFileContext->PendingReadOffset = i;
-                        pFileContext->PendingReadCount = readAll ? count : i + 1;
-                        completeRequest = FALSE;
-                    }                    
-                }
-                break;
-            }
+    // frames that complete the request, a mapped ring takes the place of the buffer
+    mapped = NULL != pFileContext->ReadRingRequest;
+    if (mapped) {
+        count = (size_t)pFileContext->ReadRingProducer.Mask + 1;
+        threshold = moderated ? count : 1;
+    }
+    else {
+        threshold = readAll || moderated ? count : min(count, (size_t)1);
+    }
 
-            NT_ASSERT(pFileContext->ReadBuffersQueued > 0);
-            --pFileContext->ReadBuffersQueued;
+    if (moderated && pFileContext->RxModeration.FrameCount) {
+        threshold = min(threshold, (size_t)pFileContext->RxModeration.FrameCount);
+    }
 
-            PLIST_ENTRY pEntry = RemoveHeadList(&pFileContext->ReadBuffersList);
-            NT_ASSERT(pEntry);
-            PMCBA_CAN_MSG_ITEM pItem = CONTAINING_RECORD(pEntry, MCBA_CAN_MSG_ITEM, ReadBuffers);
-            pData->Msg = pItem->Msg;
-            pData->SystemTimeReceived = pItem->Timestamp >> 1;
+    if (moderated) {
+        timeout = (ULONGLONG)pFileContext->RxModeration.TimeoutUs * 10;
+    }
 
-            ExInterlockedPushEntrySList(&pDeviceContext->MessageBuffersAvailable, &pItem->MessageBuffersAvailable, &pDeviceContext->MessageBuffersLock);
+    if (mapped) {
+        // consumed in user mode, only wait until there is enough to consume
+        wait = !nonBlocking && McbaRingProducerCount(&pFileContext->ReadRingProducer) < threshold;
+    }
+    else if (!nonBlocking && ReadNoFence(&pFileContext->PendingReadCount)) {
+        // earlier reads are still waiting, they get the next frames first
+        wait = TRUE;
+    }
+    else {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! %u buffers queued, want to read %u\n",
+            (unsigned)(pFileContext->ReadRing ? McbaRingCount(pFileContext->ReadRing) : McbaBroadcastRingCount(pFileContext->RxRing, pFileContext->ReadCursor)),
+            (unsigned)count);
+
+        // no queue holds more than the maximum depth, one read drains it
+        read = McbaFileReadCanRecords(
+            pFileContext,
+            format,
+            pData,
+            (ULONG)min(count, (size_t)MCBA_RX_QUEUE_MAX_DEPTH));
+        transferred = read * recordSize;
+        wait = read < threshold && !nonBlocking;
+
+        if (!wait) {
+            McbaFileCountRead(pFileContext, format, pData, read);
         }
+    }
 
-        KeReleaseSpinLock(&pFileContext->ReadLock, irql);
-
-        if (!completeRequest) {
-            goto Exit;
+    if (wait) {
+        pReadContext = McbaRequestGetContext(Request);
+        pReadContext->Buffer = pData;
+        pReadContext->RecordFormat = format;
+        pReadContext->Count = count;
+        pReadContext->Threshold = threshold;
+        pReadContext->Offset = read;
+        pReadContext->RingWait = mapped;
+        pReadContext->Timeout = timeout;
+        pReadContext->FirstFrameTime = 0;
+        pReadContext->QueuedTime = KeQueryInterruptTime();
+
+        // Full barrier, pairs with the one in McbaOnCanMsgsReceived. Either the
+        // producer sees the count or the service below sees the frames.
+        InterlockedIncrement(&pFileContext->PendingReadCount);
+
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Queuing Request=0x%p\n", Request);
+        status = WdfRequestForwardToIoQueue(Request, pFileContext->PendingReads);
+        if (NT_SUCCESS(status)) {
+            completeRequest = FALSE;
+        }
+        else {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "%!FUNC! WdfRequestForwardToIoQueue failed with status=%!STATUS!\n", status);
+            InterlockedDecrement(&pFileContext->PendingReadCount);
         }
     }
+
+    KeReleaseSpinLock(&pFileContext->ReadLock, irql);
+
+    if (!completeRequest) {
+        // picks up frames stored before the producer could see the request
+        McbaFileCompletePendingReadRequests(pFileContext);
+        goto Exit;
+    }
+
 Complete:
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! completed Request=0x%p with status=%!STATUS! can frames read=%u\n", Request, status, (unsigned)(transferred / sizeof(*pData)));
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! completed Request=0x%p with status=%!STATUS! can frames read=%u\n", Request, status, (unsigned)(transferred / recordSize));
     WdfRequestCompleteWithInformation(Request, status, transferred);
 Exit:
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "<-- %!FUNC!\n");
 }
 
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaWrite(
+    _In_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ size_t Length,
+    _In_ BOOLEAN NonBlocking
+)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PMCBA_CAN_MSG pMsgs = NULL;
+    size_t count;
+    ULONG written = 0;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! Request=0x%p bytes=%u nonblocking=%d\n", Request, (unsigned)Length, NonBlocking);
+
+    McbaRequestGetContext(Request)->Submitted = McbaQueryMonotonicTime();
+
+    count = Length / sizeof(*pMsgs);
+    if (Length != count * sizeof(*pMsgs)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+            "%!FUNC! payload of length=%u is not a multiple of %u=sizeof(MCBA_CAN_MSG)\n",
+            (unsigned)Length, (unsigned)sizeof(*pMsgs));
+        status = STATUS_INVALID_PARAMETER;
+        goto Complete;
+    }
+
+    if (count) {
+        status = WdfRequestRetrieveInputBuffer(Request, Length, &pMsgs, NULL);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed with status=%!STATUS!\n", status);
+            goto Complete;
+        }
+    }
+
+    status = McbaFileWriteCanMsgs(
+        DeviceContext,
+        McbaFileGetContext(WdfRequestGetFileObject(Request)),
+        Request,
+        pMsgs,
+        (ULONG)min(count, (size_t)MCBA_TX_QUEUE_CAPACITY), // more never fit
+        NonBlocking,
+        &written);
+    if (STATUS_PENDING == status) {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Request=0x%p waits for space\n", Request);
+        goto Exit;
+    }
+
+Complete:
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! completed Request=0x%p with status=%!STATUS! can frames queued=%u\n", Request, status, written);
+    WdfRequestCompleteWithInformation(Request, status, NT_SUCCESS(status) ? written * sizeof(*pMsgs) : 0);
+Exit:
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "<-- %!FUNC!\n");
+}
+
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaMapReadRing(
+    _In_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+)
+{
+    PMCBA_RING_MAP_REQUEST pMapRequest;
+    PMCBA_RING pRing;
+    ULONG capacity = MCBA_RING_MAP_DEFAULT_CAPACITY;
+    NTSTATUS status;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! Request=0x%p\n", Request);
+
+    if (UserMode != WdfRequestGetRequestorMode(Request)) {
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        goto Complete;
+    }
+
+    // the request is optional
+    status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pMapRequest), &pMapRequest, NULL);
+    if (NT_SUCCESS(status) && pMapRequest->Capacity) {
+        capacity = pMapRequest->Capacity;
+    }
+
+    if (capacity > MCBA_RING_MAP_MAX_CAPACITY || (capacity & (capacity - 1))) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "%!FUNC! invalid capacity %u\n", (unsigned)capacity);
+        status = STATUS_INVALID_PARAMETER;
+        goto Complete;
+    }
+
+    // locked by the I/O manager until the request completes
+    status = WdfRequestRetrieveOutputBuffer(Request, McbaRingSize(capacity), &pRing, NULL);
+    if (!NT_SUCCESS(status)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+            "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
+        goto Complete;
+    }
+
+    if ((ULONG_PTR)pRing & (MCBA_CACHE_LINE_SIZE - 1)) {
+        TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "%!FUNC! ring buffer not aligned\n");
+        status = STATUS_INVALID_PARAMETER;
+        goto Complete;
+    }
+
+    status = McbaFileMapReadRing(
+        DeviceContext,
+        McbaFileGetContext(WdfRequestGetFileObject(Request)),
+        Request,
+        pRing,
+        capacity);
+    if (STATUS_PENDING == status) {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Request=0x%p holds the mapped ring\n", Request);
+        goto Exit;
+    }
+
+Complete:
+    WdfRequestComplete(Request, status);
+Exit:
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "<-- %!FUNC! Request=0x%p status=%!STATUS!\n", Request, status);
+}
+
 _Use_decl_annotations_
 VOID
 McbaEvtIoDeviceControl(
@@ -347,8 +579,7 @@ McbaEvtIoDeviceControl(
             .cmd_id = MBCA_CMD_CHANGE_BIT_RATE
         };
 
-        const UINT16 bitrateKbpsBe = pDeviceContext->BigEndianToHost((UINT16)(*pBitrate / 1000));
-        RtlCopyMemory(&usb_msg.bitrate, &bitrateKbpsBe, 2);
+        McbaCodecWriteBigEndian16(&usb_msg.bitrate, (UINT16)(*pBitrate / 1000));
         McbaStandaloneUsbRequest(pDeviceContext, Request, (const struct mcba_usb_msg*)&usb_msg);
         pending = TRUE;
     } break;
@@ -361,7 +592,7 @@ McbaEvtIoDeviceControl(
                 "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
             break;
         }
-        *pBitrate = pDeviceContext->DeviceStatus.Bitrate;
+        *pBitrate = (MCBA_BITRATE)ReadNoFence((volatile LONG*)&pDeviceContext->DeviceStatus.Bitrate);
         information = sizeof(*pBitrate);
     } break;
     case MCBA_IOCTL_DEVICE_RESET: {
@@ -370,19 +601,21 @@ McbaEvtIoDeviceControl(
     } break;
     case MCBA_IOCTL_DEVICE_STATS_CLEAR: {
         TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_DEVICE_STATS_CLEAR\n");
-        RtlZeroMemory(&pDeviceContext->DeviceStatus.Stats, sizeof(pDeviceContext->DeviceStatus.Stats));
+        McbaClearDeviceStats(pDeviceContext);
         status = STATUS_SUCCESS;
     } break;
     case MCBA_IOCTL_DEVICE_STATS_GET: {
         TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_DEVICE_STATS_GET\n");
         PMCBA_DEVICE_STATS pStats;
+        MCBA_DEVICE_STATUS deviceStatus;
         status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*pStats), &pStats, &bufferSize);
         if (!NT_SUCCESS(status)) {
             TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
                 "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
             break;
         }
-        *pStats = pDeviceContext->DeviceStatus.Stats;
+        McbaGetDeviceStatus(pDeviceContext, &deviceStatus);
+        *pStats = deviceStatus.Stats;
         information = sizeof(*pStats);
     } break;
     case MCBA_IOCTL_DEVICE_STATUS_GET: {
@@ -394,9 +627,42 @@ McbaEvtIoDeviceControl(
                 "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
             break;
         }
-        *pStatus = pDeviceContext->DeviceStatus;
+        McbaGetDeviceStatus(pDeviceContext, pStatus);
         information = sizeof(*pStatus);
     } break;
+    case MCBA_IOCTL_DEVICE_BUS_LOAD_GET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_DEVICE_BUS_LOAD_GET\n");
+        PMCBA_BUS_LOAD pLoad;
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*pLoad), &pLoad, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+        McbaGetBusLoad(pDeviceContext, pLoad);
+        information = sizeof(*pLoad);
+    } break;
+    case MCBA_IOCTL_DEVICE_USB_REQUEST_POOL_GET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_DEVICE_USB_REQUEST_POOL_GET\n");
+        PMCBA_USB_REQUEST_POOL_STATS pPoolStats;
+        PMCBA_DEVICE_USB_REQUEST_DATA pPool = &pDeviceContext->UsbRequests;
+        KIRQL irql;
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*pPoolStats), &pPoolStats, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+        KeAcquireSpinLock(&pPool->Lock, &irql);
+        pPoolStats->Count = (UINT32)pPool->Count;
+        pPoolStats->Limit = (UINT32)pPool->Max;
+        pPoolStats->InUse = (UINT32)pPool->InUse;
+        pPoolStats->HighWater = (UINT32)pPool->HighWater;
+        pPoolStats->Allocations = (UINT64)pPool->Allocations;
+        pPoolStats->Exhausted = (UINT64)pPool->Exhausted;
+        KeReleaseSpinLock(&pPool->Lock, irql);
+        information = sizeof(*pPoolStats);
+    } break;
     case MCBA_IOCTL_DEVICE_TERMINATION_ENABLE: 
     case MCBA_IOCTL_DEVICE_TERMINATION_DISABLE: {
         TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_DEVICE_TERMINATION_ENABLE/DISABLE\n");
@@ -412,20 +678,339 @@ McbaEvtIoDeviceControl(
     case MCBA_IOCTL_HOST_CAN_FRAME_READ_AT_LEAST_ONE: {
         TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_CAN_FRAME_READ_AT_LEAST_ONE\n");
         pending = TRUE;
-        McbaRead(Request, OutputBufferLength, FALSE, FALSE);
+        McbaRead(Request, OutputBufferLength, FALSE, FALSE, FALSE);
     } break;
     case MCBA_IOCTL_HOST_CAN_FRAME_READ_NON_BLOCKING: {
         TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_CAN_FRAME_READ_NON_BLOCKING\n");
         pending = TRUE;
-        McbaRead(Request, OutputBufferLength, TRUE, TRUE);
+        McbaRead(Request, OutputBufferLength, TRUE, TRUE, FALSE);
+    } break;
+    case MCBA_IOCTL_HOST_CAN_FRAME_READ_MODERATED: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_CAN_FRAME_READ_MODERATED\n");
+        pending = TRUE;
+        McbaRead(Request, OutputBufferLength, FALSE, FALSE, TRUE);
+    } break;
+    case MCBA_IOCTL_HOST_CAN_FRAME_RING_MAP: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_CAN_FRAME_RING_MAP\n");
+        pending = TRUE;
+        McbaMapReadRing(pDeviceContext, Request);
+    } break;
+    case MCBA_IOCTL_HOST_CAN_FRAME_FILTER_SET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_CAN_FRAME_FILTER_SET\n");
+        PMCBA_CAN_FILTER pFilters = NULL;
+        size_t count = InputBufferLength / sizeof(*pFilters);
+        if (InputBufferLength != count * sizeof(*pFilters) || count > MCBA_CAN_FILTER_MAX_COUNT) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! input of length=%u is not a multiple of %u=sizeof(MCBA_CAN_FILTER) or too long\n",
+                (unsigned)InputBufferLength, (unsigned)sizeof(*pFilters));
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        if (count) {
+            status = WdfRequestRetrieveInputBuffer(Request, InputBufferLength, &pFilters, &bufferSize);
+            if (!NT_SUCCESS(status)) {
+                TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                    "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+                break;
+            }
+        }
+
+        status = McbaFileSetFilter(
+            pDeviceContext,
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            pFilters,
+            (ULONG)count);
+    } break;
+    case MCBA_IOCTL_HOST_RX_QUEUE_CONFIG_SET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_RX_QUEUE_CONFIG_SET\n");
+        PMCBA_RX_QUEUE_CONFIG pConfig;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pConfig), &pConfig, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileConfigureRxQueue(
+            pDeviceContext,
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            pConfig);
+    } break;
+    case MCBA_IOCTL_HOST_RX_MODERATION_SET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_RX_MODERATION_SET\n");
+        PMCBA_RX_MODERATION pModeration;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pModeration), &pModeration, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileSetRxModeration(
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            pModeration);
+    } break;
+    case MCBA_IOCTL_HOST_RX_RECORD_FORMAT_SET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_RX_RECORD_FORMAT_SET\n");
+        PULONG pFormat;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pFormat), &pFormat, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileSetRxRecordFormat(
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            *pFormat);
+    } break;
+    case MCBA_IOCTL_HOST_RX_TIMESTAMP_CLOCK_SET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_RX_TIMESTAMP_CLOCK_SET\n");
+        PULONG pClock;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pClock), &pClock, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileSetRxTimestampClock(
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            *pClock);
+    } break;
+    case MCBA_IOCTL_HOST_TX_PRIORITY_SET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_TX_PRIORITY_SET\n");
+        PULONG pPriority;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pPriority), &pPriority, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileSetTxPriority(
+            pDeviceContext,
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            *pPriority);
+    } break;
+    case MCBA_IOCTL_HOST_TX_ECHO_SET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_TX_ECHO_SET\n");
+        PULONG pEcho;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pEcho), &pEcho, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileSetTxEcho(
+            pDeviceContext,
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            *pEcho);
+    } break;
+    case MCBA_IOCTL_HOST_TX_LATENCY_SET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_TX_LATENCY_SET\n");
+        PMCBA_TX_LATENCY_CONFIG pConfig;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pConfig), &pConfig, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileSetTxLatency(
+            pDeviceContext,
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            pConfig);
+    } break;
+    case MCBA_IOCTL_HOST_TX_RESULTS_READ: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_TX_RESULTS_READ\n");
+        PMCBA_TX_RESULT pResults;
+        ULONG read;
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*pResults), &pResults, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileReadTxResults(
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            pResults,
+            (ULONG)min(bufferSize / sizeof(*pResults), (size_t)MCBA_TX_RESULTS_CAPACITY_MAX),
+            &read);
+        if (NT_SUCCESS(status)) {
+            information = read * sizeof(*pResults);
+        }
+    } break;
+    case MCBA_IOCTL_HOST_TX_LATENCY_GET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_TX_LATENCY_GET\n");
+        PMCBA_TX_LATENCY pLatency;
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*pLatency), &pLatency, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        McbaGetTxLatency(pDeviceContext, pLatency);
+        information = sizeof(*pLatency);
+    } break;
+    case MCBA_IOCTL_HOST_TX_LATENCY_CLEAR: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_TX_LATENCY_CLEAR\n");
+        McbaClearTxLatency(pDeviceContext);
+        status = STATUS_SUCCESS;
+    } break;
+    case MCBA_IOCTL_HOST_RX_LATENCY_SET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_RX_LATENCY_SET\n");
+        PULONG pFlags;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pFlags), &pFlags, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileSetRxLatency(McbaFileGetContext(WdfRequestGetFileObject(Request)), *pFlags);
+    } break;
+    case MCBA_IOCTL_HOST_RX_LATENCY_GET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_RX_LATENCY_GET\n");
+        PMCBA_RX_LATENCY_QUERY pQuery;
+        PMCBA_RX_LATENCY pLatency;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pQuery), &pQuery, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*pLatency), &pLatency, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileGetRxLatency(
+            pDeviceContext,
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            pQuery,
+            pLatency);
+        if (NT_SUCCESS(status)) {
+            information = sizeof(*pLatency);
+        }
+    } break;
+    case MCBA_IOCTL_HOST_RX_LATENCY_CLEAR: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_RX_LATENCY_CLEAR\n");
+        PULONG pScope;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pScope), &pScope, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileClearRxLatency(
+            pDeviceContext,
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            *pScope);
+    } break;
+    case MCBA_IOCTL_HOST_CYCLIC_FRAME_SET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_CYCLIC_FRAME_SET\n");
+        PMCBA_CYCLIC_FRAME pFrame;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pFrame), &pFrame, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileSetCyclicFrame(
+            pDeviceContext,
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            pFrame);
+    } break;
+    case MCBA_IOCTL_HOST_CYCLIC_FRAME_REMOVE: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_CYCLIC_FRAME_REMOVE\n");
+        PULONG pIndex;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pIndex), &pIndex, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileRemoveCyclicFrame(
+            pDeviceContext,
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            *pIndex);
+    } break;
+    case MCBA_IOCTL_HOST_CYCLIC_FRAME_STATS_GET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_CYCLIC_FRAME_STATS_GET\n");
+        PULONG pIndex;
+        PMCBA_CYCLIC_FRAME_STATS pStats;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(*pIndex), &pIndex, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveInputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*pStats), &pStats, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+
+        status = McbaFileGetCyclicFrameStats(
+            pDeviceContext,
+            McbaFileGetContext(WdfRequestGetFileObject(Request)),
+            *pIndex,
+            pStats);
+        if (NT_SUCCESS(status)) {
+            information = sizeof(*pStats);
+        }
     } break;
     case MCBA_IOCTL_HOST_CAN_FRAME_WRITE_AT_LEAST_ONE: {
         TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_CAN_FRAME_WRITE_AT_LEAST_ONE\n");
-        status = STATUS_NOT_IMPLEMENTED;
+        pending = TRUE;
+        McbaWrite(pDeviceContext, Request, InputBufferLength, FALSE);
     } break;
     case MCBA_IOCTL_HOST_CAN_FRAME_WRITE_NON_BLOCKING: {
         TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_CAN_FRAME_WRITE_NON_BLOCKING\n");
-        status = STATUS_NOT_IMPLEMENTED;
+        pending = TRUE;
+        McbaWrite(pDeviceContext, Request, InputBufferLength, TRUE);
+    } break;
+    case MCBA_IOCTL_HOST_FILE_STATS_CLEAR: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_FILE_STATS_CLEAR\n");
+        McbaFileClearStats(pDeviceContext, McbaFileGetContext(WdfRequestGetFileObject(Request)));
+        status = STATUS_SUCCESS;
+    } break;
+    case MCBA_IOCTL_HOST_FILE_STATS_GET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_FILE_STATS_GET\n");
+        PMCBA_FILE_STATS pStats;
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*pStats), &pStats, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+        McbaFileGetStats(McbaFileGetContext(WdfRequestGetFileObject(Request)), pStats);
+        information = sizeof(*pStats);
+    } break;
+    case MCBA_IOCTL_HOST_FILE_STATS_EX_GET: {
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! MCBA_IOCTL_HOST_FILE_STATS_EX_GET\n");
+        PMCBA_FILE_STATS_EX pStats;
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*pStats), &pStats, &bufferSize);
+        if (!NT_SUCCESS(status)) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
+                "%!FUNC! WdfRequestRetrieveOutputBuffer failed %!STATUS!\n", status);
+            break;
+        }
+        McbaFileGetStatsEx(McbaFileGetContext(WdfRequestGetFileObject(Request)), pStats);
+        information = sizeof(*pStats);
     } break;
     default:
         status = STATUS_INVALID_DEVICE_REQUEST;
@@ -500,7 +1085,7 @@ McbaEvtIoRead(
 {
     UNREFERENCED_PARAMETER(Queue);
 
-    McbaRead(Request, Length, TRUE, FALSE);
+    McbaRead(Request, Length, TRUE, FALSE, FALSE);
 }
 #if 0
 static
@@ -614,30 +1199,22 @@ McbaFinalizeBatchWrite(
     _Inout_ PMCBA_DEVICE_BATCH_REQUEST_DATA Header
 )
 {
-    NTSTATUS requestStatus = STATUS_SUCCESS;  
-    ULONG_PTR transferred = 0;
-    PMCBA_DEVICE_CONTEXT pDeviceContext;
+    PMCBA_DEVICE_CONTEXT pDeviceContext = Header->DeviceContext;
     WDFREQUEST request = Header->Request;
-    
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! Batch request=0x%p\n", Header);
-    pDeviceContext = McbaDeviceGetContext(WdfFileObjectGetDevice(WdfRequestGetFileObject(Header->Request)));
+    // frames up to the first failure went out
+    NTSTATUS requestStatus = Header->Failed < Header->Count ? Header->Status : STATUS_SUCCESS;
+    ULONG_PTR transferred = Header->Failed * sizeof(MCBA_CAN_MSG);
 
-    // collect status, bytes transfered of batch write
-    for (size_t i = 0; i < Header->Count; ++i) {
-        requestStatus = Header->UsbRequestStatuses[i];
-        if (!NT_SUCCESS(requestStatus)) {
-            break;
-        }
-
-        transferred += sizeof(MCBA_CAN_MSG);
-    }
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! Batch request=0x%p\n", Header);
 
+    McbaFileCountTxFrames(pDeviceContext, McbaFileGetContext(WdfRequestGetFileObject(request)), (ULONG)Header->Failed, (ULONG)(Header->Count - Header->Failed));
     WdfRequestCompleteWithInformation(request, requestStatus, transferred);
 
-    McbaUsbRequestsReuse(&pDeviceContext->UsbRequests, (MCBA_USB_REQUEST_INDEX_TYPE)Header->Count, Header->UsbRequestIndices);
-    McbaUsbRequestsFree(&pDeviceContext->UsbRequests, (MCBA_USB_REQUEST_INDEX_TYPE)Header->Count, Header->UsbRequestIndices);
+    McbaUsbRequestsReuse(&pDeviceContext->UsbRequests, Header->UsbRequestCount, Header->UsbRequestIndices);
+    McbaUsbRequestsFree(&pDeviceContext->UsbRequests, Header->UsbRequestCount, Header->UsbRequestIndices);
 
     ExInterlockedPushEntrySList(&pDeviceContext->BatchRequestDataListHeader, &Header->Next, &pDeviceContext->BatchRequestDataLock);
+    McbaTxQueueDrain(pDeviceContext);
 
     TraceEvents(
         TRACE_LEVEL_INFORMATION, 
@@ -649,6 +1226,133 @@ McbaFinalizeBatchWrite(
         (unsigned long)transferred);
 }
 
+// Drops a reference on the write, the last one completes it.
+static
+_IRQL_requires_same_
+VOID
+McbaReleaseBatchWrite(
+    _Inout_ PMCBA_DEVICE_BATCH_REQUEST_DATA Header
+)
+{
+    if (0 == InterlockedDecrement(&Header->References)) {
+        McbaFinalizeBatchWrite(Header);
+    }
+}
+
+// Marks a slot's transfer as done, recording the first frame that didn't go out.
+static
+_IRQL_requires_same_
+VOID
+McbaBatchWriteSlotDone(
+    _Inout_ PMCBA_DEVICE_BATCH_REQUEST_DATA Header,
+    _In_ MCBA_USB_REQUEST_INDEX_TYPE Slot,
+    _In_ NTSTATUS Status
+)
+{
+    KIRQL irql;
+
+    // before the slot is refilled
+    if (!NT_SUCCESS(Status)) {
+        McbaTxEchoFailed(Header->DeviceContext, Header->UsbRequestIndices[Slot]);
+    }
+
+    KeAcquireSpinLock(&Header->Lock, &irql);
+
+    if (!NT_SUCCESS(Status) && Header->FirstFrames[Slot] < Header->Failed) {
+        Header->Failed = Header->FirstFrames[Slot];
+        Header->Status = Status;
+    }
+
+    Header->Idle[Header->IdleCount++] = Slot;
+
+    KeReleaseSpinLock(&Header->Lock, irql);
+}
+
+static
+_IRQL_requires_same_
+VOID
+McbaUrbCompletedForCanFrameInBatch(
+    _In_
+    WDFREQUEST Request,
+    _In_
+    WDFIOTARGET Target,
+    _In_
+    PWDF_REQUEST_COMPLETION_PARAMS Params,
+    _In_
+    WDFCONTEXT Context
+);
+
+// Keeps the write's idle transfers busy with the next frames of its buffer.
+// Only one caller fills at a time so the frames go out in order, the others
+// leave their share to it. The caller must hold a reference on the write.
+static
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaFillBatchWrite(
+    _Inout_ PMCBA_DEVICE_BATCH_REQUEST_DATA Header
+)
+{
+    PMCBA_DEVICE_CONTEXT pDeviceContext = Header->DeviceContext;
+    UINT16 tag = McbaFileGetContext(WdfRequestGetFileObject(Header->Request))->TxEchoTag;
+    LONGLONG submitted = McbaRequestGetContext(Header->Request)->Submitted;
+    LONG requests = 1;
+
+    if (InterlockedIncrement(&Header->FillRequests) != 1) {
+        return;
+    }
+
+    do {
+        for (;;) {
+            MCBA_USB_REQUEST_INDEX_TYPE slot;
+            MCBA_USB_REQUEST_INDEX_TYPE usbIndex;
+            WDFREQUEST usbRequest;
+            UINT16 tags[MCBA_USB_TX_RECORDS_MAX];
+            LONGLONG submittedTimes[MCBA_USB_TX_RECORDS_MAX];
+            size_t first;
+            LONG frames;
+            NTSTATUS status;
+            KIRQL irql;
+
+            KeAcquireSpinLock(&Header->Lock, &irql);
+
+            // stop at the first failure, the frames behind it would go out of order
+            if (!Header->IdleCount || Header->Queued == Header->Count || Header->Failed < Header->Count) {
+                KeReleaseSpinLock(&Header->Lock, irql);
+                break;
+            }
+
+            slot = Header->Idle[--Header->IdleCount];
+            first = Header->Queued;
+            frames = (LONG)min((size_t)Header->FramesPerUsbRequest, Header->Count - first);
+            Header->Queued += frames;
+            Header->FirstFrames[slot] = first;
+
+            KeReleaseSpinLock(&Header->Lock, irql);
+
+            usbIndex = Header->UsbRequestIndices[slot];
+            usbRequest = pDeviceContext->UsbRequests.Requests[usbIndex];
+
+            for (LONG i = 0; i < frames; ++i) {
+                struct mcba_usb_msg_can* pCanMsg = (struct mcba_usb_msg_can*)&pDeviceContext->UsbRequests.Messages[usbIndex].Msg[i];
+                McbaCodecEncodeCanMsg(&Header->Msg[first + i], pCanMsg);
+                tags[i] = tag;
+                submittedTimes[i] = submitted;
+            }
+
+            // a transfer holds a reference until its completion routine ran
+            InterlockedIncrement(&Header->References);
+            McbaUsbRequestsReuse(&pDeviceContext->UsbRequests, 1, &usbIndex);
+            WdfRequestSetCompletionRoutine(usbRequest, McbaUrbCompletedForCanFrameInBatch, &Header->BatchIndices[slot]);
+            McbaTxEchoRecord(pDeviceContext, usbIndex, (ULONG)frames, tags, submittedTimes);
+            status = McbaUsbBulkWritePipeSendRecords(pDeviceContext, usbIndex, (ULONG)frames);
+            if (!NT_SUCCESS(status)) {
+                McbaBatchWriteSlotDone(Header, slot, status);
+                InterlockedDecrement(&Header->References); // never the last, the caller holds one
+            }
+        }
+    } while ((requests = InterlockedAdd(&Header->FillRequests, -requests)) != 0);
+}
 
 static
 _IRQL_requires_same_
@@ -667,22 +1371,29 @@ McbaUrbCompletedForCanFrameInBatch(
     NTSTATUS status = Params->IoStatus.Status;
     PWDF_USB_REQUEST_COMPLETION_PARAMS usbCompletionParams = Params->Parameters.Usb.Completion;
     size_t bytesWritten = usbCompletionParams->Parameters.PipeWrite.Length;
-    PMCBA_USB_REQUEST_INDEX_TYPE pIndex = (PMCBA_USB_REQUEST_INDEX_TYPE)Context;
-    const MCBA_USB_REQUEST_INDEX_TYPE index = *pIndex;
-    PMCBA_USB_REQUEST_INDEX_TYPE pFirst = pIndex - index;
+    PMCBA_USB_REQUEST_INDEX_TYPE pSlot = (PMCBA_USB_REQUEST_INDEX_TYPE)Context;
+    const MCBA_USB_REQUEST_INDEX_TYPE slot = *pSlot;
+    PMCBA_USB_REQUEST_INDEX_TYPE pFirst = pSlot - slot;
     PMCBA_DEVICE_BATCH_REQUEST_DATA pHeader = CONTAINING_RECORD(pFirst, MCBA_DEVICE_BATCH_REQUEST_DATA, BatchIndices);
+    // frames carried by this transfer
+    const size_t frames = min((size_t)pHeader->FramesPerUsbRequest, pHeader->Count - pHeader->FirstFrames[slot]);
 
     UNREFERENCED_PARAMETER(Request);
     UNREFERENCED_PARAMETER(Target);
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! header=0x%p index=%u written=%u status=%!STATUS!\n", pHeader, index, (unsigned)bytesWritten, status);
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! header=0x%p slot=%u written=%u status=%!STATUS!\n", pHeader, slot, (unsigned)bytesWritten, status);
 
     if (NT_SUCCESS(status)) {
-        if (bytesWritten != sizeof(struct mcba_usb_msg)) {
+        if (bytesWritten != frames * sizeof(struct mcba_usb_msg)) {
             TraceEvents(TRACE_LEVEL_WARNING, TRACE_QUEUE,
-                "%!FUNC! Incomplete write, expected %u=sizeof(struct mcba_usb_msg)\n", (unsigned)sizeof(struct mcba_usb_msg));
+                "%!FUNC! Incomplete write, expected %u=%u*sizeof(struct mcba_usb_msg)\n", (unsigned)(frames * sizeof(struct mcba_usb_msg)), (unsigned)frames);
             status = STATUS_DATA_ERROR;
         }
+        else {
+            // before the slot is refilled
+            McbaTxEchoWritten(pHeader->DeviceContext, pHeader->UsbRequestIndices[slot]);
+            McbaBusLoadCountWritten(pHeader->DeviceContext, pHeader->UsbRequestIndices[slot], (ULONG)frames);
+        }
     }
     else {
         TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE,
@@ -690,12 +1401,9 @@ McbaUrbCompletedForCanFrameInBatch(
             status, usbCompletionParams->UsbdStatus);
     }
 
-    pHeader->UsbRequestStatuses[index] = status;
-
-    LONG result = InterlockedDecrement(&pHeader->Pending);
-    if (0 == result) {
-        McbaFinalizeBatchWrite(pHeader);
-    }
+    McbaBatchWriteSlotDone(pHeader, slot, status);
+    McbaFillBatchWrite(pHeader);
+    McbaReleaseBatchWrite(pHeader);
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "<-- %!FUNC!\n");
 }
@@ -707,14 +1415,13 @@ McbaStartBatchWrite(
     PMCBA_DEVICE_CONTEXT DeviceContext,
     WDFREQUEST Request,
     const MCBA_CAN_MSG* Msg,
-    MCBA_USB_REQUEST_INDEX_TYPE Count
+    size_t Count
 )
 {
+    PMCBA_REQUEST_CONTEXT pContext = McbaRequestGetContext(Request);
+    MCBA_USB_REQUEST_INDEX_TYPE indices[MCBA_BATCH_WRITE_USB_REQUESTS_MAX];
+    const size_t framesPerUsbRequest = DeviceContext->TxPackFrames ? MCBA_USB_TX_RECORDS_MAX : 1;
     NTSTATUS status;
-    PMCBA_DEVICE_BATCH_REQUEST_DATA pData;
-    MCBA_USB_REQUEST_INDEX_TYPE sent = 0;
-
-    __analysis_assert(Count <= MCBA_MAX_WRITES);
 
     TraceEvents(
         TRACE_LEVEL_INFORMATION,
@@ -722,11 +1429,44 @@ McbaStartBatchWrite(
         "--> %!FUNC! Request=0x%p Msg=0x%p Count=%u\n",
         Request, Msg, (unsigned)Count);
 
+    // the write streams through a window of transfers, each one is
+    // refilled with the next frames as soon as it completes
+    pContext->Buffer = (PVOID)Msg;
+    pContext->Count = Count;
+    pContext->UsbRequestCount = (UINT8)min((Count + framesPerUsbRequest - 1) / framesPerUsbRequest, (size_t)MCBA_BATCH_WRITE_USB_REQUESTS_MAX);
+
+    status = McbaUsbRequestsAllocOrPark(DeviceContext, Request, indices);
+    if (NT_SUCCESS(status)) {
+        if (STATUS_PENDING != status) {
+            McbaRunBatchWrite(DeviceContext, Request, Msg, Count, pContext->UsbRequestCount, indices);
+        }
+    }
+    else {
+        WdfRequestCompleteWithInformation(Request, status, 0);
+    }
+}
+
+_Use_decl_annotations_
+static
+VOID
+McbaRunBatchWrite(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    WDFREQUEST Request,
+    const MCBA_CAN_MSG* Msg,
+    size_t Count,
+    MCBA_USB_REQUEST_INDEX_TYPE UsbRequestCount,
+    const MCBA_USB_REQUEST_INDEX_TYPE* UsbRequestIndices
+)
+{
+    PMCBA_DEVICE_BATCH_REQUEST_DATA pData;
+
     PSLIST_ENTRY pBatchRequestEntryLink = ExInterlockedPopEntrySList(&DeviceContext->BatchRequestDataListHeader, &DeviceContext->BatchRequestDataLock);
     if (!pBatchRequestEntryLink) {
         pData = (PMCBA_DEVICE_BATCH_REQUEST_DATA)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(MCBA_DEVICE_BATCH_REQUEST_DATA), POOL_TAG);
         if (!pData) {
+            McbaUsbRequestsFree(&DeviceContext->UsbRequests, UsbRequestCount, UsbRequestIndices);
             WdfRequestCompleteWithInformation(Request, STATUS_NO_MEMORY, 0);
+            McbaTxQueueDrain(DeviceContext);
             return;
         }
         
@@ -734,47 +1474,53 @@ McbaStartBatchWrite(
             pData->BatchIndices[i] = i;
         }
 
+        KeInitializeSpinLock(&pData->Lock);
+
         pBatchRequestEntryLink = &pData->Next;
     }
 
     pData = CONTAINING_RECORD(pBatchRequestEntryLink, MCBA_DEVICE_BATCH_REQUEST_DATA, Next);
-    
-    status = McbaUsbRequestsAlloc(&DeviceContext->UsbRequests, Count, pData->UsbRequestIndices);
-    if (!NT_SUCCESS(status)) {
-        ExInterlockedPushEntrySList(&DeviceContext->BatchRequestDataListHeader, &pData->Next, &DeviceContext->BatchRequestDataLock);
-        WdfRequestCompleteWithInformation(Request, status, 0);
-        return;
-    }
 
     pData->Request = Request;
-    pData->Count = (LONG)Count;
-    pData->Pending = (LONG)Count;
-
-
-    for (MCBA_USB_REQUEST_INDEX_TYPE i = 0; i < Count; ++i, ++Msg, ++sent) {
-        MCBA_USB_REQUEST_INDEX_TYPE usbIndex = pData->UsbRequestIndices[i];
-        WDFREQUEST usbRequest = DeviceContext->UsbRequests.Requests[usbIndex];
-        WdfRequestSetCompletionRoutine(usbRequest, McbaUrbCompletedForCanFrameInBatch, &pData->BatchIndices[i]);
-        struct mcba_usb_msg_can* pCanMsg = (struct mcba_usb_msg_can*)&DeviceContext->UsbRequests.Messages[usbIndex];
-        McbaFormatCanMessage(DeviceContext, Msg, pCanMsg);
-        pData->UsbRequestStatuses[i] = McbaUsbBulkWritePipeSend(DeviceContext, usbIndex);
-        if (!NT_SUCCESS(pData->UsbRequestStatuses[i])) {
-            break;
-        }
+    pData->DeviceContext = DeviceContext;
+    pData->Msg = Msg;
+    pData->Count = Count;
+    pData->Queued = 0;
+    pData->Failed = Count;
+    pData->Status = STATUS_SUCCESS;
+    pData->References = 1; // ours
+    pData->FillRequests = 0;
+    pData->FramesPerUsbRequest = DeviceContext->TxPackFrames ? MCBA_USB_TX_RECORDS_MAX : 1;
+    pData->UsbRequestCount = UsbRequestCount;
+    pData->IdleCount = UsbRequestCount;
+    RtlCopyMemory(pData->UsbRequestIndices, UsbRequestIndices, sizeof(*UsbRequestIndices) * UsbRequestCount);
+
+    for (MCBA_USB_REQUEST_INDEX_TYPE i = 0; i < UsbRequestCount; ++i) {
+        pData->Idle[i] = UsbRequestCount - 1 - i;
     }
 
-    if (sent) {
-        if (sent < Count) {
-            LONG result = InterlockedAdd(&pData->Pending, (LONG)sent - (LONG)Count);
-            if (0 == result) {
-                McbaFinalizeBatchWrite(pData);
-            }
-        }
+    McbaFillBatchWrite(pData);
+    McbaReleaseBatchWrite(pData);
+}
+
+_Use_decl_annotations_
+VOID
+McbaResumeParkedRequest(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    WDFREQUEST Request,
+    const MCBA_USB_REQUEST_INDEX_TYPE* Indices
+)
+{
+    PMCBA_REQUEST_CONTEXT pContext = McbaRequestGetContext(Request);
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! Request 0x%p\n", Request);
+
+    if (pContext->Buffer) {
+        McbaRunBatchWrite(DeviceContext, Request, (const MCBA_CAN_MSG*)pContext->Buffer, pContext->Count, pContext->UsbRequestCount, Indices);
     }
     else {
-        McbaFinalizeBatchWrite(pData);
+        McbaSendStandaloneUsbRequest(DeviceContext, Request, Indices[0]);
     }
-
 }
 
 _Use_decl_annotations_
@@ -795,6 +1541,8 @@ McbaEvtIoWrite(
         TRACE_QUEUE, 
         "--> %!FUNC! Request=0x%p Length=%u", Request, (unsigned)Length);
 
+    McbaRequestGetContext(Request)->Submitted = McbaQueryMonotonicTime();
+
     size_t count = Length / sizeof(*pMsg);
     if (Length != count * sizeof(*pMsg)) {
         TraceEvents(
@@ -806,17 +1554,6 @@ McbaEvtIoWrite(
         goto Error;
     }
 
-    if (count > MCBA_MAX_WRITES) {
-        TraceEvents(
-            TRACE_LEVEL_ERROR,
-            TRACE_QUEUE,
-            "%!FUNC! batch write size %u exceeds max batch write size %u\n",
-            (unsigned)Length, (unsigned)MCBA_MAX_WRITES);
-        status = STATUS_INVALID_PARAMETER;
-        goto Error;
-    }
-
-    
 
     status = WdfRequestRetrieveInputBuffer(Request, Length, &pMsg, NULL);
     if (!NT_SUCCESS(status)) {
@@ -824,6 +1561,14 @@ McbaEvtIoWrite(
         goto Error;
     }
 
+    for (size_t i = 0; i < count; ++i) {
+        if (pMsg[i].Dlc > MCBA_CAN_MAX_DLC) {
+            TraceEvents(TRACE_LEVEL_ERROR, TRACE_QUEUE, "%!FUNC! frame %u has DLC %u\n", (unsigned)i, (unsigned)pMsg[i].Dlc);
+            status = STATUS_INVALID_PARAMETER;
+            goto Error;
+        }
+    }
+
     pDeviceContext = McbaDeviceGetContext(WdfIoQueueGetDevice(Queue));
 
     switch (count) {
@@ -831,11 +1576,11 @@ McbaEvtIoWrite(
         goto Error;
     case 1: {
         struct mcba_usb_msg_can c;
-        McbaFormatCanMessage(pDeviceContext, pMsg, &c);
+        McbaCodecEncodeCanMsg(pMsg, &c);
         McbaStandaloneUsbRequest(pDeviceContext, Request, (const struct mcba_usb_msg*) &c);
     } break;
     default: {
-        McbaStartBatchWrite(pDeviceContext, Request, pMsg, (MCBA_USB_REQUEST_INDEX_TYPE)count);
+        McbaStartBatchWrite(pDeviceContext, Request, pMsg, count);
     } break;
     }
 
@@ -860,38 +1605,69 @@ McbaStandaloneUsbRequest(
     const struct mcba_usb_msg* Msg
 )
 {
-    MCBA_USB_REQUEST_INDEX_TYPE index;
+    PMCBA_REQUEST_CONTEXT pContext = McbaRequestGetContext(Request);
+    MCBA_USB_REQUEST_INDEX_TYPE indices[MCBA_BATCH_WRITE_USB_REQUESTS_MAX];
     NTSTATUS status;
 
     TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! Request 0x%p\n", Request);
-    
-    status = McbaUsbRequestsAlloc(&DeviceContext->UsbRequests, 1, &index);
-    if (!NT_SUCCESS(status)) {
-        goto Error;
+
+    // kept with the request in case it has to wait for a pool request
+    pContext->Buffer = NULL;
+    pContext->UsbMsg = *Msg;
+    pContext->UsbRequestCount = 1;
+
+    status = McbaUsbRequestsAllocOrPark(DeviceContext, Request, indices);
+    if (NT_SUCCESS(status)) {
+        if (STATUS_PENDING != status) {
+            McbaSendStandaloneUsbRequest(DeviceContext, Request, indices[0]);
+        }
+    }
+    else {
+        WdfRequestCompleteWithInformation(Request, status, 0);
+
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Request 0x%p completed with status=%!STATUS! bytes transferred=%u\n", Request, status, 0u);
     }
+}
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! index=%u\n", index);
+static
+_Use_decl_annotations_
+VOID
+McbaSendStandaloneUsbRequest(
+    PMCBA_DEVICE_CONTEXT DeviceContext,
+    WDFREQUEST Request,
+    MCBA_USB_REQUEST_INDEX_TYPE Index
+)
+{
+    PMCBA_REQUEST_CONTEXT pContext = McbaRequestGetContext(Request);
+    NTSTATUS status;
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "--> %!FUNC! Request 0x%p index=%u\n", Request, Index);
     
     // set context so we can complete the user request in McbaUrbCompleted
-    DeviceContext->UsbRequests.Contexts[index] = Request;
+    DeviceContext->UsbRequests.Contexts[Index] = Request;
     // copy the usb message for this request into the usb request memory
-    RtlCopyMemory(&DeviceContext->UsbRequests.Messages[index], Msg, sizeof(*Msg));
+    RtlCopyMemory(&DeviceContext->UsbRequests.Messages[Index], &pContext->UsbMsg, sizeof(pContext->UsbMsg));
     // set completion routine that will complete the user request and return the allocated usb request
-    WdfRequestSetCompletionRoutine(DeviceContext->UsbRequests.Requests[index], McbaUrbCompleted, ULongToPtr(index));
+    WdfRequestSetCompletionRoutine(DeviceContext->UsbRequests.Requests[Index], McbaUrbCompleted, ULongToPtr(Index));
 
-    status = McbaUsbBulkWritePipeSend(DeviceContext, index);
+    McbaTxEchoRecord(DeviceContext, Index, 1, &McbaFileGetContext(WdfRequestGetFileObject(Request))->TxEchoTag, &pContext->Submitted);
+    status = McbaUsbBulkWritePipeSend(DeviceContext, Index);
     if (!NT_SUCCESS(status)) {
-        McbaUsbRequestsFree(&DeviceContext->UsbRequests, 1, &index);
-        goto Error;
-    }
-Exit:
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "<-- %!FUNC! Request 0x%p pending on index %u\n", Request, index);
-    return;
+        McbaTxEchoFailed(DeviceContext, Index);
 
-Error:
-    WdfRequestCompleteWithInformation(Request, status, 0);
+        if (MBCA_CMD_TRANSMIT_MESSAGE_EV == pContext->UsbMsg.cmd_id) {
+            McbaFileCountTxFrames(DeviceContext, McbaFileGetContext(WdfRequestGetFileObject(Request)), 0, 1);
+        }
 
-    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Request 0x%p completed with status=%!STATUS! bytes transferred=%u\n", Request, status, 0u);
+        // formatted for the pipe, it has to be reset like in McbaUrbCompleted
+        McbaUsbRequestsReuse(&DeviceContext->UsbRequests, 1, &Index);
+        McbaUsbRequestsFree(&DeviceContext->UsbRequests, 1, &Index);
+        WdfRequestCompleteWithInformation(Request, status, 0);
+        McbaTxQueueDrain(DeviceContext);
 
-    goto Exit;
+        TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "%!FUNC! Request 0x%p completed with status=%!STATUS! bytes transferred=%u\n", Request, status, 0u);
+        return;
+    }
+
+    TraceEvents(TRACE_LEVEL_INFORMATION, TRACE_QUEUE, "<-- %!FUNC! Request 0x%p pending on index %u\n", Request, Index);
 }
\ No newline at end of file
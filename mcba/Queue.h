@@ -48,6 +48,17 @@ EVT_WDF_IO_QUEUE_IO_RESUME McbaEvtIoResume;
 EVT_WDF_IO_QUEUE_IO_READ McbaEvtIoRead;
 EVT_WDF_IO_QUEUE_IO_WRITE McbaEvtIoWrite;
 
+// Runs a request that waited in ParkedRequests with the pool requests
+// McbaServiceParkedRequests allocated for it.
+_IRQL_requires_same_
+_IRQL_requires_max_(DISPATCH_LEVEL)
+VOID
+McbaResumeParkedRequest(
+    _Inout_ PMCBA_DEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_reads_(MCBA_BATCH_WRITE_USB_REQUESTS_MAX) const MCBA_USB_REQUEST_INDEX_TYPE* Indices
+);
+
 
 
 EXTERN_C_END
@@ -0,0 +1,215 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Bus load meter of McbaBusLoad.h.
+ *
+ * Encodes random frames bit by bit, CRC and stuff bits included, to compare
+ * the stuff bits McbaCanFrameBits expects and allows at most with the real
+ * ones, for random payloads and for payloads of mostly zeros. Then times
+ * counting frames one by one into the meter and checks the load of a
+ * simulated bus that runs at a known utilization.
+ *
+ * Usage: BusLoadBench [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PerfCommon.h"
+#include "McbaBusLoad.h"
+
+#define BITRATE 500000
+
+typedef struct _BITS {
+    UINT8 Bits[160];
+    ULONG Count;
+} BITS, *PBITS;
+
+static
+void
+BitsPut(PBITS Bits, UINT32 Value, ULONG Width)
+{
+    while (Width--) {
+        Bits->Bits[Bits->Count++] = (UINT8)((Value >> Width) & 1);
+    }
+}
+
+/* Stuff bits of the frame from start of frame through the CRC. */
+static
+ULONG
+FrameStuffBits(const MCBA_CAN_MSG* Msg)
+{
+    BITS bits = { { 0 }, 0 };
+    const BOOLEAN rtr = 0 != (Msg->Id & MCBA_CAN_RTR_FLAG);
+    UINT32 crc = 0;
+    ULONG stuffed = 0;
+    ULONG run = 1;
+
+    BitsPut(&bits, 0, 1);
+    if (Msg->Id & MCBA_CAN_EFF_FLAG) {
+        BitsPut(&bits, (Msg->Id & MCBA_CAN_EFF_MASK) >> 18, 11);
+        BitsPut(&bits, 3, 2); // SRR, IDE
+        BitsPut(&bits, Msg->Id & 0x3ffff, 18);
+        BitsPut(&bits, rtr, 1);
+        BitsPut(&bits, 0, 2); // r1, r0
+    }
+    else {
+        BitsPut(&bits, Msg->Id & MCBA_CAN_SFF_MASK, 11);
+        BitsPut(&bits, rtr, 1);
+        BitsPut(&bits, 0, 2); // IDE, r0
+    }
+
+    BitsPut(&bits, Msg->Dlc, 4);
+    for (ULONG i = 0; !rtr && i < Msg->Dlc; ++i) {
+        BitsPut(&bits, Msg->Data[i], 8);
+    }
+
+    for (ULONG i = 0; i < bits.Count; ++i) {
+        const UINT32 next = bits.Bits[i] ^ ((crc >> 14) & 1);
+
+        crc = (crc << 1) & 0x7fff;
+        if (next) {
+            crc ^= 0x4599;
+        }
+    }
+
+    BitsPut(&bits, crc, 15);
+
+    // after 5 equal bits the stuff bit of the other level starts the next run
+    for (ULONG i = 1; i < bits.Count; ++i) {
+        run = bits.Bits[i] == bits.Bits[i - 1] ? run + 1 : 1;
+        if (5 == run) {
+            ++stuffed;
+            bits.Bits[i] ^= 1;
+            run = 1;
+        }
+    }
+
+    return stuffed;
+}
+
+static
+int
+CompareStuffing(const char* Name, UINT8 DataMask, size_t Frames)
+{
+    PERF_RANDOM random;
+    UINT64 actual = 0, expected = 0, worst = 0;
+    ULONG worstBits;
+    int failed = 0;
+
+    PerfRandomInit(&random, 7);
+
+    for (size_t i = 0; i < Frames; ++i) {
+        MCBA_CAN_MSG msg;
+        ULONG stuffed, fixed;
+
+        PerfRandomCanMsg(&random, &msg);
+        for (ULONG j = 0; j < MCBA_CAN_MAX_DLEN; ++j) {
+            msg.Data[j] &= DataMask;
+        }
+
+        // the frame without stuff bits
+        fixed = ((msg.Id & MCBA_CAN_EFF_FLAG) ? 67 : 47) + ((msg.Id & MCBA_CAN_RTR_FLAG) ? 0 : 8 * msg.Dlc);
+        stuffed = FrameStuffBits(&msg);
+
+        actual += stuffed;
+        expected += McbaCanFrameBits(msg.Id, msg.Dlc, &worstBits) - fixed;
+        worst += worstBits - fixed;
+
+        if (worstBits - fixed < stuffed) {
+            failed = 1;
+        }
+    }
+
+    printf("%-14s stuff bits per frame: actual %5.2f expected %5.2f worst case %5.2f\n",
+        Name, (double)actual / Frames, (double)expected / Frames, (double)worst / Frames);
+
+    return failed;
+}
+
+int
+main(int argc, char** argv)
+{
+    size_t frames = argc > 1 ? (size_t)strtoull(argv[1], NULL, 10) : 1000000;
+    static MCBA_BUS_LOAD_METER meter;
+    MCBA_BUS_LOAD load;
+    PERF_RANDOM random;
+    MCBA_CAN_MSG msg;
+    LONGLONG now = 1;
+    UINT64 busBits = 0;
+    ULONGLONG start, elapsed;
+    ULONG bits, worstBits;
+    int failed = 0;
+
+    if (!frames) {
+        fprintf(stderr, "usage: %s [frames]\n", argv[0]);
+        return 2;
+    }
+
+    failed |= CompareStuffing("random data", 0xff, frames / 10 + 1);
+    failed |= CompareStuffing("small values", 0x0f, frames / 10 + 1);
+    failed |= CompareStuffing("zero data", 0x00, frames / 10 + 1);
+
+    // a bus at half its bitrate: every frame is followed by as much idle time
+    McbaBusLoadMeterInit(&meter);
+    PerfRandomInit(&random, 11);
+
+    start = PerfNowNs();
+    for (size_t i = 0; i < frames; ++i) {
+        PerfRandomCanMsg(&random, &msg);
+        bits = McbaCanFrameBits(msg.Id, msg.Dlc, &worstBits);
+        McbaBusLoadMeterCount(&meter, now, i & 1, 1, bits, worstBits);
+        busBits += bits;
+        now += (LONGLONG)bits * 2 * 10000000 / BITRATE;
+    }
+    elapsed = PerfNowNs() - start;
+
+    McbaBusLoadMeterQuery(&meter, now, BITRATE, &load);
+
+    printf("counting %zu frames: %.1f ns per frame, %.1f s of bus time\n",
+        frames, (double)elapsed / frames, (double)now / 10000000);
+
+    for (ULONG i = 0; i < MCBA_BUS_LOAD_WINDOWS; ++i) {
+        const MCBA_BUS_LOAD_WINDOW* pWindow = &load.Windows[i];
+
+        printf("%6u ms window: %7u rx %7u tx  load %5.1f %%  worst case %5.1f %%\n",
+            (unsigned)pWindow->WindowMs,
+            (unsigned)pWindow->RxFrames,
+            (unsigned)pWindow->TxFrames,
+            pWindow->LoadPpm / 10000.0,
+            pWindow->LoadWorstPpm / 10000.0);
+
+        // one frame more or less at either end of the window
+        if (now / 10000000.0 > MCBA_BUS_LOAD_WINDOW_MS(i) / 1000.0 &&
+            (pWindow->LoadPpm < 490000 || pWindow->LoadPpm > 510000)) {
+            failed = 1;
+        }
+    }
+
+    if (failed) {
+        printf("FAILED\n");
+    }
+
+    return failed;
+}
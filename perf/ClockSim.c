@@ -0,0 +1,213 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Accuracy of the device clock model in McbaClock.h.
+ *
+ * Frames hit the bus at random times. The device stamps them with its own
+ * microsecond clock, which runs off by a fixed drift and wraps at 32 bit.
+ * Up to three frames travel in one bulk-IN transfer that completes on the
+ * next USB poll plus a random DPC latency. Each transfer is processed like
+ * McbaOnCanMsgsReceived does. The time of the completion (what every
+ * frame used to be stamped with) and the mapped device time are compared
+ * against the true bus time, absolutely and as distance to the previous
+ * frame.
+ *
+ * Usage: ClockSim [options]
+ *   -r rate         frames/s (2000)
+ *   -D ppm          drift of the device clock (50)
+ *   -p us           USB polling interval (1000)
+ *   -j us           mean DPC latency, exponential (100)
+ *   -w seconds      warm up excluded from the statistics (10)
+ *   -s seconds      simulated time (120)
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PerfCommon.h"
+#include "McbaClock.h"
+
+#define FRAMES_PER_TRANSFER 3
+
+typedef struct _ERRORS {
+    double* Values;
+    size_t Count;
+    size_t Capacity;
+} ERRORS;
+
+static
+void
+ErrorsAdd(ERRORS* Errors, double Value)
+{
+    if (Errors->Count == Errors->Capacity) {
+        Errors->Capacity = Errors->Capacity ? Errors->Capacity * 2 : 4096;
+        Errors->Values = realloc(Errors->Values, Errors->Capacity * sizeof(*Errors->Values));
+        if (!Errors->Values) {
+            abort();
+        }
+    }
+
+    Errors->Values[Errors->Count++] = fabs(Value);
+}
+
+static
+int
+CompareDouble(const void* Lhs, const void* Rhs)
+{
+    double l = *(const double*)Lhs, r = *(const double*)Rhs;
+    return l < r ? -1 : l > r;
+}
+
+static
+void
+ErrorsPrint(const char* Name, ERRORS* Errors)
+{
+    double sum = 0;
+
+    if (!Errors->Count) {
+        printf("%-28s no samples\n", Name);
+        return;
+    }
+
+    qsort(Errors->Values, Errors->Count, sizeof(*Errors->Values), CompareDouble);
+
+    for (size_t i = 0; i < Errors->Count; ++i) {
+        sum += Errors->Values[i];
+    }
+
+    printf("%-28s mean %8.1f us  p99 %8.1f us  max %8.1f us\n",
+        Name,
+        sum / Errors->Count / 10,
+        Errors->Values[(size_t)(Errors->Count * 0.99)] / 10,
+        Errors->Values[Errors->Count - 1] / 10);
+}
+
+static
+double
+RandomExponential(PPERF_RANDOM Random, double Mean)
+{
+    return -Mean * log(1 - PerfRandomUniform(Random));
+}
+
+int
+main(int argc, char** argv)
+{
+    double rate = 2000;
+    double driftPpm = 50;
+    double pollUs = 1000;
+    double dpcUs = 100;
+    double warmupS = 10;
+    double seconds = 120;
+    PERF_RANDOM random;
+    MCBA_CLOCK clock;
+    ERRORS completionAbs = { 0 }, modelAbs = { 0 }, completionDelta = { 0 }, modelDelta = { 0 };
+    double bus[FRAMES_PER_TRANSFER]; // 100 ns
+    double t = 0; // 100 ns
+    double previousBus = 0, previousCompletion = 0, previousModel = 0;
+    ULONG samples = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "r:D:p:j:w:s:h")) != -1) {
+        switch (opt) {
+        case 'r': rate = strtod(optarg, NULL); break;
+        case 'D': driftPpm = strtod(optarg, NULL); break;
+        case 'p': pollUs = strtod(optarg, NULL); break;
+        case 'j': dpcUs = strtod(optarg, NULL); break;
+        case 'w': warmupS = strtod(optarg, NULL); break;
+        case 's': seconds = strtod(optarg, NULL); break;
+        default:
+            fprintf(stderr, "usage: %s [-r rate] [-D ppm] [-p us] [-j us] [-w seconds] [-s seconds]\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (rate <= 0 || pollUs <= 0) {
+        fprintf(stderr, "rate and polling interval must be positive\n");
+        return 1;
+    }
+
+    PerfRandomInit(&random, 42);
+    McbaClockInit(&clock);
+
+    // start the device clock close to a wrap
+    const double deviceStartUs = 4294967296.0 - 5e6;
+
+    while (t < seconds * 1e7) {
+        ULONG count = 0;
+        double poll, completion;
+
+        // frames that are on the bus before the next poll travel together
+        t += RandomExponential(&random, 1e7 / rate);
+        poll = ceil(t / (pollUs * 10)) * pollUs * 10;
+        do {
+            bus[count++] = t;
+            t += RandomExponential(&random, 1e7 / rate);
+        } while (count < FRAMES_PER_TRANSFER && t < poll);
+        t = bus[count - 1];
+
+        completion = poll + RandomExponential(&random, dpcUs * 10);
+
+        ULONGLONG device[FRAMES_PER_TRANSFER];
+
+        for (ULONG i = 0; i < count; ++i) {
+            double us = deviceStartUs + bus[i] / 10 * (1 + driftPpm * 1e-6);
+            device[i] = McbaClockExtend(&clock, (ULONG)(ULONGLONG)fmod(us, 4294967296.0));
+        }
+
+        samples += McbaClockUpdate(&clock, device[count - 1], (LONGLONG)completion);
+
+        for (ULONG i = 0; i < count; ++i) {
+            double model = (double)McbaClockMap(&clock, device[i]);
+
+            if (bus[i] >= warmupS * 1e7) {
+                ErrorsAdd(&completionAbs, completion - bus[i]);
+                ErrorsAdd(&modelAbs, model - bus[i]);
+                ErrorsAdd(&completionDelta, (completion - previousCompletion) - (bus[i] - previousBus));
+                ErrorsAdd(&modelDelta, (model - previousModel) - (bus[i] - previousBus));
+            }
+
+            previousBus = bus[i];
+            previousCompletion = completion;
+            previousModel = model;
+        }
+    }
+
+    // the model's drift is host time per device time, the device running fast makes it negative
+    printf("%.0f frames/s, drift %.0f ppm, poll %.0f us, DPC %.0f us, %u samples, fitted drift %.1f ppm\n",
+        rate, driftPpm, pollUs, dpcUs, (unsigned)samples,
+        -(double)clock.Drift / 4294967296.0 / MCBA_CLOCK_NOMINAL_RATE * 1e6);
+    ErrorsPrint("completion time", &completionAbs);
+    ErrorsPrint("device time mapped", &modelAbs);
+    ErrorsPrint("completion time, delta", &completionDelta);
+    ErrorsPrint("device time mapped, delta", &modelDelta);
+
+    free(completionAbs.Values);
+    free(modelAbs.Values);
+    free(completionDelta.Values);
+    free(modelDelta.Values);
+
+    return 0;
+}
@@ -0,0 +1,203 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Compares the decoder in McbaCodec.h against the decode path the driver
+ * used before (run time endianness dispatch through a function pointer for
+ * each 16 bit field).
+ *
+ * Usage: CodecBench [transfers]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PerfCommon.h"
+#include "McbaCodec.h"
+
+#define RECORDS_PER_TRANSFER (MCBA_USB_RX_BUFF_SIZE / sizeof(struct mcba_usb_msg_can))
+
+static UINT16 Swap16(UINT16 value) { return McbaCodecByteSwap16(value); }
+static UINT16 Nop16(UINT16 value) { return value; }
+
+/* volatile so the compiler can't resolve the dispatch at compile time,
+ * same as in the driver which picked the function in McbaCreateDevice
+ */
+static UINT16 (* volatile BigEndianToHost)(UINT16);
+
+static
+UINT16
+LegacyReadUnalignedBigEndian16(const void* ptr)
+{
+    UINT16 x;
+    memcpy(&x, ptr, 2);
+    return BigEndianToHost(x);
+}
+
+static
+void
+LegacyDecodeCanMsg(const struct mcba_usb_msg_can* Msg, PMCBA_CAN_MSG Out)
+{
+    UINT16 sid = LegacyReadUnalignedBigEndian16(&Msg->sid);
+
+    if (sid & MCBA_SIDL_EXID_MASK) {
+        Out->Id = MCBA_CAN_EFF_FLAG;
+        Out->Id |= (sid & 0xffe0) << 13;
+        Out->Id |= (sid & 3) << 16;
+        Out->Id |= LegacyReadUnalignedBigEndian16(&Msg->eid);
+    } else {
+        Out->Id = (sid & 0xffe0) >> 5;
+    }
+
+    if (Msg->dlc & MCBA_DLC_RTR_MASK) {
+        Out->Id |= MCBA_CAN_RTR_FLAG;
+    }
+
+    Out->Dlc = Msg->dlc & MCBA_DLC_MASK;
+    if (Out->Dlc > MCBA_CAN_MAX_DLC) {
+        Out->Dlc = MCBA_CAN_MAX_DLC;
+    }
+
+    Out->Flags = 0;
+    memset(Out->Padding, 0, sizeof(Out->Padding));
+    memcpy(Out->Data, Msg->data, MCBA_CAN_MAX_DLC);
+}
+
+static
+size_t
+LegacyDecodeTransfer(const UINT8* Buffer, size_t Length, PMCBA_CAN_MSG Out)
+{
+    const struct mcba_usb_msg* pMsg = (const struct mcba_usb_msg*)Buffer;
+    size_t count = Length / sizeof(*pMsg);
+    size_t decoded = 0;
+
+    for (size_t i = 0; i < count; ++i, ++pMsg) {
+        if (MBCA_CMD_RECEIVE_MESSAGE == pMsg->cmd_id) {
+            LegacyDecodeCanMsg((const struct mcba_usb_msg_can*)pMsg, &Out[decoded++]);
+        }
+    }
+
+    return decoded;
+}
+
+/* like McbaUsbReaderCompletionRoutine */
+static
+size_t
+CodecDecodeTransfer(const UINT8* Buffer, size_t Length, PMCBA_CAN_MSG Out)
+{
+    const struct mcba_usb_msg_can* pMsg = (const struct mcba_usb_msg_can*)Buffer;
+    size_t count = Length / sizeof(*pMsg);
+    size_t decoded = 0;
+
+    for (size_t i = 0; i < count; ++i, ++pMsg) {
+        if (MBCA_CMD_RECEIVE_MESSAGE == pMsg->cmd_id) {
+            McbaCodecDecodeCanMsg(pMsg, &Out[decoded++]);
+        }
+    }
+
+    return decoded;
+}
+
+typedef size_t (*DECODE_FN)(const UINT8*, size_t, PMCBA_CAN_MSG);
+
+static
+double
+Run(const char* Name, DECODE_FN Decode, const UINT8* Transfers, size_t TransferCount, PMCBA_CAN_MSG Out, size_t* Frames)
+{
+    const int Rounds = 5;
+    double best = 0;
+
+    for (int r = 0; r < Rounds; ++r) {
+        size_t frames = 0;
+        ULONGLONG start = PerfNowNs();
+        for (size_t i = 0; i < TransferCount; ++i) {
+            frames += Decode(Transfers + i * MCBA_USB_RX_BUFF_SIZE, MCBA_USB_RX_BUFF_SIZE, Out + frames);
+        }
+        ULONGLONG elapsed = PerfNowNs() - start;
+        double rate = frames / (elapsed * 1e-9);
+        if (rate > best) {
+            best = rate;
+        }
+        *Frames = frames;
+    }
+
+    printf("%-8s %12.0f frames/s\n", Name, best);
+    return best;
+}
+
+int
+main(int argc, char** argv)
+{
+    size_t transferCount = argc > 1 ? strtoul(argv[1], NULL, 0) : 1u << 20;
+    UINT8* transfers = calloc(transferCount, MCBA_USB_RX_BUFF_SIZE);
+    size_t maxFrames = transferCount * RECORDS_PER_TRANSFER;
+    PMCBA_CAN_MSG expected = calloc(maxFrames, sizeof(*expected));
+    PMCBA_CAN_MSG actual = calloc(maxFrames, sizeof(*actual));
+    PERF_RANDOM rng;
+    size_t frames, legacyFrames;
+    int result = 0;
+
+    if (!transfers || !expected || !actual) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    BigEndianToHost = MCBA_BIG_ENDIAN ? Nop16 : Swap16;
+
+    PerfRandomInit(&rng, 0x4d434241);
+    for (size_t i = 0; i < transferCount; ++i) {
+        UINT8* transfer = transfers + i * MCBA_USB_RX_BUFF_SIZE;
+        for (size_t j = 0; j < RECORDS_PER_TRANSFER; ++j) {
+            MCBA_CAN_MSG msg;
+            struct mcba_usb_msg_can* record = (struct mcba_usb_msg_can*)transfer + j;
+
+            /* every 8th record is a keep alive to exercise the cmd_id dispatch */
+            if (0 == (PerfRandom(&rng) & 7)) {
+                record->cmd_id = MBCA_CMD_I_AM_ALIVE_FROM_CAN;
+                continue;
+            }
+
+            PerfRandomCanMsg(&rng, &msg);
+            McbaCodecEncodeCanMsg(&msg, record);
+            record->cmd_id = MBCA_CMD_RECEIVE_MESSAGE;
+        }
+    }
+
+    printf("%zu transfers of %u bytes, %zu records per transfer\n",
+        transferCount, (unsigned)MCBA_USB_RX_BUFF_SIZE, (size_t)RECORDS_PER_TRANSFER);
+
+    double legacy = Run("legacy", LegacyDecodeTransfer, transfers, transferCount, expected, &legacyFrames);
+    double codec = Run("codec", CodecDecodeTransfer, transfers, transferCount, actual, &frames);
+    if (frames != legacyFrames || memcmp(expected, actual, frames * sizeof(*actual))) {
+        fprintf(stderr, "codec decoder output differs from legacy decoder\n");
+        result = 1;
+    }
+
+    printf("codec vs legacy: %.2fx\n", codec / legacy);
+
+    free(actual);
+    free(expected);
+    free(transfers);
+
+    return result;
+}
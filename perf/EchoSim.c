@@ -0,0 +1,367 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Transmit confirmations of concurrent writers matched with their frames.
+ *
+ * Writers record the frames of a transfer in the driver's log
+ * (McbaTxEcho.h) and send it once they dropped the lock, so transfers of
+ * different writers reach the pipe in another order than they were
+ * recorded in. The device takes the transfers on the pipe in order and
+ * confirms their frames. Each writer puts its number into the first data byte and
+ * repeats IDs and payloads, frames of different writers never look
+ * alike. Some transfers fail, some confirmations get lost.
+ *
+ * Every confirmation has to find the entry of its writer and add its
+ * latencies to the histograms, every frame that was not confirmed has to
+ * be counted as unconfirmed exactly once. The run is
+ * repeated with the log trimmed the way the driver did before, dropping
+ * every entry older than the one matched, which shows what reordering
+ * did to it.
+ *
+ * Usage: EchoSim [options]
+ *   -w writers      handles writing concurrently (2)
+ *   -u requests     transfers on the pipe (4)
+ *   -P records      frames per transfer, 1..3 (1)
+ *   -f ppm          transfers that fail (1000)
+ *   -l ppm          confirmations that get lost (100)
+ *   -n frames       frames to send (1000000)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PerfCommon.h"
+#include "McbaCodec.h"
+#include "McbaHistogram.h"
+#include "McbaTxEcho.h"
+
+#define WRITERS_MAX 16
+#define USB_REQUESTS_MAX 64
+#define RECORDS_MAX (MCBA_USB_RX_BUFF_SIZE / sizeof(struct mcba_usb_msg))
+#define MATCH_WINDOW 16 /* oldest entries MatchOlder looked at */
+#define NONE ((ULONG)-1)
+#define STEP 1000 /* 100 ns, simulated time per transfer recorded, sent or completed */
+#define ON_BUS 500 /* 100 ns, from the completion of a transfer to the confirmation of its frames */
+
+typedef enum _POLICY {
+    POLICY_MATCHED,
+    POLICY_OLDER,
+} POLICY;
+
+static const char* const PolicyNames[] = { "matched", "older" };
+
+typedef struct _USB_REQUEST {
+    struct mcba_usb_msg_can Records[RECORDS_MAX];
+    ULONG Count;
+    ULONG Writer;
+    ULONG Position; /* like TxEchoPositions */
+} USB_REQUEST;
+
+typedef struct _OPTIONS {
+    ULONG Writers;
+    ULONG UsbRequests;
+    ULONG Pack;
+    ULONG FailPpm;
+    ULONG LostPpm;
+    ULONG Frames;
+} OPTIONS;
+
+typedef struct _STATS {
+    ULONG Frames;
+    ULONG Confirmations; /* arrived */
+    ULONG Matched; /* to their writer */
+    ULONG WrongWriter;
+    ULONG Unmatched;
+    ULONG Unconfirmed;
+    ULONG Failed; /* frames of transfers that failed */
+    ULONG Lost;
+    MCBA_LATENCY_HISTOGRAM WrittenToOnBus;
+    MCBA_LATENCY_HISTOGRAM SubmittedToOnBus;
+} STATS;
+
+/* McbaTxEchoMatch as the driver did before: entries before the one matched
+ * were dropped as failed.
+ */
+static
+BOOLEAN
+MatchOlder(PMCBA_TX_ECHO Echo, const MCBA_CAN_MSG* Msg, PMCBA_TX_ECHO_ENTRY Entry, PULONG Dropped)
+{
+    ULONG end = Echo->Tail + (Echo->Head - Echo->Tail < MATCH_WINDOW ? Echo->Head - Echo->Tail : MATCH_WINDOW);
+
+    for (ULONG i = Echo->Tail; i != end; ++i) {
+        PMCBA_TX_ECHO_ENTRY pEntry = McbaTxEchoEntry(Echo, i);
+
+        if (!memcmp(&pEntry->Msg, Msg, sizeof(*Msg))) {
+            *Entry = *pEntry;
+            *Dropped += i - Echo->Tail;
+            Echo->Tail = i + 1;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static
+void
+Record(PMCBA_TX_ECHO Echo, USB_REQUEST* Request, ULONG Index, LONGLONG Now, STATS* Stats)
+{
+    Request->Position = Echo->Head;
+
+    for (ULONG i = 0; i < Request->Count; ++i) {
+        PMCBA_TX_ECHO_ENTRY pEntry = McbaTxEchoAppend(Echo, Now, &Stats->Unconfirmed);
+
+        McbaCodecDecodeCanMsg(&Request->Records[i], &pEntry->Msg);
+        pEntry->Tag = (UINT16)(Request->Writer + 1);
+        pEntry->UsbRequest = Index;
+        pEntry->Submitted = Now;
+        pEntry->Written = 0;
+    }
+}
+
+/* like McbaTxEchoWritten */
+static
+void
+Written(PMCBA_TX_ECHO Echo, const USB_REQUEST* Request, ULONG Index, LONGLONG Now)
+{
+    ULONG position = Request->Position;
+
+    if ((LONG)(position - Echo->Tail) < 0) {
+        position = Echo->Tail;
+    }
+
+    for (ULONG i = position; i != Echo->Head; ++i) {
+        PMCBA_TX_ECHO_ENTRY pEntry = McbaTxEchoEntry(Echo, i);
+
+        if (pEntry->UsbRequest != Index || pEntry->Written) {
+            break;
+        }
+
+        pEntry->Written = Now;
+    }
+}
+
+static
+void
+Confirm(POLICY Policy, PMCBA_TX_ECHO Echo, const struct mcba_usb_msg_can* Record, ULONG Writer, LONGLONG Now, STATS* Stats)
+{
+    MCBA_TX_ECHO_ENTRY entry;
+    MCBA_CAN_MSG msg;
+    BOOLEAN found;
+
+    McbaCodecDecodeCanMsg(Record, &msg);
+    ++Stats->Confirmations;
+
+    if (POLICY_MATCHED == Policy) {
+        found = McbaTxEchoMatch(Echo, &msg, &entry);
+        Stats->Unconfirmed += McbaTxEchoExpire(Echo, Now);
+    }
+    else {
+        found = MatchOlder(Echo, &msg, &entry, &Stats->Unconfirmed);
+    }
+
+    if (!found) {
+        ++Stats->Unmatched;
+        return;
+    }
+
+    /* like McbaTxEchoConfirm, the frame went on the bus right after the transfer */
+    McbaHistogramRecord(&Stats->WrittenToOnBus, McbaHistogramSpanUs(entry.Written, Now + ON_BUS));
+    McbaHistogramRecord(&Stats->SubmittedToOnBus, McbaHistogramSpanUs(entry.Submitted, Now + ON_BUS));
+
+    if (entry.Tag != Writer + 1) {
+        ++Stats->WrongWriter;
+    }
+    else {
+        ++Stats->Matched;
+    }
+}
+
+static
+void
+Run(const OPTIONS* Options, POLICY Policy, STATS* Stats)
+{
+    static MCBA_TX_ECHO echo;
+    static USB_REQUEST requests[USB_REQUESTS_MAX + WRITERS_MAX];
+    ULONG idle[USB_REQUESTS_MAX + WRITERS_MAX];
+    ULONG pipe[USB_REQUESTS_MAX];
+    ULONG racing[WRITERS_MAX]; /* recorded, not yet sent, by writer */
+    ULONG idleCount = Options->UsbRequests + Options->Writers;
+    ULONG pipeHead = 0, pipeCount = 0, racingCount = 0;
+    LONGLONG now = 0;
+    PERF_RANDOM rng;
+
+    memset(Stats, 0, sizeof(*Stats));
+    McbaTxEchoInit(&echo);
+    PerfRandomInit(&rng, 0x4543);
+
+    for (ULONG i = 0; i < idleCount; ++i) {
+        idle[i] = i;
+    }
+
+    for (ULONG i = 0; i < Options->Writers; ++i) {
+        racing[i] = NONE;
+    }
+
+    while (Stats->Frames < Options->Frames || racingCount || pipeCount) {
+        ULONG writer = PerfRandom(&rng) % Options->Writers;
+
+        now += STEP;
+
+        /* the writer records a transfer, sends the one it recorded or the device takes the oldest on the pipe */
+        if (NONE == racing[writer] && Stats->Frames < Options->Frames && !(PerfRandom(&rng) % 3)) {
+            ULONG index = idle[--idleCount];
+            USB_REQUEST* request = &requests[index];
+
+            request->Writer = writer;
+            request->Count = 1 + PerfRandom(&rng) % Options->Pack;
+
+            for (ULONG i = 0; i < request->Count; ++i) {
+                MCBA_CAN_MSG msg;
+
+                memset(&msg, 0, sizeof(msg));
+                msg.Id = 0x100 + (PerfRandom(&rng) & 0x7);
+                msg.Dlc = 2;
+                msg.Data[0] = (UINT8)writer;
+                msg.Data[1] = (UINT8)(PerfRandom(&rng) & 0x3);
+                McbaCodecEncodeCanMsg(&msg, &request->Records[i]);
+            }
+
+            Record(&echo, request, index, now, Stats);
+            Stats->Frames += request->Count;
+            racing[writer] = index;
+            ++racingCount;
+        }
+        else if (NONE != racing[writer] && pipeCount < Options->UsbRequests && (PerfRandom(&rng) & 1)) {
+            pipe[(pipeHead + pipeCount++) % Options->UsbRequests] = racing[writer];
+            racing[writer] = NONE;
+            --racingCount;
+        }
+        else if (pipeCount) {
+            ULONG index = pipe[pipeHead];
+            USB_REQUEST* request = &requests[index];
+
+            pipeHead = (pipeHead + 1) % Options->UsbRequests;
+            --pipeCount;
+            idle[idleCount++] = index;
+
+            if (PerfRandom(&rng) % 1000000 < Options->FailPpm) {
+                Stats->Failed += request->Count;
+                if (POLICY_MATCHED == Policy) {
+                    Stats->Unconfirmed += McbaTxEchoFail(&echo, request->Position, index);
+                }
+
+                continue;
+            }
+
+            Written(&echo, request, index, now);
+
+            for (ULONG i = 0; i < request->Count; ++i) {
+                if (PerfRandom(&rng) % 1000000 < Options->LostPpm) {
+                    ++Stats->Lost;
+                    continue;
+                }
+
+                Confirm(Policy, &echo, &request->Records[i], request->Writer, now, Stats);
+            }
+        }
+    }
+
+    /* what is left times out */
+    if (POLICY_MATCHED == Policy) {
+        Stats->Unconfirmed += McbaTxEchoExpire(&echo, now + MCBA_TX_ECHO_TIMEOUT);
+    }
+    else {
+        Stats->Unconfirmed += echo.Head - echo.Tail;
+    }
+}
+
+static
+void
+Usage(const char* Name)
+{
+    fprintf(stderr, "Usage: %s [-w writers] [-u requests] [-P records] [-f ppm] [-l ppm] [-n frames]\n", Name);
+}
+
+int
+main(int argc, char** argv)
+{
+    OPTIONS options;
+    STATS stats;
+    int opt;
+    int rc = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.Writers = 2;
+    options.UsbRequests = 4;
+    options.Pack = 1;
+    options.FailPpm = 1000;
+    options.LostPpm = 100;
+    options.Frames = 1000000;
+
+    while ((opt = getopt(argc, argv, "w:u:P:f:l:n:h")) != -1) {
+        switch (opt) {
+        case 'w': options.Writers = strtoul(optarg, NULL, 0); break;
+        case 'u': options.UsbRequests = strtoul(optarg, NULL, 0); break;
+        case 'P': options.Pack = strtoul(optarg, NULL, 0); break;
+        case 'f': options.FailPpm = strtoul(optarg, NULL, 0); break;
+        case 'l': options.LostPpm = strtoul(optarg, NULL, 0); break;
+        case 'n': options.Frames = strtoul(optarg, NULL, 0); break;
+        default:
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!options.Writers || options.Writers > WRITERS_MAX ||
+        !options.UsbRequests || options.UsbRequests > USB_REQUESTS_MAX ||
+        !options.Pack || options.Pack > RECORDS_MAX || !options.Frames) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    printf("%u writers, %u transfers of 1..%u frame(s) on the pipe, %u ppm failed, %u ppm confirmations lost\n",
+        options.Writers, options.UsbRequests, options.Pack, options.FailPpm, options.LostPpm);
+    printf("%-8s %9s %9s %9s %9s %9s %11s %9s %9s %9s\n", "policy", "frames", "confirmed", "matched", "wrong", "unmatched", "unconfirmed", "expected", "latencies", "p99 us");
+
+    for (int policy = POLICY_MATCHED; policy <= POLICY_OLDER; ++policy) {
+        Run(&options, (POLICY)policy, &stats);
+
+        printf("%-8s %9u %9u %9u %9u %9u %11u %9u %9u %9u\n",
+            PolicyNames[policy], stats.Frames, stats.Confirmations, stats.Matched,
+            stats.WrongWriter, stats.Unmatched, stats.Unconfirmed, stats.Failed + stats.Lost,
+            (ULONG)stats.SubmittedToOnBus.Count, McbaHistogramPercentile(&stats.SubmittedToOnBus, 990000));
+
+        /* the driver's policy must get every confirmation back to its writer and into the histograms */
+        if (POLICY_MATCHED == policy &&
+            (stats.Matched != stats.Confirmations || stats.Unconfirmed != stats.Failed + stats.Lost ||
+             stats.SubmittedToOnBus.Count != stats.Confirmations || stats.WrittenToOnBus.Count != stats.Confirmations)) {
+            fprintf(stderr, "confirmations lost their writer or latency\n");
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
@@ -0,0 +1,467 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "McbaSim.h"
+#include "McbaCodec.h"
+#include "McbaTxScheduler.h"
+
+#define MCBA_SIM_RECORD_SIZE sizeof(struct mcba_usb_msg)
+
+/* CRC delimiter, ACK slot, ACK delimiter, EOF and interframe space */
+#define MCBA_SIM_FRAME_TRAILER_BITS (1 + 1 + 1 + 7 + 3)
+
+/* firmware version reported in the keep alives */
+#define MCBA_SIM_FW_MAJOR 2
+#define MCBA_SIM_FW_MINOR 3
+
+typedef struct _MCBA_SIM_BITS {
+    UINT8 Bits[160];
+    ULONG Count;
+} MCBA_SIM_BITS;
+
+static
+void
+McbaSimPushBits(MCBA_SIM_BITS* Bits, UINT32 Value, ULONG Count)
+{
+    while (Count--) {
+        Bits->Bits[Bits->Count++] = (Value >> Count) & 1;
+    }
+}
+
+ULONG
+McbaSimFrameBits(const MCBA_CAN_MSG* Msg)
+{
+    MCBA_SIM_BITS bits;
+    ULONG dataBytes = (Msg->Id & MCBA_CAN_RTR_FLAG) ? 0 : Msg->Dlc;
+    UINT32 rtr = (Msg->Id & MCBA_CAN_RTR_FLAG) ? 1 : 0;
+    UINT32 crc = 0;
+    ULONG stuffBits = 0;
+    ULONG run = 0;
+    UINT8 previous = 2;
+
+    bits.Count = 0;
+    McbaSimPushBits(&bits, 0, 1); /* SOF */
+
+    if (Msg->Id & MCBA_CAN_EFF_FLAG) {
+        McbaSimPushBits(&bits, (Msg->Id & MCBA_CAN_EFF_MASK) >> 18, 11);
+        McbaSimPushBits(&bits, 1, 1); /* SRR */
+        McbaSimPushBits(&bits, 1, 1); /* IDE */
+        McbaSimPushBits(&bits, Msg->Id & 0x3ffff, 18);
+        McbaSimPushBits(&bits, rtr, 1);
+        McbaSimPushBits(&bits, 0, 2); /* r1, r0 */
+    } else {
+        McbaSimPushBits(&bits, Msg->Id & MCBA_CAN_SFF_MASK, 11);
+        McbaSimPushBits(&bits, rtr, 1);
+        McbaSimPushBits(&bits, 0, 2); /* IDE, r0 */
+    }
+
+    McbaSimPushBits(&bits, Msg->Dlc, 4);
+
+    for (ULONG i = 0; i < dataBytes; ++i) {
+        McbaSimPushBits(&bits, Msg->Data[i], 8);
+    }
+
+    for (ULONG i = 0; i < bits.Count; ++i) {
+        UINT32 next = bits.Bits[i] ^ ((crc >> 14) & 1);
+        crc = (crc << 1) & 0x7fff;
+        if (next) {
+            crc ^= 0x4599;
+        }
+    }
+
+    McbaSimPushBits(&bits, crc, 15);
+
+    /* a stuff bit follows 5 equal bits and starts the next run */
+    for (ULONG i = 0; i < bits.Count; ++i) {
+        if (bits.Bits[i] == previous) {
+            if (++run == 5) {
+                ++stuffBits;
+                previous = !previous;
+                run = 1;
+            }
+        } else {
+            previous = bits.Bits[i];
+            run = 1;
+        }
+    }
+
+    return bits.Count + stuffBits + MCBA_SIM_FRAME_TRAILER_BITS;
+}
+
+static
+ULONGLONG
+McbaSimFrameNs(PMCBA_SIM Sim, const MCBA_CAN_MSG* Msg)
+{
+    return (McbaSimFrameBits(Msg) * 1000000000ull + Sim->Config.Bitrate - 1) / Sim->Config.Bitrate;
+}
+
+static
+void
+McbaSimGenerateRx(PMCBA_SIM Sim, ULONGLONG AfterNs)
+{
+    PMCBA_SIM_CONFIG config = &Sim->Config;
+    PMCBA_CAN_MSG msg = &Sim->NextRx.Msg;
+    UINT32 r = PerfRandom(&Sim->Random);
+
+    memset(msg, 0, sizeof(*msg));
+
+    if ((r % 100) < config->ExtendedPercent) {
+        msg->Id = MCBA_CAN_EFF_FLAG | (PerfRandom(&Sim->Random) & MCBA_CAN_EFF_MASK);
+    } else {
+        msg->Id = PerfRandom(&Sim->Random) & MCBA_CAN_SFF_MASK;
+    }
+
+    if (((r >> 8) % 100) < config->RemotePercent) {
+        msg->Id |= MCBA_CAN_RTR_FLAG;
+    }
+
+    if (config->Dlc >= 0) {
+        msg->Dlc = (UINT8)config->Dlc;
+    } else {
+        msg->Dlc = (UINT8)((r >> 16) % (MCBA_CAN_MAX_DLC + 1));
+    }
+
+    if (!(msg->Id & MCBA_CAN_RTR_FLAG)) {
+        for (UINT8 i = 0; i < msg->Dlc; ++i) {
+            msg->Data[i] = (UINT8)PerfRandom(&Sim->Random);
+        }
+    }
+
+    /* Poisson arrivals, a saturated bus always has a frame pending */
+    if (config->RxFrameRate < 0) {
+        AfterNs = ~0ull;
+    } else if (config->RxFrameRate > 0) {
+        double u = 1.0 - PerfRandomUniform(&Sim->Random);
+        AfterNs += (ULONGLONG)(-log(u) * 1e9 / config->RxFrameRate);
+    }
+
+    Sim->NextRx.ReadyNs = AfterNs;
+    Sim->NextRx.Tx = FALSE;
+}
+
+static
+struct mcba_usb_msg*
+McbaSimPushIn(PMCBA_SIM Sim)
+{
+    struct mcba_usb_msg* record;
+
+    if (Sim->InCount == Sim->InCapacity) {
+        return NULL;
+    }
+
+    record = &Sim->In[(Sim->InHead + Sim->InCount++) % Sim->InCapacity];
+    memset(record, 0, sizeof(*record));
+    return record;
+}
+
+/* device time stamp in microseconds, big endian */
+static
+void
+McbaSimStamp(struct mcba_usb_msg_can* Record, ULONGLONG Ns)
+{
+    UINT32 us = (UINT32)(Ns / 1000);
+
+    Record->timestamp[0] = (UINT8)(us >> 24);
+    Record->timestamp[1] = (UINT8)(us >> 16);
+    Record->timestamp[2] = (UINT8)(us >> 8);
+    Record->timestamp[3] = (UINT8)us;
+}
+
+static
+void
+McbaSimFrameDone(PMCBA_SIM Sim, PMCBA_SIM_FRAME Frame)
+{
+    struct mcba_usb_msg_can* record;
+
+    if (Frame->Tx) {
+        ULONGLONG latency = Frame->DoneNs - Frame->ReadyNs;
+
+        ++Sim->Stats.TxFrames;
+        Sim->Stats.TxLatencyNsSum += latency;
+        if (latency > Sim->Stats.TxLatencyNsMax) {
+            Sim->Stats.TxLatencyNsMax = latency;
+        }
+
+        if (Sim->TxDone) {
+            Sim->TxDone(Sim->TxDoneContext, Frame);
+        }
+
+        if (!Sim->Config.TxResponses) {
+            return;
+        }
+
+        record = (struct mcba_usb_msg_can*)McbaSimPushIn(Sim);
+        if (!record) {
+            return;
+        }
+
+        McbaCodecEncodeCanMsg(&Frame->Msg, record);
+        record->cmd_id = MBCA_CMD_TRANSMIT_MESSAGE_RSP;
+    } else {
+        ++Sim->Stats.RxFrames;
+
+        if (Sim->InFrames == Sim->Config.DeviceRxBufferFrames ||
+            !(record = (struct mcba_usb_msg_can*)McbaSimPushIn(Sim))) {
+            ++Sim->Stats.RxOverflow;
+            ++Sim->KeepAliveRxOverflow;
+            return;
+        }
+
+        ++Sim->InFrames;
+        McbaCodecEncodeCanMsg(&Frame->Msg, record);
+        record->cmd_id = MBCA_CMD_RECEIVE_MESSAGE;
+    }
+
+    McbaSimStamp(record, Frame->DoneNs);
+}
+
+static
+void
+McbaSimKeepAlive(PMCBA_SIM Sim)
+{
+    struct mcba_usb_msg_ka_can* can = (struct mcba_usb_msg_ka_can*)McbaSimPushIn(Sim);
+    struct mcba_usb_msg_ka_usb* usb = (struct mcba_usb_msg_ka_usb*)McbaSimPushIn(Sim);
+
+    if (can) {
+        ULONG overflow = Sim->KeepAliveRxOverflow;
+
+        can->cmd_id = MBCA_CMD_I_AM_ALIVE_FROM_CAN;
+        can->rx_buff_ovfl = (UINT8)(overflow > 255 ? 255 : overflow);
+        McbaCodecWriteBigEndian16(&can->can_bitrate, (UINT16)(Sim->Config.Bitrate / 1000));
+        Sim->KeepAliveRxLost += overflow - can->rx_buff_ovfl;
+        can->rx_lost = McbaCodecHostToLittleEndian16((UINT16)(Sim->KeepAliveRxLost > 0xffff ? 0xffff : Sim->KeepAliveRxLost));
+        can->soft_ver_major = MCBA_SIM_FW_MAJOR;
+        can->soft_ver_minor = MCBA_SIM_FW_MINOR;
+        Sim->KeepAliveRxOverflow = 0;
+        Sim->KeepAliveRxLost = 0;
+        ++Sim->Stats.KeepAlives;
+    }
+
+    if (usb) {
+        usb->cmd_id = MBCA_CMD_I_AM_ALIVE_FROM_USB;
+        usb->soft_ver_major = MCBA_SIM_FW_MAJOR;
+        usb->soft_ver_minor = MCBA_SIM_FW_MINOR;
+        ++Sim->Stats.KeepAlives;
+    }
+}
+
+void
+McbaSimConfigInit(PMCBA_SIM_CONFIG Config)
+{
+    memset(Config, 0, sizeof(*Config));
+    Config->Bitrate = 500000;
+    Config->RxFrameRate = 1000;
+    Config->ExtendedPercent = 25;
+    Config->RemotePercent = 5;
+    Config->Dlc = -1;
+    Config->DeviceRxBufferFrames = 64;
+    Config->DeviceTxBufferFrames = 16;
+    Config->KeepAliveIntervalUs = 1000000;
+    Config->NothingToSendIntervalUs = 0;
+    Config->TxResponses = FALSE;
+    Config->Seed = 0x4d434241;
+}
+
+int
+McbaSimInit(PMCBA_SIM Sim, const MCBA_SIM_CONFIG* Config)
+{
+    memset(Sim, 0, sizeof(*Sim));
+    Sim->Config = *Config;
+
+    if (!Sim->Config.Bitrate) {
+        return -1;
+    }
+
+    /* room for transmit responses and keep alives on top of the frames */
+    Sim->InCapacity = Config->DeviceRxBufferFrames + Config->DeviceTxBufferFrames + 16;
+    Sim->In = calloc(Sim->InCapacity, sizeof(*Sim->In));
+    Sim->Tx = calloc(Config->DeviceTxBufferFrames ? Config->DeviceTxBufferFrames : 1, sizeof(*Sim->Tx));
+    if (!Sim->In || !Sim->Tx) {
+        McbaSimFree(Sim);
+        return -1;
+    }
+
+    PerfRandomInit(&Sim->Random, Config->Seed);
+    Sim->NextKeepAliveNs = Config->KeepAliveIntervalUs * 1000ull;
+    Sim->NextNothingToSendNs = Config->NothingToSendIntervalUs * 1000ull;
+    McbaSimGenerateRx(Sim, 0);
+
+    return 0;
+}
+
+void
+McbaSimFree(PMCBA_SIM Sim)
+{
+    free(Sim->In);
+    free(Sim->Tx);
+    Sim->In = NULL;
+    Sim->Tx = NULL;
+}
+
+void
+McbaSimAdvance(PMCBA_SIM Sim, ULONGLONG NowNs)
+{
+    if (NowNs < Sim->NowNs) {
+        return;
+    }
+
+    for (;;) {
+        ULONGLONG start;
+        PMCBA_SIM_FRAME tx = Sim->TxCount ? &Sim->Tx[Sim->TxHead] : NULL;
+        BOOLEAN rxReady, txReady;
+
+        if (Sim->InFlightValid) {
+            if (Sim->InFlight.DoneNs > NowNs) {
+                break;
+            }
+
+            Sim->InFlightValid = FALSE;
+            McbaSimFrameDone(Sim, &Sim->InFlight);
+        }
+
+        start = Sim->NextRx.ReadyNs;
+        if (tx && tx->ReadyNs < start) {
+            start = tx->ReadyNs;
+        }
+
+        if (start < Sim->BusIdleNs) {
+            start = Sim->BusIdleNs;
+        }
+
+        if (start > NowNs) {
+            break;
+        }
+
+        rxReady = Sim->NextRx.ReadyNs <= start;
+        txReady = tx && tx->ReadyNs <= start;
+
+        if (txReady && (!rxReady || McbaTxArbitrationKey(&tx->Msg) <= McbaTxArbitrationKey(&Sim->NextRx.Msg))) {
+            Sim->InFlight = *tx;
+            Sim->TxHead = (Sim->TxHead + 1) % Sim->Config.DeviceTxBufferFrames;
+            --Sim->TxCount;
+        } else {
+            /* arrivals don't depend on when earlier frames made it onto the bus */
+            Sim->InFlight = Sim->NextRx;
+            McbaSimGenerateRx(Sim, Sim->Config.RxFrameRate > 0 ? Sim->NextRx.ReadyNs : start);
+        }
+
+        Sim->InFlight.DoneNs = start + McbaSimFrameNs(Sim, &Sim->InFlight.Msg);
+        Sim->InFlightValid = TRUE;
+        Sim->BusIdleNs = Sim->InFlight.DoneNs;
+        Sim->Stats.BusBusyNs += Sim->InFlight.DoneNs - start;
+    }
+
+    while (Sim->Config.KeepAliveIntervalUs && Sim->NextKeepAliveNs <= NowNs) {
+        McbaSimKeepAlive(Sim);
+        Sim->NextKeepAliveNs += Sim->Config.KeepAliveIntervalUs * 1000ull;
+    }
+
+    Sim->NowNs = NowNs;
+}
+
+size_t
+McbaSimReadTransfer(PMCBA_SIM Sim, ULONGLONG NowNs, void* Buffer, size_t Length)
+{
+    struct mcba_usb_msg* out = (struct mcba_usb_msg*)Buffer;
+    size_t records = 0;
+
+    McbaSimAdvance(Sim, NowNs);
+
+    /* the firmware stacks as many records as fit into the packet */
+    while (Sim->InCount && (records + 1) * MCBA_SIM_RECORD_SIZE <= Length) {
+        struct mcba_usb_msg* record = &Sim->In[Sim->InHead];
+
+        if (MBCA_CMD_RECEIVE_MESSAGE == record->cmd_id) {
+            --Sim->InFrames;
+        }
+
+        out[records++] = *record;
+        Sim->InHead = (Sim->InHead + 1) % Sim->InCapacity;
+        --Sim->InCount;
+    }
+
+    if (!records &&
+        Sim->Config.NothingToSendIntervalUs &&
+        Sim->NextNothingToSendNs <= NowNs &&
+        MCBA_SIM_RECORD_SIZE <= Length) {
+        memset(out, 0, sizeof(*out));
+        out->cmd_id = MBCA_CMD_NOTHING_TO_SEND;
+        records = 1;
+        Sim->NextNothingToSendNs = NowNs + Sim->Config.NothingToSendIntervalUs * 1000ull;
+    }
+
+    if (records) {
+        ++Sim->Stats.InTransfers;
+        Sim->Stats.InRecords += records;
+    }
+
+    return records * MCBA_SIM_RECORD_SIZE;
+}
+
+size_t
+McbaSimWriteTransfer(PMCBA_SIM Sim, ULONGLONG NowNs, const void* Buffer, size_t Length)
+{
+    const struct mcba_usb_msg* in = (const struct mcba_usb_msg*)Buffer;
+    const size_t records = Length / MCBA_SIM_RECORD_SIZE;
+    size_t accepted = 0;
+
+    McbaSimAdvance(Sim, NowNs);
+    ++Sim->Stats.OutTransfers;
+
+    for (size_t i = 0; i < records; ++i, ++in) {
+        switch (in->cmd_id) {
+        case MBCA_CMD_TRANSMIT_MESSAGE_EV:
+            if (Sim->TxCount == Sim->Config.DeviceTxBufferFrames) {
+                ++Sim->Stats.TxRejected;
+            } else {
+                PMCBA_SIM_FRAME frame = &Sim->Tx[(Sim->TxHead + Sim->TxCount++) % Sim->Config.DeviceTxBufferFrames];
+
+                McbaCodecDecodeCanMsg((const struct mcba_usb_msg_can*)in, &frame->Msg);
+                frame->ReadyNs = NowNs;
+                frame->Tx = TRUE;
+                ++accepted;
+            }
+            break;
+        case MBCA_CMD_CHANGE_BIT_RATE: {
+            UINT16 kbps = McbaCodecReadBigEndian16(&((const struct mcba_usb_msg_change_bitrate*)in)->bitrate);
+            if (kbps) {
+                Sim->Config.Bitrate = kbps * 1000u;
+            }
+        } break;
+        default:
+            break;
+        }
+    }
+
+    return accepted;
+}
+
+ULONG
+McbaSimTxSpace(const MCBA_SIM* Sim)
+{
+    return Sim->Config.DeviceTxBufferFrames - Sim->TxCount;
+}
@@ -0,0 +1,166 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Software stand-in for the Microchip CAN Bus Analyzer.
+ *
+ * The simulator models the CAN bus, the other nodes on the bus, and the
+ * device side of the USB bulk pipes. Time is simulated (nanoseconds) so
+ * runs are deterministic and independent of the speed of the host.
+ *
+ * - Frames from other nodes arrive at a configurable rate and ID/DLC mix
+ *   or back to back for a saturated bus.
+ * - Every frame occupies the bus for its real bit time including stuff
+ *   bits and interframe space.
+ * - Frames the host writes (MBCA_CMD_TRANSMIT_MESSAGE_EV) take part in
+ *   arbitration against traffic from other nodes.
+ * - Received frames, keep alives and MBCA_CMD_NOTHING_TO_SEND are stacked
+ *   into bulk-IN transfers the way the firmware does.
+ */
+
+#include "PerfCommon.h"
+#include "Mcba.h"
+
+typedef struct _MCBA_SIM_CONFIG {
+    ULONG Bitrate;                  /* bit/s */
+    double RxFrameRate;             /* frames/s sent by other nodes, 0 saturates the bus, < 0 disables */
+    ULONG ExtendedPercent;          /* share of frames with 29 bit ids */
+    ULONG RemotePercent;            /* share of remote frames */
+    LONG Dlc;                       /* fixed DLC or -1 for a random DLC */
+    ULONG DeviceRxBufferFrames;     /* device side receive FIFO, overflows are reported in keep alives */
+    ULONG DeviceTxBufferFrames;     /* device side transmit FIFO */
+    ULONG KeepAliveIntervalUs;
+    ULONG NothingToSendIntervalUs;  /* 0 disables MBCA_CMD_NOTHING_TO_SEND */
+    BOOLEAN TxResponses;            /* report MBCA_CMD_TRANSMIT_MESSAGE_RSP for transmitted frames */
+    UINT64 Seed;
+} MCBA_SIM_CONFIG, *PMCBA_SIM_CONFIG;
+
+typedef struct _MCBA_SIM_STATS {
+    ULONGLONG RxFrames;             /* frames from other nodes transmitted on the bus */
+    ULONGLONG RxOverflow;           /* frames dropped because the device receive FIFO was full */
+    ULONGLONG TxFrames;             /* host frames transmitted on the bus */
+    ULONGLONG TxRejected;           /* host frames dropped because the device transmit FIFO was full */
+    ULONGLONG TxLatencyNsSum;       /* write to end of frame on the bus */
+    ULONGLONG TxLatencyNsMax;
+    ULONGLONG BusBusyNs;
+    ULONGLONG InTransfers;
+    ULONGLONG InRecords;
+    ULONGLONG OutTransfers;
+    ULONGLONG KeepAlives;
+} MCBA_SIM_STATS, *PMCBA_SIM_STATS;
+
+typedef struct _MCBA_SIM_FRAME {
+    MCBA_CAN_MSG Msg;
+    ULONGLONG ReadyNs;
+    ULONGLONG DoneNs;
+    BOOLEAN Tx;
+} MCBA_SIM_FRAME, *PMCBA_SIM_FRAME;
+
+typedef struct _MCBA_SIM {
+    MCBA_SIM_CONFIG Config;
+    MCBA_SIM_STATS Stats;
+    PERF_RANDOM Random;
+    ULONGLONG NowNs;
+    ULONGLONG BusIdleNs;
+    ULONGLONG NextKeepAliveNs;
+    ULONGLONG NextNothingToSendNs;
+    MCBA_SIM_FRAME NextRx;
+    MCBA_SIM_FRAME InFlight;
+    BOOLEAN InFlightValid;
+    /* device -> host */
+    struct mcba_usb_msg* In;
+    ULONG InHead;
+    ULONG InCount;
+    ULONG InCapacity;
+    ULONG InFrames;
+    /* host -> bus */
+    PMCBA_SIM_FRAME Tx;
+    ULONG TxHead;
+    ULONG TxCount;
+    /* counters reported by the next MBCA_CMD_I_AM_ALIVE_FROM_CAN */
+    ULONG KeepAliveRxOverflow;
+    ULONG KeepAliveRxLost;
+    /* called for every host frame at the end of its transmission, optional */
+    void (*TxDone)(void* Context, const MCBA_SIM_FRAME* Frame);
+    void* TxDoneContext;
+} MCBA_SIM, *PMCBA_SIM;
+
+void
+McbaSimConfigInit(
+    _Out_ PMCBA_SIM_CONFIG Config
+);
+
+int
+McbaSimInit(
+    _Out_ PMCBA_SIM Sim,
+    _In_ const MCBA_SIM_CONFIG* Config
+);
+
+void
+McbaSimFree(
+    _Inout_ PMCBA_SIM Sim
+);
+
+/* Runs the bus up to NowNs. */
+void
+McbaSimAdvance(
+    _Inout_ PMCBA_SIM Sim,
+    _In_ ULONGLONG NowNs
+);
+
+/* Completes a bulk-IN request at NowNs. Returns the number of bytes
+ * stored in Buffer, 0 if the device has nothing to send.
+ */
+size_t
+McbaSimReadTransfer(
+    _Inout_ PMCBA_SIM Sim,
+    _In_ ULONGLONG NowNs,
+    _Out_writes_(Length) void* Buffer,
+    _In_ size_t Length
+);
+
+/* Consumes a bulk-OUT transfer at NowNs. Returns the number of CAN frames
+ * accepted into the device transmit FIFO.
+ */
+size_t
+McbaSimWriteTransfer(
+    _Inout_ PMCBA_SIM Sim,
+    _In_ ULONGLONG NowNs,
+    _In_reads_bytes_(Length) const void* Buffer,
+    _In_ size_t Length
+);
+
+/* Free slots in the device transmit FIFO. */
+ULONG
+McbaSimTxSpace(
+    _In_ const MCBA_SIM* Sim
+);
+
+/* Bits the frame occupies on the bus: stuffed SOF..CRC plus CRC delimiter,
+ * ACK, EOF and interframe space.
+ */
+ULONG
+McbaSimFrameBits(
+    _In_ const MCBA_CAN_MSG* Msg
+);
@@ -0,0 +1,102 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+/* Helpers shared by the user mode benchmarks and simulations in perf/. */
+
+#include <time.h>
+
+#include "McbaPortable.h"
+#include "McbaDriverInterface.h"
+
+typedef struct _PERF_RANDOM {
+    UINT64 State;
+} PERF_RANDOM, *PPERF_RANDOM;
+
+static
+inline
+ULONGLONG
+PerfNowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONGLONG)ts.tv_sec * 1000000000ull + (ULONGLONG)ts.tv_nsec;
+}
+
+static
+inline
+void
+PerfRandomInit(PPERF_RANDOM Random, UINT64 Seed)
+{
+    Random->State = Seed ? Seed : 0x9e3779b97f4a7c15ull;
+}
+
+/* xorshift64* */
+static
+inline
+UINT32
+PerfRandom(PPERF_RANDOM Random)
+{
+    UINT64 x = Random->State;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    Random->State = x;
+    return (UINT32)((x * 0x2545f4914f6cdd1dull) >> 32);
+}
+
+/* uniform in [0, 1) */
+static
+inline
+double
+PerfRandomUniform(PPERF_RANDOM Random)
+{
+    return PerfRandom(Random) * (1.0 / 4294967296.0);
+}
+
+/* Random frame, 1/4 extended, 1/16 remote. */
+static
+inline
+void
+PerfRandomCanMsg(PPERF_RANDOM Random, PMCBA_CAN_MSG Msg)
+{
+    UINT32 r = PerfRandom(Random);
+
+    memset(Msg, 0, sizeof(*Msg));
+
+    if (0 == (r & 3)) {
+        Msg->Id = MCBA_CAN_EFF_FLAG | (PerfRandom(Random) & MCBA_CAN_EFF_MASK);
+    } else {
+        Msg->Id = PerfRandom(Random) & MCBA_CAN_SFF_MASK;
+    }
+
+    if (0 == ((r >> 2) & 15)) {
+        Msg->Id |= MCBA_CAN_RTR_FLAG;
+    }
+
+    Msg->Dlc = (UINT8)((r >> 8) % (MCBA_CAN_MAX_DLC + 1));
+    for (UINT8 i = 0; i < Msg->Dlc; ++i) {
+        Msg->Data[i] = (UINT8)PerfRandom(Random);
+    }
+}
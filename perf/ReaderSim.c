@@ -0,0 +1,173 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Frames lost against the depth of the continuous reader.
+ *
+ * The simulated adapter fills its receive buffer from the bus. The host
+ * controller polls the bulk-IN endpoint while at least one read is
+ * pending; every packet completes one read. Completions run one after
+ * the other like the reader's DPC and return the read to the controller
+ * when done. Most take a few microseconds, now and then one stalls for
+ * a long time (another driver's DPC, an ISR storm). With one or two reads
+ * the controller runs dry during a stall and the device buffer overflows;
+ * every further read lets the device unload one more packet while the
+ * host is busy. Each read holds a single packet, so the depth only buys
+ * three frames of slack per read; the device buffer does the rest.
+ *
+ * The transfer size is not swept: the firmware sends at most three
+ * records per 64 byte packet and the short packet ends the transfer, so
+ * larger transfers carry the same frames.
+ *
+ * Usage: ReaderSim [options]
+ *   -b bitrate      bus bitrate in bit/s (1000000)
+ *   -r rate         frames/s from other nodes, 0 saturates (0)
+ *   -k frames       device receive buffer (64)
+ *   -p us           host controller polling interval (125)
+ *   -j us           mean completion time, exponential (20)
+ *   -S us           stall length (10000)
+ *   -P permille     share of completions that stall (0.5)
+ *   -D depth        largest depth to simulate (16)
+ *   -s seconds      simulated time per depth (20)
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PerfCommon.h"
+#include "McbaSim.h"
+
+#define MAX_DEPTH 64
+
+static
+double
+RandomExponential(PPERF_RANDOM Random, double Mean)
+{
+    return -Mean * log(1 - PerfRandomUniform(Random));
+}
+
+int
+main(int argc, char** argv)
+{
+    MCBA_SIM_CONFIG config;
+    double pollUs = 125;
+    double completionUs = 20;
+    double stallUs = 10000;
+    double stallPermille = 0.5;
+    double seconds = 20;
+    ULONG maxDepth = 16;
+    UINT8 buffer[MCBA_USB_RX_BUFF_SIZE];
+    int opt;
+
+    McbaSimConfigInit(&config);
+    config.Bitrate = 1000000;
+    config.RxFrameRate = 0;
+
+    while ((opt = getopt(argc, argv, "b:r:k:p:j:S:P:D:s:h")) != -1) {
+        switch (opt) {
+        case 'b': config.Bitrate = strtoul(optarg, NULL, 0); break;
+        case 'r': config.RxFrameRate = strtod(optarg, NULL); break;
+        case 'k': config.DeviceRxBufferFrames = strtoul(optarg, NULL, 0); break;
+        case 'p': pollUs = strtod(optarg, NULL); break;
+        case 'j': completionUs = strtod(optarg, NULL); break;
+        case 'S': stallUs = strtod(optarg, NULL); break;
+        case 'P': stallPermille = strtod(optarg, NULL); break;
+        case 'D': maxDepth = strtoul(optarg, NULL, 0); break;
+        case 's': seconds = strtod(optarg, NULL); break;
+        default:
+            fprintf(stderr, "usage: %s [-b bitrate] [-r rate] [-k frames] [-p us] [-j us] [-S us] [-P permille] [-D depth] [-s seconds]\n", argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (pollUs <= 0 || !maxDepth || maxDepth > MAX_DEPTH) {
+        fprintf(stderr, "polling interval must be positive, depth 1..%u\n", MAX_DEPTH);
+        return 1;
+    }
+
+    printf("%u bit/s, %s, device buffer %u frames, poll %.0f us, completion %.0f us, %.2f%% stall %.0f us\n",
+        config.Bitrate, config.RxFrameRate > 0 ? "rate limited" : "saturated",
+        config.DeviceRxBufferFrames, pollUs, completionUs, stallPermille / 10, stallUs);
+    printf("%5s %12s %10s %9s %11s\n", "depth", "rx frames", "overflow", "lost", "idle polls");
+
+    for (ULONG depth = 1; depth <= maxDepth; ++depth) {
+        MCBA_SIM sim;
+        PERF_RANDOM random;
+        // reads back at the controller, in completion order since completions are serialized
+        ULONGLONG resubmit[MAX_DEPTH];
+        ULONG resubmitHead = 0, resubmitCount = 0;
+        ULONG pending = depth;
+        ULONGLONG completionDoneNs = 0;
+        ULONGLONG idlePolls = 0;
+        ULONGLONG durationNs = (ULONGLONG)(seconds * 1e9);
+        ULONGLONG pollNs = (ULONGLONG)(pollUs * 1e3);
+
+        // same traffic and stalls for every depth
+        config.Seed = 42;
+        if (McbaSimInit(&sim, &config)) {
+            fprintf(stderr, "invalid simulator configuration\n");
+            return 1;
+        }
+
+        PerfRandomInit(&random, 7);
+
+        for (ULONGLONG now = 0; now < durationNs; now += pollNs) {
+            while (resubmitCount && resubmit[resubmitHead] <= now) {
+                resubmitHead = (resubmitHead + 1) % MAX_DEPTH;
+                --resubmitCount;
+                ++pending;
+            }
+
+            if (!pending) {
+                McbaSimAdvance(&sim, now);
+                ++idlePolls;
+                continue;
+            }
+
+            if (McbaSimReadTransfer(&sim, now, buffer, sizeof(buffer))) {
+                double ns = RandomExponential(&random, completionUs * 1e3);
+
+                if (PerfRandomUniform(&random) * 1000 < stallPermille) {
+                    ns += stallUs * 1e3;
+                }
+
+                completionDoneNs = (completionDoneNs > now ? completionDoneNs : now) + (ULONGLONG)ns;
+                resubmit[(resubmitHead + resubmitCount++) % MAX_DEPTH] = completionDoneNs;
+                --pending;
+            }
+        }
+
+        printf("%5u %12llu %10llu %8.3f%% %11llu\n",
+            (unsigned)depth,
+            (unsigned long long)sim.Stats.RxFrames,
+            (unsigned long long)sim.Stats.RxOverflow,
+            sim.Stats.RxFrames ? 100.0 * sim.Stats.RxOverflow / sim.Stats.RxFrames : 0.0,
+            (unsigned long long)idlePolls);
+
+        McbaSimFree(&sim);
+    }
+
+    return 0;
+}
@@ -0,0 +1,593 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Per handle receive queue: the LIST_ENTRY / SLIST pool implementation the
+ * driver used before against the McbaRing.h ring, read through the IOCTLs
+ * (copy under the file lock) or mapped into the reader (consumed in place
+ * without a lock, see MCBA_IOCTL_HOST_CAN_FRAME_RING_MAP).
+ *
+ * The list variant mirrors McbaAddCanMessageToFileReadQueue and McbaRead:
+ * per frame the file lock is taken, an item popped from the shared pool
+ * (itself behind a lock) and linked in; the reader unlinks items one at a
+ * time and returns them to the pool. The ring variant stores the frames of
+ * a transfer without a lock and the reader drains with up to two memcpys
+ * under the file lock.
+ *
+ * The broadcast variant is what the driver does now: one device wide
+ * MCBA_BROADCAST_RING the frames are stored in once, every handle only
+ * keeps a cursor (behind its file lock) so the producer's cost no longer
+ * grows with the number of handles.
+ *
+ * Single threaded the numbers show the cost per frame, threaded (one
+ * producer, one reader thread per handle) they include the cache traffic
+ * between producer and readers.
+ *
+ * Usage: RingBench [handles] [transfers]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PerfCommon.h"
+#include "McbaRing.h"
+
+#define QUEUE_CAPACITY 128
+#define BROADCAST_CAPACITY 1024
+#define FRAMES_PER_TRANSFER 3
+#define READ_BATCH 64
+#define POOL_ITEMS_PER_BLOCK (4096 / sizeof(LIST_ITEM))
+
+/* list implementation */
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY* Flink;
+    struct _LIST_ENTRY* Blink;
+} LIST_ENTRY;
+
+typedef struct _LIST_ITEM {
+    union {
+        struct _LIST_ITEM* PoolNext;
+        struct {
+            LIST_ENTRY ReadBuffers;
+            MCBA_CAN_MSG Msg;
+        };
+    };
+    ULONGLONG Timestamp;
+} LIST_ITEM;
+
+typedef struct _LIST_POOL {
+    pthread_spinlock_t Lock;
+    LIST_ITEM* Free;
+} LIST_POOL;
+
+typedef struct _LIST_QUEUE {
+    pthread_spinlock_t Lock;
+    LIST_ENTRY Head;
+    LONG Queued;
+    ULONGLONG Lost;
+} LIST_QUEUE;
+
+typedef struct _RING_QUEUE {
+    pthread_spinlock_t Lock;
+    PMCBA_RING Ring;
+    MCBA_RING_PRODUCER Producer;
+    BOOLEAN Mapped;
+    ULONGLONG Lost;
+} RING_QUEUE;
+
+static LIST_POOL Pool;
+
+static
+void
+ListPoolAdd(void)
+{
+    LIST_ITEM* items = calloc(POOL_ITEMS_PER_BLOCK, sizeof(*items));
+
+    if (!items) {
+        abort();
+    }
+
+    for (size_t i = 0; i < POOL_ITEMS_PER_BLOCK; ++i) {
+        items[i].PoolNext = Pool.Free;
+        Pool.Free = &items[i];
+    }
+}
+
+static
+LIST_ITEM*
+ListPoolPop(void)
+{
+    LIST_ITEM* item;
+
+    pthread_spin_lock(&Pool.Lock);
+    if (!Pool.Free) {
+        ListPoolAdd();
+    }
+
+    item = Pool.Free;
+    Pool.Free = item->PoolNext;
+    pthread_spin_unlock(&Pool.Lock);
+
+    return item;
+}
+
+static
+void
+ListPoolPush(LIST_ITEM* Item)
+{
+    pthread_spin_lock(&Pool.Lock);
+    Item->PoolNext = Pool.Free;
+    Pool.Free = Item;
+    pthread_spin_unlock(&Pool.Lock);
+}
+
+static
+void
+ListQueueInit(LIST_QUEUE* Queue)
+{
+    pthread_spin_init(&Queue->Lock, PTHREAD_PROCESS_PRIVATE);
+    Queue->Head.Flink = Queue->Head.Blink = &Queue->Head;
+    Queue->Queued = 0;
+    Queue->Lost = 0;
+}
+
+static
+void
+ListQueueWrite(LIST_QUEUE* Queue, const MCBA_CAN_MSG_DATA_EX* Msgs, ULONG Count)
+{
+    for (ULONG i = 0; i < Count; ++i) {
+        LIST_ITEM* item;
+
+        pthread_spin_lock(&Queue->Lock);
+        if (QUEUE_CAPACITY == Queue->Queued) {
+            LIST_ENTRY* entry = Queue->Head.Flink;
+            entry->Flink->Blink = &Queue->Head;
+            Queue->Head.Flink = entry->Flink;
+            item = (LIST_ITEM*)entry;
+            --Queue->Queued;
+            ++Queue->Lost;
+        } else {
+            item = ListPoolPop();
+        }
+
+        item->Msg = Msgs[i].Msg;
+        item->Timestamp = Msgs[i].SystemTimeReceived << 1;
+        item->ReadBuffers.Flink = &Queue->Head;
+        item->ReadBuffers.Blink = Queue->Head.Blink;
+        Queue->Head.Blink->Flink = &item->ReadBuffers;
+        Queue->Head.Blink = &item->ReadBuffers;
+        ++Queue->Queued;
+        pthread_spin_unlock(&Queue->Lock);
+    }
+}
+
+static
+ULONG
+ListQueueRead(LIST_QUEUE* Queue, PMCBA_CAN_MSG_DATA_EX Out, ULONG Count)
+{
+    ULONG i;
+
+    pthread_spin_lock(&Queue->Lock);
+    for (i = 0; i < Count && Queue->Queued; ++i) {
+        LIST_ENTRY* entry = Queue->Head.Flink;
+        LIST_ITEM* item = (LIST_ITEM*)entry;
+
+        entry->Flink->Blink = &Queue->Head;
+        Queue->Head.Flink = entry->Flink;
+        --Queue->Queued;
+
+        Out[i].Msg = item->Msg;
+        Out[i].SystemTimeReceived = item->Timestamp >> 1;
+        ListPoolPush(item);
+    }
+    pthread_spin_unlock(&Queue->Lock);
+
+    return i;
+}
+
+/* ring implementation, same locking as the driver */
+
+static
+void
+RingQueueInit(RING_QUEUE* Queue, BOOLEAN Mapped)
+{
+    pthread_spin_init(&Queue->Lock, PTHREAD_PROCESS_PRIVATE);
+    if (posix_memalign((void**)&Queue->Ring, MCBA_CACHE_LINE_SIZE, McbaRingSize(QUEUE_CAPACITY))) {
+        abort();
+    }
+
+    McbaRingInit(Queue->Ring, &Queue->Producer, QUEUE_CAPACITY);
+    Queue->Mapped = Mapped;
+    Queue->Lost = 0;
+}
+
+static
+void
+RingQueueWrite(RING_QUEUE* Queue, const MCBA_CAN_MSG_DATA_EX* Msgs, ULONG Count)
+{
+    ULONG written = McbaRingWrite(&Queue->Producer, Msgs, Count);
+
+    if (written < Count) {
+        if (Queue->Mapped) {
+            Queue->Lost += Count - written;
+        } else {
+            pthread_spin_lock(&Queue->Lock);
+            written += McbaRingWrite(&Queue->Producer, Msgs + written, Count - written);
+            if (written < Count) {
+                Queue->Lost += McbaRingDiscard(Queue->Ring, Count - written);
+                McbaRingWrite(&Queue->Producer, Msgs + written, Count - written);
+            }
+            pthread_spin_unlock(&Queue->Lock);
+        }
+    }
+
+    /* the driver checks for a pending read here */
+    McbaMemoryBarrier();
+}
+
+static
+ULONG
+RingQueueRead(RING_QUEUE* Queue, PMCBA_CAN_MSG_DATA_EX Out, ULONG Count)
+{
+    ULONG read;
+
+    pthread_spin_lock(&Queue->Lock);
+    read = McbaRingRead(Queue->Ring, Out, Count);
+    pthread_spin_unlock(&Queue->Lock);
+
+    return read;
+}
+
+/* What a reader of a mapped ring does: look at the frames where they are,
+ * then hand the slots back.
+ */
+static
+ULONG
+MappedQueueConsume(RING_QUEUE* Queue, ULONG Count, ULONGLONG* Sum)
+{
+    PMCBA_RING ring = Queue->Ring;
+    ULONG tail = ring->Tail;
+    ULONG available = McbaReadAcquire32(&ring->Head) - tail;
+
+    if (Count > available) {
+        Count = available;
+    }
+
+    for (ULONG i = 0; i < Count; ++i) {
+        *Sum += ring->Entries[(tail + i) & ring->Mask].Msg.Id;
+    }
+
+    McbaWriteRelease32(&ring->Tail, tail + Count);
+
+    return Count;
+}
+
+/* broadcast ring, see MCBA_RX_RING_CAPACITY and McbaFileReadCanMsgs */
+
+typedef struct _BROADCAST_CURSOR {
+    pthread_spinlock_t Lock;
+    ULONG Cursor;
+    ULONGLONG Lost;
+} BROADCAST_CURSOR;
+
+static
+ULONG
+BroadcastCursorRead(PMCBA_BROADCAST_RING Ring, BROADCAST_CURSOR* Cursor, PMCBA_CAN_MSG_DATA_EX Out, ULONG Count)
+{
+    ULONG read;
+
+    pthread_spin_lock(&Cursor->Lock);
+    read = McbaBroadcastRingRead(Ring, &Cursor->Cursor, Out, Count, &Cursor->Lost);
+    pthread_spin_unlock(&Cursor->Lock);
+
+    return read;
+}
+
+/* harness */
+
+typedef struct _BENCH {
+    const char* Name;
+    ULONG Handles;
+    size_t Transfers;
+    BOOLEAN List;
+    BOOLEAN Mapped;
+    BOOLEAN Broadcast;
+    LIST_QUEUE* ListQueues;
+    RING_QUEUE* RingQueues;
+    PMCBA_BROADCAST_RING Shared;
+    BROADCAST_CURSOR* Cursors;
+    volatile int Done;
+} BENCH;
+
+typedef struct _READER {
+    BENCH* Bench;
+    ULONG Handle;
+    ULONGLONG Frames;
+    pthread_t Thread;
+} READER;
+
+/* Reads up to Count frames and looks at each one. */
+static
+ULONG
+BenchRead(BENCH* Bench, ULONG Handle, PMCBA_CAN_MSG_DATA_EX Out, ULONG Count, ULONGLONG* Sum)
+{
+    ULONG read;
+
+    if (Bench->Mapped) {
+        return MappedQueueConsume(&Bench->RingQueues[Handle], Count, Sum);
+    }
+
+    if (Bench->Broadcast) {
+        read = BroadcastCursorRead(Bench->Shared, &Bench->Cursors[Handle], Out, Count);
+    } else {
+        read = Bench->List
+            ? ListQueueRead(&Bench->ListQueues[Handle], Out, Count)
+            : RingQueueRead(&Bench->RingQueues[Handle], Out, Count);
+    }
+
+    for (ULONG i = 0; i < read; ++i) {
+        *Sum += Out[i].Msg.Id;
+    }
+
+    return read;
+}
+
+static
+void
+BenchProduce(BENCH* Bench, const MCBA_CAN_MSG_DATA_EX* Msgs)
+{
+    if (Bench->Broadcast) {
+        McbaBroadcastRingWrite(Bench->Shared, Msgs, FRAMES_PER_TRANSFER);
+        return;
+    }
+
+    for (ULONG h = 0; h < Bench->Handles; ++h) {
+        if (Bench->List) {
+            ListQueueWrite(&Bench->ListQueues[h], Msgs, FRAMES_PER_TRANSFER);
+        } else {
+            RingQueueWrite(&Bench->RingQueues[h], Msgs, FRAMES_PER_TRANSFER);
+        }
+    }
+}
+
+static
+void*
+ReaderThread(void* Arg)
+{
+    READER* reader = Arg;
+    MCBA_CAN_MSG_DATA_EX out[READ_BATCH];
+    ULONGLONG sum = 0;
+
+    for (;;) {
+        int done = __atomic_load_n(&reader->Bench->Done, __ATOMIC_ACQUIRE);
+        ULONG read = BenchRead(reader->Bench, reader->Handle, out, READ_BATCH, &sum);
+
+        reader->Frames += read;
+        if (!read && done) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static
+void
+BenchReset(BENCH* Bench)
+{
+    if (Bench->Broadcast) {
+        McbaBroadcastRingInit(Bench->Shared, BROADCAST_CAPACITY);
+    }
+
+    for (ULONG h = 0; h < Bench->Handles; ++h) {
+        if (Bench->Broadcast) {
+            pthread_spin_init(&Bench->Cursors[h].Lock, PTHREAD_PROCESS_PRIVATE);
+            Bench->Cursors[h].Cursor = McbaBroadcastRingCursor(Bench->Shared);
+            Bench->Cursors[h].Lost = 0;
+        } else if (Bench->List) {
+            ListQueueInit(&Bench->ListQueues[h]);
+        } else {
+            free(Bench->RingQueues[h].Ring);
+            RingQueueInit(&Bench->RingQueues[h], Bench->Mapped);
+        }
+    }
+
+    Bench->Done = 0;
+}
+
+static
+ULONGLONG
+BenchLost(BENCH* Bench)
+{
+    ULONGLONG lost = 0;
+
+    for (ULONG h = 0; h < Bench->Handles; ++h) {
+        if (Bench->Broadcast) {
+            lost += Bench->Cursors[h].Lost;
+        } else {
+            lost += Bench->List ? Bench->ListQueues[h].Lost : Bench->RingQueues[h].Lost;
+        }
+    }
+
+    return lost;
+}
+
+/* Produce a transfer, then drain every handle. */
+static
+void
+RunSingleThreaded(BENCH* Bench, const MCBA_CAN_MSG_DATA_EX* Msgs)
+{
+    MCBA_CAN_MSG_DATA_EX out[READ_BATCH];
+    ULONGLONG frames = 0;
+    ULONGLONG sum = 0;
+    ULONGLONG start;
+    double elapsed;
+
+    BenchReset(Bench);
+    start = PerfNowNs();
+    for (size_t t = 0; t < Bench->Transfers; ++t) {
+        BenchProduce(Bench, &Msgs[(t % 1024) * FRAMES_PER_TRANSFER]);
+
+        /* read every 8 transfers so batches are realistic */
+        if (7 == (t & 7)) {
+            for (ULONG h = 0; h < Bench->Handles; ++h) {
+                frames += BenchRead(Bench, h, out, READ_BATCH, &sum);
+            }
+        }
+    }
+
+    elapsed = (double)(PerfNowNs() - start);
+    printf("%-9s 1 thread   %7.1f ns/frame/handle, %llu frames read, %llu lost\n",
+        Bench->Name, elapsed / (Bench->Transfers * FRAMES_PER_TRANSFER * Bench->Handles),
+        (unsigned long long)frames, (unsigned long long)BenchLost(Bench));
+}
+
+static
+void
+RunThreaded(BENCH* Bench, const MCBA_CAN_MSG_DATA_EX* Msgs)
+{
+    READER* readers = calloc(Bench->Handles, sizeof(*readers));
+    ULONGLONG frames = 0;
+    ULONGLONG start;
+    double elapsed;
+
+    if (!readers) {
+        abort();
+    }
+
+    BenchReset(Bench);
+    for (ULONG h = 0; h < Bench->Handles; ++h) {
+        readers[h].Bench = Bench;
+        readers[h].Handle = h;
+        pthread_create(&readers[h].Thread, NULL, ReaderThread, &readers[h]);
+    }
+
+    start = PerfNowNs();
+    for (size_t t = 0; t < Bench->Transfers; ++t) {
+        BenchProduce(Bench, &Msgs[(t % 1024) * FRAMES_PER_TRANSFER]);
+    }
+
+    elapsed = (double)(PerfNowNs() - start);
+    __atomic_store_n(&Bench->Done, 1, __ATOMIC_RELEASE);
+
+    for (ULONG h = 0; h < Bench->Handles; ++h) {
+        pthread_join(readers[h].Thread, NULL);
+        frames += readers[h].Frames;
+    }
+
+    printf("%-9s %u thread(s) %5.1f ns/frame/handle producer, %llu frames read, %.1f%% lost\n",
+        Bench->Name, Bench->Handles + 1, elapsed / (Bench->Transfers * FRAMES_PER_TRANSFER * Bench->Handles),
+        (unsigned long long)frames,
+        100.0 * BenchLost(Bench) / ((double)Bench->Transfers * FRAMES_PER_TRANSFER * Bench->Handles));
+
+    free(readers);
+}
+
+int
+main(int argc, char** argv)
+{
+    ULONG handles = argc > 1 ? strtoul(argv[1], NULL, 0) : 4;
+    size_t transfers = argc > 2 ? strtoul(argv[2], NULL, 0) : 1u << 20;
+    MCBA_CAN_MSG_DATA_EX msgs[1024 * FRAMES_PER_TRANSFER];
+    PERF_RANDOM rng;
+    BENCH list, ring, mapped, broadcast;
+
+    if (!handles) {
+        fprintf(stderr, "Usage: %s [handles] [transfers]\n", argv[0]);
+        return 1;
+    }
+
+    PerfRandomInit(&rng, 0x52494e47);
+    for (size_t i = 0; i < sizeof(msgs) / sizeof(msgs[0]); ++i) {
+        PerfRandomCanMsg(&rng, &msgs[i].Msg);
+        msgs[i].SystemTimeReceived = i;
+    }
+
+    pthread_spin_init(&Pool.Lock, PTHREAD_PROCESS_PRIVATE);
+
+    memset(&list, 0, sizeof(list));
+    list.Name = "list";
+    list.Handles = handles;
+    list.Transfers = transfers;
+    list.List = TRUE;
+    list.ListQueues = calloc(handles, sizeof(*list.ListQueues));
+
+    memset(&ring, 0, sizeof(ring));
+    ring.Name = "ring";
+    ring.Handles = handles;
+    ring.Transfers = transfers;
+    ring.RingQueues = calloc(handles, sizeof(*ring.RingQueues));
+
+    mapped = ring;
+    mapped.Name = "mapped";
+    mapped.Mapped = TRUE;
+    mapped.RingQueues = calloc(handles, sizeof(*mapped.RingQueues));
+
+    memset(&broadcast, 0, sizeof(broadcast));
+    broadcast.Name = "broadcast";
+    broadcast.Handles = handles;
+    broadcast.Transfers = transfers;
+    broadcast.Broadcast = TRUE;
+    broadcast.Shared = aligned_alloc(MCBA_CACHE_LINE_SIZE,
+        (McbaBroadcastRingSize(BROADCAST_CAPACITY) + MCBA_CACHE_LINE_SIZE - 1) & ~(size_t)(MCBA_CACHE_LINE_SIZE - 1));
+    broadcast.Cursors = calloc(handles, sizeof(*broadcast.Cursors));
+
+    if (!list.ListQueues || !ring.RingQueues || !mapped.RingQueues || !broadcast.Shared || !broadcast.Cursors) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    printf("%u handle(s), %zu transfers of %u frames, queue capacity %u, broadcast capacity %u\n",
+        handles, transfers, FRAMES_PER_TRANSFER, QUEUE_CAPACITY, BROADCAST_CAPACITY);
+
+    RunSingleThreaded(&list, msgs);
+    RunSingleThreaded(&ring, msgs);
+    RunSingleThreaded(&mapped, msgs);
+    RunSingleThreaded(&broadcast, msgs);
+    /* spinning readers need a core each next to the producer */
+    if (sysconf(_SC_NPROCESSORS_ONLN) > (long)handles) {
+        RunThreaded(&list, msgs);
+        RunThreaded(&ring, msgs);
+        RunThreaded(&mapped, msgs);
+        RunThreaded(&broadcast, msgs);
+    } else {
+        printf("threaded runs skipped, need more than %u processors\n", handles);
+    }
+
+    /* pool blocks of the list variant are leaked on purpose, the process exits */
+    for (ULONG h = 0; h < handles; ++h) {
+        free(ring.RingQueues[h].Ring);
+        free(mapped.RingQueues[h].Ring);
+    }
+
+    free(broadcast.Cursors);
+    free(broadcast.Shared);
+    free(mapped.RingQueues);
+    free(ring.RingQueues);
+    free(list.ListQueues);
+
+    return 0;
+}
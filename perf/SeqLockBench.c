@@ -0,0 +1,190 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Snapshots of the device status: a plain struct copy the driver used
+ * before against the McbaSeqLock.h sequence lock.
+ *
+ * One writer adds the same amount to every counter of an MCBA_DEVICE_STATS
+ * the way keep-alive messages do, readers copy the counters as fast as they
+ * can. A copy whose counters differ is torn. The sequence lock must never
+ * return one.
+ *
+ * Usage: SeqLockBench [readers] [milliseconds]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PerfCommon.h"
+#include "McbaSeqLock.h"
+
+typedef struct _BENCH {
+    BOOLEAN Locked;
+    MCBA_SEQLOCK Seq;
+    MCBA_DEVICE_STATS Stats;
+    volatile LONG Stop;
+} BENCH, *PBENCH;
+
+typedef struct _READER {
+    pthread_t Thread;
+    PBENCH Bench;
+    size_t Copies;
+    size_t Torn;
+    size_t Retries;
+} READER, *PREADER;
+
+static
+void*
+WriterMain(void* Arg)
+{
+    PBENCH bench = Arg;
+    UINT64 step = 1;
+
+    while (!McbaReadAcquire32(&bench->Stop)) {
+        if (bench->Locked) {
+            McbaSeqLockWriteBegin(&bench->Seq);
+        }
+
+        // volatile so the compiler keeps the stores apart like the driver's
+        ((volatile MCBA_DEVICE_STATS*)&bench->Stats)->TxErrorCount += step;
+        ((volatile MCBA_DEVICE_STATS*)&bench->Stats)->RxErrorCount += step;
+        ((volatile MCBA_DEVICE_STATS*)&bench->Stats)->RxBufferOverflow += step;
+        ((volatile MCBA_DEVICE_STATS*)&bench->Stats)->TxBusOff += step;
+        ((volatile MCBA_DEVICE_STATS*)&bench->Stats)->RxLost += step;
+
+        if (bench->Locked) {
+            McbaSeqLockWriteEnd(&bench->Seq);
+        }
+
+        step = step * 3 % 1000 + 1;
+    }
+
+    return NULL;
+}
+
+static
+void*
+ReaderMain(void* Arg)
+{
+    PREADER reader = Arg;
+    PBENCH bench = reader->Bench;
+    MCBA_DEVICE_STATS copy;
+    ULONG seq;
+
+    while (!McbaReadAcquire32(&bench->Stop)) {
+        if (bench->Locked) {
+            seq = McbaSeqLockReadBegin(&bench->Seq);
+            for (;;) {
+                copy = *(volatile MCBA_DEVICE_STATS*)&bench->Stats;
+                if (!McbaSeqLockReadRetry(&bench->Seq, seq)) {
+                    break;
+                }
+
+                ++reader->Retries;
+                seq = McbaSeqLockReadBegin(&bench->Seq);
+            }
+        }
+        else {
+            copy = *(volatile MCBA_DEVICE_STATS*)&bench->Stats;
+        }
+
+        ++reader->Copies;
+
+        if (copy.TxErrorCount != copy.RxErrorCount ||
+            copy.TxErrorCount != copy.RxBufferOverflow ||
+            copy.TxErrorCount != copy.TxBusOff ||
+            copy.TxErrorCount != copy.RxLost) {
+            ++reader->Torn;
+        }
+    }
+
+    return NULL;
+}
+
+static
+int
+Run(BOOLEAN Locked, ULONG Readers, ULONG Milliseconds)
+{
+    static BENCH bench;
+    PREADER readers = calloc(Readers, sizeof(*readers));
+    struct timespec duration = { Milliseconds / 1000, (long)(Milliseconds % 1000) * 1000000 };
+    pthread_t writer;
+    size_t copies = 0, torn = 0, retries = 0;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.Locked = Locked;
+    McbaSeqLockInit(&bench.Seq);
+
+    pthread_create(&writer, NULL, WriterMain, &bench);
+    for (ULONG i = 0; i < Readers; ++i) {
+        readers[i].Bench = &bench;
+        pthread_create(&readers[i].Thread, NULL, ReaderMain, &readers[i]);
+    }
+
+    nanosleep(&duration, NULL);
+    McbaWriteRelease32((volatile ULONG*)&bench.Stop, 1);
+
+    pthread_join(writer, NULL);
+    for (ULONG i = 0; i < Readers; ++i) {
+        pthread_join(readers[i].Thread, NULL);
+        copies += readers[i].Copies;
+        torn += readers[i].Torn;
+        retries += readers[i].Retries;
+    }
+
+    printf("%-8s %8.2f M copies/s %12zu torn %12zu retries\n",
+        Locked ? "seqlock" : "plain",
+        copies / (Milliseconds * 1000.0),
+        torn,
+        retries);
+
+    free(readers);
+
+    return Locked && torn ? 1 : 0;
+}
+
+int
+main(int argc, char** argv)
+{
+    ULONG readers = argc > 1 ? (ULONG)atoi(argv[1]) : 2;
+    ULONG milliseconds = argc > 2 ? (ULONG)atoi(argv[2]) : 1000;
+    int failed = 0;
+
+    if (!readers || !milliseconds) {
+        fprintf(stderr, "usage: %s [readers] [milliseconds]\n", argv[0]);
+        return 2;
+    }
+
+    printf("%u reader(s), 1 writer, %u ms each\n", (unsigned)readers, (unsigned)milliseconds);
+
+    failed |= Run(FALSE, readers, milliseconds);
+    failed |= Run(TRUE, readers, milliseconds);
+
+    if (failed) {
+        printf("FAILED: the sequence lock returned torn copies\n");
+    }
+
+    return failed;
+}
@@ -0,0 +1,276 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Drives the RX/TX pipeline with traffic from the simulated adapter.
+ *
+ * The first pass runs the simulated bus and records the bulk-IN transfers
+ * the host would see while writing frames at the requested rate. The
+ * second pass replays the recorded transfers through the host side receive
+ * processing (record dispatch, keep alive parsing, frame decode and copy
+ * into every open handle) to measure its cost at the simulated bus load.
+ *
+ * Usage: SimBench [options]
+ *   -b bitrate      bus bitrate in bit/s (500000)
+ *   -r rate         frames/s from other nodes, 0 saturates, -1 disables (1000)
+ *   -t rate         frames/s written by the host, 0 disables, -1 as fast as accepted (0)
+ *   -P records      frames packed into one bulk-OUT transfer, 1..3 (1)
+ *   -e percent      share of extended frames (25)
+ *   -R percent      share of remote frames (5)
+ *   -d dlc          fixed DLC, -1 for random (-1)
+ *   -k frames       device receive buffer (64)
+ *   -p us           host turnaround between bulk-IN transfers (125)
+ *   -n handles      open handles receiving each frame (1)
+ *   -s seconds      simulated time (10)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PerfCommon.h"
+#include "McbaCodec.h"
+#include "McbaSim.h"
+
+#define HOST_QUEUE_FRAMES 256
+
+typedef struct _HOST_HANDLE {
+    MCBA_CAN_MSG Queue[HOST_QUEUE_FRAMES];
+    ULONG Tail;
+} HOST_HANDLE;
+
+typedef struct _HOST {
+    HOST_HANDLE* Handles;
+    ULONG HandleCount;
+    ULONGLONG Frames;
+    ULONGLONG RxOverflow;
+    ULONGLONG RxLost;
+    ULONG Bitrate;
+} HOST;
+
+typedef struct _RECORDING {
+    UINT8* Data;
+    UINT8* Lengths;
+    size_t Count;
+    size_t Capacity;
+} RECORDING;
+
+static
+int
+RecordingAppend(RECORDING* Recording, const UINT8* Buffer, size_t Length)
+{
+    if (Recording->Count == Recording->Capacity) {
+        size_t capacity = Recording->Capacity ? Recording->Capacity * 2 : 4096;
+        UINT8* data = realloc(Recording->Data, capacity * MCBA_USB_RX_BUFF_SIZE);
+        UINT8* lengths;
+
+        if (!data) {
+            return -1;
+        }
+
+        Recording->Data = data;
+        lengths = realloc(Recording->Lengths, capacity);
+        if (!lengths) {
+            return -1;
+        }
+
+        Recording->Lengths = lengths;
+        Recording->Capacity = capacity;
+    }
+
+    memcpy(Recording->Data + Recording->Count * MCBA_USB_RX_BUFF_SIZE, Buffer, Length);
+    Recording->Lengths[Recording->Count++] = (UINT8)Length;
+    return 0;
+}
+
+/* mirrors the dispatch in McbaUsbReaderCompletionRoutine */
+static
+void
+HostProcessTransfer(HOST* Host, const UINT8* Buffer, size_t Length)
+{
+    const struct mcba_usb_msg* pMsg = (const struct mcba_usb_msg*)Buffer;
+    const size_t records = Length / sizeof(*pMsg);
+
+    for (size_t i = 0; i < records; ++i, ++pMsg) {
+        switch (pMsg->cmd_id) {
+        case MBCA_CMD_RECEIVE_MESSAGE: {
+            MCBA_CAN_MSG msg;
+
+            McbaCodecDecodeCanMsg((const struct mcba_usb_msg_can*)pMsg, &msg);
+            for (ULONG h = 0; h < Host->HandleCount; ++h) {
+                HOST_HANDLE* handle = &Host->Handles[h];
+                handle->Queue[handle->Tail++ % HOST_QUEUE_FRAMES] = msg;
+            }
+
+            ++Host->Frames;
+        } break;
+        case MBCA_CMD_I_AM_ALIVE_FROM_CAN: {
+            const struct mcba_usb_msg_ka_can* ka = (const struct mcba_usb_msg_ka_can*)pMsg;
+
+            Host->RxOverflow += ka->rx_buff_ovfl;
+            Host->RxLost += McbaCodecReadLittleEndian16(&ka->rx_lost);
+            Host->Bitrate = McbaCodecReadBigEndian16(&ka->can_bitrate);
+        } break;
+        default:
+            break;
+        }
+    }
+}
+
+static
+void
+Usage(const char* Name)
+{
+    fprintf(stderr, "Usage: %s [-b bitrate] [-r rate] [-t rate] [-P records] [-e percent] [-R percent] [-d dlc] [-k frames] [-p us] [-n handles] [-s seconds]\n", Name);
+}
+
+int
+main(int argc, char** argv)
+{
+    MCBA_SIM_CONFIG config;
+    MCBA_SIM sim;
+    RECORDING recording;
+    HOST host;
+    PERF_RANDOM rng;
+    double txRate = 0;
+    double seconds = 10;
+    ULONG pollUs = 125;
+    ULONG handleCount = 1;
+    ULONG txPack = 1;
+    ULONGLONG durationNs, nextTxNs = 0, txWritten = 0;
+    UINT8 buffer[MCBA_USB_RX_BUFF_SIZE];
+    double bestNs = 0;
+    int opt;
+
+    McbaSimConfigInit(&config);
+    memset(&recording, 0, sizeof(recording));
+
+    while ((opt = getopt(argc, argv, "b:r:t:P:e:R:d:k:p:n:s:h")) != -1) {
+        switch (opt) {
+        case 'b': config.Bitrate = strtoul(optarg, NULL, 0); break;
+        case 'r': config.RxFrameRate = strtod(optarg, NULL); break;
+        case 't': txRate = strtod(optarg, NULL); break;
+        case 'P': txPack = strtoul(optarg, NULL, 0); break;
+        case 'e': config.ExtendedPercent = strtoul(optarg, NULL, 0); break;
+        case 'R': config.RemotePercent = strtoul(optarg, NULL, 0); break;
+        case 'd': config.Dlc = strtol(optarg, NULL, 0); break;
+        case 'k': config.DeviceRxBufferFrames = strtoul(optarg, NULL, 0); break;
+        case 'p': pollUs = strtoul(optarg, NULL, 0); break;
+        case 'n': handleCount = strtoul(optarg, NULL, 0); break;
+        case 's': seconds = strtod(optarg, NULL); break;
+        default:
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.Dlc > MCBA_CAN_MAX_DLC || !pollUs || !handleCount ||
+        !txPack || txPack > MCBA_USB_RX_BUFF_SIZE / sizeof(struct mcba_usb_msg) || McbaSimInit(&sim, &config)) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    PerfRandomInit(&rng, config.Seed ^ 0x5458);
+    durationNs = (ULONGLONG)(seconds * 1e9);
+
+    for (ULONGLONG now = 0; now < durationNs; now += pollUs * 1000ull) {
+        size_t length;
+
+        /* up to txPack due frames per bulk-OUT transfer, held back while the device is full */
+        while (txRate && nextTxNs <= now && McbaSimTxSpace(&sim)) {
+            struct mcba_usb_msg_can records[MCBA_USB_RX_BUFF_SIZE / sizeof(struct mcba_usb_msg)];
+            ULONG count = 0;
+
+            do {
+                MCBA_CAN_MSG msg;
+
+                PerfRandomCanMsg(&rng, &msg);
+                McbaCodecEncodeCanMsg(&msg, &records[count++]);
+                ++txWritten;
+                nextTxNs = txRate > 0 ? (ULONGLONG)(txWritten * 1e9 / txRate) : now;
+            } while (count < txPack && count < McbaSimTxSpace(&sim) && nextTxNs <= now);
+
+            McbaSimWriteTransfer(&sim, now, records, count * sizeof(records[0]));
+        }
+
+        length = McbaSimReadTransfer(&sim, now, buffer, sizeof(buffer));
+        if (length && RecordingAppend(&recording, buffer, length)) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+
+    printf("bus         %u bit/s, load %.1f%%\n",
+        sim.Config.Bitrate, 100.0 * sim.Stats.BusBusyNs / durationNs);
+    printf("rx          %.0f frames/s, %llu overflow, %.2f records/transfer\n",
+        sim.Stats.RxFrames / seconds, (unsigned long long)sim.Stats.RxOverflow,
+        sim.Stats.InTransfers ? (double)sim.Stats.InRecords / sim.Stats.InTransfers : 0.0);
+    if (txRate) {
+        printf("tx          %.0f frames/s, %.0f transfers/s, latency avg %.1f us max %.1f us\n",
+            sim.Stats.TxFrames / seconds,
+            sim.Stats.OutTransfers / seconds,
+            sim.Stats.TxFrames ? sim.Stats.TxLatencyNsSum / 1e3 / sim.Stats.TxFrames : 0.0,
+            sim.Stats.TxLatencyNsMax / 1e3);
+    }
+
+    memset(&host, 0, sizeof(host));
+    host.HandleCount = handleCount;
+    host.Handles = calloc(handleCount, sizeof(*host.Handles));
+    if (!host.Handles) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    for (int round = 0; round < 5; ++round) {
+        ULONGLONG start;
+        double elapsed;
+
+        host.Frames = 0;
+        host.RxOverflow = 0;
+        host.RxLost = 0;
+        start = PerfNowNs();
+        for (size_t i = 0; i < recording.Count; ++i) {
+            HostProcessTransfer(&host, recording.Data + i * MCBA_USB_RX_BUFF_SIZE, recording.Lengths[i]);
+        }
+
+        elapsed = (double)(PerfNowNs() - start);
+        if (!round || elapsed < bestNs) {
+            bestNs = elapsed;
+        }
+    }
+
+    printf("host        %zu transfers, %llu frames to %u handle(s), %llu overflow reported\n",
+        recording.Count, (unsigned long long)host.Frames, handleCount,
+        (unsigned long long)(host.RxOverflow + host.RxLost));
+    if (host.Frames) {
+        printf("host        %.1f ns/frame, %.0f frames/s max, %.3f%% of one core at this load\n",
+            bestNs / host.Frames, host.Frames / (bestNs * 1e-9), 100.0 * bestNs / durationNs);
+    }
+
+    free(host.Handles);
+    free(recording.Lengths);
+    free(recording.Data);
+    McbaSimFree(&sim);
+
+    return 0;
+}
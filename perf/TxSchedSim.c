@@ -0,0 +1,350 @@
+/* The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Jean Gressmann <jean@0x42.de>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/* Latency of a periodic high priority frame behind a saturating writer.
+ *
+ * One handle queues frames of random IDs as fast as the driver takes
+ * them (MCBA_IOCTL_HOST_CAN_FRAME_WRITE_AT_LEAST_ONE in a loop), another
+ * one writes a single frame every period. Frames go through the
+ * driver's TX queue (McbaTxScheduler.h) into a window of bulk-OUT
+ * requests the device completes while its transmit FIFO has room, then
+ * onto the simulated bus (McbaSim.c).
+ *
+ * The run is repeated with the queue in FIFO order, ordered by CAN ID
+ * and with the periodic handle in MCBA_TX_PRIORITY_HIGH. In FIFO order
+ * the periodic frame waits for the whole queue, otherwise only for what
+ * already left it: the request window and the device FIFO.
+ *
+ * The last two runs add a third handle that logs with WriteFile as fast
+ * as it can. Its writes take pool requests directly and park while
+ * there are none. When parked writes go before the queue, the queue never
+ * gets a pool request. When the queue goes first, it takes at most its
+ * window of requests and the writes get the rest of the pool.
+ *
+ * Usage: TxSchedSim [options]
+ *   -b bitrate      bus bitrate in bit/s (500000)
+ *   -r rate         frames/s from other nodes, -1 disables (-1)
+ *   -i id           11 bit ID of the periodic frame (0x123)
+ *   -t us           period of the periodic frame (10000)
+ *   -u requests     bulk-OUT requests of the queue in flight (MCBA_BATCH_WRITE_MAX_SIZE / 2)
+ *   -w requests     further pool requests for WriteFile (MCBA_BATCH_WRITE_MAX_SIZE / 2)
+ *   -P records      frames packed into one bulk-OUT transfer, 1..3 (1)
+ *   -k frames       device transmit FIFO (16)
+ *   -p us           host turnaround between bulk-OUT transfers (125)
+ *   -s seconds      simulated time (10)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "PerfCommon.h"
+#include "McbaCodec.h"
+#include "McbaTxScheduler.h"
+#include "McbaSim.h"
+
+#define USB_REQUESTS_MAX 64
+#define RECORDS_MAX (MCBA_USB_RX_BUFF_SIZE / sizeof(struct mcba_usb_msg))
+
+typedef enum _ORDER {
+    ORDER_FIFO,
+    ORDER_ID,
+    ORDER_CLASS,
+} ORDER;
+
+static const char* const OrderNames[] = { "fifo", "id", "class" };
+
+typedef enum _WRITE_FILE {
+    WRITE_FILE_NONE,
+    WRITE_FILE_PARKED_FIRST, /* parked writes take pool requests before the queue */
+    WRITE_FILE_QUEUE_FIRST, /* like McbaTxQueueDrain */
+} WRITE_FILE;
+
+static const char* const WriteFileNames[] = { "", "+wf parked first", "+wf queue first" };
+
+typedef struct _USB_REQUEST {
+    struct mcba_usb_msg_can Records[RECORDS_MAX];
+    ULONG Count;
+    BOOLEAN Queue; /* carries frames of the queue, not of WriteFile */
+} USB_REQUEST;
+
+typedef struct _RUN {
+    ULONG PeriodicId;
+    ULONGLONG* DueNs; /* of the periodic frames, in order */
+    ULONGLONG* LatencyNs;
+    ULONG Written;
+    ULONG Done;
+} RUN;
+
+typedef struct _OPTIONS {
+    MCBA_SIM_CONFIG Config;
+    ULONG PeriodicId;
+    ULONG PeriodUs;
+    ULONG UsbRequests;
+    ULONG WriteFileRequests;
+    ULONG Pack;
+    ULONG PollUs;
+    double Seconds;
+} OPTIONS;
+
+static
+void
+RunTxDone(void* Context, const MCBA_SIM_FRAME* Frame)
+{
+    RUN* run = (RUN*)Context;
+
+    /* frames of one ID and class keep their order through queue, requests and device */
+    if (Frame->Msg.Id == run->PeriodicId && run->Done < run->Written) {
+        run->LatencyNs[run->Done] = Frame->DoneNs - run->DueNs[run->Done];
+        ++run->Done;
+    }
+}
+
+static
+int
+CompareLatency(const void* Lhs, const void* Rhs)
+{
+    ULONGLONG lhs = *(const ULONGLONG*)Lhs;
+    ULONGLONG rhs = *(const ULONGLONG*)Rhs;
+
+    return lhs < rhs ? -1 : lhs > rhs;
+}
+
+static
+ULONGLONG
+Key(ORDER Order, ULONG PriorityClass, const MCBA_CAN_MSG* Msg)
+{
+    switch (Order) {
+    case ORDER_ID:
+        return McbaTxSchedulerKey(MCBA_TX_PRIORITY_NORMAL, Msg);
+    case ORDER_CLASS:
+        return McbaTxSchedulerKey(PriorityClass, Msg);
+    default:
+        return 0;
+    }
+}
+
+static
+void
+EncodeRandom(PPERF_RANDOM Random, const OPTIONS* Options, struct mcba_usb_msg_can* Record)
+{
+    MCBA_CAN_MSG msg;
+
+    do {
+        PerfRandomCanMsg(Random, &msg);
+    } while ((msg.Id & ~MCBA_CAN_RTR_FLAG) == Options->PeriodicId);
+
+    McbaCodecEncodeCanMsg(&msg, Record);
+}
+
+static
+int
+Run(const OPTIONS* Options, ORDER Order, WRITE_FILE WriteFile)
+{
+    static MCBA_TX_SCHEDULER queue;
+    static USB_REQUEST requests[2 * USB_REQUESTS_MAX];
+    const ULONGLONG durationNs = (ULONGLONG)(Options->Seconds * 1e9);
+    const ULONG periodic = (ULONG)(durationNs / (Options->PeriodUs * 1000ull)) + 1;
+    const ULONG pool = Options->UsbRequests + (WriteFile ? Options->WriteFileRequests : 0);
+    ULONG requestHead = 0, requestCount = 0, queueCount = 0, waiting = 0;
+    ULONGLONG nextPeriodicNs = 0;
+    MCBA_SIM sim;
+    PERF_RANDOM rng;
+    RUN run;
+    ULONGLONG sum = 0;
+
+    memset(&run, 0, sizeof(run));
+    run.PeriodicId = Options->PeriodicId;
+    run.DueNs = calloc(periodic, sizeof(*run.DueNs));
+    run.LatencyNs = calloc(periodic, sizeof(*run.LatencyNs));
+    if (!run.DueNs || !run.LatencyNs || McbaSimInit(&sim, &Options->Config)) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    sim.TxDone = RunTxDone;
+    sim.TxDoneContext = &run;
+    McbaTxSchedulerInit(&queue);
+    PerfRandomInit(&rng, Options->Config.Seed ^ 0x5458);
+
+    for (ULONGLONG now = 0; now < durationNs; now += Options->PollUs * 1000ull) {
+        MCBA_TX_SCHEDULER_ENTRY entry;
+
+        /* the device NAKs the oldest request until its frames fit */
+        while (requestCount && requests[requestHead].Count <= McbaSimTxSpace(&sim)) {
+            USB_REQUEST* request = &requests[requestHead];
+
+            McbaSimWriteTransfer(&sim, now, request->Records, request->Count * sizeof(request->Records[0]));
+            queueCount -= request->Queue;
+            requestHead = (requestHead + 1) % pool;
+            --requestCount;
+        }
+
+        /* like McbaTxQueueSend, the WriteFile logger always has a write parked */
+        while (WRITE_FILE_PARKED_FIRST != WriteFile && requestCount < pool && queueCount < Options->UsbRequests && queue.Count) {
+            USB_REQUEST* request = &requests[(requestHead + requestCount++) % pool];
+
+            request->Queue = TRUE;
+            request->Count = 0;
+            while (request->Count < Options->Pack && McbaTxSchedulerPop(&queue, &entry)) {
+                McbaCodecEncodeCanMsg(&entry.Msg, &request->Records[request->Count++]);
+            }
+
+            ++queueCount;
+        }
+
+        /* like McbaServiceParkedRequests */
+        while (WriteFile && requestCount < pool) {
+            USB_REQUEST* request = &requests[(requestHead + requestCount++) % pool];
+
+            request->Queue = FALSE;
+            for (request->Count = 0; request->Count < Options->Pack; ++request->Count) {
+                EncodeRandom(&rng, Options, &request->Records[request->Count]);
+            }
+        }
+
+        /* writes that wait get the space first, like McbaServicePendingWrites */
+        for (; nextPeriodicNs <= now && run.Written + waiting < periodic; nextPeriodicNs += Options->PeriodUs * 1000ull) {
+            run.DueNs[run.Written + waiting++] = nextPeriodicNs;
+        }
+
+        while (waiting) {
+            MCBA_CAN_MSG msg;
+
+            memset(&msg, 0, sizeof(msg));
+            msg.Id = Options->PeriodicId;
+            msg.Dlc = MCBA_CAN_MAX_DLC;
+            if (!McbaTxSchedulerPush(&queue, &msg, Key(Order, MCBA_TX_PRIORITY_HIGH, &msg), NULL, (LONGLONG)now)) {
+                break;
+            }
+
+            --waiting;
+            ++run.Written;
+        }
+
+        while (!waiting && queue.Count < MCBA_TX_SCHEDULER_CAPACITY) {
+            MCBA_CAN_MSG msg;
+
+            do {
+                PerfRandomCanMsg(&rng, &msg);
+            } while ((msg.Id & ~MCBA_CAN_RTR_FLAG) == Options->PeriodicId);
+
+            McbaTxSchedulerPush(&queue, &msg, Key(Order, MCBA_TX_PRIORITY_NORMAL, &msg), NULL, (LONGLONG)now);
+        }
+
+        McbaSimAdvance(&sim, now);
+    }
+
+    for (ULONG i = 0; i < run.Done; ++i) {
+        sum += run.LatencyNs[i];
+    }
+
+    qsort(run.LatencyNs, run.Done, sizeof(*run.LatencyNs), CompareLatency);
+
+    printf("%-6s%-16s %9.0f %9u %10.1f %10.1f %10.1f %10.1f\n",
+        OrderNames[Order], WriteFileNames[WriteFile],
+        (sim.Stats.TxFrames - run.Done) / Options->Seconds,
+        run.Done,
+        run.Done ? sum / 1e3 / run.Done : 0.0,
+        run.Done ? run.LatencyNs[run.Done / 2] / 1e3 : 0.0,
+        run.Done ? run.LatencyNs[run.Done - 1 - run.Done / 100] / 1e3 : 0.0,
+        run.Done ? run.LatencyNs[run.Done - 1] / 1e3 : 0.0);
+
+    free(run.LatencyNs);
+    free(run.DueNs);
+    McbaSimFree(&sim);
+
+    return 0;
+}
+
+static
+void
+Usage(const char* Name)
+{
+    fprintf(stderr, "Usage: %s [-b bitrate] [-r rate] [-i id] [-t us] [-u requests] [-w requests] [-P records] [-k frames] [-p us] [-s seconds]\n", Name);
+}
+
+int
+main(int argc, char** argv)
+{
+    OPTIONS options;
+    int opt;
+
+    memset(&options, 0, sizeof(options));
+    McbaSimConfigInit(&options.Config);
+    options.Config.RxFrameRate = -1;
+    options.PeriodicId = 0x123;
+    options.PeriodUs = 10000;
+    options.UsbRequests = MCBA_BATCH_WRITE_MAX_SIZE / 2;
+    options.WriteFileRequests = MCBA_BATCH_WRITE_MAX_SIZE / 2;
+    options.Pack = 1;
+    options.PollUs = 125;
+    options.Seconds = 10;
+
+    while ((opt = getopt(argc, argv, "b:r:i:t:u:w:P:k:p:s:h")) != -1) {
+        switch (opt) {
+        case 'b': options.Config.Bitrate = strtoul(optarg, NULL, 0); break;
+        case 'r': options.Config.RxFrameRate = strtod(optarg, NULL); break;
+        case 'i': options.PeriodicId = strtoul(optarg, NULL, 0); break;
+        case 't': options.PeriodUs = strtoul(optarg, NULL, 0); break;
+        case 'u': options.UsbRequests = strtoul(optarg, NULL, 0); break;
+        case 'w': options.WriteFileRequests = strtoul(optarg, NULL, 0); break;
+        case 'P': options.Pack = strtoul(optarg, NULL, 0); break;
+        case 'k': options.Config.DeviceTxBufferFrames = strtoul(optarg, NULL, 0); break;
+        case 'p': options.PollUs = strtoul(optarg, NULL, 0); break;
+        case 's': options.Seconds = strtod(optarg, NULL); break;
+        default:
+            Usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!options.Config.Bitrate || options.PeriodicId > MCBA_CAN_SFF_MASK || !options.PeriodUs ||
+        !options.UsbRequests || options.UsbRequests > USB_REQUESTS_MAX ||
+        !options.WriteFileRequests || options.WriteFileRequests > USB_REQUESTS_MAX ||
+        !options.Pack || options.Pack > RECORDS_MAX || options.Pack > options.Config.DeviceTxBufferFrames ||
+        !options.PollUs || options.Seconds <= 0) {
+        Usage(argv[0]);
+        return 1;
+    }
+
+    printf("bus %u bit/s, frame 0x%03x every %u us, %u + %u WriteFile requests of %u frame(s), device FIFO %u frames\n",
+        options.Config.Bitrate, options.PeriodicId, options.PeriodUs,
+        options.UsbRequests, options.WriteFileRequests, options.Pack, options.Config.DeviceTxBufferFrames);
+    printf("%-22s %9s %9s %10s %10s %10s %10s\n", "order", "bulk/s", "periodic", "avg us", "p50 us", "p99 us", "max us");
+
+    for (int order = ORDER_FIFO; order <= ORDER_CLASS; ++order) {
+        if (Run(&options, (ORDER)order, WRITE_FILE_NONE)) {
+            return 1;
+        }
+    }
+
+    for (int writeFile = WRITE_FILE_PARKED_FIRST; writeFile <= WRITE_FILE_QUEUE_FIRST; ++writeFile) {
+        if (Run(&options, ORDER_CLASS, (WRITE_FILE)writeFile)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}